@@ -28,8 +28,67 @@ static const student_t EMPTY_STUDENT_RECORD = {0};
 static const int STUDENT_RECORD_SIZE  = sizeof(struct student);
 static const int DELETED_STUDENT_ID = 0;
 
+//Slot 0 can never hold a student since ids start at 1, so it holds a small
+//header instead.  gen is odd while a writer is changing the file, readers
+//compare it before and after copying the file to get a consistent snapshot
+//without taking a lock.  id is always 0 so scanners skip the header.
+//file_id is picked at random when the header is first written, so
+//(file_id, gen) names one state of one file even after it is emptied.
+typedef struct db_header {
+    int id;
+    unsigned int magic;
+    unsigned int gen;
+    unsigned int flags;
+    unsigned int log_epoch;             //replicas: change log being followed
+    unsigned long long log_seq;         //replicas: last change applied
+    unsigned int file_id;
+    char reserved[28];
+} db_header_t;
+
+#define DB_HEADER_MAGIC     0x31424453      //"SDB1"
+#define DB_FLAG_CRC         0x01            //records carry a CRC32C
+#define DB_FLAG_STALE       0x02            //replaced by compress or reshard
+
+//With DB_FLAG_CRC set, the CRC32C of slot id is stored as a 4 byte value at
+//DB_CRC_OFFSET + id * 4, just past the last possible student slot
+#define DB_CRC_OFFSET       (((off_t)MAX_STD_ID + 1) * (off_t)sizeof(student_t))
+#define DB_SNAP_RETRIES     8               //optimistic tries before locking
+#define SCRUB_CHUNK_RECS    16384           //records checksummed per pread(), 1MB
+_Static_assert(sizeof(db_header_t) == sizeof(student_t), "header must fill slot 0");
+
+//Change log.  While DB_LOG_FILE exists, next to the database files, every
+//add, delete and zero is appended to it as a fixed size record, so change
+//seq lives at offset seq * sizeof(db_log_rec_t).  Record 0 starts the log
+//and carries its epoch, a replica that finds a different epoch starts over
+//from seq 1.
+typedef struct db_log_rec {
+    unsigned long long seq;
+    int op;
+    unsigned int epoch;
+    student_t rec;                      //the new record, or just the id
+} db_log_rec_t;
+
+#define DB_LOG_FILE         "student.db.log"
+#define TMP_DB_LOG_FILE     ".tmp_student.db.log"
+#define LOG_OP_START        0
+#define LOG_OP_ADD          1
+#define LOG_OP_DEL          2
+#define LOG_OP_ZERO         3
+#define DB_LOG_POLL_MS      100             //follow mode polling interval
+
 
 #define DB_FILE     "student.db"            //name of database file
 #define TMP_DB_FILE ".tmp_student.db"       //for extra credit
 
+//Sharded layout.  When the manifest exists the id space is split into
+//contiguous ranges, one per shard file.  Each shard keeps the same sparse
+//id*STUDENT_RECORD_SIZE addressing as the single file layout, so a shard
+//only holds data for its own range and the rest of it is a hole.
+#define DB_MANIFEST_SUFFIX  ".manifest"
+#define DB_MANIFEST_FILE    DB_FILE DB_MANIFEST_SUFFIX
+#define DB_SHARD_FMT        "student.db.%d"
+#define TMP_DB_SHARD_FMT    ".tmp_student.db.%d"
+#define MAX_DB_SHARDS       16
+#define DB_PATH_MAX         64
+
 #endif
\ No newline at end of file
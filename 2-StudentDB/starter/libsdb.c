@@ -0,0 +1,694 @@
+/**
+	@file
+	@Description
+	libsdb handles, see libsdb.h.  A handle keeps its file open together
+	with a cache of 4K blocks of records, kept in LRU order with a hash
+	table to find them.  Every cached block remembers the file_id and
+	generation of the header it was read under and is only used while the
+	header still says the same, so a cache hit costs one 64 byte pread() of
+	the header and never takes a lock.  A miss reads the block between two
+	header reads the way snapshot_db() does, and falls back to a shared
+	lock if writers keep the file busy.  Direct handles check the header
+	through a second, buffered, fd so the check is served from the page
+	cache instead of the device.
+
+	Changes go through write_record() under the write lock, exactly like
+	sdbsc, and are patched into the cached block so a handle does not lose
+	its cache to its own writes.  A file replaced by compress or reshard is
+	marked stale, the handle then reopens the name.
+**/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+// database include files
+#include "db.h"
+#include "libsdb.h"
+#include "sdbsc.h"
+#include "sdbstats.h"
+
+//records in one cached block, their checksum results fit in a 64 bit mask
+#define SDB_BLOCK_RECS      (DIO_BLOCK_SIZE / (int)sizeof(student_t))
+_Static_assert(SDB_BLOCK_RECS <= 64, "bad record mask is 64 bits");
+
+//compress builds the new file next to the old one, as .tmp_<name>
+#define SDB_TMP_PREFIX      ".tmp_"
+
+typedef struct sdb_block {
+    int                 blk;            //block number, -1 while unused
+    unsigned int        file_id;        //header the block was read under
+    unsigned int        gen;
+    unsigned long long  bad;            //bit i set if recs[i] failed its checksum
+    struct sdb_block   *prev;           //LRU list, most recently used first
+    struct sdb_block   *next;
+    struct sdb_block   *chain;          //hash bucket chain
+    student_t           recs[SDB_BLOCK_RECS];
+} sdb_block_t;
+
+struct sdb {
+    int                 fd;
+    int                 hdr_fd;         //header checks, fd unless direct
+    char                path[PATH_MAX];
+    char                tmp_path[PATH_MAX];
+    sdb_options_t       opts;
+    sdb_block_t        *blocks;
+    sdb_block_t       **buckets;
+    int                 nbuckets;       //a power of two
+    sdb_block_t        *mru;
+    sdb_block_t        *lru;
+    sdb_cache_stats_t   stats;
+};
+
+/*
+ *  cache_init
+ *
+ *  Allocates opts.cache_blocks blocks, all unused and linked into the LRU
+ *  list, and a bucket per block rounded up to a power of two.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE if there is no memory
+ */
+static int cache_init(sdb_t *db)
+{
+    int n = db->opts.cache_blocks;
+
+    if (n <= 0)
+        return NO_ERROR;
+
+    db->nbuckets = 1;
+    while (db->nbuckets < n)
+        db->nbuckets <<= 1;
+    db->blocks = calloc(n, sizeof(sdb_block_t));
+    db->buckets = calloc(db->nbuckets, sizeof(sdb_block_t *));
+    if (db->blocks == NULL || db->buckets == NULL)
+        return ERR_DB_FILE;
+
+    for (int i = 0; i < n; i++) {
+        db->blocks[i].blk = -1;
+        db->blocks[i].prev = (i > 0) ? &db->blocks[i - 1] : NULL;
+        db->blocks[i].next = (i < n - 1) ? &db->blocks[i + 1] : NULL;
+    }
+    db->mru = &db->blocks[0];
+    db->lru = &db->blocks[n - 1];
+    return NO_ERROR;
+}
+
+//drops every cached block, used when the handle moves to another file
+static void cache_clear(sdb_t *db)
+{
+    for (int i = 0; i < db->opts.cache_blocks; i++)
+        db->blocks[i].blk = -1;
+    if (db->buckets != NULL)
+        memset(db->buckets, 0, db->nbuckets * sizeof(sdb_block_t *));
+}
+
+static sdb_block_t *cache_find(sdb_t *db, int blk)
+{
+    sdb_block_t *b = db->buckets[blk & (db->nbuckets - 1)];
+
+    while (b != NULL && b->blk != blk)
+        b = b->chain;
+    return b;
+}
+
+//moves b to the front of the LRU list
+static void cache_touch(sdb_t *db, sdb_block_t *b)
+{
+    if (b == db->mru)
+        return;
+
+    b->prev->next = b->next;
+    if (b->next != NULL)
+        b->next->prev = b->prev;
+    else
+        db->lru = b->prev;
+
+    b->prev = NULL;
+    b->next = db->mru;
+    db->mru->prev = b;
+    db->mru = b;
+}
+
+/*
+ *  cache_slot
+ *
+ *  Finds the block to keep blk in, the block already holding it or else
+ *  the least recently used one, which is moved to the bucket of blk.
+ *
+ *  returns:  the block, at the front of the LRU list
+ */
+static sdb_block_t *cache_slot(sdb_t *db, int blk)
+{
+    sdb_block_t *b = cache_find(db, blk);
+
+    if (b == NULL) {
+        b = db->lru;
+        if (b->blk >= 0) {
+            sdb_block_t **link = &db->buckets[b->blk & (db->nbuckets - 1)];
+            while (*link != b)
+                link = &(*link)->chain;
+            *link = b->chain;
+            db->stats.evictions++;
+        }
+        b->blk = blk;
+        b->chain = db->buckets[blk & (db->nbuckets - 1)];
+        db->buckets[blk & (db->nbuckets - 1)] = b;
+    }
+
+    cache_touch(db, b);
+    return b;
+}
+
+/*
+ *  block_record
+ *
+ *  Copies record id out of a cached block with the same results
+ *  read_record() would give.
+ *
+ *  returns:  NO_ERROR, SRCH_NOT_FOUND or ERR_DB_CORRUPT
+ */
+static int block_record(const sdb_block_t *b, int id, student_t *s)
+{
+    int slot = id % SDB_BLOCK_RECS;
+    const student_t *rec = &b->recs[slot];
+
+    if (!is_student_record(rec) || rec->id != id)
+        return SRCH_NOT_FOUND;
+
+    *s = *rec;
+    return (b->bad & (1ULL << slot)) ? ERR_DB_CORRUPT : NO_ERROR;
+}
+
+static int open_files(sdb_t *db, int flags)
+{
+    db->fd = SDB_OPEN_RECS(db->path, O_RDWR | flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (db->fd < 0)
+        return ERR_DB_FILE;
+
+    db->hdr_fd = db->fd;
+    if (sdb_direct_on) {
+        db->hdr_fd = SDB_OPEN(db->path, O_RDONLY, 0);
+        if (db->hdr_fd < 0) {
+            SDB_CLOSE(db->fd);
+            db->fd = -1;
+            return ERR_DB_FILE;
+        }
+    }
+    return NO_ERROR;
+}
+
+static void close_files(sdb_t *db)
+{
+    if (db->hdr_fd >= 0 && db->hdr_fd != db->fd)
+        SDB_CLOSE(db->hdr_fd);
+    if (db->fd >= 0)
+        SDB_CLOSE(db->fd);
+    db->fd = -1;
+    db->hdr_fd = -1;
+}
+
+/*
+ *  check_header
+ *
+ *  Reads the header of the handle's file.  A file that compress or
+ *  reshard replaced is closed and its name reopened, the cache goes with
+ *  the old file.  The name is not created again if it is gone.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int check_header(sdb_t *db, db_header_t *hdr)
+{
+    for (int tries = 0; tries < DB_SNAP_RETRIES; tries++) {
+        if (db->fd < 0 && open_files(db, 0) < 0)
+            return ERR_DB_FILE;
+        if (read_db_header(db->hdr_fd, hdr) < 0)
+            return ERR_DB_FILE;
+        if (!(hdr->flags & DB_FLAG_STALE))
+            return NO_ERROR;
+
+        close_files(db);
+        cache_clear(db);
+    }
+    return ERR_DB_FILE;
+}
+
+/*
+ *  lock_file
+ *
+ *  Takes the write lock on the handle's current file.  compress marks the
+ *  old file stale before it lets go of the lock, so a stale header seen
+ *  under the lock means the lock was taken on the wrong file.
+ *
+ *  returns:  NO_ERROR with the lock held and *hdr read under it, or
+ *            ERR_DB_FILE
+ */
+static int lock_file(sdb_t *db, db_header_t *hdr)
+{
+    for (int tries = 0; tries < DB_SNAP_RETRIES; tries++) {
+        if (check_header(db, hdr) < 0)
+            return ERR_DB_FILE;
+        if (SDB_FLOCK(db->fd, LOCK_EX) == -1)
+            return ERR_DB_FILE;
+        if (read_db_header(db->fd, hdr) < 0) {
+            SDB_FLOCK(db->fd, LOCK_UN);
+            return ERR_DB_FILE;
+        }
+        if (!(hdr->flags & DB_FLAG_STALE))
+            return NO_ERROR;
+        SDB_FLOCK(db->fd, LOCK_UN);
+    }
+    return ERR_DB_FILE;
+}
+
+//read_record() under a shared lock, for when the cache is off or busy
+static int locked_read(sdb_t *db, int id, student_t *s)
+{
+    int rc;
+
+    if (SDB_FLOCK(db->fd, LOCK_SH) == -1)
+        return ERR_DB_FILE;
+    rc = read_record(db->fd, id, s);
+    SDB_FLOCK(db->fd, LOCK_UN);
+    return rc;
+}
+
+/*
+ *  load_block
+ *
+ *  Reads block blk and checks it against its checksums, then reads the
+ *  header again.  The block is only cached if the header did not move
+ *  while it was being read.
+ *
+ *  returns:  NO_ERROR with *out set to the cached block, or NULL if a
+ *            writer got in the way, or ERR_DB_FILE
+ */
+static int load_block(sdb_t *db, int blk, const db_header_t *hdr, sdb_block_t **out)
+{
+    student_t recs[SDB_BLOCK_RECS];
+    bool bad[SDB_BLOCK_RECS] = {false};
+    off_t offset = (off_t)blk * DIO_BLOCK_SIZE;
+    db_header_t after;
+
+    *out = NULL;
+
+    // the block layer's own cache is only good under a lock
+    dio_forget(db->fd);
+    ssize_t got = SDB_PREAD(db->fd, recs, sizeof(recs), offset);
+    if (got < 0 || got % STUDENT_RECORD_SIZE != 0)
+        return ERR_DB_FILE;
+    memset((char *)recs + got, 0, sizeof(recs) - got);
+
+    if ((hdr->flags & DB_FLAG_CRC) &&
+        check_range_crc(db->fd, blk * SDB_BLOCK_RECS, SDB_BLOCK_RECS, recs, bad) < 0)
+        return ERR_DB_FILE;
+
+    if (read_db_header(db->hdr_fd, &after) < 0)
+        return ERR_DB_FILE;
+    if (after.gen != hdr->gen || after.file_id != hdr->file_id)
+        return NO_ERROR;
+
+    sdb_block_t *b = cache_slot(db, blk);
+    memcpy(b->recs, recs, sizeof(recs));
+    b->bad = 0;
+    for (int i = 0; i < SDB_BLOCK_RECS; i++) {
+        if (bad[i])
+            b->bad |= 1ULL << i;
+    }
+    b->file_id = hdr->file_id;
+    b->gen = hdr->gen;
+    *out = b;
+    return NO_ERROR;
+}
+
+/*
+ *  cache_patch
+ *
+ *  Puts a record the handle just wrote into its cached block.  The block
+ *  is only patched if it was current before the write, it is then current
+ *  again at the header the write left behind.
+ */
+static void cache_patch(sdb_t *db, int id, const student_t *s, const db_header_t *before)
+{
+    db_header_t now;
+    sdb_block_t *b;
+    int slot = id % SDB_BLOCK_RECS;
+
+    if (db->opts.cache_blocks == 0 || (b = cache_find(db, id / SDB_BLOCK_RECS)) == NULL)
+        return;
+
+    if (b->file_id != before->file_id || b->gen != before->gen ||
+        read_db_header(db->fd, &now) < 0) {
+        b->gen = ~0u;       // odd, never matches a header
+        return;
+    }
+
+    b->recs[slot] = (s != NULL) ? *s : EMPTY_STUDENT_RECORD;
+    b->bad &= ~(1ULL << slot);
+    b->file_id = now.file_id;
+    b->gen = now.gen;
+}
+
+/*
+ *  change_record
+ *
+ *  Shared body of sdb_add() and sdb_del(), s is NULL for a delete.
+ *
+ *  returns:  NO_ERROR, ERR_DB_OP, SRCH_NOT_FOUND, ERR_DB_CORRUPT, ERR_DB_FILE
+ *            or ERR_DB_LOG
+ */
+static int change_record(sdb_t *db, int id, const student_t *s)
+{
+    db_header_t hdr;
+    student_t old;
+    int rc;
+
+    if (lock_file(db, &hdr) < 0)
+        return ERR_DB_FILE;
+
+    rc = read_record(db->fd, id, &old);
+    if (rc == NO_ERROR && s != NULL)
+        rc = ERR_DB_OP;         // the id is taken
+    else if ((rc == ERR_DB_CORRUPT && s == NULL) || (rc == SRCH_NOT_FOUND && s != NULL))
+        rc = NO_ERROR;          // corrupt records are deleted, never replaced
+
+    if (rc == NO_ERROR) {
+        rc = write_record(db->fd, db->path, id, s);
+        // a change that only missed the log is still in the file
+        if (rc != ERR_DB_FILE)
+            cache_patch(db, id, s, &hdr);
+    }
+
+    SDB_FLOCK(db->fd, LOCK_UN);
+    return rc;
+}
+
+/*
+ *  sdb_open
+ *      db:    set to the new handle
+ *      path:  database file, created if it does not exist
+ *      opts:  options, NULL for SDB_OPTIONS_INIT
+ *
+ *  With opts->truncate the file is emptied, given a new header and the
+ *  change logged like sdbsc -z.  If only the log could not be written the handle is still
+ *  returned, along with ERR_DB_LOG.  A path with a manifest next to it,
+ *  student.db after sdbsc -n, is refused rather than created again beside
+ *  the shards that hold its records.
+ *
+ *  returns:  NO_ERROR, ERR_DB_LOG, ERR_DB_OP for a sharded database or
+ *            ERR_DB_FILE
+ */
+int sdb_open(sdb_t **db, const char *path, const sdb_options_t *opts)
+{
+    static const sdb_options_t defaults = SDB_OPTIONS_INIT;
+    char manifest[PATH_MAX];
+    struct stat st;
+    const char *base;
+    sdb_t *h;
+
+    *db = NULL;
+    if (opts == NULL)
+        opts = &defaults;
+    if (path == NULL || strlen(path) + strlen(SDB_TMP_PREFIX) >= PATH_MAX)
+        return ERR_DB_FILE;
+    if (snprintf(manifest, sizeof(manifest), "%s%s", path, DB_MANIFEST_SUFFIX) >= (int)sizeof(manifest))
+        return ERR_DB_FILE;
+    if (stat(manifest, &st) == 0)
+        return ERR_DB_OP;
+
+    h = calloc(1, sizeof(sdb_t));
+    if (h == NULL)
+        return ERR_DB_FILE;
+    h->fd = -1;
+    h->hdr_fd = -1;
+    h->opts = *opts;
+    if (h->opts.cache_blocks < 0)
+        h->opts.cache_blocks = 0;
+
+    base = strrchr(path, '/');
+    base = (base != NULL) ? base + 1 : path;
+    strcpy(h->path, path);
+    memcpy(h->tmp_path, path, base - path);
+    strcpy(h->tmp_path + (base - path), SDB_TMP_PREFIX);
+    strcat(h->tmp_path, base);
+
+    if (opts->direct)
+        sdb_direct_on = true;
+
+    if (cache_init(h) < 0 || open_files(h, O_CREAT | (opts->truncate ? O_TRUNC : 0)) < 0 ||
+        (opts->truncate && init_db_header(h->fd, 0) < 0)) {
+        sdb_close(h);
+        return ERR_DB_FILE;
+    }
+
+    *db = h;
+    if (opts->truncate && log_change(h->path, LOG_OP_ZERO, 0, NULL) < 0)
+        return ERR_DB_LOG;
+    return NO_ERROR;
+}
+
+/*
+ *  sdb_close
+ *      db:  handle from sdb_open(), may be NULL
+ *
+ *  returns:  NO_ERROR
+ */
+int sdb_close(sdb_t *db)
+{
+    if (db == NULL)
+        return NO_ERROR;
+
+    close_files(db);
+    free(db->blocks);
+    free(db->buckets);
+    free(db);
+    return NO_ERROR;
+}
+
+/*
+ *  sdb_get
+ *      db:  handle
+ *      id:  student to look up
+ *      s:   where the record is copied
+ *
+ *  returns:  NO_ERROR        student found and copied into *s
+ *            SRCH_NOT_FOUND  no such student
+ *            ERR_DB_CORRUPT  the record was copied but fails its checksum
+ *            ERR_DB_FILE     database file I/O issue
+ */
+int sdb_get(sdb_t *db, int id, student_t *s)
+{
+    int blk = id / SDB_BLOCK_RECS;
+    db_header_t hdr;
+
+    if (s == NULL)
+        return ERR_DB_FILE;
+    if (id < MIN_STD_ID || id > MAX_STD_ID)
+        return SRCH_NOT_FOUND;
+    if (check_header(db, &hdr) < 0)
+        return ERR_DB_FILE;
+    if (db->opts.cache_blocks == 0)
+        return locked_read(db, id, s);
+
+    for (int attempt = 0; attempt < DB_SNAP_RETRIES; attempt++) {
+        sdb_block_t *b;
+
+        if (attempt > 0 && read_db_header(db->hdr_fd, &hdr) < 0)
+            return ERR_DB_FILE;
+        if (hdr.gen & 1) {
+            sched_yield();
+            continue;
+        }
+
+        b = cache_find(db, blk);
+        if (b != NULL && b->file_id == hdr.file_id && b->gen == hdr.gen) {
+            db->stats.hits++;
+            cache_touch(db, b);
+            return block_record(b, id, s);
+        }
+
+        if (load_block(db, blk, &hdr, &b) < 0)
+            return ERR_DB_FILE;
+        if (b != NULL) {
+            db->stats.misses++;
+            return block_record(b, id, s);
+        }
+    }
+
+    db->stats.misses++;
+    return locked_read(db, id, s);
+}
+
+/*
+ *  sdb_add
+ *      db:  handle
+ *      s:   the student to add, s->id picks the slot
+ *
+ *  The names are cut to fit and always NUL terminated, like sdbsc -a.
+ *
+ *  returns:  NO_ERROR        student added
+ *            ERR_DB_OP       the id or gpa is out of range, or the id is taken
+ *            ERR_DB_CORRUPT  the slot holds a corrupt record, sdb_del() it
+ *                            first
+ *            ERR_DB_FILE     database file I/O issue
+ *            ERR_DB_LOG      student added but the change log failed
+ */
+int sdb_add(sdb_t *db, const student_t *s)
+{
+    student_t rec;
+
+    if (s == NULL || s->id < MIN_STD_ID || s->id > MAX_STD_ID ||
+        s->gpa < MIN_STD_GPA || s->gpa > MAX_STD_GPA)
+        return ERR_DB_OP;
+
+    rec = *s;
+    rec.fname[sizeof(rec.fname) - 1] = '\0';
+    rec.lname[sizeof(rec.lname) - 1] = '\0';
+    return change_record(db, rec.id, &rec);
+}
+
+/*
+ *  sdb_del
+ *      db:  handle
+ *      id:  student to delete
+ *
+ *  returns:  NO_ERROR        student deleted
+ *            SRCH_NOT_FOUND  no such student
+ *            ERR_DB_FILE     database file I/O issue
+ *            ERR_DB_LOG      student deleted but the change log failed
+ */
+int sdb_del(sdb_t *db, int id)
+{
+    if (id < MIN_STD_ID || id > MAX_STD_ID)
+        return SRCH_NOT_FOUND;
+    return change_record(db, id, NULL);
+}
+
+/*
+ *  sdb_count
+ *      db:  handle
+ *
+ *  Counts from a snapshot_db() copy, records that fail their checksum
+ *  are not counted.
+ *
+ *  returns:  <number>     the number of students
+ *            ERR_DB_FILE  database file I/O issue
+ */
+int sdb_count(sdb_t *db)
+{
+    db_header_t hdr;
+    student_t *recs;
+    int count = 0;
+
+    if (check_header(db, &hdr) < 0)
+        return ERR_DB_FILE;
+
+    int rc = snapshot_db(db->fd, 0, MAX_STD_ID, false, &recs, &count);
+    free(recs);
+    return (rc < 0) ? rc : count;
+}
+
+/*
+ *  sdb_scan
+ *      db:     handle
+ *      visit:  called for every student in id order
+ *      arg:    passed through to visit
+ *
+ *  Takes a snapshot_db() copy first, visit can take its time and call
+ *  back into the handle.  Records that fail their checksum are skipped.
+ *
+ *  returns:  NO_ERROR, ERR_DB_FILE or the non zero value visit returned
+ */
+int sdb_scan(sdb_t *db, sdb_visit_t visit, void *arg)
+{
+    db_header_t hdr;
+    student_t *recs;
+    int count = 0;
+    int rc;
+
+    if (check_header(db, &hdr) < 0)
+        return ERR_DB_FILE;
+
+    rc = snapshot_db(db->fd, 0, MAX_STD_ID, true, &recs, &count);
+    if (rc < 0) {
+        free(recs);
+        return rc;
+    }
+
+    rc = NO_ERROR;
+    for (int i = 0; i < count && rc == NO_ERROR; i++)
+        rc = visit(&recs[i], arg);
+
+    free(recs);
+    return rc;
+}
+
+/*
+ *  sdb_compress
+ *      db:  handle
+ *
+ *  Compresses the file like sdbsc -x and moves the handle to the new
+ *  file.  Other handles and sdbsc processes that have the old file open
+ *  find it marked stale and follow.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+int sdb_compress(sdb_t *db)
+{
+    db_header_t hdr;
+    int fd;
+
+    if (lock_file(db, &hdr) < 0)
+        return ERR_DB_FILE;
+
+    // the old fd and its lock go away inside compact_db_file()
+    if (db->hdr_fd != db->fd)
+        SDB_CLOSE(db->hdr_fd);
+    fd = compact_db_file(db->fd, db->path, db->tmp_path);
+    db->fd = -1;
+    db->hdr_fd = -1;
+    cache_clear(db);
+    if (fd < 0)
+        return ERR_DB_FILE;
+
+    // reopen the name so a direct handle gets its header fd back too
+    SDB_CLOSE(fd);
+    return open_files(db, 0);
+}
+
+/*
+ *  sdb_cache_stats
+ *      db:     handle
+ *      stats:  where the counters are copied
+ *
+ *  returns:  nothing, this is a void function
+ */
+void sdb_cache_stats(const sdb_t *db, sdb_cache_stats_t *stats)
+{
+    *stats = db->stats;
+}
+
+/*
+ *  sdb_strerror
+ *      rc:  status code returned by a libsdb function
+ *
+ *  returns:  a short description of rc
+ */
+const char *sdb_strerror(int rc)
+{
+    switch (rc) {
+    case NO_ERROR:          return "no error";
+    case ERR_DB_FILE:       return "database file I/O error";
+    case ERR_DB_OP:         return "operation not allowed";
+    case SRCH_NOT_FOUND:    return "student not found";
+    case ERR_DB_CORRUPT:    return "record failed its checksum";
+    case ERR_DB_LOG:        return "change was made but not logged";
+    default:                return "unknown error";
+    }
+}
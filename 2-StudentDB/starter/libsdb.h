@@ -0,0 +1,68 @@
+#ifndef __LIBSDB_H__
+    #define __LIBSDB_H__
+
+#include <stdbool.h>
+
+#include "db.h" //get student record type
+
+//libsdb, the student database as a library.  Build it with "make libsdb.a"
+//or "make libsdb.so" and link it into a program instead of running sdbsc.
+//A handle owns one open database file, its options and a cache of recently
+//read 4K blocks of records, so repeated lookups of the same ids do not go
+//back to the file.  The cache is checked against the generation in the
+//file's header on every call, changes made by sdbsc or by other handles
+//are seen right away.  Nothing in the library prints, every function
+//returns one of the status codes below.
+//
+//A handle works on one file, student.db or a single shard or replica.  Once
+//sdbsc -n has sharded student.db, open the shard files instead.
+//Handles are not thread safe, use one per thread.
+
+//error codes to be returned from individual functions
+// NO_ERROR is returned if there are no errors
+// ERR_DB_FILE is returned if there is are any issues with the database file itself
+// ERR_DB_OP is returned if an operation did not work aka add or delete a student
+// SRCH_NOT_FOUND is returned if the student is not found (get_student, and del_student)
+// ERR_DB_CORRUPT is returned if a record does not match its checksum
+// ERR_DB_LOG is returned if a change was made but the change log could not be written
+#define NO_ERROR        0
+#define ERR_DB_FILE     -1
+#define ERR_DB_OP       -2
+#define SRCH_NOT_FOUND  -3
+#define ERR_DB_CORRUPT  -4
+#define ERR_DB_LOG      -5
+
+typedef struct sdb sdb_t;
+
+//Options for sdb_open().  direct opens the file with O_DIRECT through the
+//block layer in sdbdio.c, which is switched on for the whole process.
+typedef struct sdb_options {
+    bool truncate;                      //empty the file when opening it
+    bool direct;                        //bypass the page cache
+    int  cache_blocks;                  //4K blocks cached, 0 turns it off
+} sdb_options_t;
+
+#define SDB_CACHE_BLOCKS    256         //default cache, 1MB per handle
+#define SDB_OPTIONS_INIT    { false, false, SDB_CACHE_BLOCKS }
+
+typedef struct sdb_cache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+} sdb_cache_stats_t;
+
+//called by sdb_scan() for every record, a non zero return stops the scan
+typedef int (*sdb_visit_t)(const student_t *s, void *arg);
+
+int sdb_open(sdb_t **db, const char *path, const sdb_options_t *opts);
+int sdb_close(sdb_t *db);
+int sdb_get(sdb_t *db, int id, student_t *s);
+int sdb_add(sdb_t *db, const student_t *s);
+int sdb_del(sdb_t *db, int id);
+int sdb_count(sdb_t *db);
+int sdb_scan(sdb_t *db, sdb_visit_t visit, void *arg);
+int sdb_compress(sdb_t *db);
+void sdb_cache_stats(const sdb_t *db, sdb_cache_stats_t *stats);
+const char *sdb_strerror(int rc);
+
+#endif
@@ -0,0 +1,368 @@
+/**
+	@file
+	@Description
+	Optional per record CRC32C checksums.  When DB_FLAG_CRC is set in the
+	slot 0 header every slot has a 4 byte checksum in a sparse region that
+	starts right after the last possible student slot, see DB_CRC_OFFSET.
+	Keeping the checksums in the same file means compress_db() and the
+	rename that goes with it replace records and checksums together.
+
+	The checksum is seeded with the slot number so a record written to the
+	wrong slot is caught as well.  It is computed with the SSE4.2 or ARMv8
+	crc32c instructions when the CPU has them and with slicing-by-8 tables
+	otherwise.
+**/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+#include "sdbstats.h"
+
+#define CRC32C_POLY         0x82f63b78      //reflected Castagnoli polynomial
+
+static uint32_t crc_tables[8][256];
+static bool crc_use_hw;
+// set up once on first use, scan_shards() checksums from several threads
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init_tables(void)
+{
+    for (int i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ (CRC32C_POLY & (0 - (crc & 1)));
+        crc_tables[0][i] = crc;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++)
+            crc_tables[t][i] = (crc_tables[t - 1][i] >> 8) ^
+                               crc_tables[0][crc_tables[t - 1][i] & 0xff];
+    }
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        word ^= crc;
+        crc = crc_tables[7][word & 0xff] ^
+              crc_tables[6][(word >> 8) & 0xff] ^
+              crc_tables[5][(word >> 16) & 0xff] ^
+              crc_tables[4][(word >> 24) & 0xff] ^
+              crc_tables[3][(word >> 32) & 0xff] ^
+              crc_tables[2][(word >> 40) & 0xff] ^
+              crc_tables[1][(word >> 48) & 0xff] ^
+              crc_tables[0][word >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = (crc >> 8) ^ crc_tables[0][(crc ^ *p++) & 0xff];
+
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint64_t crc64 = crc;
+
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)crc64;
+    while (len--)
+        crc = _mm_crc32_u8(crc, *p++);
+
+    return crc;
+}
+
+static bool crc32c_has_hw(void)
+{
+    return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc = __crc32cd(crc, word);
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = __crc32cb(crc, *p++);
+
+    return crc;
+}
+
+static bool crc32c_has_hw(void)
+{
+    return true;
+}
+#else
+#define crc32c_hw   crc32c_sw
+
+static bool crc32c_has_hw(void)
+{
+    return false;
+}
+#endif
+
+static void crc_init(void)
+{
+    crc_use_hw = crc32c_has_hw();
+    if (!crc_use_hw)
+        crc_init_tables();
+}
+
+/*
+ *  record_crc
+ *      id:  slot the record lives in
+ *      s:   the record
+ *
+ *  returns:  the CRC32C of the record seeded with its slot number.  Never
+ *            0, which is what an unwritten checksum slot reads back as.
+ */
+uint32_t record_crc(int id, const student_t *s)
+{
+    uint32_t crc = ~(uint32_t)id;
+
+    pthread_once(&crc_once, crc_init);
+    if (crc_use_hw)
+        crc = crc32c_hw(crc, (const uint8_t *)s, STUDENT_RECORD_SIZE);
+    else
+        crc = crc32c_sw(crc, (const uint8_t *)s, STUDENT_RECORD_SIZE);
+
+    crc = ~crc;
+    return crc ? crc : 1;
+}
+
+static off_t crc_offset(int id)
+{
+    return DB_CRC_OFFSET + (off_t)id * sizeof(uint32_t);
+}
+
+/*
+ *  db_crc_enabled
+ *      fd:  linux file descriptor
+ *
+ *  returns:  true if the file carries checksums
+ */
+bool db_crc_enabled(int fd)
+{
+    db_header_t hdr;
+
+    return read_db_header(fd, &hdr) == NO_ERROR && (hdr.flags & DB_FLAG_CRC);
+}
+
+/*
+ *  write_record_crc
+ *      fd:  linux file descriptor, the caller must hold the write lock
+ *      id:  slot that was just written
+ *      s:   the record written to it, or NULL if the slot was emptied
+ *
+ *  Does nothing unless checksums are enabled for the file.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+int write_record_crc(int fd, int id, const student_t *s)
+{
+    uint32_t crc = (s != NULL) ? record_crc(id, s) : 0;
+
+    if (!db_crc_enabled(fd))
+        return NO_ERROR;
+
+    if (SDB_PWRITE(fd, &crc, sizeof(crc), crc_offset(id)) != sizeof(crc))
+        return ERR_DB_FILE;
+    return NO_ERROR;
+}
+
+/*
+ *  check_record_crc
+ *      fd:  linux file descriptor
+ *      id:  slot the record was read from
+ *      s:   the record read from it
+ *
+ *  returns:  NO_ERROR        checksums are off or the record is intact
+ *            ERR_DB_CORRUPT  the record does not match its checksum
+ *            ERR_DB_FILE     the checksum could not be read
+ */
+int check_record_crc(int fd, int id, const student_t *s)
+{
+    uint32_t crc = 0;
+
+    if (!db_crc_enabled(fd))
+        return NO_ERROR;
+
+    if (SDB_PREAD(fd, &crc, sizeof(crc), crc_offset(id)) < 0)
+        return ERR_DB_FILE;
+    return (crc == record_crc(id, s)) ? NO_ERROR : ERR_DB_CORRUPT;
+}
+
+/*
+ *  check_range_crc
+ *      fd:    linux file descriptor
+ *      id:    slot of recs[0]
+ *      n:     number of slots in recs
+ *      recs:  slots read from the file
+ *      bad:   bad[i] is set to true if recs[i] holds a corrupt record
+ *
+ *  Bulk version of check_record_crc() for the scanners, the caller has
+ *  already checked that the file carries checksums.  Empty slots are never
+ *  bad.
+ *
+ *  returns:  <number>     the number of corrupt records
+ *            ERR_DB_FILE  the checksums could not be read
+ */
+int check_range_crc(int fd, int id, int n, const student_t *recs, bool *bad)
+{
+    uint32_t crcs[SCRUB_CHUNK_RECS];
+    int corrupt = 0;
+
+    for (int done = 0; done < n; done += SCRUB_CHUNK_RECS) {
+        int want = n - done < SCRUB_CHUNK_RECS ? n - done : SCRUB_CHUNK_RECS;
+        ssize_t got = SDB_PREAD(fd, crcs, want * sizeof(uint32_t), crc_offset(id + done));
+        if (got < 0)
+            return ERR_DB_FILE;
+        // the checksum region is sparse, anything past its end reads as 0
+        memset((char *)crcs + got, 0, want * sizeof(uint32_t) - got);
+
+        for (int i = 0; i < want; i++) {
+            const student_t *s = &recs[done + i];
+            bad[done + i] = is_student_record(s) &&
+                            crcs[i] != record_crc(id + done + i, s);
+            if (bad[done + i])
+                corrupt++;
+        }
+    }
+
+    return corrupt;
+}
+
+/*
+ *  copy_range_crc
+ *      from_fd:  linux file descriptor the records were read from
+ *      to_fd:    linux file descriptor they were copied to at the same
+ *                slots, the caller must hold its write lock
+ *      id:       slot of recs[0]
+ *      n:        number of slots in recs
+ *      recs:     the slots as read from from_fd
+ *
+ *  Copies the stored checksums of the records in recs as they are and
+ *  clears the ones of empty slots.  A record that fails its checksum goes
+ *  on failing it in the copy, so -S still reports it after compress.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+int copy_range_crc(int from_fd, int to_fd, int id, int n, const student_t *recs)
+{
+    uint32_t crcs[SCRUB_CHUNK_RECS];
+
+    for (int done = 0; done < n; done += SCRUB_CHUNK_RECS) {
+        int want = n - done < SCRUB_CHUNK_RECS ? n - done : SCRUB_CHUNK_RECS;
+        ssize_t got = SDB_PREAD(from_fd, crcs, want * sizeof(uint32_t), crc_offset(id + done));
+        if (got < 0)
+            return ERR_DB_FILE;
+        memset((char *)crcs + got, 0, want * sizeof(uint32_t) - got);
+
+        for (int i = 0; i < want; i++) {
+            if (!is_student_record(&recs[done + i]))
+                crcs[i] = 0;
+        }
+        if (SDB_PWRITE(to_fd, crcs, want * sizeof(uint32_t), crc_offset(id + done)) < 0)
+            return ERR_DB_FILE;
+    }
+
+    return NO_ERROR;
+}
+
+/*
+ *  set_db_crc
+ *      fd:  linux file descriptor, the caller must hold the write lock
+ *      on:  turn checksums on or off
+ *
+ *  Turning checksums on computes one for every record already in the file.
+ *  Turning them off cuts the file back to its last record, which drops the
+ *  checksum region.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+int set_db_crc(int fd, bool on)
+{
+    student_t *recs = malloc(SCRUB_CHUNK_RECS * sizeof(student_t));
+    uint32_t *crcs = malloc(SCRUB_CHUNK_RECS * sizeof(uint32_t));
+    db_header_t hdr;
+    off_t end = STUDENT_RECORD_SIZE;    // the header is always kept
+    int rc = NO_ERROR;
+
+    if (recs == NULL || crcs == NULL || begin_db_write(fd) < 0) {
+        rc = ERR_DB_FILE;
+        goto done;
+    }
+
+    for (int id = 0; id <= MAX_STD_ID && rc == NO_ERROR; id += SCRUB_CHUNK_RECS) {
+        off_t offset = (off_t)id * STUDENT_RECORD_SIZE;
+        size_t want = SCRUB_CHUNK_RECS * STUDENT_RECORD_SIZE;
+
+        if (offset + (off_t)want > DB_CRC_OFFSET)
+            want = DB_CRC_OFFSET - offset;
+
+        ssize_t got = SDB_PREAD(fd, recs, want, offset);
+        if (got < 0) {
+            rc = ERR_DB_FILE;
+            break;
+        }
+        if (got == 0)
+            break;
+
+        int n = got / STUDENT_RECORD_SIZE;
+        for (int i = 0; i < n; i++) {
+            crcs[i] = 0;
+            if (is_student_record(&recs[i])) {
+                crcs[i] = record_crc(id + i, &recs[i]);
+                end = offset + (off_t)(i + 1) * STUDENT_RECORD_SIZE;
+            }
+        }
+        if (on && SDB_PWRITE(fd, crcs, n * sizeof(uint32_t), crc_offset(id)) < 0)
+            rc = ERR_DB_FILE;
+    }
+
+    if (rc == NO_ERROR && !on && SDB_FTRUNCATE(fd, end) == -1)
+        rc = ERR_DB_FILE;
+
+    // rewrite the header with the new flag, it is still at the odd
+    // generation begin_db_write() left it at
+    if (rc == NO_ERROR && read_db_header(fd, &hdr) == NO_ERROR) {
+        hdr.flags = on ? (hdr.flags | DB_FLAG_CRC) : (hdr.flags & ~DB_FLAG_CRC);
+        if (SDB_PWRITE(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+            rc = ERR_DB_FILE;
+    }
+    if (end_db_write(fd) < 0)
+        rc = ERR_DB_FILE;
+
+done:
+    free(recs);
+    free(crcs);
+    return rc;
+}
@@ -0,0 +1,454 @@
+/**
+	@file
+	@Description
+	Direct I/O block layer, see sdbdio.h.  Every transfer on a direct file
+	is widened to whole 4K blocks.  Reads of one or two blocks, which is
+	what point lookups and the read-modify-write of a 64 byte record need,
+	go through a small LRU block cache.  Larger reads, the scanners and
+	compress, stream through a staging buffer instead so they never push
+	anything out of the cache.  Writes are write through.
+
+	The cache is private to the process, so a cached block is only trusted
+	while the lock it was read under is held: every flock() on a file,
+	taking or dropping a lock, forgets that file's blocks.  Block 0 holds
+	the header the snapshot readers poll without a lock and is never
+	cached.
+**/
+
+#define _GNU_SOURCE     // O_DIRECT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#include "sdbstats.h"
+
+bool sdb_direct_on = false;
+
+typedef struct dio_frame {
+    int fd;                             //-1 when the frame is free
+    off_t blk;
+    int len;                            //bytes valid, short at EOF
+    unsigned long tick;                 //last use, for LRU
+    char *data;
+} dio_frame_t;
+
+static bool direct_fds[DIO_MAX_FDS];
+static dio_frame_t frames[DIO_CACHE_BLOCKS];
+static char *staging[DIO_STAGING_BUFS];
+static bool staging_busy[DIO_STAGING_BUFS];
+static unsigned long tick;
+static char *pool;
+static pthread_mutex_t dio_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t staging_free = PTHREAD_COND_INITIALIZER;
+
+/*
+ *  dio_init
+ *      argc, argv:  the programs arguments
+ *
+ *  Turns on direct I/O if --direct is on the command line or
+ *  DIRECT_ENV_VAR is set, removing the flag from argv like stats_init().
+ *
+ *  returns:  nothing, this is a void function
+ */
+void dio_init(int *argc, char *argv[])
+{
+    char *env = getenv(DIRECT_ENV_VAR);
+    int out = 1;
+
+    if (env != NULL && *env != '\0' && strcmp(env, "0") != 0)
+        sdb_direct_on = true;
+
+    for (int i = 1; i < *argc; i++) {
+        if (strcmp(argv[i], DIRECT_FLAG) == 0) {
+            sdb_direct_on = true;
+            continue;
+        }
+        argv[out++] = argv[i];
+    }
+    *argc = out;
+    argv[out] = NULL;
+}
+
+/*
+ *  pool_init
+ *
+ *  Carves the cache frames and staging buffers out of one block aligned
+ *  allocation the first time a direct file is opened.  Called with
+ *  dio_lock held.
+ *
+ *  returns:  0, or -1 if there is no memory
+ */
+static int pool_init(void)
+{
+    size_t frames_len = (size_t)DIO_CACHE_BLOCKS * DIO_BLOCK_SIZE;
+    size_t staging_len = (size_t)DIO_BUF_BLOCKS * DIO_BLOCK_SIZE;
+
+    if (pool != NULL)
+        return 0;
+    if (posix_memalign((void **)&pool, DIO_BLOCK_SIZE,
+                       frames_len + DIO_STAGING_BUFS * staging_len) != 0) {
+        pool = NULL;
+        return -1;
+    }
+
+    for (int i = 0; i < DIO_CACHE_BLOCKS; i++) {
+        frames[i].fd = -1;
+        frames[i].data = pool + (size_t)i * DIO_BLOCK_SIZE;
+    }
+    for (int i = 0; i < DIO_STAGING_BUFS; i++)
+        staging[i] = pool + frames_len + (size_t)i * staging_len;
+    return 0;
+}
+
+static bool is_direct(int fd)
+{
+    return fd >= 0 && fd < DIO_MAX_FDS && direct_fds[fd];
+}
+
+//drops every cached block of fd, called with dio_lock held
+static void forget_fd(int fd)
+{
+    for (int i = 0; i < DIO_CACHE_BLOCKS; i++) {
+        if (frames[i].fd == fd)
+            frames[i].fd = -1;
+    }
+}
+
+static char *get_staging(void)
+{
+    char *buf = NULL;
+
+    pthread_mutex_lock(&dio_lock);
+    while (buf == NULL) {
+        for (int i = 0; i < DIO_STAGING_BUFS && buf == NULL; i++) {
+            if (!staging_busy[i]) {
+                staging_busy[i] = true;
+                buf = staging[i];
+            }
+        }
+        if (buf == NULL)
+            pthread_cond_wait(&staging_free, &dio_lock);
+    }
+    pthread_mutex_unlock(&dio_lock);
+    return buf;
+}
+
+static void put_staging(char *buf)
+{
+    pthread_mutex_lock(&dio_lock);
+    for (int i = 0; i < DIO_STAGING_BUFS; i++) {
+        if (staging[i] == buf)
+            staging_busy[i] = false;
+    }
+    pthread_cond_signal(&staging_free);
+    pthread_mutex_unlock(&dio_lock);
+}
+
+/*
+ *  read_block
+ *      fd:   a direct file
+ *      blk:  block number
+ *      out:  DIO_BLOCK_SIZE bytes, the part past EOF is zeroed
+ *
+ *  Copies one block out of the cache, loading it on a miss.  Block 0 is
+ *  read straight from the file every time.
+ *
+ *  returns:  the number of bytes of the block that exist, or -1
+ */
+static ssize_t read_block(int fd, off_t blk, char *out)
+{
+    dio_frame_t *frame = NULL;
+    ssize_t got;
+
+    pthread_mutex_lock(&dio_lock);
+    for (int i = 0; i < DIO_CACHE_BLOCKS && blk != 0; i++) {
+        if (frames[i].fd == fd && frames[i].blk == blk) {
+            frame = &frames[i];
+            frame->tick = ++tick;
+            memcpy(out, frame->data, DIO_BLOCK_SIZE);
+            pthread_mutex_unlock(&dio_lock);
+            return frame->len;
+        }
+    }
+
+    // a miss, evict the least recently used frame and load the block
+    // into it.  Block 0 borrows the frame without keeping it.
+    frame = &frames[0];
+    for (int i = 1; i < DIO_CACHE_BLOCKS; i++) {
+        if (frames[i].fd == -1 || (frame->fd != -1 && frames[i].tick < frame->tick))
+            frame = &frames[i];
+    }
+    got = pread(fd, frame->data, DIO_BLOCK_SIZE, blk * DIO_BLOCK_SIZE);
+    if (got < 0) {
+        frame->fd = -1;
+        pthread_mutex_unlock(&dio_lock);
+        return -1;
+    }
+    memset(frame->data + got, 0, DIO_BLOCK_SIZE - got);
+    memcpy(out, frame->data, DIO_BLOCK_SIZE);
+
+    frame->fd = (blk != 0) ? fd : -1;
+    frame->blk = blk;
+    frame->len = got;
+    frame->tick = ++tick;
+    pthread_mutex_unlock(&dio_lock);
+    return got;
+}
+
+/*
+ *  update_blocks
+ *
+ *  Write through: refreshes the cached copies of the blocks a write just
+ *  replaced.  Blocks that are not cached are not brought in.
+ */
+static void update_blocks(int fd, off_t first, int nblks, const char *data, off_t size)
+{
+    pthread_mutex_lock(&dio_lock);
+    for (int i = 0; i < DIO_CACHE_BLOCKS; i++) {
+        off_t n = frames[i].blk - first;
+        if (frames[i].fd != fd || n < 0 || n >= nblks)
+            continue;
+
+        off_t len = size - frames[i].blk * DIO_BLOCK_SIZE;
+        memcpy(frames[i].data, data + n * DIO_BLOCK_SIZE, DIO_BLOCK_SIZE);
+        frames[i].len = len < DIO_BLOCK_SIZE ? len : DIO_BLOCK_SIZE;
+    }
+    pthread_mutex_unlock(&dio_lock);
+}
+
+/*
+ *  dio_open
+ *
+ *  open() that remembers which fds are direct.  A file system without
+ *  O_DIRECT support fails the open with EINVAL, the file is then opened
+ *  buffered instead.  Any blocks cached under a reused fd number are
+ *  dropped.
+ */
+int dio_open(const char *path, int flags, mode_t mode)
+{
+    int fd = open(path, flags, mode);
+
+    if (fd < 0 && errno == EINVAL && (flags & O_DIRECT)) {
+        flags &= ~O_DIRECT;
+        fd = open(path, flags, mode);
+    }
+    if (fd < 0)
+        return fd;
+
+    if ((flags & O_DIRECT) && fd >= DIO_MAX_FDS) {
+        close(fd);
+        flags &= ~O_DIRECT;
+        fd = open(path, flags, mode);
+        if (fd < 0)
+            return fd;
+    }
+
+    pthread_mutex_lock(&dio_lock);
+    if ((flags & O_DIRECT) && pool_init() < 0) {
+        pthread_mutex_unlock(&dio_lock);
+        close(fd);
+        return open(path, flags & ~O_DIRECT, mode);
+    }
+    if (fd < DIO_MAX_FDS) {
+        direct_fds[fd] = (flags & O_DIRECT) != 0;
+        forget_fd(fd);
+    }
+    pthread_mutex_unlock(&dio_lock);
+    return fd;
+}
+
+int dio_open_recs(const char *path, int flags, mode_t mode)
+{
+    return SDB_OPEN(path, flags | O_DIRECT, mode);
+}
+
+/*
+ *  dio_pread
+ *
+ *  pread() for direct files, same results as a buffered pread().
+ */
+ssize_t dio_pread(int fd, void *buf, size_t len, off_t offset)
+{
+    off_t first, last;
+    size_t done = 0;
+    char *stage;
+
+    if (!is_direct(fd))
+        return pread(fd, buf, len, offset);
+    if (len == 0)
+        return 0;
+
+    first = offset / DIO_BLOCK_SIZE;
+    last = (offset + len - 1) / DIO_BLOCK_SIZE;
+    stage = get_staging();
+
+    if (last - first < 2) {
+        // point reads go through the cache a block at a time
+        for (off_t blk = first; blk <= last && done < len; blk++) {
+            off_t skip = (blk == first) ? offset - blk * DIO_BLOCK_SIZE : 0;
+            ssize_t got = read_block(fd, blk, stage);
+
+            if (got < 0) {
+                put_staging(stage);
+                return -1;
+            }
+            if (got <= skip)
+                break;
+            size_t n = got - skip;
+            if (n > len - done)
+                n = len - done;
+            memcpy((char *)buf + done, stage + skip, n);
+            done += n;
+            if (got < DIO_BLOCK_SIZE)
+                break;
+        }
+    } else {
+        // big reads stream through the staging buffer, uncached
+        off_t pos = first * DIO_BLOCK_SIZE;
+        while (done < len) {
+            size_t want = (size_t)DIO_BUF_BLOCKS * DIO_BLOCK_SIZE;
+            off_t end = (last + 1) * DIO_BLOCK_SIZE;
+            if ((off_t)want > end - pos)
+                want = end - pos;
+
+            ssize_t got = pread(fd, stage, want, pos);
+            if (got < 0) {
+                put_staging(stage);
+                return -1;
+            }
+
+            off_t skip = offset + done - pos;
+            if (got <= skip)
+                break;
+            size_t n = got - skip;
+            if (n > len - done)
+                n = len - done;
+            memcpy((char *)buf + done, stage + skip, n);
+            done += n;
+            if ((size_t)got < want)
+                break;
+            pos += got;
+        }
+    }
+
+    put_staging(stage);
+    return done;
+}
+
+/*
+ *  dio_pwrite
+ *
+ *  pwrite() for direct files.  Partial blocks at either end are read
+ *  first and merged with the new bytes, whole blocks are written, and a
+ *  write that went past EOF is trimmed back so the file ends exactly
+ *  where a buffered pwrite() would have left it.
+ */
+ssize_t dio_pwrite(int fd, const void *buf, size_t len, off_t offset)
+{
+    struct stat st;
+    size_t done = 0;
+    off_t size, written = 0;
+    char *stage;
+
+    if (!is_direct(fd))
+        return pwrite(fd, buf, len, offset);
+    if (len == 0)
+        return 0;
+    if (fstat(fd, &st) == -1)
+        return -1;
+
+    size = st.st_size;
+    stage = get_staging();
+    while (done < len) {
+        off_t pos = offset + done;
+        off_t first = pos / DIO_BLOCK_SIZE;
+        off_t skip = pos - first * DIO_BLOCK_SIZE;
+        size_t n = (size_t)DIO_BUF_BLOCKS * DIO_BLOCK_SIZE - skip;
+        if (n > len - done)
+            n = len - done;
+        int nblks = (skip + n + DIO_BLOCK_SIZE - 1) / DIO_BLOCK_SIZE;
+        off_t last = first + nblks - 1;
+
+        // merge the bytes around the write from the partial end blocks
+        if (skip != 0 && read_block(fd, first, stage) < 0)
+            goto fail;
+        if ((skip + n) % DIO_BLOCK_SIZE != 0 && (last != first || skip == 0) &&
+            read_block(fd, last, stage + (last - first) * DIO_BLOCK_SIZE) < 0)
+            goto fail;
+
+        memcpy(stage + skip, (const char *)buf + done, n);
+        ssize_t wrote = pwrite(fd, stage, (size_t)nblks * DIO_BLOCK_SIZE, first * DIO_BLOCK_SIZE);
+        if (wrote != (ssize_t)nblks * DIO_BLOCK_SIZE)
+            goto fail;
+
+        if (pos + (off_t)n > size)
+            size = pos + n;
+        if ((last + 1) * DIO_BLOCK_SIZE > written)
+            written = (last + 1) * DIO_BLOCK_SIZE;
+        update_blocks(fd, first, nblks, stage, size);
+        done += n;
+    }
+    put_staging(stage);
+
+    // whole blocks overshoot EOF, put the size back where it belongs
+    if (written > size && ftruncate(fd, size) == -1)
+        return -1;
+    return done;
+
+fail:
+    put_staging(stage);
+    return -1;
+}
+
+/*
+ *  dio_forget
+ *
+ *  Drops the cached blocks of fd.  Readers that check the header instead
+ *  of taking a lock, libsdb handles, call it before they refetch a block.
+ */
+void dio_forget(int fd)
+{
+    if (is_direct(fd)) {
+        pthread_mutex_lock(&dio_lock);
+        forget_fd(fd);
+        pthread_mutex_unlock(&dio_lock);
+    }
+}
+
+/*
+ *  dio_close
+ *
+ *  close() that drops the cached blocks of fd and forgets that it was
+ *  direct, before the fd number can be handed out again.
+ */
+int dio_close(int fd)
+{
+    if (fd >= 0 && fd < DIO_MAX_FDS) {
+        pthread_mutex_lock(&dio_lock);
+        forget_fd(fd);
+        direct_fds[fd] = false;
+        pthread_mutex_unlock(&dio_lock);
+    }
+    return close(fd);
+}
+
+int dio_flock(int fd, int how)
+{
+    int rc = flock(fd, how);
+
+    dio_forget(fd);
+    return rc;
+}
+
+int dio_ftruncate(int fd, off_t len)
+{
+    dio_forget(fd);
+    return ftruncate(fd, len);
+}
@@ -0,0 +1,42 @@
+#ifndef __SDB_DIO_H__
+    #define __SDB_DIO_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+//Optional direct I/O for the record files, enabled with --direct or by
+//setting the SDBSC_DIRECT environment variable.  Files opened with
+//SDB_OPEN_RECS() then bypass the page cache.  O_DIRECT needs transfers
+//that are aligned to the device block size, so every pread()/pwrite() on
+//such a file goes through a 4K block layer with its own aligned buffers
+//and a small block cache, see sdbdio.c.  Direct files must only be
+//accessed with SDB_PREAD()/SDB_PWRITE(), never read()/write().
+#define DIRECT_ENV_VAR      "SDBSC_DIRECT"
+#define DIRECT_FLAG         "--direct"
+
+#define DIO_BLOCK_SIZE      4096
+#define DIO_CACHE_BLOCKS    64              //block cache, 256KB
+#define DIO_BUF_BLOCKS      64              //per staging buffer, 256KB
+#define DIO_STAGING_BUFS    17              //a scanner per shard plus main
+#define DIO_MAX_FDS         1024            //fds above this stay buffered
+
+extern bool sdb_direct_on;
+
+void dio_init(int *argc, char *argv[]);
+int dio_open_recs(const char *path, int flags, mode_t mode);
+int dio_open(const char *path, int flags, mode_t mode);
+ssize_t dio_pread(int fd, void *buf, size_t len, off_t offset);
+ssize_t dio_pwrite(int fd, const void *buf, size_t len, off_t offset);
+int dio_flock(int fd, int how);
+void dio_forget(int fd);
+int dio_close(int fd);
+int dio_ftruncate(int fd, off_t len);
+
+//open a record file, with O_DIRECT when direct I/O is on
+#define SDB_OPEN_RECS(p, f, m)  (sdb_direct_on ? dio_open_recs(p, f, m) : SDB_OPEN(p, f, m))
+#define SDB_FTRUNCATE(fd, len)  (sdb_direct_on ? dio_ftruncate(fd, len) : ftruncate(fd, len))
+//every fd from SDB_OPEN() is closed with this, so a reused fd number is never
+//taken for a direct file
+#define SDB_CLOSE(fd)           (sdb_direct_on ? dio_close(fd) : close(fd))
+
+#endif
@@ -0,0 +1,580 @@
+/**
+	@file
+	@Description
+	Trigram index for name search.  Every three character window of the
+	lower cased first and last names is a trigram, and the index maps each
+	trigram to the sorted ids of the students whose names contain it.  The
+	id lists are stored as LEB128 varints of the gaps between ids, which
+	takes most lists down to a byte or two per id.
+
+	The index is a cache.  It records the inode, file_id and generation of
+	every shard it was built from and is rebuilt by the first search after
+	any of them changes, so writers never pay for it.  Candidates found
+	through the index are always read back with get_student() and matched
+	against the live record before they are printed.
+**/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+#include "sdbstats.h"
+
+#define IDX_MAGIC       0x58444953      //"SIDX"
+#define IDX_SUFFIX      ".idx"
+
+//longest name that can be searched for, the size of the longer name field
+#define SEARCH_MAX      ((int)sizeof(((student_t *)0)->lname) - 1)
+
+typedef struct idx_stamp {
+    unsigned long long ino;
+    unsigned int gen;
+    unsigned int file_id;
+} idx_stamp_t;
+
+//file layout: header, ntri directory entries sorted by trigram, postings
+typedef struct idx_header {
+    unsigned int magic;
+    int num;                            //shards the index was built from
+    unsigned int ntri;
+    unsigned int postings_len;
+    idx_stamp_t stamps[MAX_DB_SHARDS];
+} idx_header_t;
+
+typedef struct idx_entry {
+    unsigned int tri;
+    unsigned int count;                 //number of ids in the list
+    unsigned int offset;                //into the postings
+} idx_entry_t;
+
+typedef struct sdb_index {
+    void *base;
+    size_t len;
+    const idx_header_t *hdr;
+    const idx_entry_t *dir;
+    const unsigned char *postings;
+} sdb_index_t;
+
+/*
+ *  name_trigrams
+ *      name:  a name field, not necessarily NUL terminated
+ *      len:   size of the field
+ *      tris:  trigrams are appended here, at most len - 2 of them
+ *
+ *  returns:  the number of trigrams appended
+ */
+static int name_trigrams(const char *name, size_t len, unsigned int *tris)
+{
+    int n = 0;
+
+    len = strnlen(name, len);
+    for (size_t i = 0; i + 2 < len; i++) {
+        tris[n++] = (unsigned int)tolower((unsigned char)name[i]) << 16 |
+                    (unsigned int)tolower((unsigned char)name[i + 1]) << 8 |
+                    (unsigned int)tolower((unsigned char)name[i + 2]);
+    }
+    return n;
+}
+
+static int cmp_uint(const void *a, const void *b)
+{
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+    return (x > y) - (x < y);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+    return (x > y) - (x < y);
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+/*
+ *  shard_stamps
+ *
+ *  Fills in the inode, file_id and generation of every shard.  compress_db()
+ *  swaps in a new inode, -z keeps the inode but starts the generation over
+ *  under a new file_id, and every other write bumps the generation, so a
+ *  stamp that still matches means the shard has not changed.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int shard_stamps(shard_map_t *map, idx_stamp_t *stamps)
+{
+    memset(stamps, 0, MAX_DB_SHARDS * sizeof(idx_stamp_t));
+    for (int i = 0; i < map->num; i++) {
+        struct stat st;
+        db_header_t hdr;
+
+        if (fstat(map->fds[i], &st) == -1 || read_db_header(map->fds[i], &hdr) < 0)
+            return ERR_DB_FILE;
+        stamps[i].ino = st.st_ino;
+        stamps[i].gen = hdr.gen;
+        stamps[i].file_id = hdr.file_id;
+    }
+    return NO_ERROR;
+}
+
+static int put_varint(unsigned char *out, unsigned int v)
+{
+    int n = 0;
+
+    while (v >= 0x80) {
+        out[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    out[n++] = v;
+    return n;
+}
+
+static unsigned int get_varint(const unsigned char **p)
+{
+    unsigned int v = 0;
+    int shift = 0;
+
+    while (**p & 0x80) {
+        v |= (unsigned int)(*(*p)++ & 0x7f) << shift;
+        shift += 7;
+    }
+    v |= (unsigned int)(*(*p)++) << shift;
+    return v;
+}
+
+/*
+ *  build_index
+ *      map:   shard map
+ *      path:  index file to write
+ *
+ *  Collects a (trigram, id) pair for every trigram of every name, sorts
+ *  them, and writes one gap encoded id list per trigram.  The stamps are
+ *  taken before the records are read, so a write that sneaks in between
+ *  only makes the next search rebuild again.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int build_index(shard_map_t *map, const char *path)
+{
+    // the most trigrams one student can contribute
+    enum { MAX_TRIS = sizeof(((student_t *)0)->fname) + sizeof(((student_t *)0)->lname) };
+    idx_header_t hdr = {0};
+    unsigned long long *pairs = NULL;
+    idx_entry_t *dir = NULL;
+    unsigned char *postings = NULL;
+    size_t npairs = 0, cap = 0;
+    char tmp[PATH_MAX];
+    int rc = ERR_DB_FILE;
+    int fd = -1;
+
+    hdr.magic = IDX_MAGIC;
+    hdr.num = map->num;
+    if (shard_stamps(map, hdr.stamps) < 0)
+        return ERR_DB_FILE;
+
+    for (int i = 0; i < map->num; i++) {
+        student_t *recs;
+        int count;
+
+        if (snapshot_db(map->fds[i], map->lo[i], map->hi[i], true, &recs, &count) < 0)
+            goto done;
+
+        for (int j = 0; j < count; j++) {
+            unsigned int tris[MAX_TRIS];
+            int n = name_trigrams(recs[j].fname, sizeof(recs[j].fname), tris);
+            n += name_trigrams(recs[j].lname, sizeof(recs[j].lname), tris + n);
+
+            if (npairs + n > cap) {
+                size_t new_cap = cap ? cap * 2 : 4096;
+                unsigned long long *grown = realloc(pairs, new_cap * sizeof(*pairs));
+                if (grown == NULL) {
+                    free(recs);
+                    goto done;
+                }
+                pairs = grown;
+                cap = new_cap;
+            }
+            for (int t = 0; t < n; t++)
+                pairs[npairs++] = (unsigned long long)tris[t] << 32 | (unsigned int)recs[j].id;
+        }
+        free(recs);
+    }
+
+    // sorting by trigram then id also puts every list in id order
+    qsort(pairs, npairs, sizeof(*pairs), cmp_u64);
+
+    dir = malloc((npairs ? npairs : 1) * sizeof(idx_entry_t));
+    postings = malloc(npairs * 5 + 1);
+    if (dir == NULL || postings == NULL)
+        goto done;
+
+    for (size_t i = 0; i < npairs; i++) {
+        unsigned int tri = pairs[i] >> 32;
+        unsigned int id = (unsigned int)pairs[i];
+
+        if (i > 0 && pairs[i] == pairs[i - 1])
+            continue;       // the same trigram twice in one student
+        if (hdr.ntri == 0 || dir[hdr.ntri - 1].tri != tri) {
+            dir[hdr.ntri].tri = tri;
+            dir[hdr.ntri].count = 0;
+            dir[hdr.ntri].offset = hdr.postings_len;
+            hdr.ntri++;
+            hdr.postings_len += put_varint(postings + hdr.postings_len, id);
+        } else {
+            hdr.postings_len += put_varint(postings + hdr.postings_len,
+                                           id - (unsigned int)pairs[i - 1]);
+        }
+        dir[hdr.ntri - 1].count++;
+    }
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+        goto done;
+    fd = SDB_OPEN(tmp, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (fd < 0)
+        goto done;
+
+    off_t offset = 0;
+    if (SDB_PWRITE(fd, &hdr, sizeof(hdr), offset) != sizeof(hdr))
+        goto done;
+    offset += sizeof(hdr);
+    if (SDB_PWRITE(fd, dir, hdr.ntri * sizeof(idx_entry_t), offset) != (ssize_t)(hdr.ntri * sizeof(idx_entry_t)))
+        goto done;
+    offset += hdr.ntri * sizeof(idx_entry_t);
+    if (SDB_PWRITE(fd, postings, hdr.postings_len, offset) != (ssize_t)hdr.postings_len)
+        goto done;
+
+    if (rename(tmp, path) == 0)
+        rc = NO_ERROR;
+
+done:
+    if (fd >= 0) {
+        SDB_CLOSE(fd);
+        if (rc != NO_ERROR)
+            unlink(tmp);
+    }
+    free(pairs);
+    free(dir);
+    free(postings);
+    return rc;
+}
+
+/*
+ *  load_index
+ *      map:   shard map the index has to match
+ *      path:  index file
+ *      idx:   filled in with the mapped index
+ *
+ *  returns:  NO_ERROR        idx is ready, release it with munmap()
+ *            SRCH_NOT_FOUND  no index or it is out of date
+ *            ERR_DB_FILE     the shards could not be stamped
+ */
+static int load_index(shard_map_t *map, const char *path, sdb_index_t *idx)
+{
+    idx_stamp_t stamps[MAX_DB_SHARDS];
+    struct stat st;
+    int fd;
+
+    if (shard_stamps(map, stamps) < 0)
+        return ERR_DB_FILE;
+
+    fd = SDB_OPEN(path, O_RDONLY, 0);
+    if (fd < 0)
+        return SRCH_NOT_FOUND;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(idx_header_t)) {
+        SDB_CLOSE(fd);
+        return SRCH_NOT_FOUND;
+    }
+
+    idx->len = st.st_size;
+    idx->base = mmap(NULL, idx->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    SDB_CLOSE(fd);
+    if (idx->base == MAP_FAILED)
+        return SRCH_NOT_FOUND;
+
+    idx->hdr = idx->base;
+    idx->dir = (const idx_entry_t *)(idx->hdr + 1);
+    idx->postings = (const unsigned char *)(idx->dir + idx->hdr->ntri);
+
+    if (idx->hdr->magic != IDX_MAGIC || idx->hdr->num != map->num ||
+        memcmp(idx->hdr->stamps, stamps, sizeof(stamps)) != 0 ||
+        sizeof(idx_header_t) + idx->hdr->ntri * sizeof(idx_entry_t) +
+        idx->hdr->postings_len != idx->len) {
+        munmap(idx->base, idx->len);
+        return SRCH_NOT_FOUND;
+    }
+    return NO_ERROR;
+}
+
+static const idx_entry_t *find_trigram(const sdb_index_t *idx, unsigned int tri)
+{
+    int lo = 0, hi = (int)idx->hdr->ntri - 1;
+
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (idx->dir[mid].tri == tri)
+            return &idx->dir[mid];
+        if (idx->dir[mid].tri < tri)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return NULL;
+}
+
+/*
+ *  name_distance
+ *      pat:   lower cased pattern
+ *      name:  a name field
+ *      len:   size of the field
+ *
+ *  Edit distance between pat and the closest substring of name, 0 when
+ *  pat is a substring.  Case is ignored.
+ *
+ *  returns:  the distance
+ */
+static int name_distance(const char *pat, const char *name, size_t len)
+{
+    int plen = strlen(pat);
+    int prev[SEARCH_MAX + 1], cur[SEARCH_MAX + 1];
+    int best;
+
+    len = strnlen(name, len);
+    for (int i = 0; i <= plen; i++)
+        prev[i] = i;
+    best = prev[plen];
+
+    // a match may start anywhere in name, so row 0 is always free
+    for (size_t j = 0; j < len; j++) {
+        int c = tolower((unsigned char)name[j]);
+        cur[0] = 0;
+        for (int i = 1; i <= plen; i++) {
+            int sub = prev[i - 1] + (pat[i - 1] != c);
+            int del = prev[i] + 1;
+            int ins = cur[i - 1] + 1;
+            cur[i] = sub < del ? (sub < ins ? sub : ins) : (del < ins ? del : ins);
+        }
+        if (cur[plen] < best)
+            best = cur[plen];
+        memcpy(prev, cur, sizeof(cur));
+    }
+    return best;
+}
+
+static bool name_matches(const student_t *s, const char *pat, int max_dist)
+{
+    return name_distance(pat, s->fname, sizeof(s->fname)) <= max_dist ||
+           name_distance(pat, s->lname, sizeof(s->lname)) <= max_dist;
+}
+
+static void print_match(const student_t *s, int found)
+{
+    if (found == 0)
+        SDB_PRINTF(STUDENT_PRINT_HDR_STRING, "ID", "FIRST_NAME", "LAST_NAME", "GPA");
+    SDB_PRINTF(STUDENT_PRINT_FMT_STRING, s->id, s->fname, s->lname, s->gpa / 100.0);
+}
+
+/*
+ *  scan_search
+ *
+ *  Search without the index, for patterns too short to have a trigram or
+ *  when the index cannot be written.  Same matching as the indexed path.
+ *
+ *  returns:  the number of students printed or ERR_DB_FILE
+ */
+static int scan_search(shard_map_t *map, const char *pat, int max_dist)
+{
+    int found = 0;
+
+    for (int i = 0; i < map->num; i++) {
+        student_t *recs;
+        int count;
+
+        if (snapshot_db(map->fds[i], map->lo[i], map->hi[i], true, &recs, &count) < 0)
+            return ERR_DB_FILE;
+        for (int j = 0; j < count; j++) {
+            if (name_matches(&recs[j], pat, max_dist))
+                print_match(&recs[j], found++);
+        }
+        free(recs);
+    }
+    return found;
+}
+
+/*
+ *  index_search
+ *
+ *  Counts, for every id on the posting list of one of the pattern's
+ *  trigrams, how many of those trigrams its names contain.  An id needs
+ *  min_tris of them to be worth reading back with get_student().
+ *
+ *  returns:  the number of students printed or ERR_DB_FILE
+ */
+static int index_search(shard_map_t *map, const sdb_index_t *idx, const char *pat,
+                        const unsigned int *tris, int ntri, int min_tris, int max_dist)
+{
+    unsigned char *hits = calloc(MAX_STD_ID + 1, 1);
+    int *cands = NULL;
+    int ncands = 0, cap = 0;
+    int found = 0;
+
+    if (hits == NULL)
+        return ERR_DB_FILE;
+
+    for (int t = 0; t < ntri; t++) {
+        const idx_entry_t *e = find_trigram(idx, tris[t]);
+        if (e == NULL)
+            continue;
+
+        const unsigned char *p = idx->postings + e->offset;
+        unsigned int id = 0;
+        for (unsigned int k = 0; k < e->count; k++) {
+            id += get_varint(&p);
+            if (id > MAX_STD_ID)
+                break;
+            if (hits[id]++ == 0) {
+                if (ncands == cap) {
+                    cap = cap ? cap * 2 : 256;
+                    int *grown = realloc(cands, cap * sizeof(int));
+                    if (grown == NULL) {
+                        found = ERR_DB_FILE;
+                        goto done;
+                    }
+                    cands = grown;
+                }
+                cands[ncands++] = id;
+            }
+        }
+    }
+
+    qsort(cands, ncands, sizeof(int), cmp_int);
+    for (int i = 0; i < ncands; i++) {
+        student_t s;
+
+        if (hits[cands[i]] < min_tris)
+            continue;
+        if (get_student(map->fds[shard_for_id(map, cands[i])], cands[i], &s) != NO_ERROR)
+            continue;
+        if (name_matches(&s, pat, max_dist))
+            print_match(&s, found++);
+    }
+
+done:
+    free(hits);
+    free(cands);
+    return found;
+}
+
+/*
+ *  search_shards
+ *      map:      shard map
+ *      pattern:  part of a first or last name, case is ignored
+ *
+ *  Prints the students with pattern in their first or last name.  When
+ *  there are none, prints the students whose names come within one edit
+ *  of it (two for patterns of six or more characters) instead, to catch
+ *  misspellings.  The trigram index is rebuilt first if it is missing or
+ *  out of date.
+ *
+ *  returns:  NO_ERROR        at least one student was printed
+ *            SRCH_NOT_FOUND  nothing matched
+ *            ERR_DB_OP       the pattern is empty or too long
+ *            ERR_DB_FILE     database file I/O issue
+ *
+ *  console:  matching students in the -p format, then M_SEARCH_FOUND or
+ *            M_SEARCH_CLOSE, or M_SEARCH_NONE
+ *            M_ERR_SEARCH_PAT  bad pattern
+ *            M_ERR_DB_READ     error reading the database
+ */
+int search_shards(shard_map_t *map, const char *pattern)
+{
+    char pat[SEARCH_MAX + 1];
+    unsigned int tris[SEARCH_MAX];
+    char path[DB_PATH_MAX + sizeof(IDX_SUFFIX)];
+    sdb_index_t idx;
+    int plen = strlen(pattern);
+    int ntri, fuzz, found;
+    bool indexed, near;
+
+    if (plen < 1 || plen > SEARCH_MAX) {
+        printf(M_ERR_SEARCH_PAT, SEARCH_MAX);
+        return ERR_DB_OP;
+    }
+    for (int i = 0; i <= plen; i++)
+        pat[i] = tolower((unsigned char)pattern[i]);
+    fuzz = plen >= 6 ? 2 : 1;
+
+    // duplicate trigrams would make a name look like a better match
+    int n = name_trigrams(pat, plen, tris);
+    qsort(tris, n, sizeof(unsigned int), cmp_uint);
+    ntri = 0;
+    for (int i = 0; i < n; i++) {
+        if (ntri == 0 || tris[i] != tris[ntri - 1])
+            tris[ntri++] = tris[i];
+    }
+
+    // the index is named after the primary or the replica it covers
+    snprintf(path, sizeof(path), "%s%s", map->num > 1 ? DB_FILE : map->paths[0], IDX_SUFFIX);
+
+    indexed = false;
+    if (ntri > 0) {
+        int rc = load_index(map, path, &idx);
+        if (rc == SRCH_NOT_FOUND && build_index(map, path) == NO_ERROR)
+            rc = load_index(map, path, &idx);
+        indexed = (rc == NO_ERROR);
+    }
+
+    near = false;
+    if (indexed) {
+        // readers lock for the point reads, same as -f
+        for (int i = 0; i < map->num; i++)
+            SDB_FLOCK(map->fds[i], LOCK_SH);
+
+        found = index_search(map, &idx, pat, tris, ntri, ntri, 0);
+        // every edit can break at most three of the pattern's trigrams, a
+        // near match of a short pattern may share none of them with it
+        int min_tris = ntri - 3 * fuzz;
+        if (found == 0 && min_tris > 0) {
+            found = index_search(map, &idx, pat, tris, ntri, min_tris, fuzz);
+            near = true;
+        }
+
+        for (int i = 0; i < map->num; i++)
+            SDB_FLOCK(map->fds[i], LOCK_UN);
+        munmap(idx.base, idx.len);
+    } else {
+        found = scan_search(map, pat, 0);
+    }
+    // the index cannot narrow that down, so those are found by a scan
+    if (found == 0 && !near && plen >= 3) {
+        found = scan_search(map, pat, fuzz);
+        near = true;
+    }
+
+    if (found < 0) {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+    if (found == 0) {
+        printf(M_SEARCH_NONE, pattern);
+        return SRCH_NOT_FOUND;
+    }
+    if (near)
+        printf(M_SEARCH_CLOSE, found, pattern);
+    else
+        printf(M_SEARCH_FOUND, found, pattern);
+    return NO_ERROR;
+}
@@ -0,0 +1,219 @@
+/**
+	@file
+	@Description
+	Change log and read replicas.  While the change log is enabled every
+	add, delete and zero of the primary database is appended to
+	DB_LOG_FILE as a sequence numbered record.  A follower tails the log
+	and applies it to a replica file, remembering the last sequence number
+	it applied in the replica's header, so catching up only ever reads the
+	part of the log it has not seen.  The read only commands can then be
+	pointed at a replica with --replica=file.  Appending to the log and
+	applying it are storage operations and live in sdbrec.c, this file
+	holds the commands that drive them.
+**/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+#include "sdbstats.h"
+
+#define REPLICA_FLAG        "--replica"
+
+/*
+ *  replica_init
+ *      argc, argv:  the programs arguments
+ *
+ *  Looks for --replica=file on the command line and removes it from argv
+ *  the same way stats_init() handles --stats.
+ *
+ *  returns:  the name of the replica file, or NULL to use the primary
+ */
+char *replica_init(int *argc, char *argv[])
+{
+    int flag_len = strlen(REPLICA_FLAG);
+    char *replica = NULL;
+    int out = 1;
+
+    for (int i = 1; i < *argc; i++) {
+        if (strncmp(argv[i], REPLICA_FLAG "=", flag_len + 1) == 0) {
+            replica = argv[i] + flag_len + 1;
+            continue;
+        }
+        argv[out++] = argv[i];
+    }
+    *argc = out;
+    argv[out] = NULL;
+
+    return replica;
+}
+
+/*
+ *  set_change_log
+ *      map:  shard map of the primary database
+ *      on:   start or stop logging changes
+ *
+ *  Starting the log writes a start record with a new epoch followed by an
+ *  add for every record already in the database, so a new replica can be
+ *  built from the log alone.  All shards are locked while this happens so
+ *  no change slips in between the copy and the log going live.  Stopping
+ *  the log removes it, a later start begins a new epoch.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ *
+ *  console:  M_LOG_ON or M_LOG_OFF on success
+ *            M_ERR_DB_READ     error reading the shards
+ *            M_ERR_LOG_WRITE   error writing the log
+ */
+int set_change_log(shard_map_t *map, bool on)
+{
+    db_log_rec_t rec = {0};
+    struct timespec now;
+    struct stat st;
+    int tmp_fd = -1;
+    int rc = NO_ERROR;
+
+    if (!on) {
+        if (unlink(DB_LOG_FILE) == -1 && errno != ENOENT) {
+            printf(M_ERR_LOG_WRITE);
+            return ERR_DB_FILE;
+        }
+        printf(M_LOG_OFF);
+        return NO_ERROR;
+    }
+
+    for (int i = 0; i < map->num; i++) {
+        if (lock_shard(map, i, LOCK_EX) < 0) {
+            printf(M_ERR_DB_READ);
+            rc = ERR_DB_FILE;
+            goto unlock;
+        }
+    }
+
+    // an enabled log is kept as it is, followers are already using it
+    if (stat(DB_LOG_FILE, &st) == 0) {
+        printf(M_LOG_ON, (int)(st.st_size / sizeof(rec)) - 1, DB_LOG_FILE);
+        goto unlock;
+    }
+
+    tmp_fd = SDB_OPEN(TMP_DB_LOG_FILE, O_RDWR | O_CREAT | O_TRUNC,
+                      S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (tmp_fd < 0) {
+        printf(M_ERR_LOG_WRITE);
+        rc = ERR_DB_FILE;
+        goto unlock;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    rec.op = LOG_OP_START;
+    rec.epoch = (unsigned int)(now.tv_sec ^ now.tv_nsec ^ ((long)getpid() << 16));
+    if (rec.epoch == 0)
+        rec.epoch = 1;      // 0 is what a replica that never followed has
+    if (SDB_PWRITE(tmp_fd, &rec, sizeof(rec), 0) != sizeof(rec))
+        rc = ERR_DB_FILE;
+
+    for (int i = 0; i < map->num && rc == NO_ERROR; i++) {
+        student_t *recs;
+        int count;
+
+        int corrupt = snapshot_locked_db(map->fds[i], map->lo[i], map->hi[i], true, &recs, &count);
+        if (corrupt < 0) {
+            printf(M_ERR_DB_READ);
+            rc = ERR_DB_FILE;
+            break;
+        }
+        if (corrupt > 0)
+            fprintf(stderr, M_WARN_DB_CRC, corrupt);
+        for (int j = 0; j < count && rc == NO_ERROR; j++) {
+            rec.seq++;
+            rec.op = LOG_OP_ADD;
+            rec.rec = recs[j];
+            if (SDB_PWRITE(tmp_fd, &rec, sizeof(rec), rec.seq * sizeof(rec)) != sizeof(rec))
+                rc = ERR_DB_FILE;
+        }
+        free(recs);
+    }
+
+    SDB_CLOSE(tmp_fd);
+    if (rc == NO_ERROR && rename(TMP_DB_LOG_FILE, DB_LOG_FILE) == -1)
+        rc = ERR_DB_FILE;
+
+    if (rc != NO_ERROR) {
+        unlink(TMP_DB_LOG_FILE);
+        printf(M_ERR_LOG_WRITE);
+    } else {
+        printf(M_LOG_ON, (int)rec.seq, DB_LOG_FILE);
+    }
+
+unlock:
+    for (int i = 0; i < map->num; i++)
+        unlock_shard(map, i);
+    return rc;
+}
+
+/*
+ *  follow_log
+ *      replica:  name of the replica file, created if it does not exist
+ *      follow:   keep tailing the log instead of stopping once caught up
+ *
+ *  Brings a replica up to date with the change log.  In follow mode the
+ *  log is polled every DB_LOG_POLL_MS and reopened each time, so a log
+ *  that is stopped and started again is picked up as a new epoch.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ *
+ *  console:  M_LOG_APPLIED after catching up, in follow mode only when
+ *            something was applied
+ *            M_ERR_LOG  the log could not be read
+ */
+int follow_log(const char *replica, bool follow)
+{
+    struct timespec poll = {0, DB_LOG_POLL_MS * 1000000L};
+    unsigned long long seq = 0;
+    int fd, lfd, applied;
+
+    fd = open_db((char *)replica, false);
+    if (fd < 0)
+        return ERR_DB_FILE;
+
+    do {
+        lfd = SDB_OPEN(DB_LOG_FILE, O_RDONLY, 0);
+        if (lfd < 0) {
+            if (follow && errno == ENOENT) {
+                nanosleep(&poll, NULL);
+                continue;
+            }
+            printf(M_ERR_LOG);
+            SDB_CLOSE(fd);
+            return ERR_DB_FILE;
+        }
+
+        applied = apply_log(fd, lfd, &seq);
+        SDB_CLOSE(lfd);
+        if (applied < 0) {
+            printf(M_ERR_LOG);
+            SDB_CLOSE(fd);
+            return ERR_DB_FILE;
+        }
+
+        if (applied > 0 || !follow) {
+            printf(M_LOG_APPLIED, replica, applied, seq);
+            fflush(stdout);
+        }
+        if (follow)
+            nanosleep(&poll, NULL);
+    } while (follow);
+
+    SDB_CLOSE(fd);
+    return NO_ERROR;
+}
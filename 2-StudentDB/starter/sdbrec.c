@@ -0,0 +1,402 @@
+/**
+	@file
+	@Description
+	Record level storage shared by the sdbsc commands and libsdb handles.
+	Reading one record, writing one record inside the write bracket along
+	with its checksum and change log entry, applying the change log to a
+	replica and compacting a file all live here.  Nothing in this file
+	prints, every function returns a status code and the caller decides
+	what to tell the user.
+**/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <limits.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+#include "sdbstats.h"
+
+//records copied per pread() by compact_db_file(), 64KB
+#define COMPRESS_CHUNK_RECS 1024
+
+//log records applied to a replica per pread() and per header update
+#define LOG_CHUNK_RECS      256
+
+/*
+ *  read_record
+ *      fd:  linux file descriptor
+ *      id:  the student id we are looking for
+ *      s:   where the record is copied
+ *
+ *  returns:  NO_ERROR        student located and copied into *s
+ *            ERR_DB_FILE     database file I/O issue
+ *            SRCH_NOT_FOUND  student was not located in the database
+ *            ERR_DB_CORRUPT  the record does not match its checksum
+ */
+int read_record(int fd, int id, student_t *s)
+{
+    if (s == NULL) {
+        return ERR_DB_FILE;
+    }
+
+    // slot 0 holds the database header, not a student
+    if (id < MIN_STD_ID || id > MAX_STD_ID) {
+        return SRCH_NOT_FOUND;
+    }
+
+    // Calculate offset based on student ID
+    off_t offset = (off_t)id * STUDENT_RECORD_SIZE;
+
+    // pread() keeps the lookup to one syscall and works on direct files
+    ssize_t bytes_read = SDB_PREAD(fd, s, STUDENT_RECORD_SIZE, offset);
+    if (bytes_read == 0) {  // EOF
+        return SRCH_NOT_FOUND;
+    }
+    if (bytes_read != STUDENT_RECORD_SIZE) {
+        return ERR_DB_FILE;
+    }
+
+    if (memcmp(s, &EMPTY_STUDENT_RECORD, STUDENT_RECORD_SIZE) == 0) {
+        return SRCH_NOT_FOUND;
+    }
+
+    // Check if the ID matches
+    if (s->id != id) {
+        return SRCH_NOT_FOUND;
+    }
+
+    // Check the record against its checksum, if the file carries them
+    return check_record_crc(fd, id, s);
+}
+
+/*
+ *  write_record
+ *      fd:       linux file descriptor, the caller must hold the write lock
+ *      db_file:  name of the database file, its directory holds the log
+ *      id:       slot to write
+ *      s:        the new record, or NULL to empty the slot
+ *
+ *  Writes the slot between begin_db_write() and end_db_write() together
+ *  with its checksum, then appends the change to the change log.
+ *
+ *  returns:  NO_ERROR     the record was written and logged
+ *            ERR_DB_FILE  database file I/O issue
+ *            ERR_DB_LOG   the record was written but could not be logged
+ */
+int write_record(int fd, const char *db_file, int id, const student_t *s)
+{
+    off_t offset = (off_t)id * STUDENT_RECORD_SIZE;
+    const student_t *rec = (s != NULL) ? s : &EMPTY_STUDENT_RECORD;
+
+    if (begin_db_write(fd) < 0) {
+        return ERR_DB_FILE;
+    }
+    ssize_t bytes_written = SDB_PWRITE(fd, rec, STUDENT_RECORD_SIZE, offset);
+    int crc_rc = write_record_crc(fd, id, s);
+    if (end_db_write(fd) < 0 || bytes_written != STUDENT_RECORD_SIZE || crc_rc < 0) {
+        return ERR_DB_FILE;
+    }
+
+    if (log_change(db_file, s != NULL ? LOG_OP_ADD : LOG_OP_DEL, id, s) < 0) {
+        return ERR_DB_LOG;
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  compact_db_file
+ *      fd:        linux file descriptor of the database file to compress
+ *      db_file:   name of the database file that fd refers to
+ *      tmp_file:  name of the temporary file to build the compressed copy in
+ *
+ *  Copies the records of fd and their stored checksums into tmp_file under
+ *  a new header, renames it over db_file and marks the old file stale with
+ *  retire_db_file().  fd is closed in every case, which drops any lock the
+ *  caller held on it.
+ *
+ *  returns:  <number>     the fd of the compressed database file
+ *            ERR_DB_FILE  database file I/O issue
+ */
+int compact_db_file(int fd, const char *db_file, const char *tmp_file)
+{
+    student_t buff[COMPRESS_CHUNK_RECS];
+    int tmp_fd;
+
+    // Create temporary file with correct permissions
+    tmp_fd = SDB_OPEN_RECS(tmp_file, O_RDWR | O_CREAT | O_TRUNC,
+                  S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (tmp_fd == -1) {
+        SDB_CLOSE(fd);
+        return ERR_DB_FILE;
+    }
+
+    off_t read_offset = 0;
+    bool crc_on = db_crc_enabled(fd);
+
+    // Copy the file a chunk at a time until EOF or the checksum region.
+    // Records keep their offsets, so each chunk is written back to the
+    // same place with the empty slots and the header cleared, and chunks
+    // with no records are skipped to leave holes.
+    while (read_offset < DB_CRC_OFFSET) {
+        size_t want = sizeof(buff);
+        if ((off_t)want > DB_CRC_OFFSET - read_offset)
+            want = DB_CRC_OFFSET - read_offset;
+
+        ssize_t bytes_read = SDB_PREAD(fd, buff, want, read_offset);
+        if (bytes_read == 0) { // EOF
+            break;
+        }
+        if (bytes_read < 0 || bytes_read % STUDENT_RECORD_SIZE != 0) {
+            SDB_CLOSE(tmp_fd);
+            SDB_CLOSE(fd);
+            return ERR_DB_FILE;
+        }
+
+        int n = bytes_read / STUDENT_RECORD_SIZE, last = -1;
+        for (int i = 0; i < n; i++) {
+            if (is_student_record(&buff[i]))
+                last = i;
+            else
+                buff[i] = EMPTY_STUDENT_RECORD;
+        }
+
+        // checksums are copied, not recomputed, a corrupt record stays so
+        if (last >= 0) {
+            size_t len = (last + 1) * STUDENT_RECORD_SIZE;
+            int id = read_offset / STUDENT_RECORD_SIZE;
+            if (SDB_PWRITE(tmp_fd, buff, len, read_offset) != (ssize_t)len ||
+                (crc_on && copy_range_crc(fd, tmp_fd, id, last + 1, buff) < 0)) {
+                SDB_CLOSE(tmp_fd);
+                SDB_CLOSE(fd);
+                return ERR_DB_FILE;
+            }
+        }
+        read_offset += bytes_read;
+    }
+
+    // The copy gets a header of its own, it is a new file to anyone who
+    // cached the old one
+    if (init_db_header(tmp_fd, crc_on ? DB_FLAG_CRC : 0) < 0) {
+        SDB_CLOSE(tmp_fd);
+        SDB_CLOSE(fd);
+        return ERR_DB_FILE;
+    }
+    SDB_CLOSE(tmp_fd);
+
+    // Remove the original file and rename temp file
+    if (unlink(db_file) == -1 && errno != ENOENT) {
+        SDB_CLOSE(fd);
+        return ERR_DB_FILE;
+    }
+
+    if (rename(tmp_file, db_file) == -1) {
+        SDB_CLOSE(fd);
+        return ERR_DB_FILE;
+    }
+
+    // anyone still holding the old file learns it is gone
+    retire_db_file(fd);
+    SDB_CLOSE(fd);
+
+    // Reopen the compressed database
+    fd = SDB_OPEN_RECS(db_file, O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (fd == -1) {
+        return ERR_DB_FILE;
+    }
+
+    return fd;
+}
+
+/*
+ *  log_change
+ *      db_file:  name of the database file that changed
+ *      op:       LOG_OP_ADD, LOG_OP_DEL or LOG_OP_ZERO
+ *      id:       student id that changed
+ *      s:        the record written for LOG_OP_ADD, NULL otherwise
+ *
+ *  Appends one change to the log if the log is enabled.  The log is
+ *  DB_LOG_FILE in the directory of db_file, shared by all of its shards.
+ *  The caller holds the write lock of the shard that changed, so changes
+ *  to one id reach the log in the order they were made.  The log is
+ *  opened by name under that lock on every change, and set_change_log()
+ *  needs every shard's lock to start one, so a log started or stopped
+ *  since the last change is always the one written to.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+int log_change(const char *db_file, int op, int id, const student_t *s)
+{
+    char path[PATH_MAX];
+    const char *base = strrchr(db_file, '/');
+    int dir_len = (base != NULL) ? base - db_file + 1 : 0;
+    db_log_rec_t rec = {0};
+    struct stat st;
+    int log_fd;
+    int rc = NO_ERROR;
+
+    if (snprintf(path, sizeof(path), "%.*s%s", dir_len, db_file, DB_LOG_FILE) >= (int)sizeof(path))
+        return ERR_DB_FILE;
+    log_fd = SDB_OPEN(path, O_RDWR | O_CLOEXEC, 0);
+    if (log_fd < 0)
+        return (errno == ENOENT) ? NO_ERROR : ERR_DB_FILE;
+
+    rec.op = op;
+    if (s != NULL)
+        rec.rec = *s;
+    else
+        rec.rec.id = id;
+
+    // writers on other shards append too, the log lock orders them
+    if (SDB_FLOCK(log_fd, LOCK_EX) == -1) {
+        SDB_CLOSE(log_fd);
+        return ERR_DB_FILE;
+    }
+
+    if (fstat(log_fd, &st) == -1 || SDB_PREAD(log_fd, &rec.epoch, sizeof(rec.epoch),
+                                              offsetof(db_log_rec_t, epoch)) != sizeof(rec.epoch)) {
+        rc = ERR_DB_FILE;
+    } else {
+        rec.seq = st.st_size / sizeof(db_log_rec_t);
+        if (SDB_PWRITE(log_fd, &rec, sizeof(rec), rec.seq * sizeof(rec)) != sizeof(rec))
+            rc = ERR_DB_FILE;
+    }
+
+    // closing drops the log lock
+    SDB_CLOSE(log_fd);
+    return rc;
+}
+
+/*
+ *  apply_change
+ *
+ *  Applies one logged change to a replica.  The caller has the replica
+ *  between begin_db_write() and end_db_write().
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int apply_change(int fd, const db_log_rec_t *rec, bool crc_on)
+{
+    int id = rec->rec.id;
+    off_t offset = (off_t)id * STUDENT_RECORD_SIZE;
+
+    switch (rec->op) {
+    case LOG_OP_ADD:
+        if (SDB_PWRITE(fd, &rec->rec, STUDENT_RECORD_SIZE, offset) != STUDENT_RECORD_SIZE)
+            return ERR_DB_FILE;
+        return crc_on ? write_record_crc(fd, id, &rec->rec) : NO_ERROR;
+
+    case LOG_OP_DEL:
+        if (SDB_PWRITE(fd, &EMPTY_STUDENT_RECORD, STUDENT_RECORD_SIZE, offset) != STUDENT_RECORD_SIZE)
+            return ERR_DB_FILE;
+        return crc_on ? write_record_crc(fd, id, NULL) : NO_ERROR;
+
+    case LOG_OP_ZERO:
+        // keep only the header, checksums of the dropped records go too
+        return SDB_FTRUNCATE(fd, STUDENT_RECORD_SIZE) == -1 ? ERR_DB_FILE : NO_ERROR;
+
+    default:
+        return ERR_DB_FILE;
+    }
+}
+
+/*
+ *  apply_log
+ *      fd:      replica file
+ *      lfd:     change log
+ *      seq:     set to the last change applied
+ *
+ *  Applies every change after the one recorded in the replica's header,
+ *  LOG_CHUNK_RECS changes per write bracket.  A replica of another epoch
+ *  is emptied first and rebuilt from the start of the log.
+ *
+ *  returns:  <number>     the number of changes applied
+ *            ERR_DB_FILE  replica or log I/O issue
+ */
+int apply_log(int fd, int lfd, unsigned long long *seq)
+{
+    db_log_rec_t recs[LOG_CHUNK_RECS];
+    db_header_t hdr;
+    int applied = 0;
+    int rc = NO_ERROR;
+
+    // the shared log lock keeps out half written appends
+    if (SDB_FLOCK(lfd, LOCK_SH) == -1)
+        return ERR_DB_FILE;
+    if (SDB_FLOCK(fd, LOCK_EX) == -1) {
+        SDB_FLOCK(lfd, LOCK_UN);
+        return ERR_DB_FILE;
+    }
+
+    if (SDB_PREAD(lfd, recs, sizeof(recs[0]), 0) != sizeof(recs[0]) ||
+        recs[0].op != LOG_OP_START || read_db_header(fd, &hdr) < 0) {
+        rc = ERR_DB_FILE;
+        goto done;
+    }
+
+    if (hdr.log_epoch != recs[0].epoch) {
+        if (begin_db_write(fd) < 0 || SDB_FTRUNCATE(fd, STUDENT_RECORD_SIZE) == -1 ||
+            read_db_header(fd, &hdr) < 0) {
+            rc = ERR_DB_FILE;
+            goto done;
+        }
+        hdr.log_epoch = recs[0].epoch;
+        hdr.log_seq = 0;
+        if (SDB_PWRITE(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || end_db_write(fd) < 0) {
+            rc = ERR_DB_FILE;
+            goto done;
+        }
+    }
+
+    while (1) {
+        off_t offset = (off_t)(hdr.log_seq + 1) * sizeof(db_log_rec_t);
+        ssize_t got = SDB_PREAD(lfd, recs, sizeof(recs), offset);
+        int n = (got > 0) ? got / sizeof(db_log_rec_t) : 0;
+
+        if (got < 0) {
+            rc = ERR_DB_FILE;
+            break;
+        }
+        if (n == 0)
+            break;
+
+        bool crc_on = hdr.flags & DB_FLAG_CRC;
+        if (begin_db_write(fd) < 0) {
+            rc = ERR_DB_FILE;
+            break;
+        }
+        for (int i = 0; i < n && rc == NO_ERROR; i++) {
+            if (recs[i].seq != hdr.log_seq + 1 + i)
+                rc = ERR_DB_FILE;
+            else
+                rc = apply_change(fd, &recs[i], crc_on);
+        }
+
+        // record progress in the header, still at the odd generation
+        if (rc == NO_ERROR && read_db_header(fd, &hdr) == NO_ERROR) {
+            hdr.log_seq += n;
+            if (SDB_PWRITE(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+                rc = ERR_DB_FILE;
+        }
+        if (end_db_write(fd) < 0)
+            rc = ERR_DB_FILE;
+        if (rc != NO_ERROR)
+            break;
+        applied += n;
+    }
+
+done:
+    *seq = hdr.log_seq;
+    SDB_FLOCK(fd, LOCK_UN);
+    SDB_FLOCK(lfd, LOCK_UN);
+    return (rc == NO_ERROR) ? applied : rc;
+}
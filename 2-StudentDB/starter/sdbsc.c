@@ -14,10 +14,12 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <sys/file.h>
 
 // database include files
 #include "db.h"
 #include "sdbsc.h"
+#include "sdbstats.h"
 
 /*
  *  open_db
@@ -44,7 +46,14 @@ int open_db(char *dbFile, bool should_truncate)
         flags += O_TRUNC;
 
     // Now open file
-    int fd = open(dbFile, flags, mode);
+    int fd = SDB_OPEN_RECS(dbFile, flags, mode);
+
+    // an emptied file starts over under a new header
+    if (fd != -1 && should_truncate && init_db_header(fd, 0) < 0)
+    {
+        SDB_CLOSE(fd);
+        fd = -1;
+    }
 
     if (fd == -1)
     {
@@ -72,35 +81,8 @@ int open_db(char *dbFile, bool should_truncate)
 int get_student(int fd, int id, student_t *s)
 {
     // TODO
-    if (s == NULL) {
-        return ERR_DB_FILE;
-    }
-
-    // Calculate offset based on student ID
-    off_t offset = id * STUDENT_RECORD_SIZE;
-    
-    if (lseek(fd, offset, SEEK_SET) == -1) {
-        return ERR_DB_FILE;
-    }
-
-    ssize_t bytes_read = read(fd, s, STUDENT_RECORD_SIZE);
-    if (bytes_read == 0) {  // EOF
-        return SRCH_NOT_FOUND;
-    }
-    if (bytes_read != STUDENT_RECORD_SIZE) {
-        return ERR_DB_FILE;
-    }
-
-    if (memcmp(s, &EMPTY_STUDENT_RECORD, STUDENT_RECORD_SIZE) == 0) {
-        return SRCH_NOT_FOUND;
-    }
-
-    // Check if the ID matches
-    if (s->id != id) {
-        return SRCH_NOT_FOUND;
-    }
-
-    return NO_ERROR;
+    // the lookup itself is shared with libsdb, see read_record()
+    return read_record(fd, id, s);
 }
 
 /*
@@ -120,12 +102,16 @@ int get_student(int fd, int id, student_t *s)
  *            ERR_DB_FILE    database file I/O issue
  *            ERR_DB_OP      database operation logically failed (aka student
  *                           already exists)
+ *            ERR_DB_CORRUPT the slot holds a corrupt record, it has to be
+ *                           deleted with -d first
  *
  *
  *  console:  M_STD_ADDED       on success
  *            M_ERR_DB_ADD_DUP  student already exists
+ *            M_ERR_DB_CRC      the record in the slot fails its checksum
  *            M_ERR_DB_READ     error reading or seeking the database file
  *            M_ERR_DB_WRITE    error writing to db file (adding student)
+ *            M_ERR_LOG_WRITE   student added but the change log failed
  *
  */
 int add_student(int fd, int id, char *fname, char *lname, int gpa)
@@ -139,6 +125,12 @@ int add_student(int fd, int id, char *fname, char *lname, int gpa)
     if (rc == NO_ERROR) {
         printf(M_ERR_DB_ADD_DUP, id);
         return ERR_DB_OP;
+    } else if (rc == ERR_DB_CORRUPT) {
+        printf(M_ERR_DB_CRC, id);
+        return ERR_DB_CORRUPT;
+    } else if (rc != SRCH_NOT_FOUND) {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
     }
 
     // Prepare the new student record
@@ -147,16 +139,13 @@ int add_student(int fd, int id, char *fname, char *lname, int gpa)
     strncpy(new_student.fname, fname, sizeof(new_student.fname)-1);
     strncpy(new_student.lname, lname, sizeof(new_student.lname)-1);
 
-    off_t offset = id * STUDENT_RECORD_SIZE;
-
-    if (lseek(fd, offset, SEEK_SET) == -1) {
-        printf(M_ERR_DB_READ);
+    // Write the new record with its checksum and log entry
+    rc = write_record(fd, DB_FILE, id, &new_student);
+    if (rc == ERR_DB_LOG) {
+        printf(M_ERR_LOG_WRITE);
         return ERR_DB_FILE;
     }
-
-    // Write the new record
-    ssize_t bytes_written = write(fd, &new_student, STUDENT_RECORD_SIZE);
-    if (bytes_written != STUDENT_RECORD_SIZE) {
+    if (rc < 0) {
         printf(M_ERR_DB_WRITE);
         return ERR_DB_FILE;
     }
@@ -185,6 +174,7 @@ int add_student(int fd, int id, char *fname, char *lname, int gpa)
  *            M_STD_NOT_FND_MSG  student not in database, cant be deleted
  *            M_ERR_DB_READ      error reading or seeking the database file
  *            M_ERR_DB_WRITE     error writing to db file (adding student)
+ *            M_ERR_LOG_WRITE    student deleted but the change log failed
  *
  */
 int del_student(int fd, int id)
@@ -197,21 +187,18 @@ int del_student(int fd, int id)
     if (rc == SRCH_NOT_FOUND) {
         printf(M_STD_NOT_FND_MSG, id);
         return ERR_DB_OP;
-    } else if (rc != NO_ERROR) {
+    } else if (rc != NO_ERROR && rc != ERR_DB_CORRUPT) {  // corrupt records can be deleted
         printf(M_ERR_DB_READ);
         return ERR_DB_FILE;
     }
 
-    off_t offset = id * STUDENT_RECORD_SIZE;
-    
-    if (lseek(fd, offset, SEEK_SET) < 0) {
-        printf(M_ERR_DB_READ);
+    // Write empty record, write_record() clears the checksum and logs it
+    rc = write_record(fd, DB_FILE, id, NULL);
+    if (rc == ERR_DB_LOG) {
+        printf(M_ERR_LOG_WRITE);
         return ERR_DB_FILE;
     }
-
-    // Write empty record
-    ssize_t bytes_written = write(fd, &EMPTY_STUDENT_RECORD, STUDENT_RECORD_SIZE);
-    if (bytes_written < 0 || bytes_written != STUDENT_RECORD_SIZE) {
+    if (rc < 0) {
         printf(M_ERR_DB_WRITE);
         return ERR_DB_FILE;
     }
@@ -231,6 +218,8 @@ int del_student(int fd, int id)
  *  the bytes in the record read are zeros - I would suggest using memory
  *  compare memcmp() for this. Create a counter variable and initialize it
  *  to zero, every time a non-zero record is read increment the counter.
+ *  The records are read with snapshot_db(), so the count is a point in
+ *  time view even while other processes add and delete students.
  *
  *  returns:  <number>       returns the number of records in db on success
  *            ERR_DB_FILE    database file I/O issue
@@ -246,40 +235,21 @@ int del_student(int fd, int id)
  */
 int count_db_records(int fd)
 {
-    // TODO
-    student_t student = {0};
+    student_t *students;
     int count = 0;
-    
-    // Remember current position
-    off_t current = lseek(fd, 0, SEEK_CUR);
-    if (current == -1) {
-        printf(M_ERR_DB_READ);
-        return ERR_DB_FILE;
-    }
 
-    // Seek to beginning of file
-    if (lseek(fd, 0, SEEK_SET) == -1) {
+    // count from a snapshot so writers running at the same time are
+    // either fully counted or not at all
+    int corrupt = snapshot_db(fd, 0, MAX_STD_ID, false, &students, &count);
+    if (corrupt < 0) {
         printf(M_ERR_DB_READ);
         return ERR_DB_FILE;
     }
+    free(students);
 
-    // Read records until EOF
-    ssize_t bytes_read;
-    while ((bytes_read = read(fd, &student, STUDENT_RECORD_SIZE)) > 0) {
-        if (bytes_read != STUDENT_RECORD_SIZE) {
-            printf(M_ERR_DB_READ);
-            return ERR_DB_FILE;
-        }
-
-        if (memcmp(&student, &EMPTY_STUDENT_RECORD, STUDENT_RECORD_SIZE) != 0) {
-            count++;
-        }
-    }
-
-    // Return to original position
-    if (lseek(fd, current, SEEK_SET) == -1) {
-        printf(M_ERR_DB_READ);
-        return ERR_DB_FILE;
+    // keep stdout clean for the report, the good records are still counted
+    if (corrupt > 0) {
+        fprintf(stderr, M_WARN_DB_CRC, corrupt);
     }
 
     if (count == 0) {
@@ -316,6 +286,9 @@ int count_db_records(int fd)
  *  the GPA in the student structure is an int, to convert it into a real
  *  gpa divide by 100.0 and store in a float variable.
  *
+ *  The records are copied with snapshot_db() before anything is printed,
+ *  so the report is a point in time view and never holds a lock.
+ *
  *  returns:  NO_ERROR       on success
  *            ERR_DB_FILE    database file I/O issue
  *
@@ -326,43 +299,35 @@ int count_db_records(int fd)
  */
 int print_db(int fd)
 {
-    // TODO
-    student_t student = {0};
-    bool header_printed = false;
-    
-    // Seek to beginning of file
-    if (lseek(fd, 0, SEEK_SET) < 0) {
+    student_t *students;
+    int count = 0;
+
+    // take a point in time copy first, the printing is slow and must not
+    // see or hold up writers that run while it is going on
+    int corrupt = snapshot_db(fd, 0, MAX_STD_ID, true, &students, &count);
+    if (corrupt < 0) {
+        free(students);
         printf(M_ERR_DB_READ);
         return ERR_DB_FILE;
     }
+    if (corrupt > 0) {
+        fprintf(stderr, M_WARN_DB_CRC, corrupt);
+    }
 
-    // Read records until EOF
-    bool found_records = false;
-    while (1) {
-        ssize_t bytes_read = read(fd, &student, STUDENT_RECORD_SIZE);
-        if (bytes_read == 0) { // EOF
-            break;
-        }
-        if (bytes_read < 0 || bytes_read != STUDENT_RECORD_SIZE) {
-            printf(M_ERR_DB_READ);
-            return ERR_DB_FILE;
-        }
-
-        if (memcmp(&student, &EMPTY_STUDENT_RECORD, STUDENT_RECORD_SIZE) != 0) {
-            if (!header_printed) {
-                printf(STUDENT_PRINT_HDR_STRING, "ID", "FIRST_NAME", "LAST_NAME", "GPA");
-                header_printed = true;
-            }
-            float gpa = student.gpa / 100.0;
-            printf(STUDENT_PRINT_FMT_STRING, student.id, student.fname, student.lname, gpa);
-            found_records = true;
+    for (int i = 0; i < count; i++) {
+        if (i == 0) {
+            SDB_PRINTF(STUDENT_PRINT_HDR_STRING, "ID", "FIRST_NAME", "LAST_NAME", "GPA");
         }
+        float gpa = students[i].gpa / 100.0;
+        SDB_PRINTF(STUDENT_PRINT_FMT_STRING, students[i].id, students[i].fname,
+                   students[i].lname, gpa);
     }
 
-    if (!found_records) {
+    if (count == 0) {
         printf(M_DB_EMPTY);
     }
 
+    free(students);
     return NO_ERROR;
 }
 
@@ -402,9 +367,9 @@ void print_student(student_t *s)
         return;
     }
 
-    printf(STUDENT_PRINT_HDR_STRING, "ID", "FIRST_NAME", "LAST_NAME", "GPA");
+    SDB_PRINTF(STUDENT_PRINT_HDR_STRING, "ID", "FIRST_NAME", "LAST_NAME", "GPA");
     float gpa = s->gpa / 100.0;
-    printf(STUDENT_PRINT_FMT_STRING, s->id, s->fname, s->lname, gpa);
+    SDB_PRINTF(STUDENT_PRINT_FMT_STRING, s->id, s->fname, s->lname, gpa);
 }
 
 /*
@@ -457,82 +422,39 @@ void print_student(student_t *s)
  */
 int compress_db(int fd)
 {
-    // TODO
-    student_t student = {0};
-    int tmp_fd;
-    
-    // Create temporary file with correct permissions
-    tmp_fd = open(TMP_DB_FILE, O_RDWR | O_CREAT | O_TRUNC, 
-                  S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
-    if (tmp_fd == -1) {
-        printf(M_ERR_DB_OPEN);
-        return ERR_DB_FILE;
-    }
-
-    if (lseek(fd, 0, SEEK_SET) == -1) {
-        close(tmp_fd);
-        printf(M_ERR_DB_READ);
+    fd = compress_db_file(fd, DB_FILE, TMP_DB_FILE);
+    if (fd < 0) {
         return ERR_DB_FILE;
     }
 
-    off_t max_offset = 0;
-
-    // Read and copy valid records until EOF
-    while (1) {
-        ssize_t bytes_read = read(fd, &student, STUDENT_RECORD_SIZE);
-        if (bytes_read == 0) { // EOF
-            break;
-        }
-        if (bytes_read != STUDENT_RECORD_SIZE) {
-            close(tmp_fd);
-            printf(M_ERR_DB_READ);
-            return ERR_DB_FILE;
-        }
-
-        // If record is not empty/deleted, write to temp file
-        if (memcmp(&student, &EMPTY_STUDENT_RECORD, STUDENT_RECORD_SIZE) != 0) {
-            off_t offset = student.id * STUDENT_RECORD_SIZE;
-            if (offset > max_offset) {
-                max_offset = offset;
-            }
-            
-            if (lseek(tmp_fd, offset, SEEK_SET) == -1) {
-                close(tmp_fd);
-                printf(M_ERR_DB_READ);
-                return ERR_DB_FILE;
-            }
-
-            ssize_t bytes_written = write(tmp_fd, &student, STUDENT_RECORD_SIZE);
-            if (bytes_written != STUDENT_RECORD_SIZE) {
-                close(tmp_fd);
-                printf(M_ERR_DB_WRITE);
-                return ERR_DB_FILE;
-            }
-        }
-    }
-
-    close(fd);
-    close(tmp_fd);
-
-    // Remove the original file and rename temp file
-    if (unlink(DB_FILE) == -1 && errno != ENOENT) {
-        printf(M_ERR_DB_CREATE);
-        return ERR_DB_FILE;
-    }
+    printf(M_DB_COMPRESSED_OK);
+    return fd;
+}
 
-    if (rename(TMP_DB_FILE, DB_FILE) == -1) {
+/*
+ *  compress_db_file
+ *      fd:        linux file descriptor of the database file to compress
+ *      db_file:   name of the database file that fd refers to
+ *      tmp_file:  name of the temporary file to build the compressed copy in
+ *
+ *  Does the work of compress_db() for an arbitrary database file so each
+ *  shard of a sharded database can be compressed on its own.  fd is closed
+ *  and the fd of the compressed file is returned.  The copy itself is
+ *  compact_db_file(), shared with libsdb.
+ *
+ *  returns:  <number>       returns the fd of the compressed database file
+ *            ERR_DB_FILE    database file I/O issue
+ *
+ *  console:  M_ERR_DB_CREATE  the compressed file could not be built or
+ *                             moved into place, nothing on success
+ */
+int compress_db_file(int fd, const char *db_file, const char *tmp_file)
+{
+    fd = compact_db_file(fd, db_file, tmp_file);
+    if (fd < 0) {
         printf(M_ERR_DB_CREATE);
         return ERR_DB_FILE;
     }
-
-    // Reopen the compressed database
-    fd = open(DB_FILE, O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
-    if (fd == -1) {
-        printf(M_ERR_DB_OPEN);
-        return ERR_DB_FILE;
-    }
-
-    printf(M_DB_COMPRESSED_OK);
     return fd;
 }
 
@@ -576,22 +498,37 @@ int validate_range(int id, int gpa)
  */
 void usage(char *exename)
 {
-    printf("usage: %s -[h|a|c|d|f|p|z] options.  Where:\n", exename);
+    printf("usage: %s -[h|a|c|d|f|k|L|n|p|R|s|S|x|z|T] options.  Where:\n", exename);
     printf("\t-h:  prints help\n");
     printf("\t-a id first_name last_name gpa(as 3 digit int):  adds a student\n");
     printf("\t-c:  counts the records in the database\n");
     printf("\t-d id:  deletes a student\n");
     printf("\t-f id:  finds and prints a student in the database\n");
+    printf("\t-k on|off:  turn per record checksums on or off\n");
+    printf("\t-L on|off:  start or stop logging changes to %s\n", DB_LOG_FILE);
+    printf("\t-n num:  split the database into num shard files (1 to %d)\n", MAX_DB_SHARDS);
     printf("\t-p:  prints all records in the student database\n");
+    printf("\t-R replica [follow]:  apply the change log to a replica file,\n");
+    printf("\t    follow keeps applying new changes until interrupted\n");
+    printf("\t-s pattern:  find students by part of their name, or close to it\n");
+    printf("\t-S:  scrub, check every record against its checksum\n");
     printf("\t-x:  compress the database file [EXTRA CREDIT]\n");
     printf("\t-z:  zero db file (remove all records)\n");
+    printf("\t-T table a|f|d|c|p|x [args]:  same operations on another table\n");
+    printf("\t    tables: course (id code title credits),\n");
+    printf("\t            enrollment (id student_id course_id term grade)\n");
+    printf("  %s[=file.json] (or %s=1|file.json) before or after the option\n", STATS_FLAG, STATS_ENV_VAR);
+    printf("  reports time, syscalls and bytes per operation on stderr or to file.json\n");
+    printf("  %s (or %s=1) bypasses the page cache for the database files\n", DIRECT_FLAG, DIRECT_ENV_VAR);
+    printf("  --replica=file runs -c, -f, -p, -s or -S against a replica instead of %s\n", DB_FILE);
 }
 
 // Welcome to main()
 int main(int argc, char *argv[])
 {
     char opt;      // user selected option
-    int fd;        // file descriptor of database files
+    int fd;        // file descriptor of the shard being worked on
+    int shard;     // index of the shard that owns id
     int rc;        // return code from various operations
     int exit_code; // exit code to shell
     int id;        // userid from argv[2]
@@ -602,6 +539,18 @@ int main(int argc, char *argv[])
     // and print_student().
     student_t student = {0};
 
+    // the open shards of the database, a single shard unless the
+    // database has been split with -n
+    shard_map_t map;
+
+    // name of the replica to read from, if --replica=file was given
+    char *replica;
+
+    // pull --stats, --direct and --replica out of the arguments before looking at them
+    stats_init(&argc, argv);
+    dio_init(&argc, argv);
+    replica = replica_init(&argc, argv);
+
     // This function must have at least one arg, and the arg must start
     // with a dash
     if ((argc < 2) || (*argv[1] != '-'))
@@ -621,11 +570,43 @@ int main(int argc, char *argv[])
         exit(EXIT_OK);
     }
 
-    // now lets open the file and continue if there is no error
-    // note we are not truncating the file using the second
-    // parameter
-    fd = open_db(DB_FILE, false);
-    if (fd < 0)
+    // the generic tables keep their own files, see sdbtables.c
+    if (opt == 'T')
+    {
+        exit_code = table_cmd(argc - 2, argv + 2);
+        if (exit_code == EXIT_FAIL_ARGS)
+            usage(argv[0]);
+        exit(exit_code);
+    }
+
+    // followers only touch the replica and the change log
+    if (opt == 'R')
+    {
+        if (argc < 3 || argc > 4 || (argc == 4 && strcmp(argv[3], "follow") != 0))
+        {
+            usage(argv[0]);
+            exit(EXIT_FAIL_ARGS);
+        }
+        exit(follow_log(argv[2], argc == 4) < 0 ? EXIT_FAIL_DB : EXIT_OK);
+    }
+
+    // now lets open the shards and continue if there is no error
+    // note we are not truncating the files using the second
+    // parameter.  Replicas are only good for reading.
+    if (replica != NULL)
+    {
+        if (opt != 'c' && opt != 'f' && opt != 'p' && opt != 's' && opt != 'S')
+        {
+            printf(M_ERR_REPLICA_RO);
+            exit(EXIT_FAIL_ARGS);
+        }
+        STATS_PHASE(ST_OPEN, rc = open_replica(&map, replica));
+    }
+    else
+    {
+        STATS_PHASE(ST_OPEN, rc = open_shards(&map, false));
+    }
+    if (rc < 0)
     {
         exit(EXIT_FAIL_DB);
     }
@@ -661,7 +642,14 @@ int main(int argc, char *argv[])
             break;
         }
 
-        rc = add_student(fd, id, argv[3], argv[4], gpa);
+        shard = lock_shard_for_id(&map, id, LOCK_EX);
+        if (shard < 0)
+        {
+            exit_code = EXIT_FAIL_DB;
+            break;
+        }
+        STATS_PHASE(ST_ADD, rc = add_student(map.fds[shard], id, argv[3], argv[4], gpa));
+        unlock_shard(&map, shard);
         if (rc < 0)
             exit_code = EXIT_FAIL_DB;
 
@@ -672,7 +660,14 @@ int main(int argc, char *argv[])
         // prog_name     -c
         //-----------------
         // example:  prog_name -c
-        rc = count_db_records(fd);
+        if (map.num > 1)
+        {
+            STATS_PHASE(ST_COUNT, rc = count_shard_records(&map));
+        }
+        else
+        {
+            STATS_PHASE(ST_COUNT, rc = count_db_records(map.fds[0]));
+        }
         if (rc < 0)
             exit_code = EXIT_FAIL_DB;
         break;
@@ -689,7 +684,14 @@ int main(int argc, char *argv[])
             break;
         }
         id = atoi(argv[2]);
-        rc = del_student(fd, id);
+        shard = lock_shard_for_id(&map, id, LOCK_EX);
+        if (shard < 0)
+        {
+            exit_code = EXIT_FAIL_DB;
+            break;
+        }
+        STATS_PHASE(ST_DEL, rc = del_student(map.fds[shard], id));
+        unlock_shard(&map, shard);
         if (rc < 0)
             exit_code = EXIT_FAIL_DB;
 
@@ -707,7 +709,14 @@ int main(int argc, char *argv[])
             break;
         }
         id = atoi(argv[2]);
-        rc = get_student(fd, id, &student);
+        shard = lock_shard_for_id(&map, id, LOCK_SH);
+        if (shard < 0)
+        {
+            exit_code = EXIT_FAIL_DB;
+            break;
+        }
+        STATS_PHASE(ST_GET, rc = get_student(map.fds[shard], id, &student));
+        unlock_shard(&map, shard);
 
         switch (rc)
         {
@@ -718,6 +727,10 @@ int main(int argc, char *argv[])
             printf(M_STD_NOT_FND_MSG, id);
             exit_code = EXIT_FAIL_DB;
             break;
+        case ERR_DB_CORRUPT:
+            printf(M_ERR_DB_CRC, id);
+            exit_code = EXIT_FAIL_DB;
+            break;
         default:
             printf(M_ERR_DB_READ);
             exit_code = EXIT_FAIL_DB;
@@ -730,7 +743,14 @@ int main(int argc, char *argv[])
         // prog_name     -p
         //-----------------
         // example:  prog_name -p
-        rc = print_db(fd);
+        if (map.num > 1)
+        {
+            STATS_PHASE(ST_PRINT, rc = print_shards(&map));
+        }
+        else
+        {
+            STATS_PHASE(ST_PRINT, rc = print_db(map.fds[0]));
+        }
         if (rc < 0)
             exit_code = EXIT_FAIL_DB;
         break;
@@ -743,8 +763,93 @@ int main(int argc, char *argv[])
 
         // remember compress_db returns a fd of the compressed database.
         // we close it after this switch statement
-        fd = compress_db(fd);
-        if (fd < 0)
+        if (map.num > 1)
+        {
+            STATS_PHASE(ST_COMPRESS, rc = compress_shards(&map));
+        }
+        else if ((rc = lock_shard(&map, 0, LOCK_EX)) == NO_ERROR)
+        {
+            STATS_PHASE(ST_COMPRESS, fd = compress_db(map.fds[0]));
+            map.fds[0] = fd;
+            rc = fd;
+        }
+        if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
+    case 'L':
+        //    arv[0] arv[1]  arv[2]
+        // prog_name     -L  on|off
+        //-------------------------
+        // example:  prog_name -L on
+        if (argc != 3 || (strcmp(argv[2], "on") != 0 && strcmp(argv[2], "off") != 0))
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        if (set_change_log(&map, strcmp(argv[2], "on") == 0) < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
+    case 'n':
+        //    arv[0] arv[1]  arv[2]
+        // prog_name     -n     num
+        //-------------------------
+        // example:  prog_name -n 4
+        if (argc != 3)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        STATS_PHASE(ST_RESHARD, rc = reshard_db(&map, atoi(argv[2])));
+        if (rc == ERR_DB_OP)
+            exit_code = EXIT_FAIL_ARGS;
+        else if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
+    case 's':
+        //    arv[0] arv[1]   arv[2]
+        // prog_name     -s  pattern
+        //--------------------------
+        // example:  prog_name -s ohns
+        if (argc != 3)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        STATS_PHASE(ST_SEARCH, rc = search_shards(&map, argv[2]));
+        if (rc == ERR_DB_OP)
+            exit_code = EXIT_FAIL_ARGS;
+        else if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
+    case 'k':
+        //    arv[0] arv[1]  arv[2]
+        // prog_name     -k  on|off
+        //-------------------------
+        // example:  prog_name -k on
+        if (argc != 3 || (strcmp(argv[2], "on") != 0 && strcmp(argv[2], "off") != 0))
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        if (set_shards_crc(&map, strcmp(argv[2], "on") == 0) < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
+    case 'S':
+        //    arv[0] arv[1]
+        // prog_name     -S
+        //-----------------
+        // example:  prog_name -S
+        // any bad record fails the scrub, same as an I/O error
+        if (scrub_shards(&map) != NO_ERROR)
             exit_code = EXIT_FAIL_DB;
         break;
 
@@ -755,15 +860,9 @@ int main(int argc, char *argv[])
         // example:  prog_name -x
         // HINT:  close the db file, we already have fd
         //       and reopen db indicating truncate=true
-        close(fd);
-        fd = open_db(DB_FILE, true);
-        if (fd < 0)
-        {
+        STATS_PHASE(ST_ZERO, rc = zero_shards(&map));
+        if (rc < 0)
             exit_code = EXIT_FAIL_DB;
-            break;
-        }
-        printf(M_DB_ZERO_OK);
-        exit_code = EXIT_OK;
         break;
     default:
         usage(argv[0]);
@@ -772,6 +871,6 @@ int main(int argc, char *argv[])
 
     // dont forget to close the file before exiting, and setting the
     // proper exit code - see the header file for expected values
-    close(fd);
+    close_shards(&map);
     exit(exit_code);
 }
@@ -1,6 +1,21 @@
 #ifndef __SDB_H__
+    #define __SDB_H__
+
+#include <stdint.h>
 
 #include "db.h" //get student record type
+#include "libsdb.h" //status codes, shared with the library
+
+//Open shards of the database.  num == 1 with no manifest is the original
+//single student.db layout.  Shard i owns ids [lo[i], hi[i]].
+typedef struct shard_map {
+    int  num;
+    int  fds[MAX_DB_SHARDS];
+    int  lo[MAX_DB_SHARDS];
+    int  hi[MAX_DB_SHARDS];
+    char paths[MAX_DB_SHARDS][DB_PATH_MAX];
+    char tmp_paths[MAX_DB_SHARDS][DB_PATH_MAX];
+} shard_map_t;
 
 //prototypes for functions go below for this assignment
 int open_db(char *dbFile, bool should_truncate);
@@ -8,21 +23,67 @@ int add_student(int fd, int id, char *fname, char *lname, int gpa);
 int get_student(int fd, int id, student_t *s);
 int del_student(int fd, int id);
 int compress_db(int fd);
+int compress_db_file(int fd, const char *db_file, const char *tmp_file);
 void print_student(student_t *s);
 int validate_range(int id, int gpa);
 int count_db_records(int fd);
 int print_db(int fd);
 void usage(char *);
 
-//error codes to be returned from individual functions
-// NO_ERROR is returned if there are no errors
-// ERR_DB_FILE is returned if there is are any issues with the database file itself
-// ERR_DB_OP is returned if an operation did not work aka add or delete a student
-// SRCH_NOT_FOUND is returned if the student is not found (get_student, and del_student)
-#define NO_ERROR        0
-#define ERR_DB_FILE     -1
-#define ERR_DB_OP       -2
-#define SRCH_NOT_FOUND  -3
+//prototypes for snapshot reads, see sdbsnap.c
+bool is_student_record(const student_t *s);
+int read_db_header(int fd, db_header_t *hdr);
+int init_db_header(int fd, unsigned int flags);
+int begin_db_write(int fd);
+int end_db_write(int fd);
+int retire_db_file(int fd);
+int snapshot_db(int fd, int lo, int hi, bool collect, student_t **recs, int *count);
+int snapshot_locked_db(int fd, int lo, int hi, bool collect, student_t **recs, int *count);
+
+//prototypes for record storage shared with libsdb, see sdbrec.c
+int read_record(int fd, int id, student_t *s);
+int write_record(int fd, const char *db_file, int id, const student_t *s);
+int compact_db_file(int fd, const char *db_file, const char *tmp_file);
+int log_change(const char *db_file, int op, int id, const student_t *s);
+int apply_log(int fd, int lfd, unsigned long long *seq);
+
+//prototypes for record checksums, see sdbcrc.c
+uint32_t record_crc(int id, const student_t *s);
+bool db_crc_enabled(int fd);
+int write_record_crc(int fd, int id, const student_t *s);
+int check_record_crc(int fd, int id, const student_t *s);
+int check_range_crc(int fd, int id, int n, const student_t *recs, bool *bad);
+int copy_range_crc(int from_fd, int to_fd, int id, int n, const student_t *recs);
+int set_db_crc(int fd, bool on);
+int set_shards_crc(shard_map_t *map, bool on);
+int scrub_shards(shard_map_t *map);
+
+//prototypes for the sharded layout, see sdbshard.c
+int open_shards(shard_map_t *map, bool should_truncate);
+void close_shards(shard_map_t *map);
+int shard_for_id(shard_map_t *map, int id);
+int lock_shard(shard_map_t *map, int shard, int how);
+int lock_shard_for_id(shard_map_t *map, int id, int how);
+void unlock_shard(shard_map_t *map, int shard);
+int count_shard_records(shard_map_t *map);
+int print_shards(shard_map_t *map);
+int compress_shards(shard_map_t *map);
+int zero_shards(shard_map_t *map);
+int reshard_db(shard_map_t *map, int num);
+int open_replica(shard_map_t *map, const char *path);
+
+//prototypes for the change log and replicas, see sdblog.c
+char *replica_init(int *argc, char *argv[]);
+int set_change_log(shard_map_t *map, bool on);
+int follow_log(const char *replica, bool follow);
+
+//prototype for name search, see sdbindex.c
+int search_shards(shard_map_t *map, const char *pattern);
+
+//generic tables built from sdbtable.h, see sdbtables.c
+int table_cmd(int argc, char *argv[]);
+
+//error codes returned from individual functions are in libsdb.h
 #define NOT_IMPLEMENTED_YET 0
 
 
@@ -53,6 +114,37 @@ void usage(char *);
 #define M_DB_EMPTY        "Database contains no student records.\n"
 #define M_DB_RECORD_CNT   "Database contains %d student record(s).\n"
 #define M_NOT_IMPL        "The requested operation is not implemented yet!\n"
+#define M_DB_RESHARDED    "Database split into %d shard(s).\n"
+#define M_ERR_DB_MANIFEST "Error reading DB manifest, exiting!\n"
+#define M_ERR_SHARD_RNG   "Cant shard database, shard count must be 1 to %d!\n"
+#define M_ERR_DB_CRC      "Student %d failed its checksum, the record is corrupt!\n"
+#define M_WARN_DB_CRC     "warning: skipped %d corrupt record(s), run -S for details\n"
+#define M_ERR_RESHARD_CRC "Cant shard database, %d record(s) are corrupt, run -S for details!\n"
+#define M_DB_CRC_ON       "Record checksums enabled.\n"
+#define M_DB_CRC_OFF      "Record checksums disabled.\n"
+#define M_SCRUB_BAD_SLOT  "%s: slot %d holds a bad record (id %d)\n"
+#define M_SCRUB_DONE      "Scrub checked %d record(s), %d bad.\n"
+#define M_SCRUB_NO_CRC    "Record checksums are not enabled, only slot ids were checked.\n"
+#define M_LOG_ON          "Change log enabled, %d record(s) written to %s.\n"
+#define M_LOG_OFF         "Change log disabled.\n"
+#define M_ERR_LOG         "Error reading change log, exiting!\n"
+#define M_ERR_LOG_WRITE   "Error writing change log, the change was not logged!\n"
+#define M_LOG_APPLIED     "%s: applied %d change(s), at seq %llu.\n"
+#define M_SEARCH_FOUND    "%d student(s) matched \"%s\".\n"
+#define M_SEARCH_CLOSE    "No exact match, %d student(s) closely matched \"%s\".\n"
+#define M_SEARCH_NONE     "No students matched \"%s\".\n"
+#define M_ERR_SEARCH_PAT  "Search pattern must be 1 to %d characters!\n"
+#define M_ERR_REPLICA_RO  "Replicas are read only, use -c, -f, -p, -s or -S!\n"
+
+//Output messages for the generic tables, the %s is the table name
+#define M_REC_ADDED       "%s %d added to database.\n"
+#define M_REC_DEL_MSG     "%s %d was deleted from database.\n"
+#define M_REC_NOT_FND_MSG "%s %d was not found in database.\n"
+#define M_ERR_REC_DUP     "Cant add %s with ID=%d, already exists in db.\n"
+#define M_ERR_REC_RNG     "Cant use %s ID=%s, ID must be %d to %d!\n"
+#define M_REC_CNT         "Database contains %2$d %1$s record(s).\n"
+#define M_REC_EMPTY       "Database contains no %s records.\n"
+#define M_ERR_TABLE       "Unknown table %s!\n"
 
 //useful format strings for print students
 //For example to print the header in the required output:
@@ -0,0 +1,896 @@
+/**
+	@file
+	@Description
+	Sharded layout for the student database.  The id space is split into
+	contiguous ranges, one shard file per range, described by a small
+	manifest.  Point operations touch exactly one shard and take a lock on
+	that shard only; scans fan out across shards with one thread each.
+**/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+#include "sdbstats.h"
+
+//how long a point operation waits between looks at a layout being resharded
+#define RESHARD_WAIT_MS     10
+
+static int reopen_shards(shard_map_t *map);
+
+/*
+ *  shard_layout
+ *      map:  shard map to fill in
+ *      num:  number of shards
+ *
+ *  Computes the id range and file names of every shard for a layout of
+ *  num shards.  A single shard is the original student.db file so a
+ *  database that was never sharded needs no manifest at all.
+ *
+ *  returns:  nothing, this is a void function
+ */
+static void shard_layout(shard_map_t *map, int num)
+{
+    int span = (MAX_STD_ID - MIN_STD_ID + num) / num;
+
+    memset(map, 0, sizeof(shard_map_t));
+    map->num = num;
+
+    for (int i = 0; i < num; i++) {
+        map->fds[i] = -1;
+        map->lo[i] = MIN_STD_ID + i * span;
+        map->hi[i] = map->lo[i] + span - 1;
+        if (map->hi[i] > MAX_STD_ID)
+            map->hi[i] = MAX_STD_ID;
+
+        if (num == 1) {
+            snprintf(map->paths[i], DB_PATH_MAX, "%s", DB_FILE);
+            snprintf(map->tmp_paths[i], DB_PATH_MAX, "%s", TMP_DB_FILE);
+        } else {
+            snprintf(map->paths[i], DB_PATH_MAX, DB_SHARD_FMT, i);
+            snprintf(map->tmp_paths[i], DB_PATH_MAX, TMP_DB_SHARD_FMT, i);
+        }
+    }
+}
+
+/*
+ *  read_manifest
+ *
+ *  Reads the shard count from DB_MANIFEST_FILE.  The manifest is a single
+ *  line of the form "shards=N".  A missing manifest means the database is
+ *  the single file layout.
+ *
+ *  returns:  <number>       the number of shards
+ *            ERR_DB_FILE    the manifest exists but could not be parsed
+ */
+static int read_manifest(void)
+{
+    FILE *mf = fopen(DB_MANIFEST_FILE, "r");
+    int num = 0;
+
+    if (mf == NULL)
+        return (errno == ENOENT) ? 1 : ERR_DB_FILE;
+
+    if (fscanf(mf, "shards=%d", &num) != 1 || num < 1 || num > MAX_DB_SHARDS)
+        num = ERR_DB_FILE;
+
+    fclose(mf);
+    return num;
+}
+
+/*
+ *  write_manifest
+ *      num:  number of shards
+ *
+ *  Atomically replaces the manifest by writing a temporary copy and
+ *  renaming it into place.  A single shard removes the manifest so the
+ *  database goes back to being a plain student.db file.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int write_manifest(int num)
+{
+    char tmp[DB_PATH_MAX];
+    FILE *mf;
+
+    if (num == 1) {
+        if (unlink(DB_MANIFEST_FILE) == -1 && errno != ENOENT)
+            return ERR_DB_FILE;
+        return NO_ERROR;
+    }
+
+    snprintf(tmp, sizeof(tmp), ".tmp_%s", DB_MANIFEST_FILE);
+    mf = fopen(tmp, "w");
+    if (mf == NULL)
+        return ERR_DB_FILE;
+
+    fprintf(mf, "shards=%d\n", num);
+    if (fclose(mf) != 0 || rename(tmp, DB_MANIFEST_FILE) == -1)
+        return ERR_DB_FILE;
+
+    return NO_ERROR;
+}
+
+/*
+ *  open_shards
+ *      map:              shard map to fill in
+ *      should_truncate:  indicates if opening the shards also empties them
+ *
+ *  Reads the manifest and opens every shard with reopen_shards().  Only a
+ *  missing student.db is created, with open_db(), shards only ever come
+ *  from reshard_db() and one that is missing was resharded away after the
+ *  manifest was read, so it is read again.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ *
+ *  console:  M_ERR_DB_MANIFEST  the manifest could not be read
+ *            M_ERR_DB_OPEN      a shard could not be opened
+ */
+int open_shards(shard_map_t *map, bool should_truncate)
+{
+    struct timespec wait = { 0, RESHARD_WAIT_MS * 1000000L };
+    int rc = SRCH_NOT_FOUND;
+
+    map->num = 0;
+    for (int tries = 0; tries < DB_SNAP_RETRIES && rc == SRCH_NOT_FOUND; tries++) {
+        if (tries > 0)
+            nanosleep(&wait, NULL);
+        rc = reopen_shards(map);
+        if (rc == SRCH_NOT_FOUND && map->num == 1) {
+            map->fds[0] = open_db(map->paths[0], should_truncate);
+            return (map->fds[0] < 0) ? ERR_DB_FILE : NO_ERROR;
+        }
+    }
+    if (rc == SRCH_NOT_FOUND)
+        printf(M_ERR_DB_OPEN);
+    if (rc != NO_ERROR)
+        return ERR_DB_FILE;
+
+    // an emptied file starts over under a new header, same as open_db()
+    for (int i = 0; i < map->num && should_truncate; i++) {
+        if (SDB_FTRUNCATE(map->fds[i], 0) == -1 || init_db_header(map->fds[i], 0) < 0) {
+            close_shards(map);
+            printf(M_ERR_DB_OPEN);
+            return ERR_DB_FILE;
+        }
+    }
+
+    return NO_ERROR;
+}
+
+/*
+ *  open_replica
+ *      map:   shard map to fill in
+ *      path:  replica file kept up to date by follow_log()
+ *
+ *  Opens a replica as a single shard map so the read only commands work
+ *  on it unchanged.  Replicas always use the single file layout, whatever
+ *  the layout of the primary.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ *
+ *  console:  M_ERR_DB_OPEN  the replica could not be opened
+ */
+int open_replica(shard_map_t *map, const char *path)
+{
+    shard_layout(map, 1);
+    if (strlen(path) >= DB_PATH_MAX) {
+        printf(M_ERR_DB_OPEN);
+        return ERR_DB_FILE;
+    }
+    snprintf(map->paths[0], DB_PATH_MAX, "%s", path);
+
+    map->fds[0] = SDB_OPEN_RECS(path, O_RDONLY, 0);
+    if (map->fds[0] < 0) {
+        printf(M_ERR_DB_OPEN);
+        return ERR_DB_FILE;
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  close_shards
+ *      map:  shard map opened with open_shards()
+ *
+ *  returns:  nothing, this is a void function
+ */
+void close_shards(shard_map_t *map)
+{
+    for (int i = 0; i < map->num; i++) {
+        if (map->fds[i] >= 0)
+            SDB_CLOSE(map->fds[i]);
+        map->fds[i] = -1;
+    }
+}
+
+/*
+ *  shard_for_id
+ *      map:  shard map
+ *      id:   student id
+ *
+ *  returns:  index of the shard that owns id.  Ids outside the valid
+ *            range map to the nearest shard so lookups of them simply
+ *            come back not found.
+ */
+int shard_for_id(shard_map_t *map, int id)
+{
+    for (int i = 0; i < map->num - 1; i++) {
+        if (id <= map->hi[i])
+            return i;
+    }
+    return map->num - 1;
+}
+
+//replicas are opened by name as a single read only shard, see open_replica()
+static bool is_replica(shard_map_t *map)
+{
+    return map->num == 1 && strcmp(map->paths[0], DB_FILE) != 0;
+}
+
+/*
+ *  reopen_shards
+ *      map:  shard map to fill in again
+ *
+ *  Re-reads the manifest after a reshard and opens the shards of the
+ *  layout it names.  Nothing is created, a shard that is missing means the
+ *  layout changed again since the manifest was read.
+ *
+ *  returns:  NO_ERROR        the new layout is open
+ *            SRCH_NOT_FOUND  a shard of the new layout is not there yet
+ *            ERR_DB_FILE     the manifest or a shard could not be read
+ *
+ *  console:  M_ERR_DB_MANIFEST  the manifest could not be read
+ *            M_ERR_DB_OPEN      a shard could not be opened
+ */
+static int reopen_shards(shard_map_t *map)
+{
+    int num = read_manifest();
+
+    close_shards(map);
+    if (num < 0) {
+        printf(M_ERR_DB_MANIFEST);
+        return ERR_DB_FILE;
+    }
+
+    shard_layout(map, num);
+    for (int i = 0; i < num; i++) {
+        map->fds[i] = SDB_OPEN_RECS(map->paths[i], O_RDWR, 0);
+        if (map->fds[i] < 0) {
+            bool missing = (errno == ENOENT);
+            close_shards(map);
+            if (missing)
+                return SRCH_NOT_FOUND;
+            printf(M_ERR_DB_OPEN);
+            return ERR_DB_FILE;
+        }
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  lock_shard
+ *      map:    shard map
+ *      shard:  index of the shard to lock
+ *      how:    LOCK_SH for readers or LOCK_EX for writers
+ *
+ *  Takes an advisory lock on one shard.  compress_db_file() swaps a new
+ *  file in under the shard's name, so after the lock is granted make sure
+ *  the fd still refers to the file on disk and reopen it if it does not.
+ *  A reshard removes the name or gives its ids to other shards, so the
+ *  manifest is read again under the lock too.  If it names another layout
+ *  the shard is closed and never created again.
+ *
+ *  returns:  NO_ERROR        the shard is locked
+ *            SRCH_NOT_FOUND  the layout changed under map, map->fds[shard]
+ *                            is closed, see lock_shard_for_id()
+ *            ERR_DB_FILE     the shard could not be locked or reopened
+ *
+ *  console:  M_ERR_DB_OPEN  the shard could not be reopened
+ */
+int lock_shard(shard_map_t *map, int shard, int how)
+{
+    struct stat held, on_disk;
+    bool replica = is_replica(map);
+
+    while (1) {
+        if (SDB_FLOCK(map->fds[shard], how) == -1)
+            return ERR_DB_FILE;
+
+        if (fstat(map->fds[shard], &held) == -1)
+            return ERR_DB_FILE;
+        bool moved = stat(map->paths[shard], &on_disk) != 0 ||
+                     held.st_ino != on_disk.st_ino || held.st_dev != on_disk.st_dev;
+        bool resharded = !replica && read_manifest() != map->num;
+        if (!moved && !resharded)
+            return NO_ERROR;
+
+        SDB_CLOSE(map->fds[shard]);
+        map->fds[shard] = -1;
+        if (resharded)
+            return SRCH_NOT_FOUND;
+
+        map->fds[shard] = SDB_OPEN_RECS(map->paths[shard], replica ? O_RDONLY : O_RDWR, 0);
+        if (map->fds[shard] < 0) {
+            if (errno == ENOENT && !replica)
+                return SRCH_NOT_FOUND;
+            printf(M_ERR_DB_OPEN);
+            return ERR_DB_FILE;
+        }
+    }
+}
+
+/*
+ *  lock_shard_for_id
+ *      map:  shard map
+ *      id:   student id the caller is about to read or change
+ *      how:  LOCK_SH for readers or LOCK_EX for writers
+ *
+ *  lock_shard() on the shard that owns id.  If a reshard changed the
+ *  layout the manifest is read again and id routed to its new shard,
+ *  waiting RESHARD_WAIT_MS at a time for the reshard to finish moving
+ *  the files.
+ *
+ *  returns:  <number>     index of the shard, locked
+ *            ERR_DB_FILE  the shard could not be locked
+ *
+ *  console:  M_ERR_DB_OPEN  the shard could not be found or opened
+ */
+int lock_shard_for_id(shard_map_t *map, int id, int how)
+{
+    struct timespec wait = { 0, RESHARD_WAIT_MS * 1000000L };
+    int rc;
+
+    for (int tries = 0; tries < DB_SNAP_RETRIES; tries++) {
+        if (tries > 0) {
+            nanosleep(&wait, NULL);
+            rc = reopen_shards(map);
+            if (rc == SRCH_NOT_FOUND)
+                continue;
+            if (rc < 0)
+                return ERR_DB_FILE;
+        }
+
+        int shard = shard_for_id(map, id);
+        rc = lock_shard(map, shard, how);
+        if (rc != SRCH_NOT_FOUND)
+            return (rc < 0) ? ERR_DB_FILE : shard;
+    }
+
+    printf(M_ERR_DB_OPEN);
+    return ERR_DB_FILE;
+}
+
+/*
+ *  unlock_shard
+ *      map:    shard map
+ *      shard:  index of the shard to unlock
+ *
+ *  returns:  nothing, this is a void function
+ */
+void unlock_shard(shard_map_t *map, int shard)
+{
+    SDB_FLOCK(map->fds[shard], LOCK_UN);
+}
+
+//state for one scanner thread.  recs is only filled in when collect is set
+typedef struct shard_scan {
+    int        fd;
+    int        lo;
+    int        hi;
+    bool       collect;
+    bool       locked;                  //the caller holds the shard's lock
+    int        rc;
+    int        count;
+    int        corrupt;
+    student_t *recs;
+} shard_scan_t;
+
+/*
+ *  scan_shard
+ *      arg:  a shard_scan_t describing the shard to scan
+ *
+ *  Thread body for the scanners.  Takes a snapshot_db() copy of the id
+ *  range of one shard, or a snapshot_locked_db() one when the caller holds
+ *  the shard's lock, and counts, and optionally collects, its records.
+ *
+ *  returns:  arg, with rc set to NO_ERROR or ERR_DB_FILE and corrupt to
+ *            the number of records left out for failing their checksum
+ */
+static void *scan_shard(void *arg)
+{
+    shard_scan_t *scan = arg;
+    int rc;
+
+    if (scan->locked)
+        rc = snapshot_locked_db(scan->fd, scan->lo, scan->hi, scan->collect,
+                                &scan->recs, &scan->count);
+    else
+        rc = snapshot_db(scan->fd, scan->lo, scan->hi, scan->collect,
+                         &scan->recs, &scan->count);
+
+    scan->rc = (rc < 0) ? rc : NO_ERROR;
+    scan->corrupt = (rc > 0) ? rc : 0;
+    return scan;
+}
+
+/*
+ *  scan_shards
+ *      map:      shard map
+ *      scans:    one shard_scan_t per shard, filled in by this function
+ *      collect:  true to keep copies of the records found
+ *      locked:   true if the caller holds the lock on every shard
+ *
+ *  Runs scan_shard() over every shard in parallel, one thread per shard.
+ *  Each shard is a consistent snapshot on its own, and since point
+ *  operations only ever touch one shard no write is seen half applied.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int scan_shards(shard_map_t *map, shard_scan_t *scans, bool collect, bool locked)
+{
+    pthread_t threads[MAX_DB_SHARDS];
+    bool started[MAX_DB_SHARDS];
+    int rc = NO_ERROR;
+
+    memset(scans, 0, MAX_DB_SHARDS * sizeof(shard_scan_t));
+    for (int i = 0; i < map->num; i++) {
+        scans[i].fd = map->fds[i];
+        scans[i].lo = map->lo[i];
+        scans[i].hi = map->hi[i];
+        scans[i].collect = collect;
+        scans[i].locked = locked;
+    }
+
+    for (int i = 0; i < map->num; i++) {
+        started[i] = (pthread_create(&threads[i], NULL, scan_shard, &scans[i]) == 0);
+        if (!started[i]) {
+            // run it inline rather than failing the whole scan
+            scan_shard(&scans[i]);
+        }
+    }
+
+    int corrupt = 0;
+    for (int i = 0; i < map->num; i++) {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        if (scans[i].rc != NO_ERROR)
+            rc = ERR_DB_FILE;
+        corrupt += scans[i].corrupt;
+    }
+
+    // keep stdout clean for the report, the caller still gets the good records
+    if (rc == NO_ERROR && corrupt > 0)
+        fprintf(stderr, M_WARN_DB_CRC, corrupt);
+    return rc;
+}
+
+static void free_scans(shard_scan_t *scans)
+{
+    for (int i = 0; i < MAX_DB_SHARDS; i++)
+        free(scans[i].recs);
+}
+
+/*
+ *  count_shard_records
+ *      map:  shard map
+ *
+ *  Sharded version of count_db_records().
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ *
+ *  console:  same as count_db_records()
+ */
+int count_shard_records(shard_map_t *map)
+{
+    shard_scan_t scans[MAX_DB_SHARDS];
+    int count = 0;
+
+    if (scan_shards(map, scans, false, false) < 0) {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+
+    for (int i = 0; i < map->num; i++)
+        count += scans[i].count;
+
+    if (count == 0) {
+        printf(M_DB_EMPTY);
+    } else {
+        printf(M_DB_RECORD_CNT, count);
+    }
+
+    return NO_ERROR;
+}
+
+/*
+ *  print_shards
+ *      map:  shard map
+ *
+ *  Sharded version of print_db().  The shards are read in parallel and
+ *  then printed in shard order, which is id order since the shards are
+ *  contiguous id ranges.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ *
+ *  console:  same as print_db()
+ */
+int print_shards(shard_map_t *map)
+{
+    shard_scan_t scans[MAX_DB_SHARDS];
+    bool header_printed = false;
+
+    if (scan_shards(map, scans, true, false) < 0) {
+        free_scans(scans);
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+
+    for (int i = 0; i < map->num; i++) {
+        for (int j = 0; j < scans[i].count; j++) {
+            student_t *s = &scans[i].recs[j];
+            if (!header_printed) {
+                SDB_PRINTF(STUDENT_PRINT_HDR_STRING, "ID", "FIRST_NAME", "LAST_NAME", "GPA");
+                header_printed = true;
+            }
+            float gpa = s->gpa / 100.0;
+            SDB_PRINTF(STUDENT_PRINT_FMT_STRING, s->id, s->fname, s->lname, gpa);
+        }
+    }
+
+    if (!header_printed) {
+        printf(M_DB_EMPTY);
+    }
+
+    free_scans(scans);
+    return NO_ERROR;
+}
+
+/*
+ *  compress_shards
+ *      map:  shard map
+ *
+ *  Compresses each shard on its own with compress_db_file() while holding
+ *  only that shard's lock, so writers to the other shards keep going.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ *
+ *  console:  M_DB_COMPRESSED_OK once all shards are compressed, otherwise
+ *            the error messages from compress_db_file()
+ */
+int compress_shards(shard_map_t *map)
+{
+    for (int i = 0; i < map->num; i++) {
+        if (lock_shard(map, i, LOCK_EX) < 0) {
+            printf(M_ERR_DB_READ);
+            return ERR_DB_FILE;
+        }
+
+        // closing the old fd inside compress_db_file() drops the lock
+        map->fds[i] = compress_db_file(map->fds[i], map->paths[i], map->tmp_paths[i]);
+        if (map->fds[i] < 0)
+            return ERR_DB_FILE;
+    }
+
+    printf(M_DB_COMPRESSED_OK);
+    return NO_ERROR;
+}
+
+/*
+ *  zero_shards
+ *      map:  shard map
+ *
+ *  Reopens every shard truncated under a fresh header and logs the zero,
+ *  the same layout is kept.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ *
+ *  console:  M_DB_ZERO_OK on success, otherwise M_ERR_DB_OPEN or
+ *            M_ERR_LOG_WRITE
+ */
+int zero_shards(shard_map_t *map)
+{
+    close_shards(map);
+    if (open_shards(map, true) < 0)
+        return ERR_DB_FILE;
+
+    if (log_change(DB_FILE, LOG_OP_ZERO, 0, NULL) < 0) {
+        printf(M_ERR_LOG_WRITE);
+        return ERR_DB_FILE;
+    }
+
+    printf(M_DB_ZERO_OK);
+    return NO_ERROR;
+}
+
+/*
+ *  set_shards_crc
+ *      map:  shard map
+ *      on:   turn checksums on or off
+ *
+ *  Turns record checksums on or off in every shard, one shard locked at a
+ *  time like compress_shards().
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ *
+ *  console:  M_DB_CRC_ON or M_DB_CRC_OFF on success, M_ERR_DB_WRITE
+ *            otherwise
+ */
+int set_shards_crc(shard_map_t *map, bool on)
+{
+    for (int i = 0; i < map->num; i++) {
+        if (lock_shard(map, i, LOCK_EX) < 0) {
+            printf(M_ERR_DB_READ);
+            return ERR_DB_FILE;
+        }
+
+        int rc = set_db_crc(map->fds[i], on);
+        unlock_shard(map, i);
+        if (rc < 0) {
+            printf(M_ERR_DB_WRITE);
+            return ERR_DB_FILE;
+        }
+    }
+
+    printf(on ? M_DB_CRC_ON : M_DB_CRC_OFF);
+    return NO_ERROR;
+}
+
+/*
+ *  scrub_db
+ *      fd:    linux file descriptor
+ *      name:  name of the file, used in the report
+ *      bad:   incremented by the number of bad slots found
+ *
+ *  Checks every record of the file against its checksum, 1MB of records
+ *  per read, and prints each bad slot.  Records sitting in a slot that
+ *  does not match their id are reported too.
+ *
+ *  returns:  <number>     the number of records checked
+ *            ERR_DB_FILE  database file I/O issue
+ *
+ *  console:  M_SCRUB_BAD_SLOT for every bad slot
+ */
+static int scrub_db(int fd, const char *name, int *bad)
+{
+    student_t *recs = malloc(SCRUB_CHUNK_RECS * sizeof(student_t));
+    bool *flags = malloc(SCRUB_CHUNK_RECS * sizeof(bool));
+    bool crc_on = db_crc_enabled(fd);
+    int checked = 0;
+
+    if (recs == NULL || flags == NULL) {
+        checked = ERR_DB_FILE;
+        goto done;
+    }
+
+    for (int id = 0; id <= MAX_STD_ID; id += SCRUB_CHUNK_RECS) {
+        off_t offset = (off_t)id * STUDENT_RECORD_SIZE;
+        size_t want = SCRUB_CHUNK_RECS * STUDENT_RECORD_SIZE;
+
+        if (offset + (off_t)want > DB_CRC_OFFSET)
+            want = DB_CRC_OFFSET - offset;
+
+        ssize_t got = SDB_PREAD(fd, recs, want, offset);
+        if (got < 0 || got % STUDENT_RECORD_SIZE != 0) {
+            checked = ERR_DB_FILE;
+            goto done;
+        }
+        if (got == 0)
+            break;
+
+        int n = got / STUDENT_RECORD_SIZE;
+        memset(flags, 0, n * sizeof(bool));
+        if (crc_on && check_range_crc(fd, id, n, recs, flags) < 0) {
+            checked = ERR_DB_FILE;
+            goto done;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (!is_student_record(&recs[i]))
+                continue;
+            checked++;
+            if (flags[i] || recs[i].id != id + i) {
+                printf(M_SCRUB_BAD_SLOT, name, id + i, recs[i].id);
+                (*bad)++;
+            }
+        }
+    }
+
+done:
+    free(recs);
+    free(flags);
+    return checked;
+}
+
+/*
+ *  scrub_shards
+ *      map:  shard map
+ *
+ *  Runs scrub_db() over every shard.  No lock is taken, a record caught in
+ *  the middle of a write can be reported as bad, so a bad slot should be
+ *  confirmed with -f before it is acted on.
+ *
+ *  returns:  NO_ERROR     every record is intact
+ *            ERR_DB_OP    at least one bad record was found
+ *            ERR_DB_FILE  database file I/O issue
+ *
+ *  console:  M_SCRUB_BAD_SLOT for every bad slot, then M_SCRUB_DONE
+ */
+int scrub_shards(shard_map_t *map)
+{
+    int checked = 0;
+    int bad = 0;
+
+    if (!db_crc_enabled(map->fds[0]))
+        printf(M_SCRUB_NO_CRC);
+
+    for (int i = 0; i < map->num; i++) {
+        int rc = scrub_db(map->fds[i], map->paths[i], &bad);
+        if (rc < 0) {
+            printf(M_ERR_DB_READ);
+            return ERR_DB_FILE;
+        }
+        checked += rc;
+    }
+
+    printf(M_SCRUB_DONE, checked, bad);
+    return bad ? ERR_DB_OP : NO_ERROR;
+}
+
+//true if path is the name of one of the shards of map
+static bool layout_has_path(shard_map_t *map, const char *path)
+{
+    for (int i = 0; i < map->num; i++) {
+        if (strcmp(map->paths[i], path) == 0)
+            return true;
+    }
+    return false;
+}
+
+/*
+ *  reshard_db
+ *      map:  shard map of the current layout, replaced with the new one
+ *      num:  number of shards for the new layout
+ *
+ *  Moves every record into a new layout of num shards.  The new shards are
+ *  built under their temporary names while the old shards are locked.  The
+ *  ones under names the old layout does not use are renamed into place
+ *  first, then the manifest is rewritten and the rest renamed over the old
+ *  shards, so every name the manifest lists always exists.  Only then are
+ *  the old shards retired, unlocked and the names left over removed.
+ *  Readers and writers can run meanwhile: one waiting on an old shard wakes
+ *  up to a new manifest or a new file under the name and is routed to the
+ *  new layout by lock_shard_for_id().
+ *
+ *  returns:  NO_ERROR, ERR_DB_CORRUPT or ERR_DB_FILE
+ *
+ *  console:  M_DB_RESHARDED    on success
+ *            M_ERR_SHARD_RNG   num is out of range
+ *            M_ERR_RESHARD_CRC records fail their checksum, the snapshot
+ *                              would leave them behind
+ *            M_ERR_DB_READ     error reading the current shards
+ *            M_ERR_DB_WRITE    error writing the new shards
+ *            M_ERR_DB_CREATE   error moving the new shards into place
+ */
+int reshard_db(shard_map_t *map, int num)
+{
+    shard_scan_t scans[MAX_DB_SHARDS];
+    shard_map_t next;
+    bool crc_on;
+    int corrupt = 0;
+    int rc = NO_ERROR;
+
+    if (num < 1 || num > MAX_DB_SHARDS) {
+        printf(M_ERR_SHARD_RNG, MAX_DB_SHARDS);
+        return ERR_DB_OP;
+    }
+
+    // keep writers out of the old layout while it is being copied
+    for (int i = 0; i < map->num; i++) {
+        if (lock_shard(map, i, LOCK_EX) < 0) {
+            printf(M_ERR_DB_READ);
+            return ERR_DB_FILE;
+        }
+    }
+
+    // the locks are held, a snapshot_db() fallback would give them away
+    if (scan_shards(map, scans, true, true) < 0) {
+        free_scans(scans);
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+
+    // the scans skip corrupt records, they would be lost with the old shards
+    for (int i = 0; i < map->num; i++)
+        corrupt += scans[i].corrupt;
+    if (corrupt > 0) {
+        free_scans(scans);
+        printf(M_ERR_RESHARD_CRC, corrupt);
+        return ERR_DB_CORRUPT;
+    }
+
+    // the new shards carry checksums if the old ones did
+    crc_on = db_crc_enabled(map->fds[0]);
+
+    shard_layout(&next, num);
+    for (int i = 0; i < num; i++) {
+        next.fds[i] = open_db(next.tmp_paths[i], true);
+        if (next.fds[i] < 0) {
+            rc = ERR_DB_FILE;
+            goto done;
+        }
+    }
+
+    for (int i = 0; i < map->num && rc == NO_ERROR; i++) {
+        for (int j = 0; j < scans[i].count; j++) {
+            student_t *s = &scans[i].recs[j];
+            int dst = shard_for_id(&next, s->id);
+            off_t offset = (off_t)s->id * STUDENT_RECORD_SIZE;
+
+            if (SDB_PWRITE(next.fds[dst], s, STUDENT_RECORD_SIZE, offset) != STUDENT_RECORD_SIZE) {
+                printf(M_ERR_DB_WRITE);
+                rc = ERR_DB_FILE;
+                break;
+            }
+        }
+    }
+    for (int i = 0; i < num && rc == NO_ERROR && crc_on; i++) {
+        if (set_db_crc(next.fds[i], true) < 0) {
+            printf(M_ERR_DB_WRITE);
+            rc = ERR_DB_FILE;
+        }
+    }
+    if (rc != NO_ERROR)
+        goto done;
+
+    // new names first, then whoever takes an old shard's lock from here on
+    // reads the new layout, then the names both layouts use
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass == 1 && write_manifest(num) < 0) {
+            printf(M_ERR_DB_CREATE);
+            rc = ERR_DB_FILE;
+            goto done;
+        }
+        for (int i = 0; i < num; i++) {
+            if (layout_has_path(map, next.paths[i]) != (pass == 1))
+                continue;
+            if (rename(next.tmp_paths[i], next.paths[i]) == -1) {
+                printf(M_ERR_DB_CREATE);
+                rc = ERR_DB_FILE;
+                goto done;
+            }
+        }
+    }
+
+    // processes still holding an old shard learn it is gone, the names the
+    // new layout did not take over are removed
+    for (int i = 0; i < map->num; i++)
+        retire_db_file(map->fds[i]);
+    close_shards(map);
+    for (int i = 0; i < map->num; i++) {
+        if (!layout_has_path(&next, map->paths[i]))
+            unlink(map->paths[i]);
+    }
+
+    *map = next;
+    printf(M_DB_RESHARDED, num);
+
+done:
+    free_scans(scans);
+    if (rc != NO_ERROR) {
+        close_shards(&next);
+        for (int i = 0; i < num; i++)
+            unlink(next.tmp_paths[i]);
+    }
+    return rc;
+}
@@ -0,0 +1,325 @@
+/**
+	@file
+	@Description
+	Point in time snapshots for the scanners.  Writers bump the generation
+	in the slot 0 header before and after changing a file (a sequence
+	lock), readers copy the file into memory and keep the copy only if the
+	generation did not move while they were copying.  Long reports then
+	format from memory without ever holding a lock, and writers are never
+	blocked by readers.
+**/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/file.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <sched.h>
+#include <time.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+#include "sdbstats.h"
+
+//number of records pulled in with a single pread() while copying a file
+#define SNAP_CHUNK_RECS     256
+
+/*
+ *  is_student_record
+ *      s:  a slot read from the database
+ *
+ *  returns:  true if the slot holds a student, false if it is empty,
+ *            deleted or the slot 0 header
+ */
+bool is_student_record(const student_t *s)
+{
+    return s->id != DELETED_STUDENT_ID &&
+           memcmp(s, &EMPTY_STUDENT_RECORD, STUDENT_RECORD_SIZE) != 0;
+}
+
+/*
+ *  read_db_header
+ *      fd:   linux file descriptor
+ *      hdr:  where the header is copied
+ *
+ *  A file without a header, for instance a new or freshly compressed one,
+ *  gets an initialized header at generation 0 with no flags set.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+int read_db_header(int fd, db_header_t *hdr)
+{
+    ssize_t bytes_read = SDB_PREAD(fd, hdr, sizeof(db_header_t), 0);
+
+    if (bytes_read < 0)
+        return ERR_DB_FILE;
+
+    if (bytes_read != sizeof(db_header_t) || hdr->magic != DB_HEADER_MAGIC) {
+        memset(hdr, 0, sizeof(db_header_t));
+        hdr->id = DELETED_STUDENT_ID;
+        hdr->magic = DB_HEADER_MAGIC;
+    }
+    return NO_ERROR;
+}
+
+static int read_db_gen(int fd, unsigned int *gen)
+{
+    db_header_t hdr;
+
+    if (read_db_header(fd, &hdr) < 0)
+        return ERR_DB_FILE;
+    *gen = hdr.gen;
+    return NO_ERROR;
+}
+
+//a random name for a file, never 0 which is what a file with no header has
+static unsigned int new_file_id(void)
+{
+    struct timespec now;
+    unsigned int file_id;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    file_id = (unsigned int)(now.tv_sec ^ now.tv_nsec ^ ((long)getpid() << 16));
+    return (file_id != 0) ? file_id : 1;
+}
+
+static int bump_db_gen(int fd)
+{
+    db_header_t hdr;
+
+    if (read_db_header(fd, &hdr) < 0)
+        return ERR_DB_FILE;
+
+    // the first write names the file
+    if (hdr.file_id == 0)
+        hdr.file_id = new_file_id();
+    hdr.gen++;
+    if (SDB_PWRITE(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+        return ERR_DB_FILE;
+    return NO_ERROR;
+}
+
+/*
+ *  init_db_header
+ *      fd:     linux file descriptor of a file just created or emptied
+ *      flags:  DB_FLAG_* the file starts with
+ *
+ *  Writes a header at generation 0 under a new file_id.  Compress, reshard
+ *  and -z call it on every file they rewrite, so the rewritten file never
+ *  reads as the (0, 0) of a file with no header and a block cached from
+ *  the old contents can not match it.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+int init_db_header(int fd, unsigned int flags)
+{
+    db_header_t hdr = {0};
+
+    hdr.id = DELETED_STUDENT_ID;
+    hdr.magic = DB_HEADER_MAGIC;
+    hdr.flags = flags;
+    hdr.file_id = new_file_id();
+    if (SDB_PWRITE(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+        return ERR_DB_FILE;
+    return NO_ERROR;
+}
+
+/*
+ *  begin_db_write
+ *  end_db_write
+ *      fd:  linux file descriptor, the caller must hold the write lock
+ *
+ *  Bracket every change to a database file.  The generation is odd in
+ *  between, which tells snapshot_db() that the file is being changed.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+int begin_db_write(int fd)
+{
+    return bump_db_gen(fd);
+}
+
+int end_db_write(int fd)
+{
+    return bump_db_gen(fd);
+}
+
+/*
+ *  retire_db_file
+ *      fd:  linux file descriptor, the caller must hold the write lock
+ *
+ *  Marks a file that compress or reshard has replaced under its name with
+ *  DB_FLAG_STALE.  Processes that still have it open, libsdb handles in
+ *  particular, see the flag on their next header read and reopen the name.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+int retire_db_file(int fd)
+{
+    db_header_t hdr;
+
+    if (begin_db_write(fd) < 0 || read_db_header(fd, &hdr) < 0)
+        return ERR_DB_FILE;
+
+    hdr.flags |= DB_FLAG_STALE;
+    if (SDB_PWRITE(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+        return ERR_DB_FILE;
+    return end_db_write(fd);
+}
+
+/*
+ *  copy_range
+ *
+ *  Copies the non empty records of ids [lo, hi] into *recs (when collect
+ *  is set) and counts them.  *recs is grown as needed and *count starts
+ *  over at zero.  With crc_on, records that fail their checksum are left
+ *  out and counted in *corrupt instead.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int copy_range(int fd, int lo, int hi, bool collect, bool crc_on,
+                      student_t **recs, int *count, int *cap, int *corrupt)
+{
+    student_t buff[SNAP_CHUNK_RECS];
+    bool bad[SNAP_CHUNK_RECS] = {false};
+    off_t offset = (off_t)lo * STUDENT_RECORD_SIZE;
+    off_t end = ((off_t)hi + 1) * STUDENT_RECORD_SIZE;
+
+    *count = 0;
+    *corrupt = 0;
+    while (offset < end) {
+        size_t want = sizeof(buff);
+        if ((off_t)want > end - offset)
+            want = end - offset;
+
+        ssize_t bytes_read = SDB_PREAD(fd, buff, want, offset);
+        if (bytes_read == 0)
+            break;
+        if (bytes_read < 0 || bytes_read % STUDENT_RECORD_SIZE != 0)
+            return ERR_DB_FILE;
+
+        int n = bytes_read / STUDENT_RECORD_SIZE;
+        if (crc_on) {
+            int rc = check_range_crc(fd, offset / STUDENT_RECORD_SIZE, n, buff, bad);
+            if (rc < 0)
+                return rc;
+            *corrupt += rc;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (!is_student_record(&buff[i]) || bad[i])
+                continue;
+
+            if (collect) {
+                if (*count == *cap) {
+                    int new_cap = *cap ? *cap * 2 : SNAP_CHUNK_RECS;
+                    student_t *grown = realloc(*recs, new_cap * sizeof(student_t));
+                    if (grown == NULL)
+                        return ERR_DB_FILE;
+                    *recs = grown;
+                    *cap = new_cap;
+                }
+                (*recs)[*count] = buff[i];
+            }
+            (*count)++;
+        }
+        offset += bytes_read;
+    }
+
+    return NO_ERROR;
+}
+
+/*
+ *  snapshot_db
+ *      fd:       linux file descriptor
+ *      lo, hi:   range of student ids to copy
+ *      collect:  true to keep copies of the records, false to only count
+ *      recs:     set to a malloc()ed array of the records, caller frees it
+ *      count:    set to the number of records
+ *
+ *  Takes a consistent copy of the records in [lo, hi].  The copy is
+ *  retried while writers are active and, if they keep the file busy for
+ *  DB_SNAP_RETRIES attempts, falls back to copying under a shared lock.
+ *  Files replaced by compress_db() are not a problem, fd keeps referring
+ *  to the file as it was when it was opened.  Records that fail their
+ *  checksum are left out of the copy, the caller decides how to report
+ *  them.
+ *
+ *  returns:  <number>     the number of corrupt records skipped
+ *            ERR_DB_FILE  database file I/O issue
+ */
+int snapshot_db(int fd, int lo, int hi, bool collect, student_t **recs, int *count)
+{
+    db_header_t hdr;
+    unsigned int after;
+    int corrupt = 0;
+    int cap = 0;
+    int rc;
+
+    *recs = NULL;
+    *count = 0;
+
+    for (int attempt = 0; attempt < DB_SNAP_RETRIES; attempt++) {
+        if (read_db_header(fd, &hdr) < 0)
+            return ERR_DB_FILE;
+        if (hdr.gen & 1) {
+            sched_yield();
+            continue;
+        }
+
+        rc = copy_range(fd, lo, hi, collect, hdr.flags & DB_FLAG_CRC,
+                        recs, count, &cap, &corrupt);
+        if (rc < 0)
+            return rc;
+
+        if (read_db_gen(fd, &after) < 0)
+            return ERR_DB_FILE;
+        if (hdr.gen == after)
+            goto done;
+    }
+
+    if (SDB_FLOCK(fd, LOCK_SH) == -1)
+        return ERR_DB_FILE;
+    rc = read_db_header(fd, &hdr);
+    if (rc == NO_ERROR)
+        rc = copy_range(fd, lo, hi, collect, hdr.flags & DB_FLAG_CRC,
+                        recs, count, &cap, &corrupt);
+    SDB_FLOCK(fd, LOCK_UN);
+    if (rc < 0)
+        return rc;
+
+done:
+    return corrupt;
+}
+
+/*
+ *  snapshot_locked_db
+ *      same arguments as snapshot_db()
+ *
+ *  snapshot_db() for a caller that already holds a lock on fd, shared or
+ *  exclusive.  Writers are kept out, so the records are copied once and
+ *  the lock is never touched: flock() on an fd that holds LOCK_EX would
+ *  turn it into a shared lock, and LOCK_UN would drop it.
+ *
+ *  returns:  <number>     the number of corrupt records skipped
+ *            ERR_DB_FILE  database file I/O issue
+ */
+int snapshot_locked_db(int fd, int lo, int hi, bool collect, student_t **recs, int *count)
+{
+    db_header_t hdr;
+    int corrupt = 0;
+    int cap = 0;
+    int rc;
+
+    *recs = NULL;
+    *count = 0;
+
+    rc = read_db_header(fd, &hdr);
+    if (rc == NO_ERROR)
+        rc = copy_range(fd, lo, hi, collect, hdr.flags & DB_FLAG_CRC,
+                        recs, count, &cap, &corrupt);
+    return (rc < 0) ? rc : corrupt;
+}
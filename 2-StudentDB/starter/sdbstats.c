@@ -0,0 +1,247 @@
+/**
+	@file
+	@Description
+	Per operation latency and syscall counters for sdbsc, see sdbstats.h.
+	All counters are updated with relaxed atomics because the shard
+	scanners issue reads from several threads at once.
+**/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/file.h>
+
+#include "sdbstats.h"
+
+bool sdb_stats_on = false;
+
+typedef struct stats_ctr {
+    uint64_t calls;
+    uint64_t bytes;
+    uint64_t ns;
+} stats_ctr_t;
+
+//phase ST_PHASES collects anything issued outside of STATS_PHASE()
+static stats_ctr_t phase_ctr[ST_PHASES + 1];
+static stats_ctr_t call_ctr[ST_PHASES + 1][SC_CALLS];
+static int cur_phase = ST_PHASES;
+static char *json_file = NULL;
+
+static const char *phase_names[ST_PHASES + 1] = {
+    "open", "get", "add", "del", "count", "print", "compress", "reshard", "search", "zero",
+    "other",
+};
+
+static const char *call_names[SC_CALLS] = {
+    "open", "lseek", "read", "write", "pread", "pwrite", "flock", "printf",
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void ctr_add(stats_ctr_t *ctr, uint64_t bytes, uint64_t ns)
+{
+    __atomic_fetch_add(&ctr->calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&ctr->bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&ctr->ns, ns, __ATOMIC_RELAXED);
+}
+
+static void call_done(stats_call_t call, ssize_t rc, uint64_t start)
+{
+    int phase = __atomic_load_n(&cur_phase, __ATOMIC_RELAXED);
+
+    ctr_add(&call_ctr[phase][call], rc > 0 ? (uint64_t)rc : 0, now_ns() - start);
+}
+
+/*
+ *  stats_report
+ *
+ *  atexit() handler that prints the counters, as a table on stderr or as
+ *  JSON when a file name was given.
+ */
+static void stats_report(void)
+{
+    FILE *out = stderr;
+
+    fflush(stdout);
+    if (json_file != NULL) {
+        out = fopen(json_file, "w");
+        if (out == NULL) {
+            perror(json_file);
+            return;
+        }
+
+        fprintf(out, "{\"phases\": {");
+        for (int p = 0, first = 1; p <= ST_PHASES; p++) {
+            if (phase_ctr[p].calls == 0 && p != ST_PHASES)
+                continue;
+            fprintf(out, "%s\n  \"%s\": {\"calls\": %lu, \"ns\": %lu, \"syscalls\": {",
+                    first ? "" : ",", phase_names[p],
+                    phase_ctr[p].calls, phase_ctr[p].ns);
+            for (int c = 0, cfirst = 1; c < SC_CALLS; c++) {
+                stats_ctr_t *ctr = &call_ctr[p][c];
+                if (ctr->calls == 0)
+                    continue;
+                fprintf(out, "%s\"%s\": {\"calls\": %lu, \"bytes\": %lu, \"ns\": %lu}",
+                        cfirst ? "" : ", ", call_names[c],
+                        ctr->calls, ctr->bytes, ctr->ns);
+                cfirst = 0;
+            }
+            fprintf(out, "}}");
+            first = 0;
+        }
+        fprintf(out, "\n}}\n");
+        fclose(out);
+        return;
+    }
+
+    fprintf(out, "%-10s %-8s %10s %12s %12s\n", "PHASE", "CALL", "COUNT", "BYTES", "USEC");
+    for (int p = 0; p <= ST_PHASES; p++) {
+        if (phase_ctr[p].calls > 0)
+            fprintf(out, "%-10s %-8s %10lu %12s %12.1f\n", phase_names[p], "-",
+                    phase_ctr[p].calls, "-", phase_ctr[p].ns / 1000.0);
+        for (int c = 0; c < SC_CALLS; c++) {
+            stats_ctr_t *ctr = &call_ctr[p][c];
+            if (ctr->calls == 0)
+                continue;
+            fprintf(out, "%-10s %-8s %10lu %12lu %12.1f\n", phase_names[p], call_names[c],
+                    ctr->calls, ctr->bytes, ctr->ns / 1000.0);
+        }
+    }
+}
+
+/*
+ *  stats_init
+ *      argc, argv:  the programs arguments
+ *
+ *  Turns on instrumentation if --stats[=file] is on the command line or
+ *  STATS_ENV_VAR is set.  The flag is removed from argv so the rest of
+ *  main() never sees it.
+ *
+ *  returns:  nothing, this is a void function
+ */
+void stats_init(int *argc, char *argv[])
+{
+    char *env = getenv(STATS_ENV_VAR);
+    int flag_len = strlen(STATS_FLAG);
+    int out = 1;
+
+    if (env != NULL && *env != '\0') {
+        sdb_stats_on = true;
+        if (strcmp(env, "1") != 0)
+            json_file = env;
+    }
+
+    for (int i = 1; i < *argc; i++) {
+        if (strncmp(argv[i], STATS_FLAG, flag_len) == 0 &&
+            (argv[i][flag_len] == '\0' || argv[i][flag_len] == '=')) {
+            sdb_stats_on = true;
+            json_file = argv[i][flag_len] == '=' ? argv[i] + flag_len + 1 : NULL;
+            continue;
+        }
+        argv[out++] = argv[i];
+    }
+    *argc = out;
+    argv[out] = NULL;
+
+    if (sdb_stats_on)
+        atexit(stats_report);
+}
+
+uint64_t stats_enter(stats_phase_t phase)
+{
+    __atomic_store_n(&cur_phase, phase, __ATOMIC_RELAXED);
+    return now_ns();
+}
+
+void stats_leave(stats_phase_t phase, uint64_t start)
+{
+    ctr_add(&phase_ctr[phase], 0, now_ns() - start);
+    __atomic_store_n(&cur_phase, ST_PHASES, __ATOMIC_RELAXED);
+}
+
+int stats_open(const char *path, int flags, mode_t mode)
+{
+    uint64_t start = now_ns();
+    int rc = sdb_direct_on ? dio_open(path, flags, mode) : open(path, flags, mode);
+
+    call_done(SC_OPEN, 0, start);
+    return rc;
+}
+
+off_t stats_lseek(int fd, off_t offset, int whence)
+{
+    uint64_t start = now_ns();
+    off_t rc = lseek(fd, offset, whence);
+
+    call_done(SC_LSEEK, 0, start);
+    return rc;
+}
+
+ssize_t stats_read(int fd, void *buf, size_t len)
+{
+    uint64_t start = now_ns();
+    ssize_t rc = read(fd, buf, len);
+
+    call_done(SC_READ, rc, start);
+    return rc;
+}
+
+ssize_t stats_write(int fd, const void *buf, size_t len)
+{
+    uint64_t start = now_ns();
+    ssize_t rc = write(fd, buf, len);
+
+    call_done(SC_WRITE, rc, start);
+    return rc;
+}
+
+ssize_t stats_pread(int fd, void *buf, size_t len, off_t offset)
+{
+    uint64_t start = now_ns();
+    ssize_t rc = sdb_direct_on ? dio_pread(fd, buf, len, offset) : pread(fd, buf, len, offset);
+
+    call_done(SC_PREAD, rc, start);
+    return rc;
+}
+
+ssize_t stats_pwrite(int fd, const void *buf, size_t len, off_t offset)
+{
+    uint64_t start = now_ns();
+    ssize_t rc = sdb_direct_on ? dio_pwrite(fd, buf, len, offset) : pwrite(fd, buf, len, offset);
+
+    call_done(SC_PWRITE, rc, start);
+    return rc;
+}
+
+int stats_flock(int fd, int how)
+{
+    uint64_t start = now_ns();
+    int rc = sdb_direct_on ? dio_flock(fd, how) : flock(fd, how);
+
+    call_done(SC_FLOCK, 0, start);
+    return rc;
+}
+
+int stats_printf(const char *fmt, ...)
+{
+    uint64_t start = now_ns();
+    va_list args;
+    int rc;
+
+    va_start(args, fmt);
+    rc = vprintf(fmt, args);
+    va_end(args);
+
+    call_done(SC_PRINTF, rc, start);
+    return rc;
+}
@@ -0,0 +1,88 @@
+#ifndef __SDB_STATS_H__
+    #define __SDB_STATS_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "sdbdio.h"
+
+//Optional instrumentation enabled with --stats[=file.json] or by setting the
+//SDBSC_STATS environment variable ("1" for stderr, anything else is the
+//name of a JSON file).  When it is off every wrapper below is a single
+//predictable branch in front of the plain system call.
+#define STATS_ENV_VAR   "SDBSC_STATS"
+#define STATS_FLAG      "--stats"
+
+//the operation the syscalls are charged to.  main() sets this around each
+//call into the database, see STATS_PHASE()
+typedef enum {
+    ST_OPEN,
+    ST_GET,
+    ST_ADD,
+    ST_DEL,
+    ST_COUNT,
+    ST_PRINT,
+    ST_COMPRESS,
+    ST_RESHARD,
+    ST_SEARCH,
+    ST_ZERO,
+    ST_PHASES,
+} stats_phase_t;
+
+//what is counted inside each phase
+typedef enum {
+    SC_OPEN,
+    SC_LSEEK,
+    SC_READ,
+    SC_WRITE,
+    SC_PREAD,
+    SC_PWRITE,
+    SC_FLOCK,
+    SC_PRINTF,
+    SC_CALLS,
+} stats_call_t;
+
+extern bool sdb_stats_on;
+
+void stats_init(int *argc, char *argv[]);
+uint64_t stats_enter(stats_phase_t phase);
+void stats_leave(stats_phase_t phase, uint64_t start);
+
+int stats_open(const char *path, int flags, mode_t mode);
+off_t stats_lseek(int fd, off_t offset, int whence);
+ssize_t stats_read(int fd, void *buf, size_t len);
+ssize_t stats_write(int fd, const void *buf, size_t len);
+ssize_t stats_pread(int fd, void *buf, size_t len, off_t offset);
+ssize_t stats_pwrite(int fd, const void *buf, size_t len, off_t offset);
+int stats_flock(int fd, int how);
+int stats_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+//the calls that can land on a direct file go through the block layer when
+//direct I/O is on, see sdbdio.h
+#define SDB_OPEN(p, f, m)       (sdb_stats_on ? stats_open(p, f, m) :              \
+                                 sdb_direct_on ? dio_open(p, f, m) : open(p, f, m))
+#define SDB_LSEEK(fd, o, w)     (sdb_stats_on ? stats_lseek(fd, o, w) : lseek(fd, o, w))
+#define SDB_READ(fd, b, n)      (sdb_stats_on ? stats_read(fd, b, n) : read(fd, b, n))
+#define SDB_WRITE(fd, b, n)     (sdb_stats_on ? stats_write(fd, b, n) : write(fd, b, n))
+#define SDB_PREAD(fd, b, n, o)  (sdb_stats_on ? stats_pread(fd, b, n, o) :         \
+                                 sdb_direct_on ? dio_pread(fd, b, n, o) : pread(fd, b, n, o))
+#define SDB_PWRITE(fd, b, n, o) (sdb_stats_on ? stats_pwrite(fd, b, n, o) :        \
+                                 sdb_direct_on ? dio_pwrite(fd, b, n, o) : pwrite(fd, b, n, o))
+#define SDB_FLOCK(fd, how)      (sdb_stats_on ? stats_flock(fd, how) :             \
+                                 sdb_direct_on ? dio_flock(fd, how) : flock(fd, how))
+#define SDB_PRINTF(...)         (sdb_stats_on ? stats_printf(__VA_ARGS__) : printf(__VA_ARGS__))
+
+//charge everything stmt does to phase
+#define STATS_PHASE(phase, stmt)                        \
+    do {                                                \
+        if (sdb_stats_on) {                             \
+            uint64_t _stats_start = stats_enter(phase); \
+            stmt;                                       \
+            stats_leave(phase, _stats_start);           \
+        } else {                                        \
+            stmt;                                       \
+        }                                               \
+    } while (0)
+
+#endif
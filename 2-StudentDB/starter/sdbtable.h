@@ -0,0 +1,251 @@
+#ifndef __SDB_TABLE_H__
+    #define __SDB_TABLE_H__
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#include "sdbsc.h"
+#include "sdbstats.h"
+
+//Generic fixed-record table engine.  A record type is described once as a
+//schema X-macro that lists its fields with two field kinds, for example:
+//
+//  #define COURSE_SCHEMA(INT, STR)  INT(id) STR(code, 12) INT(credits)
+//
+//SDB_DECLARE_RECORD() turns the schema into a struct and SDB_DEFINE_TABLE()
+//generates get/add/del/scan/compress/print/parse functions for it.  Every
+//table uses the same sparse layout as student.db: the record with key id
+//lives at id * sizeof(record), an all zero record is an empty slot and the
+//key must be the int field named id.  Like MIN_STD_ID and MAX_STD_ID for
+//students, each table has an id range that keeps its file to a known size,
+//ids outside it are never read or written.  All of the generated code is
+//static inline and works on a concrete type and size, so the compiler
+//specializes it exactly like the hand written student_t functions.
+
+//number of records read per pread() by the scanners
+#define SDB_TABLE_SCAN_RECS     64
+
+#define SDB_STRUCT_INT(n)       int n;
+#define SDB_STRUCT_STR(n, len)  char n[len];
+
+#define SDB_DECLARE_RECORD(type, SCHEMA)                                    \
+    typedef struct {                                                        \
+        SCHEMA(SDB_STRUCT_INT, SDB_STRUCT_STR)                              \
+    } type;                                                                 \
+    _Static_assert(offsetof(type, id) == 0, #type ": id must come first");  \
+    _Static_assert(4096 % sizeof(type) == 0,                                \
+                   #type ": records must not straddle a 4K block")
+
+//field expansions used by the generated print and parse functions
+#define SDB_HDR_INT(n)          SDB_PRINTF("%-10s ", #n);
+#define SDB_HDR_STR(n, len)     SDB_PRINTF("%-*s ", (len), #n);
+#define SDB_PRINT_INT(n)        SDB_PRINTF("%-10d ", r->n);
+#define SDB_PRINT_STR(n, len)   SDB_PRINTF("%-*.*s ", (len), (len), r->n);
+#define SDB_COUNT_INT(n)        + 1
+#define SDB_COUNT_STR(n, len)   + 1
+#define SDB_PARSE_INT(n)        if (sdb_parse_int(argv[i++], &r->n) < 0)    \
+                                    return ERR_DB_OP;
+#define SDB_PARSE_STR(n, len)   strncpy(r->n, argv[i++], (len) - 1);
+
+//Parses arg as a whole decimal number that fits an int into *v.
+//Returns NO_ERROR or ERR_DB_OP.
+static inline int sdb_parse_int(const char *arg, int *v)
+{
+    char *end;
+    long n;
+
+    errno = 0;
+    n = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || errno == ERANGE || n < INT_MIN || n > INT_MAX)
+        return ERR_DB_OP;
+    *v = (int)n;
+    return NO_ERROR;
+}
+
+//Opens the table file named file, creating it if needed.  Tables are small
+//and always buffered, --direct only applies to the student record files.
+//Returns the fd, or ERR_DB_FILE after printing M_ERR_DB_OPEN.
+static inline int sdb_table_open(const char *file)
+{
+    int fd = SDB_OPEN(file, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+
+    if (fd < 0) {
+        printf(M_ERR_DB_OPEN);
+        return ERR_DB_FILE;
+    }
+    return fd;
+}
+
+//Takes lock how on *fd, the table file named file.  Compress renames a new
+//file over the name, so once the lock is granted the name is checked again
+//and the file now under it is opened and locked instead if it moved.
+//Returns NO_ERROR or ERR_DB_FILE, *fd is -1 if the reopen failed.
+static inline int sdb_table_lock(int *fd, const char *file, int how)
+{
+    struct stat held, on_disk;
+
+    while (1) {
+        if (SDB_FLOCK(*fd, how) == -1 || fstat(*fd, &held) == -1)
+            return ERR_DB_FILE;
+        if (stat(file, &on_disk) == 0 &&
+            held.st_ino == on_disk.st_ino && held.st_dev == on_disk.st_dev)
+            return NO_ERROR;
+
+        SDB_CLOSE(*fd);
+        *fd = SDB_OPEN(file, O_RDWR, 0);
+        if (*fd < 0)
+            return ERR_DB_FILE;
+    }
+}
+
+#define SDB_DEFINE_TABLE(name, type, SCHEMA, min_id, max_id)                \
+                                                                            \
+static const int name##_nfields = 0 SCHEMA(SDB_COUNT_INT, SDB_COUNT_STR);   \
+static const int name##_min_id = (min_id);                                  \
+static const int name##_max_id = (max_id);                                  \
+                                                                            \
+static inline int name##_valid_id(int id)                                   \
+{                                                                           \
+    return id >= name##_min_id && id <= name##_max_id;                      \
+}                                                                           \
+                                                                            \
+static inline off_t name##_offset(int id)                                   \
+{                                                                           \
+    return (off_t)id * sizeof(type);                                        \
+}                                                                           \
+                                                                            \
+static inline int name##_is_empty(const type *r)                            \
+{                                                                           \
+    static const type empty;                                                \
+    return memcmp(r, &empty, sizeof(type)) == 0;                            \
+}                                                                           \
+                                                                            \
+static inline int name##_get(int fd, int id, type *r)                       \
+{                                                                           \
+    ssize_t n;                                                              \
+    if (!name##_valid_id(id))                                               \
+        return SRCH_NOT_FOUND;                                              \
+    n = SDB_PREAD(fd, r, sizeof(type), name##_offset(id));                  \
+    if (n == 0)                                                             \
+        return SRCH_NOT_FOUND;                                              \
+    if (n != (ssize_t)sizeof(type))                                         \
+        return ERR_DB_FILE;                                                 \
+    if (name##_is_empty(r) || r->id != id)                                  \
+        return SRCH_NOT_FOUND;                                              \
+    return NO_ERROR;                                                        \
+}                                                                           \
+                                                                            \
+static inline int name##_add(int fd, const type *r)                         \
+{                                                                           \
+    type existing;                                                          \
+    int rc;                                                                 \
+    if (!name##_valid_id(r->id))                                            \
+        return ERR_DB_OP;                                                   \
+    rc = name##_get(fd, r->id, &existing);                                  \
+    if (rc == NO_ERROR)                                                     \
+        return ERR_DB_OP;                                                   \
+    if (rc != SRCH_NOT_FOUND)                                               \
+        return rc;                                                          \
+    if (SDB_PWRITE(fd, r, sizeof(type), name##_offset(r->id)) !=            \
+        (ssize_t)sizeof(type))                                              \
+        return ERR_DB_FILE;                                                 \
+    return NO_ERROR;                                                        \
+}                                                                           \
+                                                                            \
+static inline int name##_del(int fd, int id)                                \
+{                                                                           \
+    static const type empty;                                                \
+    type existing;                                                          \
+    int rc = name##_get(fd, id, &existing);                                 \
+    if (rc != NO_ERROR)                                                     \
+        return rc;                                                          \
+    if (SDB_PWRITE(fd, &empty, sizeof(type), name##_offset(id)) !=          \
+        (ssize_t)sizeof(type))                                              \
+        return ERR_DB_FILE;                                                 \
+    return NO_ERROR;                                                        \
+}                                                                           \
+                                                                            \
+/* calls visit on every non empty record, stops early if visit != 0 */     \
+static inline int name##_scan(int fd,                                       \
+                              int (*visit)(const type *r, void *arg),       \
+                              void *arg)                                    \
+{                                                                           \
+    type buff[SDB_TABLE_SCAN_RECS];                                         \
+    off_t offset = 0;                                                       \
+    while (1) {                                                             \
+        ssize_t n = SDB_PREAD(fd, buff, sizeof(buff), offset);              \
+        if (n == 0)                                                         \
+            return NO_ERROR;                                                \
+        if (n < 0 || n % sizeof(type) != 0)                                 \
+            return ERR_DB_FILE;                                             \
+        for (size_t i = 0; i < n / sizeof(type); i++) {                     \
+            if (!name##_is_empty(&buff[i]) && visit(&buff[i], arg) != 0)    \
+                return NO_ERROR;                                            \
+        }                                                                   \
+        offset += n;                                                        \
+    }                                                                       \
+}                                                                           \
+                                                                            \
+static inline int name##_copy_to(const type *r, void *arg)                  \
+{                                                                           \
+    int tmp_fd = *(int *)arg;                                               \
+    if (SDB_PWRITE(tmp_fd, r, sizeof(type), name##_offset(r->id)) !=        \
+        (ssize_t)sizeof(type))                                              \
+        return -1;                                                          \
+    return 0;                                                               \
+}                                                                           \
+                                                                            \
+/* same approach as compress_db_file(), returns the new fd and closes       \
+   fd in every case */                                                      \
+static inline int name##_compress(int fd, const char *db_file,              \
+                                  const char *tmp_file)                     \
+{                                                                           \
+    int tmp_fd = SDB_OPEN(tmp_file, O_RDWR | O_CREAT | O_TRUNC,             \
+                          S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);           \
+    int rc;                                                                 \
+    if (tmp_fd < 0) {                                                       \
+        SDB_CLOSE(fd);                                                      \
+        return ERR_DB_FILE;                                                 \
+    }                                                                       \
+    rc = name##_scan(fd, name##_copy_to, &tmp_fd);                          \
+    SDB_CLOSE(tmp_fd);                                                      \
+    if (rc != NO_ERROR || rename(tmp_file, db_file) == -1) {                \
+        unlink(tmp_file);                                                   \
+        SDB_CLOSE(fd);                                                      \
+        return ERR_DB_FILE;                                                 \
+    }                                                                       \
+    SDB_CLOSE(fd);                                                          \
+    return SDB_OPEN(db_file, O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);\
+}                                                                           \
+                                                                            \
+static inline void name##_print_hdr(void)                                   \
+{                                                                           \
+    SCHEMA(SDB_HDR_INT, SDB_HDR_STR)                                        \
+    SDB_PRINTF("\n");                                                       \
+}                                                                           \
+                                                                            \
+static inline void name##_print(const type *r)                              \
+{                                                                           \
+    SCHEMA(SDB_PRINT_INT, SDB_PRINT_STR)                                    \
+    SDB_PRINTF("\n");                                                       \
+}                                                                           \
+                                                                            \
+/* fills r from one command line argument per field, in schema order,       \
+   returns ERR_DB_OP if an int field is not a number */                     \
+static inline int name##_parse(type *r, char *argv[])                       \
+{                                                                           \
+    int i = 0;                                                              \
+    memset(r, 0, sizeof(type));                                             \
+    SCHEMA(SDB_PARSE_INT, SDB_PARSE_STR)                                    \
+    return NO_ERROR;                                                        \
+}
+
+#endif
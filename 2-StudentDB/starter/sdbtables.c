@@ -0,0 +1,181 @@
+/**
+	@file
+	@Description
+	Command line front end for the tables built with the generic table
+	engine in sdbtable.h.  Adding a table means adding a schema to
+	tables.h and one SDB_TABLE_CMD() plus one line in the table list below.
+**/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <sys/file.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+#include "tables.h"
+
+static int print_one(const void *r, void *arg);
+
+//generates name_cmd(), the handler for one table's operations:
+//  a field...  add a record, one argument per schema field
+//  f id        find and print a record
+//  d id        delete a record
+//  c           count the records
+//  p           print all records
+//  x           compress the table file
+//ids outside the table's range are turned away before the file is opened
+#define SDB_TABLE_CMD(name, type, SCHEMA, min_id, max_id, file, tmp_file)   \
+SDB_DEFINE_TABLE(name, type, SCHEMA, min_id, max_id)                        \
+                                                                            \
+static int name##_count_one(const type *r, void *arg)                       \
+{                                                                           \
+    (void)r;                                                                \
+    (*(int *)arg)++;                                                        \
+    return 0;                                                               \
+}                                                                           \
+                                                                            \
+static int name##_print_one(const type *r, void *arg)                       \
+{                                                                           \
+    if (print_one(r, arg))                                                  \
+        name##_print_hdr();                                                 \
+    name##_print(r);                                                        \
+    return 0;                                                               \
+}                                                                           \
+                                                                            \
+static int name##_cmd(char op, int argc, char *argv[])                      \
+{                                                                           \
+    type rec;                                                               \
+    int count = 0;                                                          \
+    int fd, how, id = 0, rc = NO_ERROR;                                     \
+                                                                            \
+    if ((op == 'a' && argc != name##_nfields) ||                            \
+        ((op == 'f' || op == 'd') && argc != 1))                            \
+        return EXIT_FAIL_ARGS;                                              \
+    /* the id comes first for a, f and d */                                 \
+    if ((op == 'a' || op == 'f' || op == 'd') &&                            \
+        (sdb_parse_int(argv[0], &id) < 0 || !name##_valid_id(id))) {        \
+        printf(M_ERR_REC_RNG, #name, argv[0], name##_min_id, name##_max_id);\
+        return EXIT_FAIL_ARGS;                                              \
+    }                                                                       \
+    if (op == 'a' && name##_parse(&rec, argv) < 0)                          \
+        return EXIT_FAIL_ARGS;                                              \
+                                                                            \
+    fd = sdb_table_open(file);                                              \
+    if (fd < 0)                                                             \
+        return EXIT_FAIL_DB;                                                \
+    how = (op == 'a' || op == 'd' || op == 'x') ? LOCK_EX : LOCK_SH;        \
+    if (sdb_table_lock(&fd, file, how) < 0) {                               \
+        if (fd >= 0)                                                        \
+            SDB_CLOSE(fd);                                                  \
+        printf(M_ERR_DB_READ);                                              \
+        return EXIT_FAIL_DB;                                                \
+    }                                                                       \
+                                                                            \
+    switch (op) {                                                           \
+    case 'a':                                                               \
+        rc = name##_add(fd, &rec);                                          \
+        if (rc == NO_ERROR)                                                 \
+            printf(M_REC_ADDED, #name, rec.id);                             \
+        else if (rc == ERR_DB_OP)                                           \
+            printf(M_ERR_REC_DUP, #name, rec.id);                           \
+        break;                                                              \
+    case 'f':                                                               \
+        rc = name##_get(fd, id, &rec);                                      \
+        if (rc == NO_ERROR) {                                               \
+            name##_print_hdr();                                             \
+            name##_print(&rec);                                             \
+        }                                                                   \
+        break;                                                              \
+    case 'd':                                                               \
+        rc = name##_del(fd, id);                                            \
+        if (rc == NO_ERROR)                                                 \
+            printf(M_REC_DEL_MSG, #name, id);                               \
+        break;                                                              \
+    case 'c':                                                               \
+        rc = name##_scan(fd, name##_count_one, &count);                     \
+        if (rc == NO_ERROR)                                                 \
+            printf(M_REC_CNT, #name, count);                                \
+        break;                                                              \
+    case 'p':                                                               \
+        rc = name##_scan(fd, name##_print_one, &count);                     \
+        if (rc == NO_ERROR && count == 0)                                   \
+            printf(M_REC_EMPTY, #name);                                     \
+        break;                                                              \
+    case 'x':                                                               \
+        fd = name##_compress(fd, file, tmp_file);                           \
+        rc = fd < 0 ? ERR_DB_FILE : NO_ERROR;                               \
+        if (rc == NO_ERROR)                                                 \
+            printf(M_DB_COMPRESSED_OK);                                     \
+        break;                                                              \
+    default:                                                                \
+        SDB_CLOSE(fd);                                                      \
+        return EXIT_FAIL_ARGS;                                              \
+    }                                                                       \
+                                                                            \
+    if (rc == SRCH_NOT_FOUND)                                               \
+        printf(M_REC_NOT_FND_MSG, #name, id);                               \
+    else if (rc == ERR_DB_FILE)                                             \
+        printf(M_ERR_DB_READ);                                              \
+    if (fd >= 0)                                                            \
+        SDB_CLOSE(fd);                                                      \
+    return rc == NO_ERROR ? EXIT_OK : EXIT_FAIL_DB;                         \
+}
+
+/*
+ *  print_one
+ *      r:    record about to be printed
+ *      arg:  pointer to the running count of printed records
+ *
+ *  Shared by the generated print callbacks so the header is only printed
+ *  in front of the first record.
+ *
+ *  returns:  true if r is the first record
+ */
+static int print_one(const void *r, void *arg)
+{
+    (void)r;
+    return (*(int *)arg)++ == 0;
+}
+
+SDB_TABLE_CMD(course, course_t, COURSE_SCHEMA, MIN_COURSE_ID, MAX_COURSE_ID,
+              COURSE_DB_FILE, TMP_COURSE_DB_FILE)
+SDB_TABLE_CMD(enrollment, enrollment_t, ENROLLMENT_SCHEMA, MIN_ENROLLMENT_ID, MAX_ENROLLMENT_ID,
+              ENROLLMENT_DB_FILE, TMP_ENROLLMENT_DB_FILE)
+
+static const struct {
+    const char *name;
+    int (*cmd)(char op, int argc, char *argv[]);
+} tables[] = {
+    { "course",     course_cmd },
+    { "enrollment", enrollment_cmd },
+};
+
+/*
+ *  table_cmd
+ *      argc, argv:  arguments following -T, i.e. table op [args...]
+ *
+ *  Runs one operation against one of the generic tables, see
+ *  SDB_TABLE_CMD() for the operations.
+ *
+ *  returns:  an EXIT_* code for the shell
+ *
+ *  console:  M_REC_* messages, M_ERR_TABLE for an unknown table
+ */
+int table_cmd(int argc, char *argv[])
+{
+    if (argc < 2 || argv[1][0] == '\0' || argv[1][1] != '\0')
+        return EXIT_FAIL_ARGS;
+
+    for (size_t i = 0; i < sizeof(tables) / sizeof(tables[0]); i++) {
+        if (strcmp(argv[0], tables[i].name) == 0)
+            return tables[i].cmd(argv[1][0], argc - 2, argv + 2);
+    }
+
+    printf(M_ERR_TABLE, argv[0]);
+    return EXIT_FAIL_ARGS;
+}
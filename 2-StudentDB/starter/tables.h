@@ -0,0 +1,39 @@
+#ifndef __TABLES_H__
+    #define __TABLES_H__
+
+#include "sdbtable.h"
+
+//Schemas for the extra tables served by the generic table engine in
+//sdbtable.h.  Each record size divides 4K, just like student_t.  The id
+//ranges cap the table files at 640KB and 32MB.
+
+//a course, 64 bytes
+#define COURSE_SCHEMA(INT, STR)     \
+    INT(id)                         \
+    STR(code, 12)                   \
+    STR(title, 44)                  \
+    INT(credits)
+
+#define MIN_COURSE_ID           1
+#define MAX_COURSE_ID           9999
+
+//a student enrolled in a course for a term, 32 bytes
+#define ENROLLMENT_SCHEMA(INT, STR) \
+    INT(id)                         \
+    INT(student_id)                 \
+    INT(course_id)                  \
+    STR(term, 12)                   \
+    STR(grade, 8)
+
+#define MIN_ENROLLMENT_ID       1
+#define MAX_ENROLLMENT_ID       999999
+
+SDB_DECLARE_RECORD(course_t, COURSE_SCHEMA);
+SDB_DECLARE_RECORD(enrollment_t, ENROLLMENT_SCHEMA);
+
+#define COURSE_DB_FILE          "course.db"
+#define TMP_COURSE_DB_FILE      ".tmp_course.db"
+#define ENROLLMENT_DB_FILE      "enrollment.db"
+#define TMP_ENROLLMENT_DB_FILE  ".tmp_enrollment.db"
+
+#endif
@@ -6,6 +6,9 @@ setup_file() {
     if [ -f "student.db" ]; then
         rm "student.db"
     fi
+    # and any shards left behind by a previous run
+    rm -f student.db.*
+    rm -f course.db enrollment.db
 }
 
 @test "Check if database is empty to start" {
@@ -191,4 +194,596 @@ setup_file() {
         echo "Failed Output:  $output"
         return 1
     }
-}
\ No newline at end of file
+}
+
+@test "Split db into shards" {
+    run ./sdbsc -n 4
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Database split into 4 shard(s)." ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+
+    run ./sdbsc -c
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Database contains 3 student record(s)." ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+}
+
+@test "Point operations on a sharded db" {
+    run ./sdbsc -a 75000 shard student 300
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Student 75000 added to database." ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+
+    run ./sdbsc -f 75000
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "75000 shard student 3.00" ] || {
+        echo "Failed Output:  $normalized_output"
+        return 1
+    }
+
+    run ./sdbsc -d 75000
+    [ "$status" -eq 0 ]
+
+    # the library opens single files, it must not recreate student.db
+    cat > libsdb_test.c <<'PROG'
+#include <stdio.h>
+#include "libsdb.h"
+
+int main(void)
+{
+    sdb_t *db;
+
+    printf("%s\n", sdb_strerror(sdb_open(&db, "student.db", NULL)));
+    return db != NULL;
+}
+PROG
+    run gcc -pthread -o libsdb_test libsdb_test.c libsdb.a
+    [ "$status" -eq 0 ]
+
+    run ./libsdb_test
+    rm -f libsdb_test libsdb_test.c
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "operation not allowed" ]
+    [ ! -f student.db ]
+}
+
+@test "Merge shards back into a single db" {
+    run ./sdbsc -n 1
+    [ "$status" -eq 0 ]
+    [ ! -f "student.db.manifest" ]
+
+    run ./sdbsc -p
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    expected_output="ID FIRST_NAME LAST_NAME GPA 1 john doe 3.45 3 jane doe 3.90 63 jim doe 2.85"
+    [ "$normalized_output" = "$expected_output" ] || {
+        echo "Failed Output: $normalized_output"
+        return 1
+    }
+}
+
+@test "Stats flag reports syscalls without changing output" {
+    run ./sdbsc -c --stats=stats.json
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Database contains 3 student record(s)." ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+
+    run grep -q '"count": {"calls": 1' stats.json
+    rm -f stats.json
+    [ "$status" -eq 0 ]
+}
+
+@test "Course table through the generic table engine" {
+    run ./sdbsc -T course a 283 CS283 Systems 4
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "course 283 added to database." ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+
+    run ./sdbsc -T course f 283
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "283 CS283 Systems 4 " ] || {
+        echo "Failed Output:  $normalized_output"
+        return 1
+    }
+
+    run stat --format="%s" ./course.db
+    [ "${lines[0]}" = "18176" ]
+
+    run ./sdbsc -T course d 283
+    [ "$status" -eq 0 ]
+    run ./sdbsc -T course c
+    [ "${lines[0]}" = "Database contains 0 course record(s)." ]
+
+    # ids outside the table's range never reach the file
+    run ./sdbsc -T course a 2000000000 CS999 Huge 4
+    [ "$status" -eq 2 ]
+    [ "${lines[0]}" = "Cant use course ID=2000000000, ID must be 1 to 9999!" ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+    run ./sdbsc -T course f 0
+    [ "$status" -eq 2 ]
+    run ./sdbsc -T course d -5
+    [ "$status" -eq 2 ]
+    [ "${lines[0]}" = "Cant use course ID=-5, ID must be 1 to 9999!" ]
+    run ./sdbsc -T course f 12abc
+    [ "$status" -eq 2 ]
+    run ./sdbsc -T course a 284 CS284 Credits four
+    [ "$status" -eq 2 ]
+
+    run stat --format="%s" ./course.db
+    [ "${lines[0]}" = "18176" ]
+}
+
+@test "Snapshot header in slot 0 is never reported as a student" {
+    run ./sdbsc -f 0
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "Student 0 was not found in database." ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 3 student record(s)." ]
+}
+
+@test "Checksums catch a corrupted record" {
+    run ./sdbsc -k on
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Record checksums enabled." ]
+
+    run ./sdbsc -a 77 crc test 300
+    [ "$status" -eq 0 ]
+
+    # flip a byte in the first name of student 77
+    printf 'X' | dd of=student.db bs=1 seek=$((77 * 64 + 10)) conv=notrunc 2>/dev/null
+
+    run ./sdbsc -f 77
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "Student 77 failed its checksum, the record is corrupt!" ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+
+    run ./sdbsc -S
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "student.db: slot 77 holds a bad record (id 77)" ]
+
+    # the corrupt record has to be deleted before the id is reused
+    run ./sdbsc -a 77 crc again 300
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "Student 77 failed its checksum, the record is corrupt!" ]
+
+    run ./sdbsc -d 77
+    [ "$status" -eq 0 ]
+    run ./sdbsc -S
+    [ "$status" -eq 0 ]
+
+    run ./sdbsc -k off
+    [ "$status" -eq 0 ]
+}
+
+@test "Compress keeps a corrupt record failing its checksum" {
+    run ./sdbsc -k on
+    [ "$status" -eq 0 ]
+    run ./sdbsc -a 78 crc test 300
+    [ "$status" -eq 0 ]
+    printf 'X' | dd of=student.db bs=1 seek=$((78 * 64 + 10)) conv=notrunc 2>/dev/null
+
+    run ./sdbsc -x
+    [ "$status" -eq 0 ]
+
+    run ./sdbsc -S
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "student.db: slot 78 holds a bad record (id 78)" ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+
+    run ./sdbsc -d 78
+    [ "$status" -eq 0 ]
+    run ./sdbsc -k off
+    [ "$status" -eq 0 ]
+}
+
+@test "Reshard refuses to drop a corrupt record" {
+    run ./sdbsc -k on
+    [ "$status" -eq 0 ]
+    run ./sdbsc -a 79 crc test 300
+    [ "$status" -eq 0 ]
+    printf 'X' | dd of=student.db bs=1 seek=$((79 * 64 + 10)) conv=notrunc 2>/dev/null
+
+    run ./sdbsc -n 2
+    [ "$status" -eq 1 ]
+    [ "${lines[-1]}" = "Cant shard database, 1 record(s) are corrupt, run -S for details!" ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+    [ ! -f student.db.manifest ]
+
+    run ./sdbsc -d 79
+    [ "$status" -eq 0 ]
+    run ./sdbsc -k off
+    [ "$status" -eq 0 ]
+}
+
+@test "Replica follows the change log" {
+    rm -f replica.db
+    run ./sdbsc -L on
+    [ "$status" -eq 0 ]
+
+    run ./sdbsc -a 88 log test 250
+    [ "$status" -eq 0 ]
+
+    run ./sdbsc -R replica.db
+    [ "$status" -eq 0 ]
+    run ./sdbsc --replica=replica.db -f 88
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "88 log test 2.50" ] || {
+        echo "Failed Output:  $normalized_output"
+        return 1
+    }
+
+    # only the new change is applied on the next catch up
+    run ./sdbsc -d 88
+    run ./sdbsc -R replica.db
+    [ "${lines[0]}" = "replica.db: applied 1 change(s), at seq $(( $(stat --format=%s student.db.log) / 80 - 1 ))." ]
+    run ./sdbsc --replica=replica.db -f 88
+    [ "$status" -eq 1 ]
+
+    run ./sdbsc --replica=replica.db -a 89 no write 100
+    [ "$status" -eq 2 ]
+
+    run ./sdbsc -L off
+    [ "$status" -eq 0 ]
+    rm -f replica.db
+}
+
+@test "Search names through the trigram index" {
+    run ./sdbsc -a 91 Johnson Smithers 300
+    run ./sdbsc -a 92 Maria Johnston 310
+
+    run ./sdbsc -s OHNS
+    [ "$status" -eq 0 ]
+    [ "${lines[3]}" = "2 student(s) matched \"OHNS\"." ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+    [ -f student.db.idx ]
+
+    # a change after the index was built is still found
+    run ./sdbsc -d 92
+    run ./sdbsc -s ohns
+    [ "${lines[2]}" = "1 student(s) matched \"ohns\"." ]
+
+    run ./sdbsc -s smitehrs
+    [ "$status" -eq 0 ]
+    [ "${lines[2]}" = "No exact match, 1 student(s) closely matched \"smitehrs\"." ]
+
+    # too short for any of its trigrams to survive the misspelling
+    run ./sdbsc -s jhn
+    [ "$status" -eq 0 ]
+    echo "$output" | tr -s ' ' | grep -qx "1 john doe 3.45" || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+
+    run ./sdbsc -s qqqq
+    [ "$status" -eq 1 ]
+
+    run ./sdbsc -d 91
+}
+
+@test "Direct I/O mode reads and writes the same records" {
+    run ./sdbsc --direct -a 4097 direct write 333
+    [ "$status" -eq 0 ]
+
+    # a 64 byte record in the middle of a 4K block, read both ways
+    run ./sdbsc -f 4097
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "4097 direct write 3.33" ] || {
+        echo "Failed Output:  $normalized_output"
+        return 1
+    }
+
+    buffered=$(./sdbsc -p)
+    run ./sdbsc -p --direct
+    [ "$output" = "$buffered" ]
+
+    run ./sdbsc --direct -d 4097
+    [ "$status" -eq 0 ]
+    run env SDBSC_DIRECT=1 ./sdbsc -f 4097
+    [ "$status" -eq 1 ]
+
+    # tables stay buffered, --direct does not change them
+    run ./sdbsc --direct -T course a 4097 CS4097 Direct 3
+    [ "$status" -eq 0 ]
+    run ./sdbsc -T course f 4097
+    [ "$status" -eq 0 ]
+    run ./sdbsc --direct -T course d 4097
+    [ "$status" -eq 0 ]
+}
+
+@test "Library handles share records with sdbsc and cache lookups" {
+    run ./sdbsc -a 4242 lib reader 321
+    [ "$status" -eq 0 ]
+
+    cat > libsdb_test.c <<'PROG'
+#include <stdio.h>
+#include "libsdb.h"
+
+int main(void)
+{
+    sdb_t *db;
+    student_t got, s = {.id = 4243, .fname = "lib", .lname = "writer", .gpa = 123};
+    sdb_cache_stats_t st;
+
+    if (sdb_open(&db, "student.db", NULL) != NO_ERROR)
+        return 1;
+    for (int i = 0; i < 10; i++) {
+        if (sdb_get(db, 4242, &got) != NO_ERROR)
+            return 1;
+    }
+    printf("%d %s %s %d\n", got.id, got.fname, got.lname, got.gpa);
+    sdb_cache_stats(db, &st);
+    printf("hits %lu misses %lu\n", st.hits, st.misses);
+
+    printf("%s\n", sdb_strerror(sdb_add(db, &s)));
+    printf("%s\n", sdb_strerror(sdb_add(db, &s)));
+    return sdb_close(db);
+}
+PROG
+    run gcc -pthread -o libsdb_test libsdb_test.c libsdb.a
+    [ "$status" -eq 0 ]
+
+    run ./libsdb_test
+    rm -f libsdb_test libsdb_test.c
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "4242 lib reader 321" ]
+    [ "${lines[1]}" = "hits 9 misses 1" ]
+    [ "${lines[2]}" = "no error" ]
+    [ "${lines[3]}" = "operation not allowed" ]
+
+    run ./sdbsc -f 4243
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "4243 lib writer 1.23" ]
+
+    run ./sdbsc -d 4242
+    run ./sdbsc -d 4243
+    [ "$status" -eq 0 ]
+}
+
+@test "Library handles do not serve cached records after compress or zero" {
+    run ./sdbsc -a 5000 before compress 300
+    [ "$status" -eq 0 ]
+
+    cat > libsdb_test.c <<'PROG'
+#include <stdio.h>
+#include <stdlib.h>
+#include "libsdb.h"
+
+int main(void)
+{
+    sdb_t *db, *other;
+    sdb_options_t zero = SDB_OPTIONS_INIT;
+    student_t got, s = {.id = 5001, .fname = "after", .lname = "compress", .gpa = 301};
+
+    zero.truncate = true;
+    if (sdb_open(&db, "student.db", NULL) != NO_ERROR)
+        return 1;
+
+    // cached, then compressed by sdbsc and cached again from the new file
+    printf("%s\n", sdb_strerror(sdb_get(db, 5000, &got)));
+    if (system("./sdbsc -x > /dev/null") != 0)
+        return 1;
+    printf("%s\n", sdb_strerror(sdb_get(db, 5000, &got)));
+
+    // emptied by another handle
+    if (sdb_open(&other, "student.db", &zero) != NO_ERROR)
+        return 1;
+    sdb_close(other);
+    printf("%s\n", sdb_strerror(sdb_get(db, 5000, &got)));
+
+    // compressed by this handle, then emptied by sdbsc
+    sdb_add(db, &s);
+    if (sdb_compress(db) != NO_ERROR)
+        return 1;
+    printf("%s\n", sdb_strerror(sdb_get(db, 5001, &got)));
+    if (system("./sdbsc -z > /dev/null") != 0)
+        return 1;
+    printf("%s\n", sdb_strerror(sdb_get(db, 5001, &got)));
+    return sdb_close(db);
+}
+PROG
+    run gcc -pthread -o libsdb_test libsdb_test.c libsdb.a
+    [ "$status" -eq 0 ]
+
+    run ./libsdb_test
+    rm -f libsdb_test libsdb_test.c
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "no error" ]
+    [ "${lines[1]}" = "no error" ]
+    [ "${lines[2]}" = "student not found" ]
+    [ "${lines[3]}" = "no error" ]
+    [ "${lines[4]}" = "student not found" ]
+
+    run ./sdbsc -c
+    [ "$status" -eq 0 ]
+    [ "$output" = "Database contains no student records." ]
+}
+
+@test "Search index is rebuilt after the database is zeroed" {
+    run ./sdbsc -z
+    run ./sdbsc -a 7 alpha first 300
+    run ./sdbsc -s alpha
+    [ "$status" -eq 0 ]
+    [ "${lines[2]}" = "1 student(s) matched \"alpha\"." ]
+
+    # same inode and generation as when the index was built
+    run ./sdbsc -z --stats=stats.json
+    [ "$status" -eq 0 ]
+    run grep -q '"zero": {"calls": 1' stats.json
+    rm -f stats.json
+    [ "$status" -eq 0 ]
+    run ./sdbsc -a 8 omega second 300
+    run ./sdbsc -s omega
+    [ "$status" -eq 0 ]
+    [ "${lines[2]}" = "1 student(s) matched \"omega\"." ]
+}
+
+@test "A reader waiting on a resharded shard follows the new layout" {
+    run ./sdbsc -a 30000 moved shard 300
+    [ "$status" -eq 0 ]
+    cp student.db student.db.single
+    run ./sdbsc -n 4
+    [ "$status" -eq 0 ]
+
+    # the reader gets the lock on shard 1 only after the layout is gone
+    flock student.db.1 sleep 1 &
+    sleep 0.2
+    ./sdbsc -f 30000 > student.db.out &
+    reader=$!
+    sleep 0.2
+    mv student.db.single student.db
+    rm student.db.manifest student.db.0 student.db.1 student.db.2 student.db.3
+    rc=0
+    wait $reader || rc=$?
+    wait
+
+    run cat student.db.out
+    rm -f student.db.out
+    [ "$rc" -eq 0 ]
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "30000 moved shard 3.00" ]
+    [ ! -e student.db.1 ]
+}
+
+@test "A writer checks the manifest again once it holds its shard's lock" {
+    run ./sdbsc -n 2
+    [ "$status" -eq 0 ]
+
+    # shard 0 keeps its file, but the layout of 4 gives 30001 to shard 1
+    flock student.db.0 sleep 1 &
+    sleep 0.2
+    ./sdbsc -a 30001 late writer 300 > student.db.out &
+    writer=$!
+    sleep 0.2
+    cp student.db.1 student.db.2
+    cp student.db.1 student.db.3
+    cp student.db.0 student.db.1
+    echo "shards=4" > student.db.manifest
+    rc=0
+    wait $writer || rc=$?
+    wait
+    rm -f student.db.out
+    [ "$rc" -eq 0 ]
+
+    run ./sdbsc -f 30001
+    [ "$status" -eq 0 ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+
+    run ./sdbsc -n 1
+    [ "$status" -eq 0 ]
+    run ./sdbsc -d 30001
+    [ "$status" -eq 0 ]
+}
+
+@test "Library handles log next to their database and see -L on and off" {
+    rm -rf logdir
+    mkdir logdir
+
+    cat > libsdb_test.c <<'PROG'
+#include <stdio.h>
+#include <stdlib.h>
+#include "libsdb.h"
+
+static void add(sdb_t *db, int id)
+{
+    student_t s = {.id = id, .fname = "log", .lname = "dir", .gpa = 200};
+    printf("%d %s\n", id, sdb_strerror(sdb_add(db, &s)));
+}
+
+int main(void)
+{
+    sdb_t *db;
+
+    if (sdb_open(&db, "logdir/student.db", NULL) != NO_ERROR)
+        return 1;
+    add(db, 9001);
+    if (system("cd logdir && ../sdbsc -L on > /dev/null") != 0)
+        return 1;
+    add(db, 9002);
+    if (system("cd logdir && ../sdbsc -L off > /dev/null") != 0)
+        return 1;
+    add(db, 9003);
+    if (system("cd logdir && ../sdbsc -L on > /dev/null") != 0)
+        return 1;
+    add(db, 9004);
+    return sdb_close(db);
+}
+PROG
+    run gcc -pthread -o libsdb_test libsdb_test.c libsdb.a
+    [ "$status" -eq 0 ]
+
+    rm -f student.db.log
+    run ./libsdb_test
+    rm -f libsdb_test libsdb_test.c
+    [ "$status" -eq 0 ]
+    [ "${lines[3]}" = "9004 no error" ]
+    [ ! -e student.db.log ]
+
+    # three records copied by the second -L on, then the add after it
+    cd logdir
+    run ../sdbsc -R replica.db
+    cd ..
+    rm -rf logdir
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "replica.db: applied 4 change(s), at seq 4." ]
+}
+
+@test "Table commands waiting on a compressed file use the new one" {
+    run ./sdbsc -T course a 310 CS310 Networks 3
+    [ "$status" -eq 0 ]
+    cp course.db course.db.new
+    run ./sdbsc -T course d 310
+    [ "$status" -eq 0 ]
+
+    # swap the file in under the lock, the way compress does
+    flock course.db sleep 1 &
+    sleep 0.2
+    ./sdbsc -T course f 310 > course.db.out &
+    reader=$!
+    sleep 0.2
+    mv course.db.new course.db
+    rc=0
+    wait $reader || rc=$?
+    wait
+
+    run cat course.db.out
+    rm -f course.db.out
+    [ "$rc" -eq 0 ]
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "310 CS310 Networks 3 " ]
+
+    run ./sdbsc -T course x
+    [ "$status" -eq 0 ]
+    run ./sdbsc -T course d 310
+    [ "$status" -eq 0 ]
+}
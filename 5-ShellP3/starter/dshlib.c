@@ -1,3 +1,4 @@
+#define _GNU_SOURCE     // pipe2, environ
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -6,6 +7,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/wait.h>
+#include <spawn.h>
 #include <errno.h>
 #include "dshlib.h"
 #include <limits.h>
@@ -259,72 +261,104 @@ int exec_cd_command(cmd_buff_t *cmd) {
     return OK;
 }
 
-// Execute a single external command
-int exec_external_command(cmd_buff_t *cmd) {
-    pid_t pid = fork();
-    
-    if (pid < 0) {
-        perror("fork");
-        return ERR_EXEC_CMD;
-    } 
+// Report why a command could not be started, the same messages the child
+// used to print when execvp() failed
+static void report_exec_error(int err) {
+    if (err == ENOENT) {
+        fprintf(stderr, "Command not found in PATH\n");
+    } else if (err == EACCES) {
+        fprintf(stderr, "Permission denied\n");
+    } else {
+        fprintf(stderr, "error executing command\n");
+    }
+}
+
+// Open the redirection files of cmd.  Input is only opened when want_in and
+// output when want_out, a pipe takes precedence over a file.  The fds are
+// close on exec, spawn_command() dup2()s them onto stdin and stdout.
+// Returns 0, or the errno of the open that failed with *in_fd closed again.
+static int open_redirs(cmd_buff_t *cmd, bool want_in, bool want_out, int *in_fd, int *out_fd) {
+    redir_info_t *redir = (redir_info_t*)cmd->_cmd_buffer;
+    
+    *in_fd = -1;
+    *out_fd = -1;
+    if (!redir) return 0;
+    
+    // Input redirection
+    if (want_in && redir->in_type == REDIR_IN && redir->in_file) {
+        *in_fd = open(redir->in_file, O_RDONLY | O_CLOEXEC);
+        if (*in_fd == -1) {
+            int err = errno;
+            fprintf(stderr, "Error opening input file: %s\n", strerror(err));
+            return err;
+        }
+    }
     
-    if (pid == 0) {
-        // Child process
-        
-        // Handle redirection if present
-        if (cmd->_cmd_buffer) {
-            redir_info_t *redir = (redir_info_t*)cmd->_cmd_buffer;
-            
-            // Input redirection
-            if (redir->in_type == REDIR_IN && redir->in_file) {
-                int fd = open(redir->in_file, O_RDONLY);
-                if (fd == -1) {
-                    fprintf(stderr, "Error opening input file: %s\n", strerror(errno));
-                    exit(errno);
-                }
-                if (dup2(fd, STDIN_FILENO) == -1) {
-                    perror("dup2 stdin");
-                    exit(EXIT_FAILURE);
-                }
-                close(fd);
-            }
-            
-            // Output redirection
-            if (redir->out_type != REDIR_NONE && redir->out_file) {
-                int flags;
-                if (redir->out_type == REDIR_APPEND) {
-                    flags = O_WRONLY | O_CREAT | O_APPEND;
-                } else { // REDIR_OUT
-                    flags = O_WRONLY | O_CREAT | O_TRUNC;
-                }
-                
-                int fd = open(redir->out_file, flags, 0644);
-                if (fd == -1) {
-                    fprintf(stderr, "Error opening output file: %s\n", strerror(errno));
-                    exit(errno);
-                }
-                if (dup2(fd, STDOUT_FILENO) == -1) {
-                    perror("dup2 stdout");
-                    exit(EXIT_FAILURE);
-                }
-                close(fd);
-            }
+    // Output redirection
+    if (want_out && redir->out_type != REDIR_NONE && redir->out_file) {
+        int flags;
+        if (redir->out_type == REDIR_APPEND) {
+            flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC;
+        } else { // REDIR_OUT
+            flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
         }
         
-        execvp(cmd->argv[0], cmd->argv);
-        
-        // If execvp returns, there was an error
-        if (errno == ENOENT) {
-            fprintf(stderr, "Command not found in PATH\n");
-        } else if (errno == EACCES) {
-            fprintf(stderr, "Permission denied\n");
-        } else {
-            fprintf(stderr, "error executing command\n");
+        *out_fd = open(redir->out_file, flags, 0644);
+        if (*out_fd == -1) {
+            int err = errno;
+            fprintf(stderr, "Error opening output file: %s\n", strerror(err));
+            if (*in_fd != -1) close(*in_fd);
+            *in_fd = -1;
+            return err;
         }
-        exit(errno);
     }
     
-    // Parent process
+    return 0;
+}
+
+// Start cmd with posix_spawnp().  glibc runs the child with
+// clone(CLONE_VM | CLONE_VFORK), no page tables are copied so the cost does
+// not grow with the shell's memory the way fork() does.  in_fd and out_fd
+// become stdin and stdout, -1 leaves them alone.  Every other fd the shell
+// opens is close on exec and does not reach the command.
+// Returns 0 with *pid set, or the errno of the failed exec.
+static int spawn_command(cmd_buff_t *cmd, int in_fd, int out_fd, pid_t *pid) {
+    posix_spawn_file_actions_t actions;
+    int rc;
+    
+    if (posix_spawn_file_actions_init(&actions) != 0) return ENOMEM;
+    if (in_fd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    }
+    if (out_fd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    }
+    
+    rc = posix_spawnp(pid, cmd->argv[0], &actions, NULL, cmd->argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    return rc;
+}
+
+// Execute a single external command
+int exec_external_command(cmd_buff_t *cmd) {
+    int in_fd, out_fd;
+    pid_t pid;
+    
+    int rc = open_redirs(cmd, true, true, &in_fd, &out_fd);
+    if (rc == 0) {
+        rc = spawn_command(cmd, in_fd, out_fd, &pid);
+        if (rc != 0) report_exec_error(rc);
+    }
+    if (in_fd != -1) close(in_fd);
+    if (out_fd != -1) close(out_fd);
+    
+    // A command that could not be started exits with the errno, like the
+    // forked child used to
+    if (rc != 0) {
+        last_return_code = rc;
+        return OK;
+    }
+    
     int status;
     waitpid(pid, &status, 0);
     
@@ -358,10 +392,12 @@ int execute_pipeline(command_list_t *clist) {
     // Setup for piped commands
     int pipe_fds[CMD_MAX-1][2]; // Array of pipe file descriptors
     pid_t child_pids[CMD_MAX];  // Array to store child PIDs
+    int spawn_errs[CMD_MAX];    // errno of a command that did not start
     
-    // Create all pipes needed
+    // Create all pipes needed, close on exec so each command only gets
+    // the two ends spawn_command() puts on its stdin and stdout
     for (int i = 0; i < clist->num - 1; i++) {
-        if (pipe(pipe_fds[i]) == -1) {
+        if (pipe2(pipe_fds[i], O_CLOEXEC) == -1) {
             perror("pipe");
             // Close any pipes already created
             for (int j = 0; j < i; j++) {
@@ -372,102 +408,25 @@ int execute_pipeline(command_list_t *clist) {
         }
     }
     
-    // Create all child processes
+    // Start every command.  One that cannot be started does not stop the
+    // others, just like a forked child whose exec failed.
     for (int i = 0; i < clist->num; i++) {
-        child_pids[i] = fork();
-        
-        if (child_pids[i] < 0) {
-            perror("fork");
-            // Close all pipes
-            for (int j = 0; j < clist->num - 1; j++) {
-                close(pipe_fds[j][0]);
-                close(pipe_fds[j][1]);
-            }
-            // Kill any child processes already created
-            for (int j = 0; j < i; j++) {
-                kill(child_pids[j], SIGTERM);
-                waitpid(child_pids[j], NULL, 0);
-            }
-            return ERR_EXEC_CMD;
-        }
+        bool first = (i == 0);
+        bool last = (i == clist->num - 1);
+        int in_fd, out_fd;
         
-        if (child_pids[i] == 0) {
-    // Child process
-    
-    // Handle redirection for this command
-    redir_info_t *redir = NULL;
-    if (clist->commands[i]._cmd_buffer) {
-        redir = (redir_info_t*)clist->commands[i]._cmd_buffer;
-    }
-    
-    // Input redirection: Either from previous pipe or from file
-    if (i > 0) {
-        // From previous pipe takes precedence
-        if (dup2(pipe_fds[i-1][0], STDIN_FILENO) == -1) {
-            perror("dup2 stdin");
-            exit(EXIT_FAILURE);
-        }
-    } else if (redir && redir->in_type == REDIR_IN && redir->in_file) {
-        // From file (only for the first command in pipeline)
-        int fd = open(redir->in_file, O_RDONLY);
-        if (fd == -1) {
-            fprintf(stderr, "Error opening input file: %s\n", strerror(errno));
-            exit(errno);
-        }
-        if (dup2(fd, STDIN_FILENO) == -1) {
-            perror("dup2 stdin");
-            exit(EXIT_FAILURE);
-        }
-        close(fd);
-    }
-    
-    // Output redirection: Either to next pipe or to file
-    if (i < clist->num - 1) {
-        // To next pipe takes precedence
-        if (dup2(pipe_fds[i][1], STDOUT_FILENO) == -1) {
-            perror("dup2 stdout");
-            exit(EXIT_FAILURE);
-        }
-    } else if (redir && redir->out_type != REDIR_NONE && redir->out_file) {
-        // To file (only for the last command in pipeline)
-        int flags;
-        if (redir->out_type == REDIR_APPEND) {
-            flags = O_WRONLY | O_CREAT | O_APPEND;
-        } else { // REDIR_OUT
-            flags = O_WRONLY | O_CREAT | O_TRUNC;
-        }
-        
-        int fd = open(redir->out_file, flags, 0644);
-        if (fd == -1) {
-            fprintf(stderr, "Error opening output file: %s\n", strerror(errno));
-            exit(errno);
-        }
-        if (dup2(fd, STDOUT_FILENO) == -1) {
-            perror("dup2 stdout");
-            exit(EXIT_FAILURE);
-        }
-        close(fd);
-    }
-            
-            // Close all pipe file descriptors
-            for (int j = 0; j < clist->num - 1; j++) {
-                close(pipe_fds[j][0]);
-                close(pipe_fds[j][1]);
-            }
-            
-            // Execute the command
-            execvp(clist->commands[i].argv[0], clist->commands[i].argv);
-            
-            // If we get here, execvp failed
-            if (errno == ENOENT) {
-                fprintf(stderr, "Command not found in PATH\n");
-            } else if (errno == EACCES) {
-                fprintf(stderr, "Permission denied\n");
-            } else {
-                fprintf(stderr, "error executing command\n");
-            }
-            exit(errno);
+        // Input from the previous pipe, or a file for the first command;
+        // output to the next pipe, or a file for the last command
+        spawn_errs[i] = open_redirs(&clist->commands[i], first, last, &in_fd, &out_fd);
+        if (spawn_errs[i] == 0) {
+            spawn_errs[i] = spawn_command(&clist->commands[i],
+                                          first ? in_fd : pipe_fds[i-1][0],
+                                          last ? out_fd : pipe_fds[i][1],
+                                          &child_pids[i]);
+            if (spawn_errs[i] != 0) report_exec_error(spawn_errs[i]);
         }
+        if (in_fd != -1) close(in_fd);
+        if (out_fd != -1) close(out_fd);
     }
     
     // Parent process - close all pipe file descriptors
@@ -479,6 +438,10 @@ int execute_pipeline(command_list_t *clist) {
     // Wait for all child processes to complete
     int status;
     for (int i = 0; i < clist->num; i++) {
+        if (spawn_errs[i] != 0) {
+            last_return_code = spawn_errs[i];
+            continue;
+        }
         waitpid(child_pids[i], &status, 0);
         if (WIFEXITED(status)) {
             last_return_code = WEXITSTATUS(status);
@@ -508,6 +471,10 @@ int exec_local_cmd_loop() {
     char input_buffer[ARG_MAX];
     int rc;
     
+    // build_cmd_buff() clears each slot before using it, they must start
+    // out empty rather than holding stack garbage
+    memset(&cmd_list, 0, sizeof(cmd_list));
+    
     printf("%s", SH_PROMPT);  // Initial prompt
     
     while (1) {
@@ -0,0 +1,454 @@
+#define _GNU_SOURCE     // ppoll
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "rshlib.h"
+
+//Load generator for the rsh server.  Opens -c connections, each on its own
+//thread, and replays a mix of commands on them for -d seconds or -n
+//commands a connection, then prints throughput, latency percentiles,
+//output bytes and error counts, overall and for each command of the mix.
+//
+//usage: rsh_bench [-i IP | -u PATH] [-p PORT] [-c conns] [-n cmds | -d secs]
+//                 [-r rate] [-w window] [[weight:]cmd ...]
+//
+//Closed loop (the default) keeps -w commands in flight on every
+//connection, the next one is sent as soon as an answer comes back.  With
+//-r the load is open loop: rate commands a second over all connections,
+//sent on schedule whether or not the server keeps up, a v3 server taking
+//up to RDSH_PIPELINE_MAX of them in flight on a connection.  Latency is
+//then counted from when a command was due, not from when it could be
+//sent, so a stalled server is not hidden by the sender waiting on it.
+//
+//Each cmd is picked with a chance of weight (default 1) in the total, the
+//default mix is "echo hi".  Compare server cores with e.g.
+//  rsh_bench -c 32 -d 5 3:"echo hi" "cat /etc/services" "ls /"
+
+#define BENCH_MIX_MAX       16
+#define BENCH_DEF_MIX       "echo hi"
+
+typedef struct bench_cmd {
+    const char  *line;
+    int         len;
+    int         weight;
+} bench_cmd_t;
+
+typedef struct bench_samples {
+    double      *us;
+    long        count;
+    long        cap;
+} bench_samples_t;
+
+typedef struct bench_conn {
+    pthread_t       tid;
+    int             index;
+    unsigned int    seed;
+    long            done;           //answers received
+    long            errors;         //failed connects and commands lost with them
+    long            failed;         //answers with a non-zero exit status
+    uint64_t        bytes;          //OUT payload bytes
+    bench_samples_t lat[BENCH_MIX_MAX];
+} bench_conn_t;
+
+static struct {
+    const char  *addr;
+    int         port;
+    int         conns;
+    long        count;              //commands a connection, 0 to run for secs
+    double      secs;
+    double      rate;               //commands a second, 0 for closed loop
+    int         window;
+    bench_cmd_t mix[BENCH_MIX_MAX];
+    int         mix_len;
+    int         mix_total;
+} cfg = {
+    .addr = RDSH_DEF_CLI_CONNECT,
+    .port = RDSH_DEF_PORT,
+    .conns = 1,
+    .secs = 5,
+    .window = 1,
+};
+
+static pthread_barrier_t start_line;
+
+static double now_us(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int add_sample(bench_samples_t *s, double us){
+    if (s->count == s->cap) {
+        long cap = s->cap ? s->cap * 2 : 4096;
+        double *us_new = realloc(s->us, cap * sizeof(double));
+        if (us_new == NULL)
+            return -1;
+        s->us = us_new;
+        s->cap = cap;
+    }
+    s->us[s->count++] = us;
+    return 0;
+}
+
+/*
+ * bench_connect(addr, port, proto)
+ *
+ * Connects to addr:port, or to the Unix socket addr names if it is a path,
+ * and agrees on v2 or v3 with no options, stored in *proto.
+ *
+ * returns:  the socket, or -1
+ */
+static int bench_connect(const char *addr, int port, int *proto){
+    struct sockaddr_storage ss;
+    socklen_t ss_len;
+    int opts;
+    int sock;
+
+    memset(&ss, 0, sizeof(ss));
+    if (rsh_is_unix_path(addr)) {
+        struct sockaddr_un *un = (struct sockaddr_un *)&ss;
+        un->sun_family = AF_UNIX;
+        strncpy(un->sun_path, addr, sizeof(un->sun_path) - 1);
+        ss_len = sizeof(*un);
+    } else {
+        struct sockaddr_in *in = (struct sockaddr_in *)&ss;
+        in->sin_family = AF_INET;
+        in->sin_addr.s_addr = inet_addr(addr);
+        in->sin_port = htons(port);
+        ss_len = sizeof(*in);
+    }
+
+    sock = socket(ss.ss_family, SOCK_STREAM, 0);
+    if (sock < 0)
+        return -1;
+    if (connect(sock, (struct sockaddr *)&ss, ss_len) < 0) {
+        close(sock);
+        return -1;
+    }
+    if (ss.ss_family == AF_INET)
+        rsh_tcp_nodelay(sock);
+
+    *proto = rsh_client_hello(sock, 0, &opts);
+    if (*proto < RDSH_PROTO_V2) {
+        if (*proto == RDSH_PROTO_V1)
+            fprintf(stderr, "rsh_bench: the server only speaks v1\n");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static int pick_cmd(bench_conn_t *bc){
+    int n = rand_r(&bc->seed) % cfg.mix_total;
+    int i = 0;
+
+    while (n >= cfg.mix[i].weight)
+        n -= cfg.mix[i++].weight;
+    return i;
+}
+
+/*
+ * recv_answer(sock, bc, buff, status)
+ *
+ * Reads one frame of an answer, the OUT payload is counted and dropped.
+ *
+ * returns:  1 when it was the EXIT frame, 0 for OUT, -1 on errors
+ */
+static int recv_answer(int sock, bench_conn_t *bc, char *buff, int *status){
+    rsh_frame_hdr_t hdr;
+    uint32_t wire;
+    uint32_t len;
+
+    if (rsh_recv_all(sock, &hdr, sizeof(hdr)) != OK)
+        return -1;
+    len = ntohl(hdr.len);
+
+    if (hdr.type == RDSH_FRAME_EXIT) {
+        if (len != sizeof(wire) || rsh_recv_all(sock, &wire, sizeof(wire)) != OK)
+            return -1;
+        *status = (int)ntohl(wire);
+        return 1;
+    }
+    if (hdr.type != RDSH_FRAME_OUT)
+        return -1;
+
+    bc->bytes += len;
+    while (len > 0) {
+        uint32_t chunk = len < RDSH_COMM_BUFF_SZ ? len : RDSH_COMM_BUFF_SZ;
+        if (rsh_recv_all(sock, buff, chunk) != OK)
+            return -1;
+        len -= chunk;
+    }
+    return 0;
+}
+
+/*
+ * bench_run(arg)
+ *
+ * One connection.  Commands go out while the window allows and, open
+ * loop, once they are due.  The server answers a connection's commands
+ * in order, so due[] and which[] are rings indexed by the send count.
+ */
+static void *bench_run(void *arg){
+    bench_conn_t *bc = arg;
+    double due[RDSH_PIPELINE_MAX];
+    int which[RDSH_PIPELINE_MAX];
+    char *buff = malloc(RDSH_COMM_BUFF_SZ);
+    long sent = 0;
+    int window = cfg.window;
+    double interval = 0, next, end;
+    int proto;
+    int sock;
+
+    sock = buff ? bench_connect(cfg.addr, cfg.port, &proto) : -1;
+    pthread_barrier_wait(&start_line);
+    if (sock < 0) {
+        bc->errors++;
+        free(buff);
+        return NULL;
+    }
+
+    if (cfg.rate > 0) {
+        window = RDSH_PIPELINE_MAX;
+        interval = 1e6 * cfg.conns / cfg.rate;
+    }
+    if (proto < RDSH_PROTO_V3)
+        window = 1;
+
+    // stagger the connections of an open loop over one interval
+    next = now_us() + interval * bc->index / cfg.conns;
+    end = now_us() + cfg.secs * 1e6;
+
+    while (1) {
+        double now = now_us();
+        bool more = cfg.count ? sent < cfg.count : now < end;
+        int inflight = sent - bc->done;
+        struct pollfd pfd = { .fd = sock, .events = POLLIN };
+        struct timespec ts, *timeout = NULL;
+        int status;
+        int rc;
+
+        if (!more && inflight == 0)
+            break;
+
+        if (more && inflight < window && (interval == 0 || next <= now)) {
+            int c = pick_cmd(bc);
+            int slot = sent % RDSH_PIPELINE_MAX;
+
+            due[slot] = interval ? next : now;
+            which[slot] = c;
+            next += interval;
+            if (rsh_send_frame(sock, RDSH_FRAME_CMD, sent & 0xffff,
+                               cfg.mix[c].line, cfg.mix[c].len) != OK)
+                break;
+            sent++;
+            continue;
+        }
+
+        if (more && inflight < window) {
+            double wait = next - now;
+            ts.tv_sec = wait / 1e6;
+            ts.tv_nsec = (wait - ts.tv_sec * 1e6) * 1e3;
+            timeout = &ts;
+        }
+        if (ppoll(&pfd, 1, timeout, NULL) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (pfd.revents == 0)
+            continue;
+
+        rc = recv_answer(sock, bc, buff, &status);
+        if (rc < 0)
+            break;
+        if (rc == 1) {
+            int slot = bc->done % RDSH_PIPELINE_MAX;
+            if (add_sample(&bc->lat[which[slot]], now_us() - due[slot]) != 0)
+                break;
+            if (status != 0)
+                bc->failed++;
+            bc->done++;
+        }
+    }
+
+    // whatever was in flight when the connection broke is lost
+    bc->errors += sent - bc->done;
+    close(sock);
+    free(buff);
+    return NULL;
+}
+
+static int cmp_double(const void *a, const void *b){
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double pct(const bench_samples_t *s, double p){
+    long i = (long)(p * s->count);
+
+    if (s->count == 0)
+        return 0;
+    return s->us[i < s->count ? i : s->count - 1];
+}
+
+/*
+ * merge(conns, c, out)
+ *
+ * Gathers the latencies of mix entry c, or of all of them if c is -1,
+ * from every connection into out, sorted.
+ */
+static int merge(bench_conn_t *conns, int c, bench_samples_t *out){
+    memset(out, 0, sizeof(*out));
+    for (int i = 0; i < cfg.conns; i++) {
+        for (int m = 0; m < cfg.mix_len; m++) {
+            bench_samples_t *s = &conns[i].lat[m];
+            if (c != -1 && m != c)
+                continue;
+            for (long k = 0; k < s->count; k++)
+                if (add_sample(out, s->us[k]) != 0)
+                    return -1;
+        }
+    }
+    qsort(out->us, out->count, sizeof(double), cmp_double);
+    return 0;
+}
+
+static void print_latency(const char *name, const bench_samples_t *s){
+    printf("%-24.24s %9ld %9.1f %9.1f %9.1f %9.1f\n", name, s->count,
+           pct(s, 0.50), pct(s, 0.99), pct(s, 0.999),
+           s->count ? s->us[s->count - 1] : 0);
+}
+
+static void usage(const char *progname){
+    fprintf(stderr, "usage: %s [-i IP | -u PATH] [-p PORT] [-c conns] [-n cmds | -d secs]\n"
+                    "       [-r rate] [-w window] [[weight:]cmd ...]\n", progname);
+    exit(1);
+}
+
+int main(int argc, char *argv[]){
+    static char *def_mix[] = { BENCH_DEF_MIX, NULL };
+    char **mix = def_mix;
+    char unix_path[108];
+    bench_conn_t *conns;
+    bench_samples_t all;
+    long done = 0, errors = 0, failed = 0;
+    uint64_t bytes = 0;
+    double start, secs;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:u:p:c:n:d:r:w:")) != -1) {
+        switch (opt) {
+        case 'i': cfg.addr = optarg; break;
+        case 'u':
+            // a path without a '/' would be taken for an address
+            snprintf(unix_path, sizeof(unix_path), "%s%s",
+                     strchr(optarg, '/') ? "" : "./", optarg);
+            cfg.addr = unix_path;
+            break;
+        case 'p': cfg.port = atoi(optarg); break;
+        case 'c': cfg.conns = atoi(optarg); break;
+        case 'n': cfg.count = atol(optarg); break;
+        case 'd': cfg.secs = atof(optarg); break;
+        case 'r': cfg.rate = atof(optarg); break;
+        case 'w': cfg.window = atoi(optarg); break;
+        default:  usage(argv[0]);
+        }
+    }
+    if (cfg.conns < 1 || cfg.port <= 0 || cfg.count < 0 || cfg.secs <= 0 || cfg.rate < 0 ||
+        cfg.window < 1 || cfg.window > RDSH_PIPELINE_MAX)
+        usage(argv[0]);
+    if (cfg.rate > 0 && cfg.window != 1)
+        fprintf(stderr, "rsh_bench: -w is for closed loop, -r sends on schedule\n");
+
+    if (optind < argc)
+        mix = &argv[optind];
+    for (; *mix != NULL; mix++) {
+        bench_cmd_t *bcmd = &cfg.mix[cfg.mix_len];
+        char *colon = strchr(*mix, ':');
+        char *end;
+
+        if (cfg.mix_len == BENCH_MIX_MAX) {
+            fprintf(stderr, "rsh_bench: at most %d commands in the mix\n", BENCH_MIX_MAX);
+            return 1;
+        }
+        bcmd->weight = 1;
+        bcmd->line = *mix;
+        if (colon != NULL) {
+            long w = strtol(*mix, &end, 10);
+            if (end == colon && w > 0) {
+                bcmd->weight = w;
+                bcmd->line = colon + 1;
+            }
+        }
+        bcmd->len = strlen(bcmd->line);
+        cfg.mix_total += bcmd->weight;
+        cfg.mix_len++;
+    }
+
+    conns = calloc(cfg.conns, sizeof(bench_conn_t));
+    if (conns == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    pthread_barrier_init(&start_line, NULL, cfg.conns + 1);
+    for (int i = 0; i < cfg.conns; i++) {
+        conns[i].index = i;
+        conns[i].seed = i + 1;
+        if (pthread_create(&conns[i].tid, NULL, bench_run, &conns[i]) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    pthread_barrier_wait(&start_line);
+    start = now_us();
+    for (int i = 0; i < cfg.conns; i++) {
+        pthread_join(conns[i].tid, NULL);
+        done += conns[i].done;
+        errors += conns[i].errors;
+        failed += conns[i].failed;
+        bytes += conns[i].bytes;
+    }
+    secs = (now_us() - start) / 1e6;
+
+    if (rsh_is_unix_path(cfg.addr))
+        printf("%s, %d connections, ", cfg.addr, cfg.conns);
+    else
+        printf("%s:%d, %d connections, ", cfg.addr, cfg.port, cfg.conns);
+    if (cfg.rate > 0)
+        printf("open loop at %.0f/s\n", cfg.rate);
+    else
+        printf("closed loop, %d in flight each\n", cfg.window);
+    printf("%-12s %12ld in %.2fs, %.1f/s\n", "commands", done, secs, done / secs);
+    printf("%-12s %12ld\n", "errors", errors);
+    printf("%-12s %12ld non-zero exit status\n", "failed", failed);
+    printf("%-12s %12.1f MB, %.1f MB/s\n", "output", bytes / 1e6, bytes / 1e6 / secs);
+
+    printf("%-24s %9s %9s %9s %9s %9s\n", "latency us", "count", "p50", "p99", "p999", "max");
+    if (merge(conns, -1, &all) != 0) {
+        perror("realloc");
+        return 1;
+    }
+    print_latency("all", &all);
+    for (int c = 0; cfg.mix_len > 1 && c < cfg.mix_len; c++) {
+        bench_samples_t s;
+        if (merge(conns, c, &s) != 0) {
+            perror("realloc");
+            return 1;
+        }
+        print_latency(cfg.mix[c].line, &s);
+        free(s.us);
+    }
+    return errors ? 2 : 0;
+}
@@ -0,0 +1,140 @@
+#define _GNU_SOURCE     // vfork, environ
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+//Process launch latency, fork() + execvp() against posix_spawnp() and
+//vfork(), the way dsh and the rsh server start a command.  The cost of
+//fork() grows with the parent's mapped memory and the server carries a
+//lot of it, so -m dirties that many MB first and -t parks that many
+//threads, each with its own stack, to look like a busy -x server.
+//
+//usage: spawnbench [-n launches] [-m MB] [-t threads] [cmd [args...]]
+//
+//The default command is /bin/true.  Each method launches and reaps the
+//command n times, the mean and best microseconds per launch are printed.
+
+typedef int (*launch_fn)(char *argv[]);
+
+static int launch_fork(char *argv[]){
+    pid_t pid = fork();
+
+    if (pid < 0)
+        return -1;
+    if (pid == 0) {
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    return waitpid(pid, NULL, 0) == pid ? 0 : -1;
+}
+
+static int launch_vfork(char *argv[]){
+    pid_t pid = vfork();
+
+    if (pid < 0)
+        return -1;
+    if (pid == 0) {
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    return waitpid(pid, NULL, 0) == pid ? 0 : -1;
+}
+
+static int launch_spawn(char *argv[]){
+    pid_t pid;
+
+    if (posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ) != 0)
+        return -1;
+    return waitpid(pid, NULL, 0) == pid ? 0 : -1;
+}
+
+static double now_us(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/*
+ * run(name, fn, argv, n)
+ *
+ * Launches argv n times with fn and prints the mean and best latency.
+ */
+static int run(const char *name, launch_fn fn, char *argv[], int n){
+    double total = 0, best = -1;
+
+    for (int i = 0; i < n; i++) {
+        double start = now_us();
+        if (fn(argv) != 0) {
+            fprintf(stderr, "%s: launching %s failed: %s\n", name, argv[0], strerror(errno));
+            return -1;
+        }
+        double took = now_us() - start;
+        total += took;
+        if (best < 0 || took < best)
+            best = took;
+    }
+    printf("%-14s %10.1f %10.1f\n", name, total / n, best);
+    return 0;
+}
+
+static void *park(void *arg){
+    (void)arg;
+    pause();
+    return NULL;
+}
+
+int main(int argc, char *argv[]){
+    static char *def_cmd[] = { "/bin/true", NULL };
+    char **cmd = def_cmd;
+    int n = 1000;
+    long mb = 0;
+    int threads = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:m:t:")) != -1) {
+        switch (opt) {
+        case 'n': n = atoi(optarg); break;
+        case 'm': mb = atol(optarg); break;
+        case 't': threads = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-n launches] [-m MB] [-t threads] [cmd [args...]]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc)
+        cmd = &argv[optind];
+    if (n < 1)
+        n = 1;
+
+    // touch every page so fork() has page tables to copy
+    if (mb > 0) {
+        char *mem = malloc(mb << 20);
+        if (mem == NULL) {
+            perror("malloc");
+            return 1;
+        }
+        memset(mem, 1, mb << 20);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, park, NULL) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    printf("%s, %d launches, %ld MB resident, %d threads\n", cmd[0], n, mb, threads);
+    printf("%-14s %10s %10s\n", "method", "mean us", "best us");
+    if (run("fork+exec", launch_fork, cmd, n) != 0 ||
+        run("vfork+exec", launch_vfork, cmd, n) != 0 ||
+        run("posix_spawn", launch_spawn, cmd, n) != 0)
+        return 1;
+    return 0;
+}
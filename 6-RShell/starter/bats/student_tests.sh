@@ -302,4 +302,468 @@ EOF
     [ "$status" -eq 0 ]
     # Verify output contains at least part of the long string
     [[ "$output" =~ "aaaaaaaaaaaaaaaaaaaa" ]]
-}
\ No newline at end of file
+}
+@test "Threaded server serves clients while another command runs" {
+    # Start threaded server in background
+    ./dsh -s -x -p 5567 &
+    server_pid=$!
+
+    # Give server time to start
+    sleep 1
+
+    # Keep one worker busy
+    ./dsh -c -p 5567 > /dev/null <<EOF &
+sleep 3
+exit
+EOF
+    slow_pid=$!
+    sleep 0.5
+
+    # A second client must not wait for the sleep
+    start=$(date +%s)
+    run ./dsh -c -p 5567 <<EOF
+echo "not blocked"
+exit
+EOF
+    elapsed=$(( $(date +%s) - start ))
+
+    [ "$status" -eq 0 ]
+    [[ "$output" =~ "not blocked" ]]
+    [ "$elapsed" -lt 2 ]
+
+    # stop-server lets the running sleep finish, then the server exits
+    ./dsh -c -p 5567 > /dev/null <<EOF
+stop-server
+EOF
+    wait $slow_pid
+    for i in $(seq 50); do
+        kill -0 $server_pid 2>/dev/null || break
+        sleep 0.1
+    done
+    ! kill -0 $server_pid 2>/dev/null
+}
+
+@test "Event server serves clients while another command runs" {
+    # Start event driven server in background
+    ./dsh -s -e -p 5568 &
+    server_pid=$!
+
+    # Give server time to start
+    sleep 1
+
+    # Keep one connection busy
+    ./dsh -c -p 5568 > /dev/null <<EOF &
+sleep 3
+exit
+EOF
+    slow_pid=$!
+    sleep 0.5
+
+    # A second client must not wait for the sleep, and output larger than
+    # the socket buffers must arrive whole
+    start=$(date +%s)
+    run ./dsh -c -p 5568 <<EOF
+echo "not blocked"
+seq 1 200000
+exit
+EOF
+    elapsed=$(( $(date +%s) - start ))
+
+    [ "$status" -eq 0 ]
+    [[ "$output" =~ "not blocked" ]]
+    [[ "$output" =~ "199999" ]]
+    [[ "$output" =~ "200000" ]]
+    [ "$elapsed" -lt 2 ]
+
+    # stop-server lets the running sleep finish, then the server exits
+    ./dsh -c -p 5568 > /dev/null <<EOF
+stop-server
+EOF
+    wait $slow_pid
+    for i in $(seq 50); do
+        kill -0 $server_pid 2>/dev/null || break
+        sleep 0.1
+    done
+    ! kill -0 $server_pid 2>/dev/null
+}
+
+@test "Protocol v2 carries 0x04 in output and the exit status" {
+    # Start server in background
+    ./dsh -s -p 5569 &
+    server_pid=$!
+
+    # Give server time to start
+    sleep 1
+
+    # printf ends its output with RDSH_EOF_CHAR, which v1 takes for the end
+    # of the response
+    run ./dsh -c -p 5569 <<EOF
+printf x\\004
+echo after
+sh -c "exit 7"
+rc
+exit
+EOF
+
+    # Kill server
+    kill $server_pid
+
+    [ "$status" -eq 0 ]
+    [[ "$output" == *$'x\004'* ]]
+    [[ "$output" =~ "after" ]]
+    [[ "$output" =~ "dsh4> 7" ]]
+}
+
+@test "Pipelined commands come back in order" {
+    ./dsh -s -e -p 5570 &
+    server_pid=$!
+
+    sleep 1
+
+    # the whole script is sent before the first answer is read
+    run bash -c 'for i in $(seq 1 100); do echo "echo line$i"; done; echo false; echo rc; echo exit'
+    run ./dsh -c -p 5570 <<<"$output"
+
+    kill $server_pid
+
+    [ "$status" -eq 0 ]
+    expected=$(for i in $(seq 1 100); do printf 'dsh4> line%d\n' $i; done)
+    [[ "$output" == *"$expected"* ]]
+    [[ "$output" =~ "dsh4> dsh4> 1" ]]
+}
+
+@test "Compressed output (-z) matches the plain output" {
+    ./dsh -s -x -p 5571 &
+    server_pid=$!
+
+    sleep 1
+
+    run ./dsh -c -z -p 5571 <<EOF
+seq 1 20000
+echo small
+rc
+exit
+EOF
+
+    kill $server_pid
+
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"$(seq 1 20000)"* ]]
+    [[ "$output" =~ "dsh4> small" ]]
+    [[ "$output" =~ "dsh4> 0" ]]
+}
+
+@test "Remote command reads the client's stdin (-r)" {
+    ./dsh -s -e -p 5572 &
+    server_pid=$!
+
+    sleep 1
+
+    # more stdin than the pipes and socket buffers hold, output flowing back
+    # while it is sent
+    run bash -c 'seq 1 200000 | ./dsh -c -p 5572 -r "grep 99"'
+    grep_status=$status
+    grep_output=$output
+    run bash -c 'seq 1 200000 | ./dsh -c -p 5572 -r "wc -l"'
+
+    kill $server_pid
+
+    [ "$grep_status" -eq 0 ]
+    [[ "$grep_output" == *"$(seq 1 200000 | grep 99)"* ]]
+    [ "$status" -eq 0 ]
+    [[ "$output" =~ "200000" ]]
+    [[ "$output" =~ "cmd loop returned 0" ]]
+}
+
+@test "Server listens on a Unix socket next to TCP (-u)" {
+    sock=/tmp/rsh-5573.sock
+    ./dsh -s -x -p 5573 -u $sock &
+    server_pid=$!
+
+    sleep 1
+
+    run ./dsh -c -u $sock <<EOF
+echo "over unix"
+exit
+EOF
+    unix_status=$status
+    unix_output=$output
+
+    run ./dsh -c -p 5573 <<EOF
+echo "over tcp"
+stop-server
+EOF
+
+    for i in $(seq 50); do
+        kill -0 $server_pid 2>/dev/null || break
+        sleep 0.1
+    done
+
+    [ "$unix_status" -eq 0 ]
+    [[ "$unix_output" =~ "over unix" ]]
+    [ "$status" -eq 0 ]
+    [[ "$output" =~ "over tcp" ]]
+    ! kill -0 $server_pid 2>/dev/null
+    # the socket file goes with the server
+    [ ! -e $sock ]
+}
+
+@test "Commands write straight to the client's fds (-f)" {
+    sock=/tmp/rsh-5574.sock
+    ./dsh -s -e -p 5574 -u $sock &
+    server_pid=$!
+
+    sleep 1
+
+    run ./dsh -c -f -u $sock <<EOF
+echo "passed fd"
+ls /nonexistent
+rc
+exit
+EOF
+    fd_status=$status
+    fd_output=$output
+
+    run bash -c "seq 1 1000 | ./dsh -c -f -u $sock -r 'wc -l'"
+    stdin_output=$output
+
+    # TCP cannot carry fds
+    run ./dsh -c -f -p 5574 <<EOF
+exit
+EOF
+
+    kill $server_pid
+
+    [ "$fd_status" -eq 0 ]
+    [[ "$fd_output" =~ "dsh4> passed fd" ]]
+    [[ "$fd_output" =~ "dsh4> ls: cannot access" ]]
+    [[ "$fd_output" =~ "dsh4> 2" ]]
+    [[ "$stdin_output" =~ "1000" ]]
+    [[ "$output" =~ "-f needs -u" ]]
+}
+
+@test "Small replies over TCP are not held back" {
+    ./dsh -s -p 5575 &
+    server_pid=$!
+
+    sleep 1
+
+    # about 90ms a command if Nagle waits on the delayed ACK
+    start=$(date +%s%N)
+    run bash -c "for i in \$(seq 1 20); do ./dsh -c -p 5575 -r 'echo quick' </dev/null; done"
+    elapsed=$(( ($(date +%s%N) - start) / 1000000 ))
+
+    kill $server_pid
+
+    [ "$status" -eq 0 ]
+    [ "$(grep -c quick <<< "$output")" -eq 20 ]
+    [ "$elapsed" -lt 1000 ]
+}
+
+@test "server-stats reports counters and -m dumps them" {
+    metrics=/tmp/rsh-5576.prom
+    rm -f $metrics
+    ./dsh -s -x -p 5576 -m $metrics &
+    server_pid=$!
+
+    sleep 1
+
+    run ./dsh -c -p 5576 <<EOF
+echo one
+echo two | cat
+server-stats
+stop-server
+EOF
+    wait $server_pid
+
+    [ "$status" -eq 0 ]
+    [[ "$output" =~ "rsh_connections_active 1" ]]
+    [[ "$output" =~ "rsh_commands_total 2" ]]
+    [[ "$output" =~ "rsh_spawn_seconds_count 2" ]]
+    [[ "$output" =~ 'rsh_client_commands_total{client="127.0.0.1"} 2' ]]
+    # the last dump is written as the server stops
+    grep -q "^rsh_commands_total 4$" $metrics
+    grep -q "^rsh_connections_active 0$" $metrics
+    grep -q '^rsh_sent_bytes_total [1-9]' $metrics
+}
+
+@test "-l admits one pipeline at a time" {
+    ./dsh -s -e -p 5577 -l 1,8 &
+    server_pid=$!
+
+    sleep 1
+
+    # three at once, the limit runs them one after another
+    start=$(date +%s%N)
+    run bash -c "for i in 1 2 3; do ./dsh -c -p 5577 -r 'sleep 0.5 | echo done' </dev/null & done; wait"
+    elapsed=$(( ($(date +%s%N) - start) / 1000000 ))
+
+    kill $server_pid
+
+    [ "$status" -eq 0 ]
+    [ "$(grep -c done <<< "$output")" -eq 3 ]
+    [ "$elapsed" -ge 1400 ]
+}
+
+@test "echo, cat and ls run in-process with the real tools' output" {
+    ./dsh -s -e -p 5578 &
+    server_pid=$!
+
+    sleep 1
+
+    mkdir -p /tmp/rsh-5578/d
+    touch /tmp/rsh-5578/d/b /tmp/rsh-5578/d/A /tmp/rsh-5578/d/.hidden
+    printf 'x\n' > /tmp/rsh-5578/f
+
+    run ./dsh -c -p 5578 <<EOF
+echo -n one
+echo two
+cat /tmp/rsh-5578/missing /tmp/rsh-5578/f
+ls /tmp/rsh-5578/d | cat
+echo three | tr a-z A-Z
+seq 1 3 | echo four
+stop-server
+EOF
+    wait $server_pid
+    rm -rf /tmp/rsh-5578
+
+    stripped_output=$(echo "$output" | tr -d '[:space:]')
+    expected_output="socketclientmode:addr:127.0.0.1:5578Connectedtoserver127.0.0.1:5578dsh4>onedsh4>twodsh4>cat:/tmp/rsh-5578/missing:Nosuchfileordirectoryxdsh4>Abdsh4>THREEdsh4>fourdsh4>ServershuttingdownServerhasbeenstoppedcmdloopreturned0"
+
+    echo "Output: $output"
+    echo "Expected: $expected_output"
+
+    [ "$status" -eq 0 ]
+    [ "$stripped_output" = "$expected_output" ]
+}
+
+@test "cd only moves its own session" {
+    ./dsh -s -x -p 5579 &
+    server_pid=$!
+
+    sleep 1
+
+    # the first session sits in /tmp while the second one runs
+    (printf 'cd /tmp\nsleep 1\nreadlink /proc/self/cwd\nexit\n' | ./dsh -c -p 5579 > /tmp/rsh-5579.out) &
+    first=$!
+    sleep 0.5
+    run ./dsh -c -p 5579 <<EOF
+pwd
+readlink /proc/self/cwd
+EOF
+    wait $first
+    kill $server_pid
+
+    echo "Output: $output"
+    cat /tmp/rsh-5579.out
+
+    [ "$status" -eq 0 ]
+    [ "$(grep -c "$PWD\$" <<< "$output")" -eq 2 ]
+    grep -q "/tmp$" /tmp/rsh-5579.out
+    rm -f /tmp/rsh-5579.out
+}
+
+@test "-e drops a client that sends an oversized IN frame" {
+    ./dsh -s -e -p 5580 &
+    server_pid=$!
+
+    sleep 1
+
+    # HELLO v3 with STDIN, CMD "cat" flagged F_STDIN, then an IN frame
+    # claiming 0xFFFFFFFF bytes with 4 behind it
+    run timeout 5 bash -c '
+        exec 3<>/dev/tcp/127.0.0.1/5580
+        printf "\x01\x00\x00\x00\x00\x00\x00\x02\x03\x03" >&3
+        printf "\x02\x02\x00\x01\x00\x00\x00\x03cat" >&3
+        printf "\x05\x00\x00\x00\xff\xff\xff\xffAAAA" >&3
+        cat <&3 | wc -c'
+    received=$output
+
+    run ./dsh -c -p 5580 -r "echo still here" </dev/null
+    kill $server_pid
+
+    echo "received: $received"
+    echo "Output: $output"
+
+    # the HELLO reply, the connection is closed before any output
+    [ "$received" -lt 64 ]
+    [[ "$output" =~ "still here" ]]
+}
+
+@test "cat of a fifo or /proc/self runs the real cat" {
+    ./dsh -s -e -p 5581 &
+    server_pid=$!
+
+    sleep 1
+
+    rm -f /tmp/rsh-5581.fifo
+    mkfifo /tmp/rsh-5581.fifo
+    ./dsh -c -p 5581 -r "cat /tmp/rsh-5581.fifo" </dev/null >/dev/null &
+    reader=$!
+    sleep 0.3
+
+    # the blocked cat must not hold up anyone else
+    start=$(date +%s%N)
+    run ./dsh -c -p 5581 -r "cat /proc/self/comm" </dev/null
+    elapsed=$(( ($(date +%s%N) - start) / 1000000 ))
+
+    echo done > /tmp/rsh-5581.fifo
+    wait $reader
+    kill $server_pid
+    rm -f /tmp/rsh-5581.fifo
+
+    echo "Output: $output"
+    [ "$status" -eq 0 ]
+    [ "$(grep -cx cat <<< "$output")" -eq 1 ]
+    [ "$elapsed" -lt 1000 ]
+}
+
+@test "-l does not hold back a command that runs in-process" {
+    ./dsh -s -e -p 5582 -l 1,8 &
+    server_pid=$!
+
+    sleep 1
+
+    ./dsh -c -p 5582 -r "sleep 2" </dev/null >/dev/null &
+    busy=$!
+    sleep 0.3
+
+    start=$(date +%s%N)
+    run ./dsh -c -p 5582 -r "echo hi" </dev/null
+    elapsed=$(( ($(date +%s%N) - start) / 1000000 ))
+
+    wait $busy
+    kill $server_pid
+
+    echo "Output: $output"
+    [ "$status" -eq 0 ]
+    [ "$(grep -cx hi <<< "$output")" -eq 1 ]
+    [ "$elapsed" -lt 1000 ]
+}
+
+@test "-l holds back an in-process command that has to run the real tool" {
+    for core in -e -x; do
+        port=$([ "$core" = -e ] && echo 5583 || echo 5584)
+        ./dsh -s $core -p $port -l 1,8 &
+        server_pid=$!
+
+        sleep 1
+
+        ./dsh -c -p $port -r "sleep 2" </dev/null >/dev/null &
+        busy=$!
+        sleep 0.3
+
+        # ls -l is not done in-process, it needs the slot sleep holds
+        start=$(date +%s%N)
+        run ./dsh -c -p $port -r "ls -l /" </dev/null
+        elapsed=$(( ($(date +%s%N) - start) / 1000000 ))
+
+        wait $busy
+        kill $server_pid
+
+        echo "$core Output: $output"
+        [ "$status" -eq 0 ]
+        [ "$(grep -c ' tmp$' <<< "$output")" -eq 1 ]
+        [ "$elapsed" -ge 1000 ]
+    done
+}
@@ -19,7 +19,11 @@ typedef struct cmd_args{
   int   mode;
   char  ip[16];   //e.g., 192.168.100.101\0
   int   port;
-  int   threaded_server;
+  int   svr_mode;   //RDSH_SVR_SERIAL, RDSH_SVR_THREADED or RDSH_SVR_EVENT
+  int   cli_opts;   //RDSH_OPT_* the client asks the server for
+  char  *run_cmd;   //-r, run this one command with our stdin and exit
+  char  unix_path[108];     //-u, Unix socket path, "" for none
+  char  *stats_path;  //-m, where the server dumps its metrics
 }cmd_args_t;
 
 
@@ -30,13 +34,26 @@ typedef struct cmd_args{
 //with passing optional connection parameters. 
 
 void print_usage(const char *progname) {
-  printf("Usage: %s [-c | -s] [-i IP] [-p PORT] [-x] [-h]\n", progname);
+  printf("Usage: %s [-c | -s] [-i IP] [-p PORT] [-x | -e] [-u PATH] [-f] [-z] [-r CMD] [-m PATH] [-l LIMITS] [-h]\n", progname);
   printf("  Default is to run %s in local mode\n", progname);
   printf("  -c            Run as client\n");
   printf("  -s            Run as server\n");
   printf("  -i IP         Set IP/Interface address (only valid with -c or -s)\n");
   printf("  -p PORT       Set port number (only valid with -c or -s)\n");
   printf("  -x            Enable threaded mode (only valid with -s)\n");
+  printf("  -e            Enable event driven epoll mode (only valid with -s)\n");
+  printf("  -u PATH       Server: also listen on Unix socket PATH, client: connect to it\n");
+  printf("                (only valid with -c or -s)\n");
+  printf("  -f            Pass our stdin, stdout and stderr to the server, commands\n");
+  printf("                write to them directly (only valid with -c -u)\n");
+  printf("  -z            Ask for compressed output (only valid with -c)\n");
+  printf("  -r CMD        Run CMD on the server with this stdin, then exit (only valid with -c)\n");
+  printf("  -m PATH       Write server metrics to PATH every %d seconds (only valid with -s)\n",
+         RDSH_STATS_DUMP_SECS);
+  printf("  -l P,N[,p,n]  Run at most P pipelines of N processes in all, p and n per\n");
+  printf("                client, 0 keeps the default (%d,%d,%d,%d, only valid with -s)\n",
+         RDSH_ADMIT_PIPELINES, RDSH_ADMIT_PROCS,
+         RDSH_ADMIT_CLIENT_PIPELINES, RDSH_ADMIT_CLIENT_PROCS);
   printf("  -h            Show this help message\n");
   exit(0);
 }
@@ -49,7 +66,7 @@ void parse_args(int argc, char *argv[], cmd_args_t *cargs) {
   cargs->mode = MODE_LCLI;
   cargs->port = RDSH_DEF_PORT;
 
-  while ((opt = getopt(argc, argv, "csi:p:xh")) != -1) {
+  while ((opt = getopt(argc, argv, "csi:p:xeu:fzr:m:l:h")) != -1) {
       switch (opt) {
           case 'c':
               if (cargs->mode != MODE_LCLI) {
@@ -91,8 +108,73 @@ void parse_args(int argc, char *argv[], cmd_args_t *cargs) {
                   fprintf(stderr, "Error: -x can only be used with -s\n");
                   exit(EXIT_FAILURE);
               }
-              cargs->threaded_server = 1;
+              if (cargs->svr_mode == RDSH_SVR_EVENT) {
+                  fprintf(stderr, "Error: Cannot use both -x and -e\n");
+                  exit(EXIT_FAILURE);
+              }
+              cargs->svr_mode = RDSH_SVR_THREADED;
+              break;
+          case 'e':
+              if (cargs->mode != MODE_SSVR) {
+                  fprintf(stderr, "Error: -e can only be used with -s\n");
+                  exit(EXIT_FAILURE);
+              }
+              if (cargs->svr_mode == RDSH_SVR_THREADED) {
+                  fprintf(stderr, "Error: Cannot use both -x and -e\n");
+                  exit(EXIT_FAILURE);
+              }
+              cargs->svr_mode = RDSH_SVR_EVENT;
+              break;
+          case 'u':
+              if (cargs->mode == MODE_LCLI) {
+                  fprintf(stderr, "Error: -u can only be used with -c or -s\n");
+                  exit(EXIT_FAILURE);
+              }
+              // a path without a '/' would be taken for an address
+              snprintf(cargs->unix_path, sizeof(cargs->unix_path), "%s%s",
+                       strchr(optarg, '/') ? "" : "./", optarg);
+              break;
+          case 'f':
+              if (cargs->mode != MODE_SCLI) {
+                  fprintf(stderr, "Error: -f can only be used with -c\n");
+                  exit(EXIT_FAILURE);
+              }
+              cargs->cli_opts |= RDSH_OPT_PASSFD;
+              break;
+          case 'z':
+              if (cargs->mode != MODE_SCLI) {
+                  fprintf(stderr, "Error: -z can only be used with -c\n");
+                  exit(EXIT_FAILURE);
+              }
+              cargs->cli_opts |= RDSH_OPT_DEFLATE;
+              break;
+          case 'r':
+              if (cargs->mode != MODE_SCLI) {
+                  fprintf(stderr, "Error: -r can only be used with -c\n");
+                  exit(EXIT_FAILURE);
+              }
+              cargs->run_cmd = optarg;
+              break;
+          case 'm':
+              if (cargs->mode != MODE_SSVR) {
+                  fprintf(stderr, "Error: -m can only be used with -s\n");
+                  exit(EXIT_FAILURE);
+              }
+              cargs->stats_path = optarg;
+              break;
+          case 'l': {
+              int lim[4] = { 0, 0, 0, 0 };
+              if (cargs->mode != MODE_SSVR) {
+                  fprintf(stderr, "Error: -l can only be used with -s\n");
+                  exit(EXIT_FAILURE);
+              }
+              if (sscanf(optarg, "%d,%d,%d,%d", &lim[0], &lim[1], &lim[2], &lim[3]) < 2) {
+                  fprintf(stderr, "Error: -l takes P,N[,p,n]\n");
+                  exit(EXIT_FAILURE);
+              }
+              rsh_admit_limits(lim[0], lim[1], lim[2], lim[3]);
               break;
+          }
           case 'h':
               print_usage(argv[0]);
               break;
@@ -101,8 +183,8 @@ void parse_args(int argc, char *argv[], cmd_args_t *cargs) {
       }
   }
 
-  if (cargs->threaded_server && cargs->mode != MODE_SSVR) {
-      fprintf(stderr, "Error: -x can only be used with -s\n");
+  if (cargs->svr_mode != RDSH_SVR_SERIAL && cargs->mode != MODE_SSVR) {
+      fprintf(stderr, "Error: -x and -e can only be used with -s\n");
       exit(EXIT_FAILURE);
   }
 }
@@ -128,17 +210,25 @@ int main(int argc, char *argv[]){
       rc = exec_local_cmd_loop();
       break;
     case MODE_SCLI:
-      printf("socket client mode:  addr:%s:%d\n", cargs.ip, cargs.port);
-      rc = exec_remote_cmd_loop(cargs.ip, cargs.port);
+      if (cargs.unix_path[0])
+        printf("socket client mode:  addr:%s\n", cargs.unix_path);
+      else
+        printf("socket client mode:  addr:%s:%d\n", cargs.ip, cargs.port);
+      rc = exec_remote_cmd_loop(cargs.unix_path[0] ? cargs.unix_path : cargs.ip,
+                                cargs.port, cargs.cli_opts, cargs.run_cmd);
       break;
     case MODE_SSVR:
       printf("socket server mode:  addr:%s:%d\n", cargs.ip, cargs.port);
-      if (cargs.threaded_server){
+      if (cargs.svr_mode == RDSH_SVR_THREADED){
         printf("-> Multi-Threaded Mode\n");
+      } else if (cargs.svr_mode == RDSH_SVR_EVENT){
+        printf("-> Event Driven Mode\n");
       } else {
         printf("-> Single-Threaded Mode\n");
       }
-      rc = start_server(cargs.ip, cargs.port, cargs.threaded_server);
+      rc = start_server(cargs.ip, cargs.port,
+                        cargs.unix_path[0] ? cargs.unix_path : NULL,
+                        cargs.stats_path, cargs.svr_mode);
       break;
     default:
       printf("error unknown mode\n");
@@ -0,0 +1,277 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#include <errno.h>
+#include "dshlib.h"
+
+// In-process versions of echo, pwd, cat, ls and true.  Most commands sent
+// to the shell are this trivial, and spawning one costs far more than what
+// it does.  Each answers only the forms whose output it reproduces byte for
+// byte, anything else (an option it does not know, a locale that changes
+// the sort order, more output than fits in a fast_out_t) is FAST_FALLBACK
+// and the real tool runs instead.  They only read, so dropping a result
+// and running the tool has no side effects twice, which holds because cat
+// only reads regular files and neither looks into /proc, where what a file
+// says depends on who reads it.  Relative paths are resolved from dir_fd, a
+// session's directory or AT_FDCWD.
+
+// Appends len bytes to out, false once it is full
+static bool out_put(fast_out_t *out, const char *s, int len) {
+    if (len > FAST_OUT_MAX - out->len) return false;
+    memcpy(out->buf + out->len, s, len);
+    out->len += len;
+    return true;
+}
+
+static bool out_str(fast_out_t *out, const char *s) {
+    return out_put(out, s, strlen(s));
+}
+
+// The coreutils message for a file that failed, "cat: NAME: reason"
+static bool out_err(fast_out_t *err, const char *tool, const char *name, int errnum) {
+    return out_str(err, tool) && out_str(err, ": ") && out_str(err, name) &&
+           out_str(err, ": ") && out_str(err, strerror(errnum)) && out_str(err, "\n");
+}
+
+// --help and --version are only options when they are the sole argument
+static bool asks_for_help(cmd_buff_t *cmd) {
+    return cmd->argc == 2 &&
+           (strcmp(cmd->argv[1], "--help") == 0 || strcmp(cmd->argv[1], "--version") == 0);
+}
+
+// true if the locale the tools would set up is not the C one
+static bool other_locale(void) {
+    const char *vars[] = { "LC_ALL", "LC_COLLATE", "LANG" };
+
+    for (int i = 0; i < 3; i++) {
+        const char *v = getenv(vars[i]);
+        if (v != NULL && *v != '\0')
+            return strcmp(v, "C") != 0 && strcmp(v, "POSIX") != 0;
+    }
+    return false;
+}
+
+// echo [-nE]... ARGS, -e and its escapes are left to the real one
+static int fast_echo(cmd_buff_t *cmd, fast_out_t *out) {
+    bool newline = true;
+    int i = 1;
+
+    if (asks_for_help(cmd) || getenv("POSIXLY_CORRECT")) return FAST_FALLBACK;
+    for (; i < cmd->argc && cmd->argv[i][0] == '-' && cmd->argv[i][1] != '\0'; i++) {
+        const char *opt = cmd->argv[i] + 1;
+        if (opt[strspn(opt, "neE")] != '\0') break;     // an argument after all
+        if (strchr(opt, 'e')) return FAST_FALLBACK;
+        if (strchr(opt, 'n')) newline = false;
+    }
+    for (int first = i; i < cmd->argc; i++) {
+        if ((i > first && !out_put(out, " ", 1)) || !out_str(out, cmd->argv[i]))
+            return FAST_FALLBACK;
+    }
+    if (newline && !out_put(out, "\n", 1)) return FAST_FALLBACK;
+    return 0;
+}
+
+// pwd, physical like coreutils' unless POSIXLY_CORRECT
+static int fast_pwd(cmd_buff_t *cmd, int dir_fd, fast_out_t *out) {
+    char cwd[FAST_OUT_MAX];
+    char link[64];
+    int n;
+
+    if (cmd->argc != 1 || getenv("POSIXLY_CORRECT")) return FAST_FALLBACK;
+    if (dir_fd == AT_FDCWD) {
+        if (getcwd(cwd, sizeof(cwd) - 1) == NULL) return FAST_FALLBACK;
+    } else {
+        // the kernel knows the path of an open directory
+        snprintf(link, sizeof(link), "/proc/self/fd/%d", dir_fd);
+        n = readlink(link, cwd, sizeof(cwd) - 2);
+        if (n <= 0 || cwd[0] != '/') return FAST_FALLBACK;
+        cwd[n] = '\0';
+        if (n > 10 && strcmp(cwd + n - 10, " (deleted)") == 0) return FAST_FALLBACK;
+    }
+    strcat(cwd, "\n");
+    return out_str(out, cwd) ? 0 : FAST_FALLBACK;
+}
+
+// true for an fd on procfs, /proc/self there is the shell itself
+static bool on_proc(int fd) {
+    struct statfs fs;
+
+    return fstatfs(fd, &fs) != 0 || fs.f_type == PROC_SUPER_MAGIC;
+}
+
+// Opens a regular file that fits the output without blocking.  A fifo or
+// device could block or lose what was read on a fallback, and is never
+// opened.  Returns the fd, -1 with errno for cat to report, or -2 to fall
+// back.
+static int open_regular(int dir_fd, const char *path) {
+    struct stat st;
+    int fd;
+
+    if (fstatat(dir_fd, path, &st, 0) != 0)
+        return errno == ENOENT || errno == EACCES || errno == ENOTDIR ? -1 : -2;
+    if (!S_ISREG(st.st_mode)) {
+        if (!S_ISDIR(st.st_mode)) return -2;
+        errno = EISDIR;     // what cat's read() of a directory says
+        return -1;
+    }
+    if (st.st_size > FAST_OUT_MAX) return -2;
+
+    fd = openat(dir_fd, path, O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+    if (fd < 0)
+        return errno == EACCES ? -1 : -2;
+    // it could have been swapped since the stat
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || on_proc(fd)) {
+        close(fd);
+        return -2;
+    }
+    return fd;
+}
+
+// cat FILE... of regular files, stdin and options are left to the real one
+static int fast_cat(cmd_buff_t *cmd, int dir_fd, fast_out_t *out, fast_out_t *err) {
+    int status = 0;
+
+    if (cmd->argc < 2) return FAST_FALLBACK;
+    for (int i = 1; i < cmd->argc; i++)
+        if (cmd->argv[i][0] == '-') return FAST_FALLBACK;
+
+    for (int i = 1; i < cmd->argc; i++) {
+        int fd = open_regular(dir_fd, cmd->argv[i]);
+        int n = -1;
+
+        if (fd == -2) return FAST_FALLBACK;
+        while (fd >= 0 && (n = read(fd, out->buf + out->len, FAST_OUT_MAX - out->len)) > 0)
+            out->len += n;
+        if (n == 0 && out->len == FAST_OUT_MAX) {
+            // full, unless the file happened to end right there
+            char probe;
+            n = read(fd, &probe, 1);
+            if (n != 0) {
+                close(fd);
+                return FAST_FALLBACK;
+            }
+        }
+        if (n < 0) {
+            if (!out_err(err, "cat", cmd->argv[i], errno)) {
+                if (fd >= 0) close(fd);
+                return FAST_FALLBACK;
+            }
+            status = 1;
+        }
+        if (fd >= 0) close(fd);
+    }
+    return status;
+}
+
+static int name_cmp(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// ls [DIR | FILE] into a pipe or file: one name a line, dot files hidden,
+// sorted like the C locale does
+static int fast_ls(cmd_buff_t *cmd, int dir_fd, int out_fd, fast_out_t *out) {
+    const char *path = cmd->argc == 2 ? cmd->argv[1] : ".";
+    char *names[FAST_OUT_MAX / 2];
+    int num = 0;
+    int rc = 0;
+    int fd;
+    struct dirent *ent;
+    DIR *dir;
+
+    // a terminal gets columns and colors
+    if (cmd->argc > 2 || (cmd->argc == 2 && cmd->argv[1][0] == '-') ||
+        isatty(out_fd) || other_locale() || getenv("QUOTING_STYLE"))
+        return FAST_FALLBACK;
+
+    fd = openat(dir_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        // a file is listed by its name, errors are left to the real one
+        if (errno == ENOTDIR && faccessat(dir_fd, path, F_OK, 0) == 0)
+            return out_str(out, path) && out_put(out, "\n", 1) ? 0 : FAST_FALLBACK;
+        return FAST_FALLBACK;
+    }
+    if (on_proc(fd) || (dir = fdopendir(fd)) == NULL) {
+        close(fd);
+        return FAST_FALLBACK;
+    }
+
+    // every name takes at least two bytes of output, more do not fit
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] == '.') continue;
+        if (num == FAST_OUT_MAX / 2 || (names[num] = strdup(ent->d_name)) == NULL) {
+            rc = FAST_FALLBACK;
+            break;
+        }
+        num++;
+    }
+    closedir(dir);
+
+    qsort(names, num, sizeof(char *), name_cmp);
+    for (int i = 0; i < num; i++) {
+        if (rc == 0 && !(out_str(out, names[i]) && out_put(out, "\n", 1)))
+            rc = FAST_FALLBACK;
+        free(names[i]);
+    }
+    return rc;
+}
+
+// true if fds a and b write to the same file, terminal or pipe, what a
+// command prints to both then goes in one buffer to keep its order
+bool fast_same_output(int a, int b) {
+    struct stat sa, sb;
+
+    return a == b ||
+           (fstat(a, &sa) == 0 && fstat(b, &sb) == 0 &&
+            sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino);
+}
+
+// true if cmd is one of the commands above in a form they can run.  Only
+// the arguments are looked at, exec_fast_command() may still fall back.
+// Redirections are left to the real tools.
+bool fast_command(cmd_buff_t *cmd) {
+    if (cmd->argc < 1 || cmd->input_file || cmd->output_file) return false;
+
+    switch (match_command(cmd->argv[0])) {
+    case BI_CMD_ECHO:
+    case BI_CMD_PWD:
+    case BI_CMD_LS:
+    case BI_CMD_TRUE:
+        return true;
+    case BI_CMD_CAT:
+        return cmd->argc > 1;       // cat alone reads stdin
+    default:
+        return false;
+    }
+}
+
+// Runs cmd in-process in directory dir_fd, its stdout into out and its
+// stderr into err, which may be the same buffer when they go to the same
+// place.  out_fd is where out will be written, some tools format for a
+// terminal.
+// Returns the exit status the real tool would, or FAST_FALLBACK.
+int exec_fast_command(cmd_buff_t *cmd, int dir_fd, int out_fd, fast_out_t *out, fast_out_t *err) {
+    out->len = 0;
+    err->len = 0;
+
+    switch (match_command(cmd->argv[0])) {
+    case BI_CMD_ECHO:
+        return fast_echo(cmd, out);
+    case BI_CMD_PWD:
+        return fast_pwd(cmd, dir_fd, out);
+    case BI_CMD_CAT:
+        return fast_cat(cmd, dir_fd, out, err);
+    case BI_CMD_LS:
+        return fast_ls(cmd, dir_fd, out_fd, out);
+    case BI_CMD_TRUE:
+        return asks_for_help(cmd) ? FAST_FALLBACK : 0;
+    default:
+        return FAST_FALLBACK;
+    }
+}
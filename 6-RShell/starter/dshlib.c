@@ -1,3 +1,4 @@
+#define _GNU_SOURCE     // pipe2, environ
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -6,6 +7,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/wait.h>
+#include <spawn.h>
 #include <errno.h>
 #include "dshlib.h"
 
@@ -185,69 +187,125 @@ int exec_rc_command(cmd_buff_t *cmd __attribute__((unused))) {
     return OK;
 }
 
-// Execute a single external command
-int exec_external_command(cmd_buff_t *cmd) {
-    pid_t pid = fork();
-    
-    if (pid < 0) {
-        perror("fork");
-        last_return_code = errno;
-        return ERR_EXEC_CMD;
+// Open the redirection files of cmd.  Input is only opened when want_in and
+// output when want_out, a pipe takes precedence over a file.  The fds are
+// close on exec, spawn_command() dup2()s them onto stdin and stdout.
+// Returns 0, or the errno of the open that failed with *in_fd closed again.
+static int open_redirs(cmd_buff_t *cmd, bool want_in, bool want_out, int *in_fd, int *out_fd) {
+    *in_fd = -1;
+    *out_fd = -1;
+    
+    if (want_in && cmd->input_file) {
+        *in_fd = open(cmd->input_file, O_RDONLY | O_CLOEXEC);
+        if (*in_fd < 0) {
+            int err = errno;
+            perror("open input file");
+            return err;
+        }
     }
     
-    if (pid == 0) {
-        // Child process
-        
-        // Handle input/output redirection if supported
-        if (cmd->input_file) {
-            int fd = open(cmd->input_file, O_RDONLY);
-            if (fd < 0) {
-                perror("open input file");
-                exit(errno);
-            }
-            if (dup2(fd, STDIN_FILENO) < 0) {
-                perror("dup2 stdin");
-                exit(errno);
-            }
-            close(fd);
+    if (want_out && cmd->output_file) {
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+        if (cmd->append_mode) {
+            flags |= O_APPEND;
+        } else {
+            flags |= O_TRUNC;
         }
         
-        if (cmd->output_file) {
-            int flags = O_WRONLY | O_CREAT;
-            if (cmd->append_mode) {
-                flags |= O_APPEND;
-            } else {
-                flags |= O_TRUNC;
-            }
-            
-            int fd = open(cmd->output_file, flags, 0644);
-            if (fd < 0) {
-                perror("open output file");
-                exit(errno);
-            }
-            if (dup2(fd, STDOUT_FILENO) < 0) {
-                perror("dup2 stdout");
-                exit(errno);
-            }
-            close(fd);
+        *out_fd = open(cmd->output_file, flags, 0644);
+        if (*out_fd < 0) {
+            int err = errno;
+            perror("open output file");
+            if (*in_fd >= 0) close(*in_fd);
+            *in_fd = -1;
+            return err;
         }
-        
-        // Execute the command
-        execvp(cmd->argv[0], cmd->argv);
-        
-        // If execvp returns, there was an error
-        if (errno == ENOENT) {
+    }
+    
+    return 0;
+}
+
+// Start cmd with posix_spawnp().  glibc runs the child with
+// clone(CLONE_VM | CLONE_VFORK), no page tables are copied so the cost does
+// not grow with the shell's memory the way fork() does.  in_fd and out_fd
+// become stdin and stdout, -1 leaves them alone.  Every other fd the shell
+// opens is close on exec and does not reach the command.
+// Returns 0 with *pid set, or the errno of the failed exec.
+static int spawn_command(cmd_buff_t *cmd, int in_fd, int out_fd, pid_t *pid) {
+    posix_spawn_file_actions_t actions;
+    int rc;
+    
+    if (posix_spawn_file_actions_init(&actions) != 0) return ENOMEM;
+    if (in_fd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    }
+    if (out_fd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    }
+    
+    rc = posix_spawnp(pid, cmd->argv[0], &actions, NULL, cmd->argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    return rc;
+}
+
+// Write all of len bytes, a terminal may take them in pieces
+static void write_all(int fd, const char *buf, int len) {
+    while (len > 0) {
+        int n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        buf += n;
+        len -= n;
+    }
+}
+
+// Run cmd in-process when exec_fast_command() can, straight to our stdout
+// and stderr like a child would write them.
+// Returns true if it ran, with last_return_code set.
+static bool exec_fast(cmd_buff_t *cmd) {
+    fast_out_t out, err;
+    bool merged;
+    int status;
+    
+    if (!fast_command(cmd)) return false;
+    merged = fast_same_output(STDOUT_FILENO, STDERR_FILENO);
+    status = exec_fast_command(cmd, AT_FDCWD, STDOUT_FILENO, &out, merged ? &out : &err);
+    if (status == FAST_FALLBACK) return false;
+    
+    write_all(STDOUT_FILENO, out.buf, out.len);
+    if (!merged) write_all(STDERR_FILENO, err.buf, err.len);
+    last_return_code = status;
+    return true;
+}
+
+// Execute a single external command
+int exec_external_command(cmd_buff_t *cmd) {
+    int in_fd, out_fd;
+    pid_t pid;
+    
+    if (exec_fast(cmd)) return OK;
+    
+    int rc = open_redirs(cmd, true, true, &in_fd, &out_fd);
+    if (rc == 0) {
+        rc = spawn_command(cmd, in_fd, out_fd, &pid);
+        if (rc == ENOENT) {
             fprintf(stderr, "Command not found in PATH\n");
-        } else if (errno == EACCES) {
+        } else if (rc == EACCES) {
             fprintf(stderr, "Permission denied\n");
-        } else {
+        } else if (rc != 0) {
             fprintf(stderr, "Error executing command\n");
         }
-        
-        exit(errno);
+    }
+    if (in_fd >= 0) close(in_fd);
+    if (out_fd >= 0) close(out_fd);
+    
+    // A command that could not be started exits with the errno, like the
+    // forked child used to
+    if (rc != 0) {
+        last_return_code = rc;
+        return OK;
     }
     
-    // Parent process
     int status;
     waitpid(pid, &status, 0);
     
@@ -282,89 +340,43 @@ int execute_pipeline(command_list_t *clist) {
     // Setup pipes for commands
     int pipes[CMD_MAX-1][2];
     pid_t child_pids[CMD_MAX];
+    int spawn_errs[CMD_MAX];
     
-    // Create all pipes needed
+    // Create all pipes needed, close on exec so each command only gets
+    // the two ends spawn_command() puts on its stdin and stdout
     for (int i = 0; i < clist->num - 1; i++) {
-        if (pipe(pipes[i]) == -1) {
+        if (pipe2(pipes[i], O_CLOEXEC) == -1) {
             perror("pipe");
-            return ERR_EXEC_CMD;
-        }
-    }
-    
-    // Create all child processes
-    for (int i = 0; i < clist->num; i++) {
-        child_pids[i] = fork();
-        
-        if (child_pids[i] < 0) {
-            perror("fork");
-            
-            // Close all pipes
-            for (int j = 0; j < clist->num - 1; j++) {
+            for (int j = 0; j < i; j++) {
                 close(pipes[j][0]);
                 close(pipes[j][1]);
             }
-            
-            // Kill any child processes already created
-            for (int j = 0; j < i; j++) {
-                kill(child_pids[j], SIGTERM);
-                waitpid(child_pids[j], NULL, 0);
-            }
-            
             return ERR_EXEC_CMD;
         }
+    }
+    
+    // Start every command.  One that cannot be started does not stop the
+    // others, just like a forked child whose exec failed.
+    for (int i = 0; i < clist->num; i++) {
+        bool first = (i == 0);
+        bool last = (i == clist->num - 1);
+        int in_fd, out_fd;
         
-        if (child_pids[i] == 0) {
-            // Child process
-            
-            // Handle stdin from previous pipe (except first command)
-            if (i > 0) {
-                dup2(pipes[i-1][0], STDIN_FILENO);
-            } else if (clist->commands[i].input_file) {
-                // First command with input redirection
-                int fd = open(clist->commands[i].input_file, O_RDONLY);
-                if (fd < 0) {
-                    perror("open input file");
-                    exit(errno);
-                }
-                dup2(fd, STDIN_FILENO);
-                close(fd);
-            }
-            
-            // Handle stdout to next pipe (except last command)
-            if (i < clist->num - 1) {
-                dup2(pipes[i][1], STDOUT_FILENO);
-            } else if (clist->commands[i].output_file) {
-                // Last command with output redirection
-                int flags = O_WRONLY | O_CREAT;
-                if (clist->commands[i].append_mode) {
-                    flags |= O_APPEND;
-                } else {
-                    flags |= O_TRUNC;
-                }
-                
-                int fd = open(clist->commands[i].output_file, flags, 0644);
-                if (fd < 0) {
-                    perror("open output file");
-                    exit(errno);
-                }
-                dup2(fd, STDOUT_FILENO);
-                close(fd);
-            }
-            
-            // Close all pipe file descriptors
-            for (int j = 0; j < clist->num - 1; j++) {
-                close(pipes[j][0]);
-                close(pipes[j][1]);
+        // stdin from the previous pipe, or a file for the first command;
+        // stdout to the next pipe, or a file for the last command
+        spawn_errs[i] = open_redirs(&clist->commands[i], first, last, &in_fd, &out_fd);
+        if (spawn_errs[i] == 0) {
+            spawn_errs[i] = spawn_command(&clist->commands[i],
+                                          first ? in_fd : pipes[i-1][0],
+                                          last ? out_fd : pipes[i][1],
+                                          &child_pids[i]);
+            if (spawn_errs[i] != 0) {
+                fprintf(stderr, "execvp failed for %s: %s\n",
+                        clist->commands[i].argv[0], strerror(spawn_errs[i]));
             }
-            
-            // Execute the command
-            execvp(clist->commands[i].argv[0], clist->commands[i].argv);
-            
-            // If execvp returns, there was an error
-            fprintf(stderr, "execvp failed for %s: %s\n", 
-                    clist->commands[i].argv[0], strerror(errno));
-            exit(errno);
         }
+        if (in_fd >= 0) close(in_fd);
+        if (out_fd >= 0) close(out_fd);
     }
     
     // Parent process: close all pipe file descriptors
@@ -376,6 +388,12 @@ int execute_pipeline(command_list_t *clist) {
     // Wait for all child processes to complete
     int status;
     for (int i = 0; i < clist->num; i++) {
+        if (spawn_errs[i] != 0) {
+            if (i == clist->num - 1) {
+                last_return_code = spawn_errs[i];
+            }
+            continue;
+        }
         waitpid(child_pids[i], &status, 0);
         if (i == clist->num - 1 && WIFEXITED(status)) {
             last_return_code = WEXITSTATUS(status);
@@ -394,6 +412,11 @@ Built_In_Cmds match_command(const char *input) {
     if (strcmp(input, "rc") == 0) return BI_CMD_RC;
     if (strcmp(input, "dragon") == 0) return BI_CMD_DRAGON;
     if (strcmp(input, "stop-server") == 0) return BI_CMD_STOP_SVR;
+    if (strcmp(input, "echo") == 0) return BI_CMD_ECHO;
+    if (strcmp(input, "pwd") == 0) return BI_CMD_PWD;
+    if (strcmp(input, "cat") == 0) return BI_CMD_CAT;
+    if (strcmp(input, "ls") == 0) return BI_CMD_LS;
+    if (strcmp(input, "true") == 0) return BI_CMD_TRUE;
     
     return BI_NOT_BI;
 }
@@ -71,12 +71,31 @@ typedef enum {
     BI_CMD_CD,
     BI_CMD_RC,              //extra credit command
     BI_CMD_STOP_SVR,        //new command "stop-server"
+    BI_CMD_SVR_STATS,       //"server-stats", rsh server counters
+    BI_CMD_ECHO,            //echo, pwd, cat, ls and true run in-process
+    BI_CMD_PWD,             //when they can, see dsh_fast.c
+    BI_CMD_CAT,
+    BI_CMD_LS,
+    BI_CMD_TRUE,
     BI_NOT_BI,
     BI_EXECUTED,
 } Built_In_Cmds;
 Built_In_Cmds match_command(const char *input); 
 Built_In_Cmds exec_built_in_cmd(cmd_buff_t *cmd);
 
+//in-process commands, what they print is collected and written at once
+#define FAST_OUT_MAX    4096    //PIPE_BUF, a pipe takes one write() whole
+#define FAST_FALLBACK   -1      //run the real tool instead
+
+typedef struct fast_out {
+    int  len;
+    char buf[FAST_OUT_MAX];
+} fast_out_t;
+
+bool fast_command(cmd_buff_t *cmd);
+bool fast_same_output(int a, int b);
+int exec_fast_command(cmd_buff_t *cmd, int dir_fd, int out_fd, fast_out_t *out, fast_out_t *err);
+
 //main execution context
 int exec_local_cmd_loop();
 int exec_cmd(cmd_buff_t *cmd);
@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "dshlib.h"
+#include "rshlib.h"
+
+//Admission control, see rshlib.h.  Every client has a FIFO of commands
+//waiting to start, and whenever a pipeline ends the waiting clients are
+//granted in turn, one command each a round, so a client with many
+//connections cannot push the others out.  Everything is guarded by one
+//lock, taken once before and once after each pipeline.
+
+struct rsh_admit_client {
+    char                addr[RDSH_PEER_KEY_SZ];
+    int                 refs;           //connections of the client
+    int                 pipes;          //pipelines running
+    int                 procs;          //processes they started
+    int                 waiting;
+    rsh_admit_waiter_t  *head, *tail;
+    struct rsh_admit_client *prev, *next;
+};
+
+static struct {
+    int                 max_pipes;
+    int                 max_procs;
+    int                 client_pipes;
+    int                 client_procs;
+    int                 pipes;
+    int                 procs;
+    int                 waiting;
+    rsh_admit_client_t  *clients;
+    rsh_admit_client_t  *cursor;        //first client of the next round
+    pthread_mutex_t     lock;
+    pthread_cond_t      granted;        //blocking waiters
+} admit = {
+    .max_pipes = RDSH_ADMIT_PIPELINES,
+    .max_procs = RDSH_ADMIT_PROCS,
+    .client_pipes = RDSH_ADMIT_CLIENT_PIPELINES,
+    .client_procs = RDSH_ADMIT_CLIENT_PROCS,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .granted = PTHREAD_COND_INITIALIZER,
+};
+
+/*
+ * rsh_admit_limits(pipes, procs, client_pipes, client_procs)
+ *
+ * Sets the limits before the server starts, 0 keeps the default.
+ */
+void rsh_admit_limits(int pipes, int procs, int client_pipes, int client_procs){
+    if (pipes > 0)
+        admit.max_pipes = pipes;
+    if (procs > 0)
+        admit.max_procs = procs;
+    if (client_pipes > 0)
+        admit.client_pipes = client_pipes;
+    if (client_procs > 0)
+        admit.client_procs = client_procs;
+}
+
+/*
+ * rsh_admit_join(sock)
+ *
+ * returns:  the client sock belongs to, see rsh_peer_key(), or NULL if
+ *           out of memory, its commands are then never held back
+ */
+rsh_admit_client_t *rsh_admit_join(int sock){
+    rsh_admit_client_t *cl;
+    char key[RDSH_PEER_KEY_SZ];
+
+    rsh_peer_key(sock, key);
+    pthread_mutex_lock(&admit.lock);
+    for (cl = admit.clients; cl != NULL; cl = cl->next)
+        if (strcmp(cl->addr, key) == 0)
+            break;
+    if (cl == NULL && (cl = calloc(1, sizeof(*cl))) != NULL) {
+        strcpy(cl->addr, key);
+        cl->next = admit.clients;
+        if (admit.clients)
+            admit.clients->prev = cl;
+        admit.clients = cl;
+    }
+    if (cl != NULL)
+        cl->refs++;
+    pthread_mutex_unlock(&admit.lock);
+    return cl;
+}
+
+void rsh_admit_leave(rsh_admit_client_t *cl){
+    if (cl == NULL)
+        return;
+    pthread_mutex_lock(&admit.lock);
+    if (--cl->refs == 0) {
+        if (admit.cursor == cl)
+            admit.cursor = cl->next;
+        if (cl->prev)
+            cl->prev->next = cl->next;
+        else
+            admit.clients = cl->next;
+        if (cl->next)
+            cl->next->prev = cl->prev;
+        free(cl);
+    }
+    pthread_mutex_unlock(&admit.lock);
+}
+
+/*
+ * fits(cl, procs)
+ *
+ * A pipeline fits while the client and the server are under their
+ * limits.  One bigger than a process limit on its own still runs, alone.
+ */
+static bool fits(rsh_admit_client_t *cl, int procs){
+    return admit.pipes < admit.max_pipes &&
+           (admit.procs == 0 || admit.procs + procs <= admit.max_procs) &&
+           cl->pipes < admit.client_pipes &&
+           (cl->procs == 0 || cl->procs + procs <= admit.client_procs);
+}
+
+static void take(rsh_admit_client_t *cl, int procs){
+    admit.pipes++;
+    admit.procs += procs;
+    cl->pipes++;
+    cl->procs += procs;
+    rsh_stats_admission(admit.pipes, admit.procs, admit.waiting);
+}
+
+static void unlink_waiter(rsh_admit_waiter_t *w){
+    rsh_admit_client_t *cl = w->client;
+    rsh_admit_waiter_t **p = &cl->head;
+
+    while (*p != w)
+        p = &(*p)->next;
+    *p = w->next;
+    if (cl->tail == w) {
+        cl->tail = NULL;
+        for (rsh_admit_waiter_t *t = cl->head; t != NULL; t = t->next)
+            cl->tail = t;
+    }
+    cl->waiting--;
+    admit.waiting--;
+}
+
+/*
+ * dispatch(self)
+ *
+ * Grants waiting commands round robin over the clients, the head of each
+ * client's queue in turn, until nothing waiting fits.  Granted waiters
+ * are woken, but self, the caller's own, is not.
+ */
+static void dispatch(rsh_admit_waiter_t *self){
+    bool progress = true;
+
+    while (progress && admit.waiting > 0) {
+        rsh_admit_client_t *start = admit.cursor ? admit.cursor : admit.clients;
+        rsh_admit_client_t *cl = start;
+
+        progress = false;
+        do {
+            rsh_admit_waiter_t *w = cl->head;
+            rsh_admit_client_t *next = cl->next ? cl->next : admit.clients;
+
+            if (w != NULL && fits(cl, w->procs)) {
+                unlink_waiter(w);
+                take(cl, w->procs);
+                w->state = RDSH_ADMIT_GRANTED;
+                if (w != self && w->wake != NULL)
+                    w->wake(w);
+                admit.cursor = next;
+                progress = true;
+            }
+            cl = next;
+        } while (cl != start);
+    }
+    rsh_stats_admission(admit.pipes, admit.procs, admit.waiting);
+}
+
+/*
+ * rsh_admit_enter(cl, w, procs)
+ *
+ * Asks to start a pipeline of procs processes for client cl.  If it
+ * cannot start now w joins the client's queue, w->wake(w) is called from
+ * whichever thread grants it later, or rsh_admit_cancel() takes it back.
+ * A full queue, the server's or the client's, is an answer right away.
+ *
+ * returns:  RDSH_ADMIT_GRANTED, RDSH_ADMIT_WAITING or RDSH_ADMIT_BUSY
+ */
+int rsh_admit_enter(rsh_admit_client_t *cl, rsh_admit_waiter_t *w, int procs){
+    int state;
+
+    w->client = cl;
+    w->procs = procs;
+    w->next = NULL;
+    w->deadline = rsh_stats_now() + RDSH_ADMIT_WAIT_MS * 1000000ull;
+    if (cl == NULL)
+        return w->state = RDSH_ADMIT_GRANTED;
+
+    pthread_mutex_lock(&admit.lock);
+    if (admit.waiting == 0 && fits(cl, procs)) {
+        take(cl, procs);
+        w->state = RDSH_ADMIT_GRANTED;
+    } else if (admit.waiting >= RDSH_ADMIT_QUEUE_MAX ||
+               cl->waiting >= RDSH_ADMIT_CLIENT_QUEUE) {
+        w->state = RDSH_ADMIT_BUSY;
+    } else {
+        w->state = RDSH_ADMIT_WAITING;
+        if (cl->tail)
+            cl->tail->next = w;
+        else
+            cl->head = w;
+        cl->tail = w;
+        cl->waiting++;
+        admit.waiting++;
+        dispatch(w);
+    }
+    // once unlocked a waiter can be granted any time
+    state = w->state;
+    pthread_mutex_unlock(&admit.lock);
+
+    if (state == RDSH_ADMIT_BUSY)
+        rsh_stats_busy();
+    return state;
+}
+
+/*
+ * rsh_admit_cancel(w)
+ *
+ * Takes a waiting command out of its queue, it timed out or its client
+ * went away.
+ *
+ * returns:  true if it was still waiting, false if it had been granted
+ *           and must be released with rsh_admit_done()
+ */
+bool rsh_admit_cancel(rsh_admit_waiter_t *w){
+    bool waiting;
+
+    pthread_mutex_lock(&admit.lock);
+    waiting = w->state == RDSH_ADMIT_WAITING;
+    if (waiting) {
+        unlink_waiter(w);
+        w->state = RDSH_ADMIT_BUSY;
+        rsh_stats_admission(admit.pipes, admit.procs, admit.waiting);
+    }
+    pthread_mutex_unlock(&admit.lock);
+    return waiting;
+}
+
+/*
+ * rsh_admit_granted(w)
+ *
+ * For a thread other than the granting one, the state under the lock.
+ */
+int rsh_admit_granted(rsh_admit_waiter_t *w){
+    int state;
+
+    pthread_mutex_lock(&admit.lock);
+    state = w->state;
+    pthread_mutex_unlock(&admit.lock);
+    return state == RDSH_ADMIT_GRANTED;
+}
+
+/*
+ * rsh_admit_done(w)
+ *
+ * The pipeline w was granted for has ended, what waits may start.
+ */
+void rsh_admit_done(rsh_admit_waiter_t *w){
+    rsh_admit_client_t *cl = w->client;
+
+    if (cl == NULL || w->state != RDSH_ADMIT_GRANTED)
+        return;
+    pthread_mutex_lock(&admit.lock);
+    admit.pipes--;
+    admit.procs -= w->procs;
+    cl->pipes--;
+    cl->procs -= w->procs;
+    w->state = RDSH_ADMIT_DONE;
+    dispatch(NULL);
+    pthread_mutex_unlock(&admit.lock);
+}
+
+static void wake_blocked(rsh_admit_waiter_t *w){
+    (void)w;
+    pthread_cond_broadcast(&admit.granted);
+}
+
+/*
+ * rsh_admit_wait(cl, w, procs)
+ *
+ * rsh_admit_enter() for a thread that can block, waiting up to
+ * RDSH_ADMIT_WAIT_MS for its turn.
+ *
+ * returns:  OK once granted, or ERR_RDSH_BUSY
+ */
+int rsh_admit_wait(rsh_admit_client_t *cl, rsh_admit_waiter_t *w, int procs){
+    struct timespec until;
+    int rc = 0;
+
+    w->wake = wake_blocked;
+    switch (rsh_admit_enter(cl, w, procs)) {
+    case RDSH_ADMIT_GRANTED:
+        return OK;
+    case RDSH_ADMIT_BUSY:
+        return ERR_RDSH_BUSY;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += RDSH_ADMIT_WAIT_MS / 1000;
+    until.tv_nsec += (RDSH_ADMIT_WAIT_MS % 1000) * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&admit.lock);
+    while (w->state == RDSH_ADMIT_WAITING && rc != ETIMEDOUT)
+        rc = pthread_cond_timedwait(&admit.granted, &admit.lock, &until);
+    pthread_mutex_unlock(&admit.lock);
+
+    if (rsh_admit_cancel(w)) {
+        rsh_stats_busy();
+        return ERR_RDSH_BUSY;
+    }
+    return OK;
+}
@@ -6,21 +6,467 @@
 #include <unistd.h>
 #include <sys/un.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <poll.h>
 
 #include "dshlib.h"
 #include "rshlib.h"
 
 
+//A line of input in a v2 session.  A v3 server lets us send commands
+//before the answers to earlier ones are back, so lines are queued until
+//everything before them has been shown.  The prompt and output of each
+//line come out in the same order as if every command had waited.
+typedef enum { LINE_CMD, LINE_LOCAL, LINE_RC, LINE_EOF } line_kind_t;
+
+typedef struct line {
+    line_kind_t kind;
+    uint16_t    id;             //request id of a LINE_CMD
+    bool        prompted;       //its prompt is already on the screen
+    bool        stop;           //stop-server, the session ends with it
+} line_t;
+
+typedef struct session {
+    int         sock;
+    int         proto;
+    int         opts;           //RDSH_OPT_* the server granted
+    z_stream    zs;             //inflates RDSH_FRAME_F_DEFLATE payloads
+    char        *zbuf;          //inflated output, RDSH_COMM_BUFF_SZ
+    line_t      lines[RDSH_PIPELINE_MAX];
+    int         head;
+    int         count;
+    int         inflight;       //commands sent, their EXIT frame not seen
+    int         window;         //commands allowed in flight
+    uint16_t    next_id;
+    bool        reading;        //more lines are wanted from stdin
+    bool        prompted;       //prompt shown for the line not read yet
+    int         status;         //exit status of the last answered command
+} session_t;
+
+static void show_local(session_t *ss);
+
+static void push_line(session_t *ss, line_kind_t kind, uint16_t id, bool stop)
+{
+    line_t *line = &ss->lines[(ss->head + ss->count) % RDSH_PIPELINE_MAX];
+
+    line->kind = kind;
+    line->id = id;
+    line->stop = stop;
+    line->prompted = ss->prompted;
+    ss->prompted = false;
+    ss->count++;
+}
+
+static line_t *pop_line(session_t *ss)
+{
+    line_t *line = &ss->lines[ss->head];
+
+    ss->head = (ss->head + 1) % RDSH_PIPELINE_MAX;
+    ss->count--;
+    return line;
+}
+
+/*
+ * take_line(ss, cmd)
+ *
+ * Queues one line of input, sending it right away if it is a command for
+ * the server.  exit and stop-server end the input.  When the server writes
+ * to our stdout itself (RDSH_OPT_PASSFD) everything before the command,
+ * its prompt included, is printed and flushed first.
+ */
+static int take_line(session_t *ss, char *cmd)
+{
+    bool stop;
+
+    cmd[strcspn(cmd, "\n")] = '\0';
+    if (strlen(cmd) == 0) {
+        push_line(ss, LINE_LOCAL, 0, false);
+        return OK;
+    }
+    if (strcmp(cmd, "rc") == 0) {
+        push_line(ss, LINE_RC, 0, false);
+        return OK;
+    }
+
+    if (ss->opts & RDSH_OPT_PASSFD) {
+        show_local(ss);
+        if (!ss->prompted) {
+            printf("%s", SH_PROMPT);
+            ss->prompted = true;
+        }
+        fflush(stdout);
+    }
+
+    if (rsh_send_frame(ss->sock, RDSH_FRAME_CMD, ss->next_id, cmd, strlen(cmd)) != OK) {
+        perror("send");
+        return ERR_RDSH_COMMUNICATION;
+    }
+
+    if (strcmp(cmd, EXIT_CMD) == 0) {
+        push_line(ss, LINE_LOCAL, 0, false);
+        ss->reading = false;
+        return OK;
+    }
+
+    stop = strcmp(cmd, "stop-server") == 0;
+    push_line(ss, LINE_CMD, ss->next_id, stop);
+    ss->inflight++;
+    if (stop)
+        ss->reading = false;
+    if (++ss->next_id == 0)
+        ss->next_id = 1;
+    return OK;
+}
+
+/*
+ * show_local(ss)
+ *
+ * Prints the lines at the front of the queue that need no answer from the
+ * server.
+ */
+static void show_local(session_t *ss)
+{
+    while (ss->count > 0 && ss->lines[ss->head].kind != LINE_CMD) {
+        line_t *line = pop_line(ss);
+
+        if (!line->prompted)
+            printf("%s", SH_PROMPT);
+        if (line->kind == LINE_RC)
+            printf("%d\n", ss->status);
+        else if (line->kind == LINE_EOF)
+            printf("\n");
+    }
+}
+
+/*
+ * inflate_out(ss, payload, len)
+ *
+ * Prints a deflated OUT payload, one complete raw deflate stream.
+ */
+static int inflate_out(session_t *ss, char *payload, uint32_t len)
+{
+    int zrc;
+
+    inflateReset(&ss->zs);
+    ss->zs.next_in = (Bytef *)payload;
+    ss->zs.avail_in = len;
+    do {
+        ss->zs.next_out = (Bytef *)ss->zbuf;
+        ss->zs.avail_out = RDSH_COMM_BUFF_SZ;
+        zrc = inflate(&ss->zs, Z_NO_FLUSH);
+        if (zrc != Z_OK && zrc != Z_STREAM_END) {
+            fprintf(stderr, "%s", CMD_ERR_RDSH_COMM);
+            return ERR_RDSH_COMMUNICATION;
+        }
+        fwrite(ss->zbuf, 1, RDSH_COMM_BUFF_SZ - ss->zs.avail_out, stdout);
+    } while (zrc != Z_STREAM_END);
+    return OK;
+}
+
+/*
+ * recv_answer(ss, rsp_buff)
+ *
+ * Receives one frame of the answer to the first queued command, printing
+ * an OUT payload of any size as it arrives.
+ *
+ * returns:  the frame type, or ERR_RDSH_COMMUNICATION
+ */
+static int recv_answer(session_t *ss, char *rsp_buff)
+{
+    line_t *line = &ss->lines[ss->head];
+    rsh_frame_hdr_t hdr;
+    uint32_t len, chunk;
+    uint32_t wire;
+
+    if (rsh_recv_all(ss->sock, &hdr, sizeof(hdr)) != OK)
+        return ERR_RDSH_COMMUNICATION;
+    len = ntohl(hdr.len);
+
+    if ((hdr.type != RDSH_FRAME_OUT && hdr.type != RDSH_FRAME_EXIT) ||
+        (hdr.type == RDSH_FRAME_EXIT && len != sizeof(wire)) ||
+        ((hdr.flags & RDSH_FRAME_F_DEFLATE) &&
+         (!(ss->opts & RDSH_OPT_DEFLATE) || len > RDSH_COMM_BUFF_SZ)) ||
+        (ss->proto >= RDSH_PROTO_V3 && ntohs(hdr.id) != line->id)) {
+        fprintf(stderr, "%s", CMD_ERR_RDSH_COMM);
+        return ERR_RDSH_COMMUNICATION;
+    }
+
+    if (!line->prompted) {
+        printf("%s", SH_PROMPT);
+        line->prompted = true;
+    }
+
+    if (hdr.type == RDSH_FRAME_EXIT) {
+        if (rsh_recv_all(ss->sock, &wire, sizeof(wire)) != OK)
+            return ERR_RDSH_COMMUNICATION;
+        ss->status = (int)ntohl(wire);
+        return RDSH_FRAME_EXIT;
+    }
+
+    if (hdr.flags & RDSH_FRAME_F_DEFLATE) {
+        if (rsh_recv_all(ss->sock, rsp_buff, len) != OK)
+            return ERR_RDSH_COMMUNICATION;
+        return inflate_out(ss, rsp_buff, len) == OK ? RDSH_FRAME_OUT : ERR_RDSH_COMMUNICATION;
+    }
+
+    while (len > 0) {
+        chunk = len < RDSH_COMM_BUFF_SZ ? len : RDSH_COMM_BUFF_SZ;
+        if (rsh_recv_all(ss->sock, rsp_buff, chunk) != OK)
+            return ERR_RDSH_COMMUNICATION;
+        fwrite(rsp_buff, 1, chunk, stdout);
+        len -= chunk;
+    }
+    return RDSH_FRAME_OUT;
+}
+
+/*
+ * run_session(ss, cmd_buff, rsp_buff)
+ *
+ * The client loop for v2 and later.  stdin and the socket are polled
+ * together: lines are sent as soon as they are read, up to the window of
+ * commands in flight, RDSH_PIPELINE_MAX for v3 and 1 for v2, and answers
+ * are printed as they arrive.  A script of N commands costs one round
+ * trip instead of N.
+ */
+static int run_session(session_t *ss, char *cmd_buff, char *rsp_buff)
+{
+    struct pollfd fds[2];
+    bool eof = false;
+    int in_len = 0;
+    char *nl;
+    ssize_t n;
+
+    while (1) {
+        // send the lines already read while the window allows
+        while (ss->reading && ss->count < RDSH_PIPELINE_MAX && ss->inflight < ss->window &&
+               (nl = memchr(cmd_buff, '\n', in_len)) != NULL) {
+            int used = nl + 1 - cmd_buff;
+
+            *nl = '\0';
+            if (take_line(ss, cmd_buff) != OK)
+                return ERR_RDSH_COMMUNICATION;
+            memmove(cmd_buff, cmd_buff + used, in_len - used);
+            in_len -= used;
+        }
+        if (ss->reading && eof && in_len == 0 && ss->count < RDSH_PIPELINE_MAX) {
+            push_line(ss, LINE_EOF, 0, false);
+            ss->reading = false;
+        }
+
+        show_local(ss);
+        if (!ss->reading && ss->count == 0)
+            return OK;
+
+        // everything read so far is answered, prompt for more
+        if (ss->reading && !eof && ss->count == 0 && !ss->prompted) {
+            printf("%s", SH_PROMPT);
+            ss->prompted = true;
+        }
+        fflush(stdout);
+
+        // a negative fd is skipped, a closed pipe reports POLLHUP even
+        // without POLLIN asked for
+        fds[0].fd = ss->inflight > 0 ? ss->sock : -1;
+        fds[0].events = POLLIN;
+        fds[1].fd = ss->reading && !eof && memchr(cmd_buff, '\n', in_len) == NULL ? STDIN_FILENO : -1;
+        fds[1].events = POLLIN;
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            return ERR_RDSH_COMMUNICATION;
+        }
+
+        if (fds[1].revents) {
+            n = read(STDIN_FILENO, cmd_buff + in_len, RDSH_COMM_BUFF_SZ - 1 - in_len);
+            if (n > 0)
+                in_len += n;
+            else
+                eof = true;
+            // a last line without a newline, or one too long for the
+            // buffer, is still a line
+            if ((eof && in_len > 0) || in_len == RDSH_COMM_BUFF_SZ - 1)
+                cmd_buff[in_len++] = '\n';
+        }
+
+        if (fds[0].revents) {
+            int type = recv_answer(ss, rsp_buff);
+
+            if (type < 0) {
+                fprintf(stderr, "%s", RCMD_SERVER_EXITED);
+                return ERR_RDSH_COMMUNICATION;
+            }
+            if (type == RDSH_FRAME_EXIT) {
+                line_t *line = pop_line(ss);
+                ss->inflight--;
+                if (line->stop) {
+                    printf("Server has been stopped\n");
+                    return OK;
+                }
+            }
+        }
+    }
+}
+
+/*
+ * run_streamed(ss, cmd, cmd_buff, rsp_buff)
+ *
+ * Runs one command that reads our stdin.  The CMD frame is flagged
+ * RDSH_FRAME_F_STDIN and stdin follows in IN frames, an empty one at EOF,
+ * while the output is printed as it arrives.  Frames are sent without
+ * blocking so a command that writes more than it reads cannot wedge both
+ * ends, the socket's flow control paces stdin to what the command takes.
+ * Once the EXIT frame is back stdin is no longer read.  With
+ * RDSH_OPT_PASSFD the command reads our stdin itself and only the EXIT
+ * frame is waited for.
+ *
+ * returns:  the exit status of the command, or ERR_RDSH_COMMUNICATION
+ */
+static int run_streamed(session_t *ss, char *cmd, char *cmd_buff, char *rsp_buff)
+{
+    struct pollfd fds[2];
+    rsh_frame_hdr_t hdr;
+    bool eof = (ss->opts & RDSH_OPT_PASSFD) != 0;
+    int pend_off = 0;
+    int pend_len = 0;
+    ssize_t n;
+
+    // the command may write to our stdout itself
+    fflush(stdout);
+    rsh_frame_hdr(&hdr, RDSH_FRAME_CMD, ss->next_id, strlen(cmd));
+    hdr.flags = RDSH_FRAME_F_STDIN;
+    if (rsh_send_all(ss->sock, &hdr, sizeof(hdr)) != OK ||
+        rsh_send_all(ss->sock, cmd, strlen(cmd)) != OK) {
+        perror("send");
+        return ERR_RDSH_COMMUNICATION;
+    }
+    // the output is all there is to show, no prompt
+    ss->prompted = true;
+    push_line(ss, LINE_CMD, ss->next_id, false);
+
+    while (1) {
+        fflush(stdout);
+        fds[0].fd = ss->sock;
+        fds[0].events = POLLIN | (pend_len > 0 ? POLLOUT : 0);
+        fds[1].fd = !eof && pend_len == 0 ? STDIN_FILENO : -1;
+        fds[1].events = POLLIN;
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            return ERR_RDSH_COMMUNICATION;
+        }
+
+        if (fds[1].revents) {
+            n = read(STDIN_FILENO, cmd_buff + RDSH_FRAME_HDR_SZ,
+                     RDSH_COMM_BUFF_SZ - RDSH_FRAME_HDR_SZ);
+            if (n <= 0) {
+                n = 0;
+                eof = true;
+            }
+            rsh_frame_hdr((rsh_frame_hdr_t *)cmd_buff, RDSH_FRAME_IN, ss->next_id, n);
+            pend_off = 0;
+            pend_len = RDSH_FRAME_HDR_SZ + n;
+        }
+
+        if (pend_len > 0) {
+            n = send(ss->sock, cmd_buff + pend_off, pend_len - pend_off,
+                     MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                perror("send");
+                return ERR_RDSH_COMMUNICATION;
+            }
+            if (n > 0 && (pend_off += n) == pend_len)
+                pend_len = 0;
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            int type = recv_answer(ss, rsp_buff);
+
+            if (type < 0) {
+                fprintf(stderr, "%s", RCMD_SERVER_EXITED);
+                return ERR_RDSH_COMMUNICATION;
+            }
+            if (type == RDSH_FRAME_EXIT)
+                break;
+        }
+    }
+
+    // the server skips the rest of the stream, but not half a frame
+    fflush(stdout);
+    if (pend_len > 0 &&
+        rsh_send_all(ss->sock, cmd_buff + pend_off, pend_len - pend_off) != OK)
+        return ERR_RDSH_COMMUNICATION;
+    pop_line(ss);
+    if (rsh_send_frame(ss->sock, RDSH_FRAME_CMD, ss->next_id, EXIT_CMD, strlen(EXIT_CMD)) != OK)
+        return ERR_RDSH_COMMUNICATION;
+    return ss->status;
+}
+
+/*
+ * exec_framed_loop(cli_socket, proto, opts, run_cmd, cmd_buff, rsp_buff)
+ *
+ * Sets up a v2 session, with an inflater if the server grants
+ * RDSH_OPT_DEFLATE, and runs it, or just run_cmd if it is not NULL.  A
+ * server writing to our stdout itself gets one command at a time, or the
+ * output of one could overtake the prompt of the next.
+ */
+static int exec_framed_loop(int cli_socket, int proto, int opts, char *run_cmd,
+                            char *cmd_buff, char *rsp_buff)
+{
+    session_t ss = {
+        .sock = cli_socket,
+        .proto = proto,
+        .opts = opts,
+        .window = proto >= RDSH_PROTO_V3 && !(opts & RDSH_OPT_PASSFD) ? RDSH_PIPELINE_MAX : 1,
+        .next_id = 1,
+        .reading = true,
+    };
+    int rc;
+
+    if (opts & RDSH_OPT_DEFLATE) {
+        ss.zbuf = malloc(RDSH_COMM_BUFF_SZ);
+        if (ss.zbuf == NULL || inflateInit2(&ss.zs, -MAX_WBITS) != Z_OK) {
+            fprintf(stderr, "Failed to allocate buffers\n");
+            free(ss.zbuf);
+            return ERR_MEMORY;
+        }
+    }
+
+    if (run_cmd != NULL)
+        rc = run_streamed(&ss, run_cmd, cmd_buff, rsp_buff);
+    else
+        rc = run_session(&ss, cmd_buff, rsp_buff);
+
+    if (opts & RDSH_OPT_DEFLATE) {
+        inflateEnd(&ss.zs);
+        free(ss.zbuf);
+    }
+    return rc;
+}
+
 /*
- * exec_remote_cmd_loop(server_ip, port)
+ * exec_remote_cmd_loop(server_ip, port, opts, run_cmd)
+ *
+ * Servers that speak v2 or later are handled by exec_framed_loop(), the
+ * exit status of each command comes back in its EXIT frame and rc prints
+ * the last one like it does in the local shell.  opts are the RDSH_OPT_*
+ * asked for in the HELLO, a v1 server grants none.  With run_cmd the
+ * session is that one command fed our stdin, see run_streamed(), and its
+ * exit status is returned.  With RDSH_OPT_PASSFD our stdin, stdout and
+ * stderr are sent right after the HELLO.
  */
-int exec_remote_cmd_loop(char *address, int port)
+int exec_remote_cmd_loop(char *address, int port, int opts, char *run_cmd)
 {
     char *cmd_buff;
     char *rsp_buff;
     int cli_socket;
     ssize_t io_size;
     int is_eof;
+    int proto;
+    int want;
     int rc = OK;
 
     // Allocate buffers for sending and receiving
@@ -38,7 +484,36 @@ int exec_remote_cmd_loop(char *address, int port)
         return client_cleanup(cli_socket, cmd_buff, rsp_buff, ERR_RDSH_CLIENT);
     }
 
-    printf("Connected to server %s:%d\n", address, port);
+    if (run_cmd != NULL)
+        opts |= RDSH_OPT_STDIN;
+    want = opts;
+    proto = rsh_client_hello(cli_socket, want, &opts);
+    if (proto < 0) {
+        fprintf(stderr, "%s", RCMD_SERVER_EXITED);
+        return client_cleanup(cli_socket, cmd_buff, rsp_buff, ERR_RDSH_COMMUNICATION);
+    }
+    if ((want & RDSH_OPT_STDIN) && !(opts & RDSH_OPT_STDIN)) {
+        fprintf(stderr, "%s", RCMD_ERR_NO_STDIN);
+        return client_cleanup(cli_socket, cmd_buff, rsp_buff, ERR_RDSH_CLIENT);
+    }
+    if ((want & RDSH_OPT_PASSFD) && !(opts & RDSH_OPT_PASSFD)) {
+        fprintf(stderr, "%s", RCMD_ERR_NO_PASSFD);
+        return client_cleanup(cli_socket, cmd_buff, rsp_buff, ERR_RDSH_CLIENT);
+    }
+    if ((opts & RDSH_OPT_PASSFD) && rsh_send_fds(cli_socket) != OK) {
+        perror("sendmsg");
+        return client_cleanup(cli_socket, cmd_buff, rsp_buff, ERR_RDSH_COMMUNICATION);
+    }
+
+    if (rsh_is_unix_path(address))
+        printf("Connected to server %s\n", address);
+    else
+        printf("Connected to server %s:%d\n", address, port);
+
+    if (proto >= RDSH_PROTO_V2) {
+        rc = exec_framed_loop(cli_socket, proto, opts, run_cmd, cmd_buff, rsp_buff);
+        goto cleanup;
+    }
 
     while (1) 
     {
@@ -131,14 +606,53 @@ cleanup:
 }
 
 
+/*
+ * start_unix_client(path)
+ *
+ * Connects to the server's Unix socket at path.
+ */
+static int start_unix_client(char *path){
+    struct sockaddr_un addr;
+    int cli_socket;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path too long: %s\n", path);
+        return ERR_RDSH_CLIENT;
+    }
+
+    cli_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (cli_socket == -1) {
+        perror("socket");
+        return ERR_RDSH_CLIENT;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (connect(cli_socket, (const struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        perror("connect");
+        close(cli_socket);
+        return ERR_RDSH_CLIENT;
+    }
+
+    rsh_unix_bufs(cli_socket);
+    return cli_socket;
+}
+
 /*
  * start_client(server_ip, port)
+ *
+ * Connects to server_ip:port, or to the Unix socket server_ip names if it
+ * is a path, see rsh_is_unix_path().
  */
 int start_client(char *server_ip, int port){
     struct sockaddr_in addr;
     int cli_socket;
     int ret;
 
+    if (rsh_is_unix_path(server_ip))
+        return start_unix_client(server_ip);
+
     // Create socket
     cli_socket = socket(AF_INET, SOCK_STREAM, 0);
     if (cli_socket == -1) {
@@ -161,6 +675,8 @@ int start_client(char *server_ip, int port){
         return ERR_RDSH_CLIENT;
     }
 
+    // each command is one small write, do not hold it back
+    rsh_tcp_nodelay(cli_socket);
     return cli_socket;
 }
 
@@ -0,0 +1,1174 @@
+#define _GNU_SOURCE     // accept4, pipe2
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/pidfd.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "dshlib.h"
+#include "rshlib.h"
+
+//Event driven server core (-e).  Each reactor thread has its own epoll set
+//holding the shared listening sockets (EPOLLEXCLUSIVE, so a new connection
+//wakes one reactor) and the connections that reactor accepted.  Sockets are
+//non blocking and nothing in a reactor ever waits: commands are split out
+//of the received bytes at their '\0', or their CMD frame for protocol v2
+//clients, a pipeline's output comes back
+//through a pipe that is polled like any socket, and children that outlive
+//their output are waited for with a pidfd.  A command sent with
+//RDSH_FRAME_F_STDIN reads a pipe the reactor fills from the client's IN
+//frames.  A client that passed its fds (RDSH_OPT_PASSFD) gets the output
+//straight from the children, the reactor only waits for them.  A command
+//admission control holds back waits on the reactor's list, parsed, until
+//its turn comes or RDSH_ADMIT_WAIT_MS passes.
+
+//What an epoll event is for.  Every fd in a reactor's epoll set is a
+//watch, the ones for a connection are embedded in the connection.
+typedef enum {
+    W_LISTEN,       //listening socket, accept
+    W_STOP,         //stop_fd, a client asked for stop-server
+    W_SOCK,         //client socket
+    W_OUT,          //read end of the running pipeline's output
+    W_IN,           //write end of the running pipeline's stdin
+    W_PID,          //pidfd of a child still running after its output ended
+    W_ADMIT,        //eventfd, a waiting command was granted
+} watch_kind_t;
+
+typedef struct rsh_watch {
+    watch_kind_t    kind;
+    int             fd;         //-1 when closed
+    unsigned int    events;     //registered events, 0 when not in the set
+    struct rsh_conn *conn;
+} rsh_watch_t;
+
+//One client connection.  in and out_buf are only allocated while there is
+//a partial command or unsent output, an idle connection is just this struct.
+typedef struct rsh_conn {
+    rsh_watch_t     sock;
+    rsh_watch_t     out;
+    rsh_watch_t     pid;
+    rsh_watch_t     stdin_w;        //fd -1 once the command's stdin ended
+    char            *in;            //received bytes not yet run
+    int             in_len;
+    int             stdin_off;      //payload of the first IN frame written
+    char            *out_buf;       //output not yet sent
+    int             out_off;
+    int             out_len;
+    pid_t           pids[CMD_MAX];  //children of the pipeline, 0 once reaped
+    int             npids;
+    int             status;         //exit status of the last command
+    int             proto;          //RDSH_PROTO_V1, V2 or V3, 0 until known
+    int             opts;           //RDSH_OPT_* granted in the HELLO
+    uint16_t        id;             //request id of the command being answered
+    int             cmd_flags;      //RDSH_FRAME_F_* of its CMD frame
+    int             fds[3];         //the client's stdin, stdout and stderr, or -1
+    int             dir_fd;         //working directory, see rsh_session_dir()
+    uint64_t        cmd_start;      //rsh_stats_now() when the command arrived
+    rsh_client_stats_t *client;     //what the connection counts for
+    rsh_admit_client_t *adm;        //the client admission counts it for
+    rsh_admit_waiter_t ticket;      //the command's turn
+    command_list_t  *pending;       //the command waiting for its turn
+    bool            running;        //a pipeline is running, or waiting
+    bool            closing;        //close once the current command is done
+    bool            dead;           //closed, freed after this epoll batch
+    struct rsh_conn *prev, *next;
+    struct rsh_conn *wait_next;     //the reactor's waiting list
+} rsh_conn_t;
+
+typedef struct rsh_reactor {
+    pthread_t       thread;
+    int             index;
+    int             epfd;
+    rsh_watch_t     listen[RDSH_LISTENERS_MAX];
+    int             num_listen;
+    rsh_watch_t     stop;
+    rsh_watch_t     admit;
+    rsh_conn_t      *conns;
+    rsh_conn_t      *waiting;       //oldest first, so in deadline order
+    rsh_conn_t      *dead;          //closed connections, next links them
+    bool            draining;
+    char            buf[RDSH_COMM_BUFF_SZ];     //recv() and pipe read scratch
+    z_stream        zs;                         //deflates buf into zbuf
+    bool            zs_ok;
+    char            zbuf[RDSH_FRAME_HDR_SZ + RDSH_COMM_BUFF_SZ];
+} rsh_reactor_t;
+
+static int null_fd = -1;    //stdin of every pipeline
+static int stop_fd = -1;    //eventfd, readable once stop-server was asked for
+
+static void conn_send(rsh_reactor_t *r, rsh_conn_t *c, const char *data, int len, bool more);
+static void conn_end(rsh_reactor_t *r, rsh_conn_t *c, int status);
+
+/*
+ * watch_set(r, w, events)
+ *
+ * Makes events the set w is registered for, adding w to the epoll set or
+ * taking it out when events is 0.  A watch with nothing to wait for is kept
+ * out of the set so a hang up on it cannot wake the reactor over and over.
+ */
+static int watch_set(rsh_reactor_t *r, rsh_watch_t *w, unsigned int events){
+    struct epoll_event ev = { .events = events, .data.ptr = w };
+    int op;
+
+    if (w->fd < 0 || events == w->events)
+        return OK;
+    if (events == 0)
+        op = EPOLL_CTL_DEL;
+    else if (w->events == 0)
+        op = EPOLL_CTL_ADD;
+    else
+        op = EPOLL_CTL_MOD;
+
+    if (epoll_ctl(r->epfd, op, w->fd, &ev) < 0) {
+        perror("epoll_ctl");
+        return ERR_RDSH_SERVER;
+    }
+    w->events = events;
+    return OK;
+}
+
+static void watch_close(rsh_reactor_t *r, rsh_watch_t *w){
+    if (w->fd < 0)
+        return;
+    watch_set(r, w, 0);
+    close(w->fd);
+    w->fd = -1;
+}
+
+static void watch_init(rsh_watch_t *w, watch_kind_t kind, int fd, rsh_conn_t *c){
+    w->kind = kind;
+    w->fd = fd;
+    w->events = 0;
+    w->conn = c;
+}
+
+static rsh_conn_t *conn_new(rsh_reactor_t *r, int cli_socket){
+    rsh_conn_t *c = calloc(1, sizeof(rsh_conn_t));
+
+    if (c == NULL)
+        return NULL;
+    watch_init(&c->sock, W_SOCK, cli_socket, c);
+    watch_init(&c->out, W_OUT, -1, c);
+    watch_init(&c->pid, W_PID, -1, c);
+    watch_init(&c->stdin_w, W_IN, -1, c);
+    c->fds[0] = c->fds[1] = c->fds[2] = -1;
+    c->dir_fd = rsh_session_dir();
+
+    c->next = r->conns;
+    if (r->conns)
+        r->conns->prev = c;
+    r->conns = c;
+    return c;
+}
+
+/*
+ * conn_close(r, c)
+ *
+ * Closes a connection's fds and moves it to the dead list.  It is freed
+ * once the current epoll batch is handled, later events in the batch may
+ * still point at it.
+ */
+static void conn_close(rsh_reactor_t *r, rsh_conn_t *c){
+    watch_close(r, &c->sock);
+    watch_close(r, &c->out);
+    watch_close(r, &c->pid);
+    watch_close(r, &c->stdin_w);
+    for (int i = 0; i < 3; i++)
+        if (c->fds[i] >= 0)
+            close(c->fds[i]);
+    if (c->dir_fd >= 0)
+        close(c->dir_fd);
+
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        r->conns = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+
+    free(c->in);
+    free(c->out_buf);
+    c->in = c->out_buf = NULL;
+    c->dead = true;
+    rsh_admit_leave(c->adm);
+    rsh_stats_closed(c->client);
+    c->next = r->dead;
+    r->dead = c;
+
+    // an fd was freed, accepting may work again after EMFILE
+    for (int i = 0; i < r->num_listen && !r->draining; i++)
+        watch_set(r, &r->listen[i], EPOLLIN | EPOLLEXCLUSIVE);
+
+    printf("%s", RCMD_MSG_CLIENT_EXITED);
+}
+
+/*
+ * conn_reap(r, c)
+ *
+ * Reaps the children of the pipeline once its output has ended.  A child
+ * that is still running gets a pidfd in the epoll set and the reap is tried
+ * again when it exits.  When all are gone the response is ended with
+ * RDSH_EOF_CHAR.
+ */
+static void conn_reap(rsh_reactor_t *r, rsh_conn_t *c){
+    for (int i = 0; i < c->npids; i++) {
+        int status;
+        if (c->pids[i] <= 0 || waitpid(c->pids[i], &status, WNOHANG) == 0)
+            continue;
+        c->pids[i] = 0;
+        if (i == c->npids - 1) {
+            if (WIFEXITED(status))
+                c->status = WEXITSTATUS(status);
+            else if (WIFSIGNALED(status))
+                c->status = 128 + WTERMSIG(status);
+        }
+    }
+
+    for (int i = 0; i < c->npids; i++) {
+        if (c->pids[i] <= 0)
+            continue;
+        if (c->pid.fd >= 0)
+            return;
+        c->pid.fd = pidfd_open(c->pids[i], 0);
+        if (c->pid.fd < 0) {
+            // no pidfds on this kernel, wait the old way
+            int status;
+            if (waitpid(c->pids[i], &status, 0) > 0 && i == c->npids - 1 &&
+                WIFEXITED(status))
+                c->status = WEXITSTATUS(status);
+            c->pids[i] = 0;
+            continue;
+        }
+        watch_set(r, &c->pid, EPOLLIN);
+        return;
+    }
+
+    // stdin the command never read stays in the input, it is skipped
+    watch_close(r, &c->stdin_w);
+    c->stdin_off = 0;
+    c->npids = 0;
+    c->running = false;
+    conn_end(r, c, c->status);
+}
+
+/*
+ * conn_unwait(r, c)
+ *
+ * Drops the command c waits to start, and its turn if it just got one.
+ */
+static void conn_unwait(rsh_reactor_t *r, rsh_conn_t *c){
+    rsh_conn_t **p = &r->waiting;
+
+    while (*p != c)
+        p = &(*p)->wait_next;
+    *p = c->wait_next;
+    if (!rsh_admit_cancel(&c->ticket))
+        rsh_admit_done(&c->ticket);
+    free_cmd_list(c->pending);
+    free(c->pending);
+    c->pending = NULL;
+    c->running = false;
+}
+
+/*
+ * conn_lost(r, c)
+ *
+ * The client went away.  Its socket and pending output are dropped, and the
+ * output pipe of a running pipeline is closed so the children get SIGPIPE
+ * instead of writing for nobody.  Their stdin ends.
+ */
+static void conn_lost(rsh_reactor_t *r, rsh_conn_t *c){
+    watch_close(r, &c->sock);
+    watch_close(r, &c->stdin_w);
+    free(c->out_buf);
+    c->out_buf = NULL;
+    c->out_off = c->out_len = 0;
+    c->closing = true;
+
+    if (c->pending != NULL)
+        conn_unwait(r, c);
+    if (c->running && c->out.fd >= 0) {
+        watch_close(r, &c->out);
+        conn_reap(r, c);
+    }
+}
+
+/*
+ * conn_send(r, c, data, len, more)
+ *
+ * Sends as much as the socket takes right now and queues the rest in
+ * out_buf, which is sent when the socket is writable again.  more says
+ * the end of the response follows right away, see rshlib.h.
+ */
+static void conn_send(rsh_reactor_t *r, rsh_conn_t *c, const char *data, int len, bool more){
+    int sent = 0;
+
+    if (c->sock.fd < 0)
+        return;
+
+    if (c->out_off == c->out_len) {
+        sent = send(c->sock.fd, data, len, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+        if (sent < 0) {
+            if (errno != EAGAIN && errno != EINTR) {
+                conn_lost(r, c);
+                return;
+            }
+            sent = 0;
+        }
+        if (sent == len)
+            return;
+    }
+
+    if (c->out_off > 0) {
+        memmove(c->out_buf, c->out_buf + c->out_off, c->out_len - c->out_off);
+        c->out_len -= c->out_off;
+        c->out_off = 0;
+    }
+    char *buf = realloc(c->out_buf, c->out_len + len - sent);
+    if (buf == NULL) {
+        fprintf(stderr, "Failed to allocate buffer\n");
+        conn_lost(r, c);
+        return;
+    }
+    memcpy(buf + c->out_len, data + sent, len - sent);
+    c->out_buf = buf;
+    c->out_len += len - sent;
+}
+
+static void conn_flush(rsh_reactor_t *r, rsh_conn_t *c){
+    int sent = send(c->sock.fd, c->out_buf + c->out_off,
+                    c->out_len - c->out_off, MSG_NOSIGNAL);
+
+    if (sent < 0) {
+        if (errno != EAGAIN && errno != EINTR)
+            conn_lost(r, c);
+        return;
+    }
+    c->out_off += sent;
+    if (c->out_off == c->out_len) {
+        free(c->out_buf);
+        c->out_buf = NULL;
+        c->out_off = c->out_len = 0;
+    }
+}
+
+/*
+ * conn_frame(r, c, type, data, len, more)
+ *
+ * Queues one v2 frame.  Small frames are built in one piece so they go out
+ * in one send().
+ */
+static void conn_frame(rsh_reactor_t *r, rsh_conn_t *c, int type,
+                       const void *data, int len, bool more){
+    char frame[RDSH_FRAME_HDR_SZ + 256];
+
+    rsh_frame_hdr((rsh_frame_hdr_t *)frame, type, c->id, len);
+    if (len <= (int)(sizeof(frame) - RDSH_FRAME_HDR_SZ)) {
+        memcpy(frame + RDSH_FRAME_HDR_SZ, data, len);
+        conn_send(r, c, frame, RDSH_FRAME_HDR_SZ + len, more);
+    } else {
+        conn_send(r, c, frame, RDSH_FRAME_HDR_SZ, true);
+        conn_send(r, c, data, len, more);
+    }
+}
+
+/*
+ * conn_end(r, c, status)
+ *
+ * Ends a response, RDSH_EOF_CHAR for v1, an EXIT frame for v2.  A pipeline
+ * that was let in gives back its turn.
+ */
+static void conn_end(rsh_reactor_t *r, rsh_conn_t *c, int status){
+    uint32_t wire = htonl((uint32_t)status);
+
+    rsh_admit_done(&c->ticket);
+    rsh_stats_command(c->cmd_start);
+    if (c->proto >= RDSH_PROTO_V2)
+        conn_frame(r, c, RDSH_FRAME_EXIT, &wire, sizeof(wire), false);
+    else
+        conn_send(r, c, &RDSH_EOF_CHAR, 1, false);
+}
+
+static void conn_reply(rsh_reactor_t *r, rsh_conn_t *c, const char *msg, int status){
+    int len = strlen(msg);
+
+    rsh_stats_out(len);
+    if (c->proto >= RDSH_PROTO_V2) {
+        if (len > 0)
+            conn_frame(r, c, RDSH_FRAME_OUT, msg, len, true);
+    } else {
+        conn_send(r, c, msg, len, true);
+    }
+    conn_end(r, c, status);
+}
+
+/*
+ * conn_pump(r, c, last)
+ *
+ * Moves what the pipeline wrote from its output pipe to the client,
+ * deflated if the client asked for RDSH_OPT_DEFLATE.  The pipe is only
+ * polled while nothing is queued for the socket, so a slow client pushes
+ * back on the pipeline instead of growing out_buf.  last is set once the
+ * pipe has hung up, the chunk then waits for the EXIT frame behind it.
+ */
+static void conn_pump(rsh_reactor_t *r, rsh_conn_t *c, bool last){
+    // v2 output is read in behind room for its frame header
+    int hdr = c->proto >= RDSH_PROTO_V2 ? RDSH_FRAME_HDR_SZ : 0;
+    int n = read(c->out.fd, r->buf + hdr, sizeof(r->buf) - hdr);
+    int zlen = 0;
+
+    if (n > 0)
+        rsh_stats_out(n);
+    if (n > 0 && (c->opts & RDSH_OPT_DEFLATE) && r->zs_ok)
+        zlen = rsh_deflate_chunk(&r->zs, r->buf + hdr, n, r->zbuf + hdr);
+    if (zlen > 0) {
+        rsh_frame_hdr((rsh_frame_hdr_t *)r->zbuf, RDSH_FRAME_OUT, c->id, zlen);
+        ((rsh_frame_hdr_t *)r->zbuf)->flags = RDSH_FRAME_F_DEFLATE;
+        conn_send(r, c, r->zbuf, hdr + zlen, last);
+        return;
+    }
+    if (n > 0) {
+        if (hdr)
+            rsh_frame_hdr((rsh_frame_hdr_t *)r->buf, RDSH_FRAME_OUT, c->id, n);
+        conn_send(r, c, r->buf, hdr + n, last);
+        return;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+
+    watch_close(r, &c->out);
+    conn_reap(r, c);
+}
+
+static void stop_reactors(void){
+    uint64_t one = 1;
+
+    if (write(stop_fd, &one, sizeof(one)) != sizeof(one))
+        perror("write stop");
+}
+
+/*
+ * conn_started(c, npids)
+ *
+ * Marks the connection running the npids children rsh_start_pipeline()
+ * left in c->pids.  A command that never started has -errno for a pid,
+ * one that ran in-process -its status, that is its exit status.
+ */
+static void conn_started(rsh_conn_t *c, int npids){
+    c->npids = npids;
+    c->status = 0;
+    c->running = true;
+    for (int i = 0; i < c->npids; i++) {
+        if (c->pids[i] >= 0)
+            continue;
+        if (i == c->npids - 1)
+            c->status = -c->pids[i];
+        c->pids[i] = 0;
+    }
+}
+
+/*
+ * conn_spawn(r, c, clist, fast_only)
+ *
+ * Starts clist writing into a pipe the reactor polls, or on the client's
+ * own fds.  With fast_only it only runs in-process, see
+ * rsh_start_pipeline().
+ *
+ * returns:  ERR_RDSH_SPAWN if fast_only kept it from starting, nothing was
+ *           sent to the client then, otherwise OK
+ */
+static int conn_spawn(rsh_reactor_t *r, rsh_conn_t *c, command_list_t *clist, bool fast_only){
+    int outp[2];
+    int inp[2] = { null_fd, -1 };
+    int rc;
+
+    // on the client's own fds there is nothing to relay, only children to
+    // wait for
+    if (c->fds[0] >= 0) {
+        rc = rsh_start_pipeline(clist, c->dir_fd,
+                                (c->cmd_flags & RDSH_FRAME_F_STDIN) ? c->fds[0] : null_fd,
+                                c->fds[1], c->fds[2], c->pids, fast_only);
+        if (rc == ERR_RDSH_SPAWN)
+            return rc;
+        if (rc != OK) {
+            conn_reply(r, c, CMD_ERR_RDSH_EXEC, 1);
+        } else {
+            conn_started(c, clist->num);
+            conn_reap(r, c);
+        }
+        return OK;
+    }
+
+    // only the reactor's end is non blocking, the children block as usual
+    if (pipe2(outp, O_CLOEXEC) == -1) {
+        perror("pipe");
+        conn_reply(r, c, CMD_ERR_RDSH_EXEC, 1);
+        return OK;
+    }
+    fcntl(outp[0], F_SETFL, O_NONBLOCK);
+    if ((c->cmd_flags & RDSH_FRAME_F_STDIN) && pipe2(inp, O_CLOEXEC) == -1) {
+        perror("pipe");
+        inp[0] = null_fd;
+    }
+
+    rc = rsh_start_pipeline(clist, c->dir_fd, inp[0], outp[1], outp[1], c->pids, fast_only);
+    close(outp[1]);
+    if (inp[1] >= 0) {
+        close(inp[0]);
+        fcntl(inp[1], F_SETFL, O_NONBLOCK);
+    }
+    if (rc != OK) {
+        close(outp[0]);
+        if (inp[1] >= 0)
+            close(inp[1]);
+        if (rc == ERR_RDSH_SPAWN)
+            return rc;
+        conn_reply(r, c, CMD_ERR_RDSH_EXEC, 1);
+    } else {
+        conn_started(c, clist->num);
+        c->out.fd = outp[0];
+        c->stdin_w.fd = inp[1];
+    }
+    return OK;
+}
+
+static void conn_wake(rsh_admit_waiter_t *w){
+    rsh_reactor_t *r = w->arg;
+    uint64_t one = 1;
+
+    if (write(r->admit.fd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN)
+        perror("write admit");
+}
+
+/*
+ * conn_admit(r, c, clist)
+ *
+ * Starts clist if admission control lets it in, otherwise parks it on the
+ * reactor's waiting list, the connection counts as running meanwhile.
+ * reactor_admit() starts it, or turns it away, later.  A command that runs
+ * in-process starts no processes and never waits for a turn, one that has
+ * to be spawned after all does.
+ */
+static void conn_admit(rsh_reactor_t *r, rsh_conn_t *c, command_list_t *clist){
+    int procs = rsh_pipeline_procs(clist);
+    rsh_conn_t **p;
+
+    if (procs == 0) {
+        if (conn_spawn(r, c, clist, true) == OK) {
+            free_cmd_list(clist);
+            return;
+        }
+        procs = clist->num;
+    }
+
+    c->ticket.wake = conn_wake;
+    c->ticket.arg = r;
+    switch (rsh_admit_enter(c->adm, &c->ticket, procs)) {
+    case RDSH_ADMIT_BUSY:
+        conn_reply(r, c, RCMD_ERR_SVR_BUSY, RDSH_BUSY_STATUS);
+        free_cmd_list(clist);
+        return;
+    case RDSH_ADMIT_GRANTED:
+        conn_spawn(r, c, clist, false);
+        free_cmd_list(clist);
+        return;
+    }
+
+    c->pending = malloc(sizeof(command_list_t));
+    if (c->pending == NULL) {
+        if (rsh_admit_cancel(&c->ticket))
+            conn_reply(r, c, CMD_ERR_RDSH_EXEC, 1);
+        else
+            conn_spawn(r, c, clist, false);
+        free_cmd_list(clist);
+        return;
+    }
+    *c->pending = *clist;
+    c->running = true;
+    c->wait_next = NULL;
+    for (p = &r->waiting; *p != NULL; p = &(*p)->wait_next)
+        ;
+    *p = c;
+}
+
+/*
+ * conn_exec(r, c, cmd)
+ *
+ * Runs one command.  The builtins are answered right away, anything else
+ * starts a pipeline once admission control lets it, see conn_admit().
+ */
+static void conn_exec(rsh_reactor_t *r, rsh_conn_t *c, char *cmd){
+    command_list_t cmd_list;
+    int rc;
+
+    printf("Received command: %s\n", cmd);
+    c->cmd_start = rsh_stats_now();
+    rsh_stats_in(strlen(cmd));
+
+    if (strlen(cmd) == 0) {
+        conn_reply(r, c, CMD_WARN_NO_CMD, 0);
+        return;
+    }
+    if (strcmp(cmd, EXIT_CMD) == 0) {
+        c->closing = true;
+        return;
+    }
+    if (strcmp(cmd, "stop-server") == 0) {
+        printf("%s", RCMD_MSG_SVR_STOP_REQ);
+        conn_reply(r, c, "Server shutting down\n", 0);
+        c->closing = true;
+        stop_reactors();
+        return;
+    }
+
+    memset(&cmd_list, 0, sizeof(command_list_t));
+    rc = build_cmd_list(cmd, &cmd_list);
+    if (rc == WARN_NO_CMDS) {
+        conn_reply(r, c, CMD_WARN_NO_CMD, 0);
+        return;
+    } else if (rc == ERR_TOO_MANY_COMMANDS) {
+        char err_msg[100];
+        sprintf(err_msg, CMD_ERR_PIPE_LIMIT, CMD_MAX);
+        conn_reply(r, c, err_msg, 1);
+        return;
+    } else if (rc != OK) {
+        conn_reply(r, c, CMD_ERR_RDSH_EXEC, 1);
+        return;
+    }
+
+    if (cmd_list.num == 1 &&
+        rsh_match_command(cmd_list.commands[0].argv[0]) == BI_CMD_CD) {
+        char err_msg[256];
+        rc = rsh_cd(&cmd_list.commands[0], &c->dir_fd, err_msg, sizeof(err_msg));
+        conn_reply(r, c, err_msg, rc);
+        free_cmd_list(&cmd_list);
+        return;
+    }
+    if (cmd_list.num == 1 &&
+        rsh_match_command(cmd_list.commands[0].argv[0]) == BI_CMD_SVR_STATS) {
+        char *text = rsh_stats_text();
+        conn_reply(r, c, text ? text : CMD_ERR_RDSH_EXEC, text ? 0 : 1);
+        free(text);
+        free_cmd_list(&cmd_list);
+        return;
+    }
+
+    conn_admit(r, c, &cmd_list);
+}
+
+/*
+ * conn_read(r, c)
+ *
+ * Appends what arrived on the socket to the connection's input,
+ * conn_settle() runs the commands in it one at a time.  A v3 client
+ * may have sent several, the socket is not read again until they have
+ * all run, so the input stays bounded.
+ */
+static void conn_read(rsh_reactor_t *r, rsh_conn_t *c){
+    int n;
+
+    // the client's fds come with its FDS frame
+    if (c->opts & RDSH_OPT_PASSFD)
+        n = rsh_recv_fds(c->sock.fd, r->buf, sizeof(r->buf), 0, c->fds);
+    else
+        n = recv(c->sock.fd, r->buf, sizeof(r->buf), 0);
+
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (n <= 0) {
+        conn_lost(r, c);
+        return;
+    }
+
+    char *in = realloc(c->in, c->in_len + n);
+    if (in == NULL) {
+        fprintf(stderr, "Failed to allocate buffer\n");
+        conn_lost(r, c);
+        return;
+    }
+    memcpy(in + c->in_len, r->buf, n);
+    c->in = in;
+    c->in_len += n;
+}
+
+static void conn_consume(rsh_conn_t *c, int used){
+    memmove(c->in, c->in + used, c->in_len - used);
+    c->in_len -= used;
+    if (c->in_len == 0) {
+        free(c->in);
+        c->in = NULL;
+    }
+}
+
+/*
+ * conn_feed(r, c)
+ *
+ * Writes the payloads of the IN frames at the head of the input into the
+ * running command's stdin.  An empty IN frame, any other frame or a
+ * command that stopped reading ends its stdin.  A frame too large for the
+ * input buffer, like rsh_recv_frame() refuses, drops the connection.
+ *
+ * returns:  true if the pipe is full and more is waiting to be written
+ */
+static bool conn_feed(rsh_reactor_t *r, rsh_conn_t *c){
+    rsh_frame_hdr_t hdr;
+    uint32_t len;
+    int n;
+
+    while (c->stdin_w.fd >= 0 && c->in_len >= RDSH_FRAME_HDR_SZ) {
+        memcpy(&hdr, c->in, sizeof(hdr));
+        len = ntohl(hdr.len);
+        if (hdr.type != RDSH_FRAME_IN || len == 0) {
+            watch_close(r, &c->stdin_w);
+            if (hdr.type == RDSH_FRAME_IN)
+                conn_consume(c, RDSH_FRAME_HDR_SZ);
+            break;
+        }
+        if (len >= RDSH_COMM_BUFF_SZ) {
+            fprintf(stderr, CMD_ERR_RDSH_FRAME, len);
+            conn_lost(r, c);
+            break;
+        }
+        if ((uint32_t)c->in_len < RDSH_FRAME_HDR_SZ + len)
+            break;
+
+        n = write(c->stdin_w.fd, c->in + RDSH_FRAME_HDR_SZ + c->stdin_off,
+                  len - c->stdin_off);
+        if (n < 0) {
+            if (errno == EAGAIN)
+                return true;
+            if (errno != EINTR)
+                watch_close(r, &c->stdin_w);
+            continue;
+        }
+        c->stdin_off += n;
+        rsh_stats_in(n);
+        if ((uint32_t)c->stdin_off == len) {
+            conn_consume(c, RDSH_FRAME_HDR_SZ + len);
+            c->stdin_off = 0;
+        }
+    }
+    return false;
+}
+
+/*
+ * conn_next_cmd(r, c, used)
+ *
+ * Finds the next complete command in the connection's input.  The first
+ * byte a client sends tells the protocol: a v2 client opens with a HELLO
+ * frame, answered here, anything else is a v1 command ending at its '\0'
+ * and is run where it is.  A v2 CMD payload has no '\0' and is copied to
+ * r->buf to get one.
+ *
+ * returns:  the command, or NULL until all of it has arrived, with the
+ *           number of input bytes it took in *used
+ */
+static char *conn_next_cmd(rsh_reactor_t *r, rsh_conn_t *c, int *used){
+    rsh_frame_hdr_t hdr;
+    uint32_t len;
+    char *end;
+
+    if (c->proto == 0 && c->in[0] != RDSH_FRAME_HELLO)
+        c->proto = RDSH_PROTO_V1;
+
+    if (c->proto == RDSH_PROTO_V1) {
+        end = memchr(c->in, '\0', c->in_len);
+        if (end == NULL) {
+            if (c->in_len >= RDSH_COMM_BUFF_SZ) {
+                conn_reply(r, c, CMD_ERR_RDSH_EXEC, 1);
+                c->closing = true;
+            }
+            return NULL;
+        }
+        *used = end - c->in + 1;
+        return c->in;
+    }
+
+    // stdin a command did not read before it ended
+    while (c->proto != 0 && c->in_len >= RDSH_FRAME_HDR_SZ &&
+           c->in[0] == RDSH_FRAME_IN) {
+        memcpy(&hdr, c->in, sizeof(hdr));
+        len = ntohl(hdr.len);
+        if (len >= RDSH_COMM_BUFF_SZ)
+            break;
+        if ((uint32_t)c->in_len < RDSH_FRAME_HDR_SZ + len)
+            return NULL;
+        conn_consume(c, RDSH_FRAME_HDR_SZ + len);
+    }
+
+    if (c->in_len < RDSH_FRAME_HDR_SZ)
+        return NULL;
+    memcpy(&hdr, c->in, sizeof(hdr));
+    len = ntohl(hdr.len);
+
+    // conn_read() took the fds that came with the FDS frame, there is
+    // only one
+    if (hdr.type == RDSH_FRAME_FDS && (c->opts & RDSH_OPT_PASSFD) &&
+        c->fds[0] >= 0 && len == 0) {
+        c->opts &= ~RDSH_OPT_PASSFD;
+        conn_consume(c, RDSH_FRAME_HDR_SZ);
+        return c->in_len > 0 ? conn_next_cmd(r, c, used) : NULL;
+    }
+
+    if (len >= RDSH_COMM_BUFF_SZ ||
+        hdr.type != (c->proto == 0 ? RDSH_FRAME_HELLO : RDSH_FRAME_CMD) ||
+        (hdr.type == RDSH_FRAME_HELLO && len < 1)) {
+        fprintf(stderr, "%s", CMD_ERR_RDSH_COMM);
+        c->closing = true;
+        return NULL;
+    }
+    if ((uint32_t)c->in_len < RDSH_FRAME_HDR_SZ + len)
+        return NULL;
+    *used = RDSH_FRAME_HDR_SZ + len;
+
+    if (hdr.type == RDSH_FRAME_HELLO) {
+        unsigned char reply[2];
+        int reply_len = rsh_hello_reply((unsigned char *)c->in + RDSH_FRAME_HDR_SZ,
+                                        len, rsh_allowed_opts(c->sock.fd), reply);
+        c->proto = reply[0];
+        c->opts = reply_len > 1 ? reply[1] : 0;
+        conn_frame(r, c, RDSH_FRAME_HELLO, reply, reply_len, false);
+        conn_consume(c, *used);
+        return c->in_len > 0 ? conn_next_cmd(r, c, used) : NULL;
+    }
+
+    memcpy(r->buf, c->in + RDSH_FRAME_HDR_SZ, len);
+    r->buf[len] = '\0';
+    c->id = ntohs(hdr.id);
+    c->cmd_flags = hdr.flags;
+    return r->buf;
+}
+
+/*
+ * conn_settle(r, c)
+ *
+ * Called after every event on a connection.  Runs the next complete
+ * command when nothing is running, frees the connection once it is done
+ * with, and otherwise registers what it now waits for: input while idle or
+ * while the command's stdin is open and little of it is buffered, the
+ * socket's writability while output is queued, the output pipe only while
+ * nothing is queued, and the stdin pipe while it is full.
+ */
+static void conn_settle(rsh_reactor_t *r, rsh_conn_t *c){
+    bool stdin_full = false;
+    bool feeding;
+    char *cmd;
+    int used;
+
+    while (!c->running && !c->closing && c->in_len > 0 &&
+           (cmd = conn_next_cmd(r, c, &used)) != NULL) {
+        conn_exec(r, c, cmd);
+        conn_consume(c, used);
+    }
+
+    if (!c->running &&
+        (c->sock.fd < 0 || (c->closing && c->out_off == c->out_len))) {
+        conn_close(r, c);
+        return;
+    }
+
+    if (c->running && c->stdin_w.fd >= 0)
+        stdin_full = conn_feed(r, c);
+    feeding = c->stdin_w.fd >= 0 && c->in_len < RDSH_COMM_BUFF_SZ;
+
+    watch_set(r, &c->sock, ((!c->running && !c->closing) || feeding ? EPOLLIN : 0) |
+                           (c->out_off < c->out_len ? EPOLLOUT : 0));
+    watch_set(r, &c->out, c->out_off < c->out_len ? 0 : EPOLLIN);
+    watch_set(r, &c->stdin_w, stdin_full ? EPOLLOUT : 0);
+}
+
+static void reactor_accept(rsh_reactor_t *r, rsh_watch_t *w){
+    struct sockaddr_storage client_addr;
+    socklen_t client_len;
+    int cli_socket;
+
+    while (1) {
+        client_len = sizeof(client_addr);
+        cli_socket = accept4(w->fd, (struct sockaddr*)&client_addr,
+                             &client_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (cli_socket < 0) {
+            if (errno == EMFILE || errno == ENFILE) {
+                // out of fds, stop accepting until a connection closes
+                perror("accept");
+                watch_set(r, w, 0);
+            } else if (errno != EAGAIN && errno != EINTR &&
+                       errno != ECONNABORTED) {
+                perror("accept");
+            }
+            return;
+        }
+
+        rsh_client_connected(cli_socket, &client_addr);
+
+        rsh_conn_t *c = conn_new(r, cli_socket);
+        if (c == NULL) {
+            fprintf(stderr, "Failed to allocate connection\n");
+            close(cli_socket);
+            continue;
+        }
+        c->client = rsh_stats_connected(cli_socket);
+        c->adm = rsh_admit_join(cli_socket);
+        watch_set(r, &c->sock, EPOLLIN);
+    }
+}
+
+/*
+ * reactor_drain(r)
+ *
+ * stop-server was asked for.  Stops accepting and marks every connection
+ * closing: idle ones are closed now, running ones after their command
+ * finishes and its output is sent.
+ */
+static void reactor_drain(rsh_reactor_t *r){
+    rsh_conn_t *c, *next;
+
+    r->draining = true;
+    for (int i = 0; i < r->num_listen; i++)
+        watch_set(r, &r->listen[i], 0);
+    watch_set(r, &r->stop, 0);
+
+    for (c = r->conns; c != NULL; c = next) {
+        next = c->next;
+        c->closing = true;
+        conn_settle(r, c);
+    }
+}
+
+/*
+ * reactor_admit(r)
+ *
+ * Starts the waiting commands that were granted their turn and turns away
+ * the ones that waited too long.
+ */
+static void reactor_admit(rsh_reactor_t *r){
+    uint64_t now = rsh_stats_now();
+    rsh_conn_t **p = &r->waiting;
+    rsh_conn_t *c;
+
+    while ((c = *p) != NULL) {
+        command_list_t *clist = c->pending;
+        bool granted = rsh_admit_granted(&c->ticket);
+
+        if (!granted && c->ticket.deadline > now) {
+            p = &c->wait_next;
+            continue;
+        }
+        *p = c->wait_next;
+        if (!granted && !rsh_admit_cancel(&c->ticket))
+            granted = true;
+        c->pending = NULL;
+        c->running = false;
+        rsh_stats_client(c->client);
+
+        if (granted) {
+            conn_spawn(r, c, clist, false);
+        } else {
+            rsh_stats_busy();
+            conn_reply(r, c, RCMD_ERR_SVR_BUSY, RDSH_BUSY_STATUS);
+        }
+        free_cmd_list(clist);
+        free(clist);
+        conn_settle(r, c);
+    }
+}
+
+/*
+ * reactor_timeout(r)
+ *
+ * returns:  ms until the oldest waiting command times out, -1 for none
+ */
+static int reactor_timeout(rsh_reactor_t *r){
+    uint64_t now = rsh_stats_now();
+
+    if (r->waiting == NULL)
+        return -1;
+    if (r->waiting->ticket.deadline <= now)
+        return 0;
+    return (r->waiting->ticket.deadline - now + 999999) / 1000000;
+}
+
+static void *reactor_run(void *arg){
+    rsh_reactor_t *r = arg;
+    struct epoll_event events[RDSH_EPOLL_EVENTS];
+    char name[16];
+
+    snprintf(name, sizeof(name), "reactor%d", r->index);
+    rsh_stats_thread(name);
+
+    while (!r->draining || r->conns != NULL) {
+        int n = epoll_wait(r->epfd, events, RDSH_EPOLL_EVENTS, reactor_timeout(r));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            rsh_watch_t *w = events[i].data.ptr;
+            rsh_conn_t *c = w->conn;
+
+            if (c != NULL && c->dead)
+                continue;
+            if (c != NULL)
+                rsh_stats_client(c->client);
+
+            switch (w->kind) {
+            case W_LISTEN:
+                reactor_accept(r, w);
+                continue;
+            case W_STOP:
+                reactor_drain(r);
+                continue;
+            case W_ADMIT: {
+                uint64_t count;
+                if (read(w->fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                    perror("read admit");
+                continue;
+            }
+            case W_SOCK:
+                if (events[i].events & EPOLLOUT)
+                    conn_flush(r, c);
+                if (c->sock.fd >= 0 &&
+                    events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                    conn_read(r, c);
+                break;
+            case W_OUT:
+                conn_pump(r, c, (events[i].events & EPOLLHUP) != 0);
+                break;
+            case W_PID:
+                watch_close(r, &c->pid);
+                conn_reap(r, c);
+                break;
+            case W_IN:
+                // conn_settle() writes what is waiting
+                break;
+            }
+            conn_settle(r, c);
+        }
+        if (r->waiting != NULL)
+            reactor_admit(r);
+
+        while (r->dead != NULL) {
+            rsh_conn_t *c = r->dead;
+            r->dead = c->next;
+            free(c);
+        }
+    }
+
+    return NULL;
+}
+
+static void reactor_free(rsh_reactor_t *r){
+    if (r->zs_ok)
+        deflateEnd(&r->zs);
+    if (r->admit.fd >= 0)
+        close(r->admit.fd);
+    close(r->epfd);
+    free(r);
+}
+
+static rsh_reactor_t *reactor_new(int svr_sockets[], int num_svr){
+    rsh_reactor_t *r = calloc(1, sizeof(rsh_reactor_t));
+
+    if (r == NULL)
+        return NULL;
+    r->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (r->epfd < 0) {
+        perror("epoll_create1");
+        free(r);
+        return NULL;
+    }
+    r->zs_ok = rsh_deflate_init(&r->zs) == OK;
+    watch_init(&r->stop, W_STOP, stop_fd, NULL);
+    watch_init(&r->admit, W_ADMIT, eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK), NULL);
+    if (watch_set(r, &r->stop, EPOLLIN) != OK ||
+        r->admit.fd < 0 || watch_set(r, &r->admit, EPOLLIN) != OK) {
+        reactor_free(r);
+        return NULL;
+    }
+    for (int i = 0; i < num_svr; i++) {
+        watch_init(&r->listen[i], W_LISTEN, svr_sockets[i], NULL);
+        if (watch_set(r, &r->listen[i], EPOLLIN | EPOLLEXCLUSIVE) != OK) {
+            reactor_free(r);
+            return NULL;
+        }
+        r->num_listen++;
+    }
+    return r;
+}
+
+/*
+ * process_cli_events(svr_sockets, num_svr)
+ *
+ * Serves clients with one reactor thread per online core until a client
+ * asks for stop-server, then waits for every reactor to drain.  The fd
+ * limit is raised to the hard limit first, each connection is an fd.
+ */
+int process_cli_events(int svr_sockets[], int num_svr){
+    rsh_reactor_t *reactors[RDSH_REACTORS_MAX];
+    int num_reactors = 0;
+    struct rlimit rl;
+    long ncpu;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    for (int i = 0; i < num_svr; i++) {
+        if (fcntl(svr_sockets[i], F_SETFL, O_NONBLOCK) < 0) {
+            perror("fcntl");
+            return ERR_RDSH_SERVER;
+        }
+    }
+    null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (null_fd < 0 || stop_fd < 0) {
+        perror("open");
+        return ERR_RDSH_SERVER;
+    }
+
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1)
+        ncpu = 1;
+    if (ncpu > RDSH_REACTORS_MAX)
+        ncpu = RDSH_REACTORS_MAX;
+
+    for (int i = 0; i < ncpu; i++) {
+        rsh_reactor_t *r = reactor_new(svr_sockets, num_svr);
+        if (r == NULL)
+            break;
+        r->index = i;
+        if (pthread_create(&r->thread, NULL, reactor_run, r) != 0) {
+            reactor_free(r);
+            break;
+        }
+        reactors[num_reactors++] = r;
+    }
+    if (num_reactors == 0) {
+        fprintf(stderr, "Failed to start reactor threads\n");
+        return ERR_RDSH_SERVER;
+    }
+    printf(RCMD_MSG_SVR_REACTORS, num_reactors);
+
+    for (int i = 0; i < num_reactors; i++) {
+        pthread_join(reactors[i]->thread, NULL);
+        reactor_free(reactors[i]);
+    }
+    close(null_fd);
+    close(stop_fd);
+
+    return OK_EXIT;
+}
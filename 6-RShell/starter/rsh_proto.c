@@ -0,0 +1,476 @@
+#define _GNU_SOURCE     // struct ucred
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "dshlib.h"
+#include "rshlib.h"
+
+//Protocol v2 framing, output compression and the Unix socket transport
+//shared by the client and the blocking server cores.  The event core builds the same frames with
+//rsh_frame_hdr() but sends them through its own non blocking buffers.
+
+_Static_assert(sizeof(rsh_frame_hdr_t) == RDSH_FRAME_HDR_SZ, "frame header is 8 bytes");
+
+/*
+ * rsh_frame_hdr(hdr, type, id, len)
+ */
+void rsh_frame_hdr(rsh_frame_hdr_t *hdr, int type, uint16_t id, uint32_t len){
+    hdr->type = type;
+    hdr->flags = 0;
+    hdr->id = htons(id);
+    hdr->len = htonl(len);
+}
+
+/*
+ * rsh_send_all(sock, buff, len)
+ *
+ * send() until all of buff is out.
+ */
+int rsh_send_all(int sock, const void *buff, size_t len){
+    const char *p = buff;
+
+    while (len > 0) {
+        ssize_t sent = send(sock, p, len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            return ERR_RDSH_COMMUNICATION;
+        }
+        p += sent;
+        len -= sent;
+    }
+    return OK;
+}
+
+/*
+ * rsh_recv_all(sock, buff, len)
+ *
+ * recv() exactly len bytes.  ERR_RDSH_COMMUNICATION if the peer closes
+ * the connection first.
+ */
+int rsh_recv_all(int sock, void *buff, size_t len){
+    char *p = buff;
+
+    while (len > 0) {
+        ssize_t got = recv(sock, p, len, 0);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return ERR_RDSH_COMMUNICATION;
+        p += got;
+        len -= got;
+    }
+    return OK;
+}
+
+/*
+ * rsh_send_frame(sock, type, id, payload, len)
+ *
+ * Sends the header and payload with one sendmsg() so a small frame goes
+ * out as one segment.
+ */
+int rsh_send_frame(int sock, int type, uint16_t id, const void *payload, uint32_t len){
+    rsh_frame_hdr_t hdr;
+    struct iovec iov[2];
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+    ssize_t sent;
+
+    rsh_frame_hdr(&hdr, type, id, len);
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = (void *)payload;
+    iov[1].iov_len = len;
+
+    do {
+        sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    if (sent < 0)
+        return ERR_RDSH_COMMUNICATION;
+
+    // finish a partial send
+    if ((size_t)sent < sizeof(hdr)) {
+        if (rsh_send_all(sock, (char *)&hdr + sent, sizeof(hdr) - sent) != OK)
+            return ERR_RDSH_COMMUNICATION;
+        sent = sizeof(hdr);
+    }
+    sent -= sizeof(hdr);
+    return rsh_send_all(sock, (const char *)payload + sent, len - sent);
+}
+
+/*
+ * rsh_send_exit(sock, id, status)
+ *
+ * Ends a v2 response with the exit status of the command.
+ */
+int rsh_send_exit(int sock, uint16_t id, int status){
+    uint32_t wire = htonl((uint32_t)status);
+
+    return rsh_send_frame(sock, RDSH_FRAME_EXIT, id, &wire, sizeof(wire));
+}
+
+/*
+ * rsh_send_reply(sock, id, msg, len, status)
+ *
+ * Sends an answer the server makes up itself, an OUT frame with msg
+ * unless len is 0 and the EXIT frame, in one send() when it is short.
+ */
+int rsh_send_reply(int sock, uint16_t id, const char *msg, uint32_t len, int status){
+    char buff[2 * RDSH_FRAME_HDR_SZ + RDSH_REPLY_MAX + sizeof(uint32_t)];
+    uint32_t wire = htonl((uint32_t)status);
+    char *p = buff;
+
+    if (len > RDSH_REPLY_MAX) {
+        if (rsh_send_frame(sock, RDSH_FRAME_OUT, id, msg, len) != OK)
+            return ERR_RDSH_COMMUNICATION;
+        return rsh_send_exit(sock, id, status);
+    }
+
+    if (len > 0) {
+        rsh_frame_hdr((rsh_frame_hdr_t *)p, RDSH_FRAME_OUT, id, len);
+        memcpy(p + RDSH_FRAME_HDR_SZ, msg, len);
+        p += RDSH_FRAME_HDR_SZ + len;
+    }
+    rsh_frame_hdr((rsh_frame_hdr_t *)p, RDSH_FRAME_EXIT, id, sizeof(wire));
+    memcpy(p + RDSH_FRAME_HDR_SZ, &wire, sizeof(wire));
+    p += RDSH_FRAME_HDR_SZ + sizeof(wire);
+    return rsh_send_all(sock, buff, p - buff);
+}
+
+/*
+ * rsh_recv_frame(sock, type, flags, id, buff, max)
+ *
+ * Receives one frame.  The payload, at most max bytes, is stored in buff,
+ * flags may be NULL when the frame type allows none.
+ *
+ * returns:  payload length, or ERR_RDSH_COMMUNICATION if the connection
+ *           ended or the frame does not fit
+ */
+int rsh_recv_frame(int sock, int *type, int *flags, uint16_t *id, char *buff, uint32_t max){
+    rsh_frame_hdr_t hdr;
+    uint32_t len;
+
+    if (rsh_recv_all(sock, &hdr, sizeof(hdr)) != OK)
+        return ERR_RDSH_COMMUNICATION;
+    len = ntohl(hdr.len);
+    if (len > max) {
+        fprintf(stderr, CMD_ERR_RDSH_FRAME, len);
+        return ERR_RDSH_COMMUNICATION;
+    }
+    if (rsh_recv_all(sock, buff, len) != OK)
+        return ERR_RDSH_COMMUNICATION;
+
+    *type = hdr.type;
+    if (flags != NULL)
+        *flags = hdr.flags;
+    *id = ntohs(hdr.id);
+    return len;
+}
+
+/*
+ * rsh_recv_fd_frame(sock, fds)
+ *
+ * Receives the FDS frame that follows a HELLO granting RDSH_OPT_PASSFD.
+ * The fds are stored in fds, which the caller closes either way.
+ *
+ * returns:  OK, or ERR_RDSH_COMMUNICATION if anything else came
+ */
+int rsh_recv_fd_frame(int sock, int fds[3]){
+    rsh_frame_hdr_t hdr;
+    ssize_t got;
+
+    do {
+        got = rsh_recv_fds(sock, &hdr, sizeof(hdr), MSG_WAITALL, fds);
+    } while (got < 0 && errno == EINTR);
+    if (got != sizeof(hdr) || hdr.type != RDSH_FRAME_FDS || hdr.len != 0 || fds[0] < 0)
+        return ERR_RDSH_COMMUNICATION;
+    return OK;
+}
+
+/*
+ * rsh_hello_reply(payload, len, allow, reply)
+ *
+ * The server's answer to a HELLO payload: the version both will use and,
+ * when the client asked for options, the ones granted out of allow.
+ *
+ * returns:  the reply length, 1 or 2
+ */
+int rsh_hello_reply(const unsigned char *payload, int len, int allow, unsigned char reply[2]){
+    unsigned char version = payload[0];
+
+    if (version > RDSH_PROTO_VERSION)
+        version = RDSH_PROTO_VERSION;
+    if (version < RDSH_PROTO_V2)
+        version = RDSH_PROTO_V1;
+    reply[0] = version;
+    if (len < 2)
+        return 1;
+    reply[1] = payload[1] & allow;
+    return 2;
+}
+
+/*
+ * rsh_allowed_opts(sock)
+ *
+ * The options a server grants on sock, fds can only be passed over a Unix
+ * socket.
+ */
+int rsh_allowed_opts(int sock){
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+
+    if (getsockname(sock, (struct sockaddr *)&addr, &len) == 0 &&
+        addr.ss_family == AF_UNIX)
+        return RDSH_OPT_ALL;
+    return RDSH_OPT_ALL & ~RDSH_OPT_PASSFD;
+}
+
+/*
+ * rsh_send_fds(sock)
+ *
+ * Sends the FDS frame, our stdin, stdout and stderr ride along with its
+ * header as SCM_RIGHTS.
+ */
+int rsh_send_fds(int sock){
+    int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    char cbuf[CMSG_SPACE(sizeof(fds))];
+    rsh_frame_hdr_t hdr;
+    struct iovec iov = { .iov_base = &hdr, .iov_len = sizeof(hdr) };
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = cbuf, .msg_controllen = sizeof(cbuf),
+    };
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    ssize_t sent;
+
+    rsh_frame_hdr(&hdr, RDSH_FRAME_FDS, 0, 0);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+    do {
+        sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    if (sent < 0)
+        return ERR_RDSH_COMMUNICATION;
+    // the fds went with the first byte, the rest is plain data
+    return rsh_send_all(sock, (char *)&hdr + sent, sizeof(hdr) - sent);
+}
+
+/*
+ * rsh_recv_fds(sock, buff, len, flags, fds)
+ *
+ * recv() that also takes the fds of an FDS frame.  Three fds arriving
+ * while fds[0] is -1 are stored in fds, all close on exec, any others are
+ * closed.
+ *
+ * returns:  what recv() would
+ */
+ssize_t rsh_recv_fds(int sock, void *buff, size_t len, int flags, int fds[3]){
+    char cbuf[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = { .iov_base = buff, .iov_len = len };
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = cbuf, .msg_controllen = sizeof(cbuf),
+    };
+    struct cmsghdr *cm;
+    ssize_t got;
+
+    got = recvmsg(sock, &msg, flags | MSG_CMSG_CLOEXEC);
+    for (cm = CMSG_FIRSTHDR(&msg); got >= 0 && cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+        int n, *rcvd;
+
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+            continue;
+        n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        rcvd = (int *)CMSG_DATA(cm);
+        if (n == 3 && fds[0] < 0) {
+            memcpy(fds, rcvd, 3 * sizeof(int));
+            continue;
+        }
+        for (int i = 0; i < n; i++)
+            close(rcvd[i]);
+    }
+    return got;
+}
+
+/*
+ * rsh_server_hello(cli_socket, opts)
+ *
+ * Finds out which protocol a new client speaks.  A v2 client opens with a
+ * HELLO frame and gets one back carrying the version both will use, a v1
+ * client just sends its first command, which is left unread.  The options
+ * granted are stored in *opts, see rsh_allowed_opts().
+ *
+ * returns:  the protocol version, or ERR_RDSH_COMMUNICATION
+ */
+int rsh_server_hello(int cli_socket, int *opts){
+    unsigned char first;
+    unsigned char payload[4];
+    unsigned char reply[2];
+    int type, len, reply_len;
+    uint16_t id;
+    ssize_t got;
+
+    *opts = 0;
+    do {
+        got = recv(cli_socket, &first, 1, MSG_PEEK);
+    } while (got < 0 && errno == EINTR);
+    if (got <= 0)
+        return ERR_RDSH_COMMUNICATION;
+    if (first != RDSH_FRAME_HELLO)
+        return RDSH_PROTO_V1;
+
+    len = rsh_recv_frame(cli_socket, &type, NULL, &id, (char *)payload, sizeof(payload));
+    if (len < 1 || type != RDSH_FRAME_HELLO)
+        return ERR_RDSH_COMMUNICATION;
+
+    reply_len = rsh_hello_reply(payload, len, rsh_allowed_opts(cli_socket), reply);
+    if (rsh_send_frame(cli_socket, RDSH_FRAME_HELLO, 0, reply, reply_len) != OK)
+        return ERR_RDSH_COMMUNICATION;
+    if (reply_len > 1)
+        *opts = reply[1];
+    return reply[0];
+}
+
+/*
+ * rsh_client_hello(cli_socket, want_opts, opts)
+ *
+ * Offers RDSH_PROTO_VERSION and want_opts to the server, the options it
+ * grants are stored in *opts.  A v1 server takes the HELLO frame for a
+ * command it cannot run, its answer is read up to RDSH_EOF_CHAR and
+ * dropped.
+ *
+ * returns:  the protocol version, or ERR_RDSH_COMMUNICATION
+ */
+int rsh_client_hello(int cli_socket, int want_opts, int *opts){
+    unsigned char hello[2] = { RDSH_PROTO_VERSION, want_opts };
+    rsh_frame_hdr_t hdr;
+    char buff[256];
+    uint32_t len;
+    ssize_t got;
+
+    *opts = 0;
+    if (rsh_send_frame(cli_socket, RDSH_FRAME_HELLO, 0, hello, want_opts ? 2 : 1) != OK)
+        return ERR_RDSH_COMMUNICATION;
+    if (rsh_recv_all(cli_socket, &hdr, sizeof(hdr)) != OK)
+        return ERR_RDSH_COMMUNICATION;
+
+    len = ntohl(hdr.len);
+    if (hdr.type == RDSH_FRAME_HELLO && (len == 1 || len == 2)) {
+        if (rsh_recv_all(cli_socket, hello, len) != OK)
+            return ERR_RDSH_COMMUNICATION;
+        if (len == 2)
+            *opts = hello[1] & want_opts;
+        return hello[0];
+    }
+
+    got = sizeof(hdr);
+    memcpy(buff, &hdr, sizeof(hdr));
+    while (buff[got - 1] != RDSH_EOF_CHAR) {
+        got = recv(cli_socket, buff, sizeof(buff), 0);
+        if (got <= 0)
+            return ERR_RDSH_COMMUNICATION;
+    }
+    return RDSH_PROTO_V1;
+}
+
+/*
+ * rsh_deflate_init(zs)
+ *
+ * Sets zs up for rsh_deflate_chunk(), raw deflate with no zlib header.
+ */
+int rsh_deflate_init(z_stream *zs){
+    memset(zs, 0, sizeof(*zs));
+    if (deflateInit2(zs, RDSH_DEFLATE_LEVEL, Z_DEFLATED, -MAX_WBITS, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        return ERR_MEMORY;
+    return OK;
+}
+
+/*
+ * rsh_deflate_chunk(zs, in, len, out)
+ *
+ * Deflates one chunk of output into out, which has room for len bytes.
+ * Every chunk is a complete stream, the client inflates it on its own.
+ *
+ * returns:  the deflated size, or 0 if the chunk is under
+ *           RDSH_DEFLATE_MIN or would not shrink, send it as it is then
+ */
+int rsh_deflate_chunk(z_stream *zs, const void *in, int len, void *out){
+    if (len < RDSH_DEFLATE_MIN)
+        return 0;
+
+    deflateReset(zs);
+    zs->next_in = (Bytef *)in;
+    zs->avail_in = len;
+    zs->next_out = out;
+    zs->avail_out = len - 1;
+    if (deflate(zs, Z_FINISH) != Z_STREAM_END)
+        return 0;
+    return len - 1 - zs->avail_out;
+}
+
+/*
+ * rsh_is_unix_path(addr)
+ *
+ * An address with a '/' in it is the path of a Unix domain socket.
+ */
+int rsh_is_unix_path(const char *addr){
+    return strchr(addr, '/') != NULL;
+}
+
+/*
+ * rsh_peer_key(sock, key)
+ *
+ * Names the client on the other end of sock for statistics and admission
+ * control: its IP address over TCP, its uid over a Unix socket.
+ */
+void rsh_peer_key(int sock, char key[RDSH_PEER_KEY_SZ]){
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+
+    strcpy(key, "unknown");
+    if (getpeername(sock, (struct sockaddr *)&addr, &len) < 0)
+        return;
+    if (addr.ss_family == AF_INET)
+        inet_ntop(AF_INET, &((struct sockaddr_in *)&addr)->sin_addr, key, RDSH_PEER_KEY_SZ);
+    else if (addr.ss_family == AF_UNIX &&
+             getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == 0)
+        snprintf(key, RDSH_PEER_KEY_SZ, "unix:%u", (unsigned)cred.uid);
+}
+
+/*
+ * rsh_tcp_nodelay(sock)
+ *
+ * Turns Nagle's algorithm off, see the latency notes in rshlib.h.
+ */
+void rsh_tcp_nodelay(int sock){
+    int one = 1;
+
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+/*
+ * rsh_unix_bufs(sock)
+ *
+ * Raises the buffers of a connected Unix socket to RDSH_UNIX_SOCK_BUF.
+ * Only the send buffer limits a Unix stream, the receive buffer is set to
+ * match for the kernels that look at it.
+ */
+void rsh_unix_bufs(int sock){
+    int sz = RDSH_UNIX_SOCK_BUF;
+
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &sz, sizeof(sz));
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &sz, sizeof(sz));
+}
@@ -1,5 +1,9 @@
+#define _GNU_SOURCE     // accept4, pipe2, splice, environ
 #include <sys/socket.h>
 #include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <spawn.h>
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,10 +12,13 @@
 #include <sys/un.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <poll.h>
 
 //INCLUDES for extra credit
-//#include <signal.h>
-//#include <pthread.h>
+#include <signal.h>
+#include <pthread.h>
 //-------------------------
 
 #include "dshlib.h"
@@ -19,27 +26,94 @@
 
 static int threaded_mode = 0;
 
+//Worker pool for the threaded server.  The accept loop pushes client
+//sockets onto a bounded queue and RDSH_WORKERS threads pop them, each
+//running exec_client_requests() for one client at a time.  active[] is the
+//socket each worker is serving, or -1, so stop-server can end the other
+//sessions.  Everything but the thread ids is guarded by lock.
+static struct {
+    pthread_t       threads[RDSH_WORKERS];
+    int             num_threads;
+    int             queue[RDSH_QUEUE_MAX];
+    int             head;
+    int             count;
+    int             active[RDSH_WORKERS];
+    int             svr_sockets[RDSH_LISTENERS_MAX];
+    int             num_svr;
+    bool            stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t  not_empty;
+    pthread_cond_t  not_full;
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER,
+    .not_full = PTHREAD_COND_INITIALIZER,
+};
+
+/*
+ * set_threaded_server(val)
+ */
+void set_threaded_server(int val){
+    threaded_mode = val;
+}
+
 /*
- * start_server(ifaces, port, is_threaded)
+ * start_server(ifaces, port, unix_path, stats_path, svr_mode)
+ *
+ * svr_mode picks the server core: RDSH_SVR_SERIAL serves one client at a
+ * time, RDSH_SVR_THREADED uses the worker pool and RDSH_SVR_EVENT the epoll
+ * reactors in rsh_event.c.  If unix_path is not NULL the server listens on
+ * that Unix socket too and removes it when it stops.  If stats_path is not
+ * NULL the metrics are dumped there, see rsh_stats_start().
  */
-int start_server(char *ifaces, int port, int is_threaded){
+int start_server(char *ifaces, int port, char *unix_path, char *stats_path, int svr_mode){
+    int svr_sockets[RDSH_LISTENERS_MAX];
+    int num_svr = 0;
     int svr_socket;
     int rc;
 
-    threaded_mode = is_threaded;
+    set_threaded_server(svr_mode == RDSH_SVR_THREADED);
+
+    // splice() into a socket the client closed raises SIGPIPE, the relay
+    // wants EPIPE.  rsh_start_pipeline() gives the children the default.
+    signal(SIGPIPE, SIG_IGN);
+
+    if (rsh_stats_start(stats_path) != OK)
+        return ERR_RDSH_SERVER;
 
     svr_socket = boot_server(ifaces, port);
     if (svr_socket < 0){
         int err_code = svr_socket;  // server socket will carry error code
         fprintf(stderr, "Failed to boot server: %d\n", err_code);
+        rsh_stats_stop();
         return err_code;
     }
-
+    svr_sockets[num_svr++] = svr_socket;
     printf("Server started successfully on %s:%d\n", ifaces, port);
-    rc = process_cli_requests(svr_socket);
+
+    if (unix_path != NULL) {
+        svr_socket = boot_server(unix_path, 0);
+        if (svr_socket < 0) {
+            fprintf(stderr, "Failed to boot server: %d\n", svr_socket);
+            stop_server(svr_sockets[0]);
+            rsh_stats_stop();
+            return svr_socket;
+        }
+        svr_sockets[num_svr++] = svr_socket;
+        printf("Server started successfully on %s\n", unix_path);
+    }
+
+    if (svr_mode == RDSH_SVR_EVENT)
+        rc = process_cli_events(svr_sockets, num_svr);
+    else
+        rc = process_cli_requests(svr_sockets, num_svr);
 
     printf("Stopping server...\n");
-    stop_server(svr_socket);
+    for (int i = 0; i < num_svr; i++)
+        stop_server(svr_sockets[i]);
+    if (unix_path != NULL)
+        unlink(unix_path);
+    rsh_stats_stop();
 
     return rc;
 }
@@ -52,8 +126,48 @@ int stop_server(int svr_socket){
     return close(svr_socket);
 }
 
+/*
+ * boot_unix_server(path)
+ *
+ * The Unix socket half of boot_server().  A socket file left behind by a
+ * server that did not stop cleanly is removed first, anything else at
+ * path is left alone and bind() fails.
+ */
+static int boot_unix_server(char *path){
+    struct sockaddr_un addr;
+    struct stat st;
+    int svr_socket;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path too long: %s\n", path);
+        return ERR_RDSH_COMMUNICATION;
+    }
+
+    svr_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (svr_socket == -1) {
+        perror("socket");
+        return ERR_RDSH_COMMUNICATION;
+    }
+
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (bind(svr_socket, (const struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        perror("bind");
+        close(svr_socket);
+        return ERR_RDSH_COMMUNICATION;
+    }
+    return svr_socket;
+}
+
 /*
  * boot_server(ifaces, port)
+ *
+ * Listens on ifaces:port, or on the Unix socket ifaces names if it is a
+ * path, see rsh_is_unix_path().
  */
 int boot_server(char *ifaces, int port){
     int svr_socket;
@@ -61,8 +175,15 @@ int boot_server(char *ifaces, int port){
     
     struct sockaddr_in addr;
 
+    if (rsh_is_unix_path(ifaces)) {
+        svr_socket = boot_unix_server(ifaces);
+        if (svr_socket < 0)
+            return svr_socket;
+        goto do_listen;
+    }
+
     /* Create local socket. */
-    svr_socket = socket(AF_INET, SOCK_STREAM, 0);
+    svr_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (svr_socket == -1) {
         perror("socket");
         return ERR_RDSH_COMMUNICATION;
@@ -87,12 +208,13 @@ int boot_server(char *ifaces, int port){
         return ERR_RDSH_COMMUNICATION;
     }
 
+do_listen:
     /*
      * Prepare for accepting connections. The backlog size is set
-     * to 20. So while one request is being processed other requests
-     * can be waiting.
+     * to RDSH_LISTEN_BACKLOG. So while one request is being processed
+     * other requests, or a burst of new connections, can be waiting.
      */
-    ret = listen(svr_socket, 20);
+    ret = listen(svr_socket, RDSH_LISTEN_BACKLOG);
     if (ret == -1) {
         perror("listen");
         close(svr_socket);
@@ -103,25 +225,259 @@ int boot_server(char *ifaces, int port){
 }
 
 /*
- * process_cli_requests(svr_socket)
+ * stop_workers()
+ *
+ * Starts a clean shutdown of the threaded server.  The listening socket is
+ * shut down so the accept loop returns, and every session a worker is
+ * serving is shut down for reading, the command it is running finishes and
+ * its output still reaches the client, but the next recv() sees the end of
+ * the connection.  Safe to call more than once.
  */
-int process_cli_requests(int svr_socket){
+static void stop_workers(void){
+    pthread_mutex_lock(&pool.lock);
+    if (!pool.stopping) {
+        pool.stopping = true;
+        for (int i = 0; i < pool.num_svr; i++)
+            shutdown(pool.svr_sockets[i], SHUT_RD);
+        for (int i = 0; i < pool.num_threads; i++) {
+            if (pool.active[i] >= 0)
+                shutdown(pool.active[i], SHUT_RD);
+        }
+        pthread_cond_broadcast(&pool.not_empty);
+        pthread_cond_broadcast(&pool.not_full);
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/*
+ * handle_client(arg)
+ *
+ * Worker thread, arg is the worker's slot in pool.active.  Serves queued
+ * clients until the server stops.  A client asking for stop-server stops
+ * the whole pool.
+ */
+void *handle_client(void *arg){
+    int id = (int)(intptr_t)arg;
+    char name[16];
     int cli_socket;
-    int rc = OK;    
-    struct sockaddr_in client_addr;
+    int rc;
+
+    snprintf(name, sizeof(name), "worker%d", id);
+    rsh_stats_thread(name);
+
+    while (1) {
+        pthread_mutex_lock(&pool.lock);
+        while (pool.count == 0 && !pool.stopping)
+            pthread_cond_wait(&pool.not_empty, &pool.lock);
+        if (pool.stopping) {
+            pthread_mutex_unlock(&pool.lock);
+            break;
+        }
+        cli_socket = pool.queue[pool.head];
+        pool.head = (pool.head + 1) % RDSH_QUEUE_MAX;
+        pool.count--;
+        rsh_stats_queue(pool.count);
+        pool.active[id] = cli_socket;
+        pthread_cond_signal(&pool.not_full);
+        pthread_mutex_unlock(&pool.lock);
+
+        rc = exec_client_requests(cli_socket);
+
+        pthread_mutex_lock(&pool.lock);
+        pool.active[id] = -1;
+        pthread_mutex_unlock(&pool.lock);
+
+        if (rc == OK_EXIT) {
+            printf("%s", RCMD_MSG_SVR_STOP_REQ);
+            stop_workers();
+            break;
+        }
+        printf("%s", RCMD_MSG_CLIENT_EXITED);
+    }
+
+    return NULL;
+}
+
+/*
+ * exec_client_thread(main_socket, cli_socket)
+ *
+ * Hands an accepted client to the worker pool, waiting while the queue is
+ * full so a burst of connections backs up into the listen backlog instead
+ * of growing without bound.  Clients that arrive once the server is
+ * stopping are closed.
+ */
+int exec_client_thread(int main_socket __attribute__((unused)), int cli_socket){
+    pthread_mutex_lock(&pool.lock);
+    while (pool.count == RDSH_QUEUE_MAX && !pool.stopping)
+        pthread_cond_wait(&pool.not_full, &pool.lock);
+    if (pool.stopping) {
+        pthread_mutex_unlock(&pool.lock);
+        close(cli_socket);
+        return ERR_RDSH_SERVER;
+    }
+    pool.queue[(pool.head + pool.count) % RDSH_QUEUE_MAX] = cli_socket;
+    pool.count++;
+    rsh_stats_queue(pool.count);
+    pthread_cond_signal(&pool.not_empty);
+    pthread_mutex_unlock(&pool.lock);
+
+    return OK;
+}
+
+/*
+ * start_workers(svr_sockets, num_svr)
+ *
+ * Starts the worker pool, running with fewer threads if the system will
+ * not give us all RDSH_WORKERS.
+ */
+static int start_workers(int svr_sockets[], int num_svr){
+    memcpy(pool.svr_sockets, svr_sockets, num_svr * sizeof(int));
+    pool.num_svr = num_svr;
+    for (int i = 0; i < RDSH_WORKERS; i++) {
+        pool.active[i] = -1;
+        if (pthread_create(&pool.threads[i], NULL, handle_client,
+                           (void *)(intptr_t)i) != 0)
+            break;
+        pool.num_threads++;
+    }
+    if (pool.num_threads == 0) {
+        fprintf(stderr, "Failed to start worker threads\n");
+        return ERR_RDSH_SERVER;
+    }
+
+    printf(RCMD_MSG_SVR_WORKERS, pool.num_threads);
+    return OK;
+}
+
+/*
+ * drain_workers()
+ *
+ * Stops the pool and waits for it.  Clients still queued never got a
+ * worker and are closed, sessions in progress finish their current command.
+ */
+static void drain_workers(void){
+    int busy = 0;
+
+    stop_workers();
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.count > 0) {
+        close(pool.queue[pool.head]);
+        pool.head = (pool.head + 1) % RDSH_QUEUE_MAX;
+        pool.count--;
+    }
+    rsh_stats_queue(0);
+    for (int i = 0; i < pool.num_threads; i++)
+        busy += pool.active[i] >= 0;
+    pthread_mutex_unlock(&pool.lock);
+
+    if (busy > 0)
+        printf(RCMD_MSG_SVR_DRAIN, busy);
+    for (int i = 0; i < pool.num_threads; i++)
+        pthread_join(pool.threads[i], NULL);
+    pool.num_threads = 0;
+}
+
+/*
+ * rsh_client_connected(cli_socket, addr)
+ *
+ * Logs a client accepted from addr, and sets up its socket: TCP_NODELAY
+ * for TCP, bigger buffers for a Unix socket.
+ */
+void rsh_client_connected(int cli_socket, const struct sockaddr_storage *addr){
+    if (addr->ss_family == AF_UNIX) {
+        struct sockaddr_un local;
+        socklen_t len = sizeof(local);
+
+        // the client end is unnamed, name the socket it came in on
+        if (getsockname(cli_socket, (struct sockaddr *)&local, &len) < 0)
+            local.sun_path[0] = '\0';
+        printf("Client connected on %s\n", local.sun_path);
+        rsh_unix_bufs(cli_socket);
+        return;
+    }
+
+    const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+    printf("Client connected from %s:%d\n",
+           inet_ntoa(in->sin_addr), ntohs(in->sin_port));
+    rsh_tcp_nodelay(cli_socket);
+}
+
+/*
+ * accept_client(svr_sockets, num_svr)
+ *
+ * Waits for a client on any of the listening sockets and accepts it, close
+ * on exec so commands run for one client never hold another client's
+ * connection open.  A lone listener is just accept()ed.
+ *
+ * returns:  the client socket, or -1 with errno set
+ */
+static int accept_client(int svr_sockets[], int num_svr){
+    struct pollfd pfd[RDSH_LISTENERS_MAX];
+    struct sockaddr_storage client_addr;
     socklen_t client_len = sizeof(client_addr);
+    int svr_socket = svr_sockets[0];
+    int cli_socket;
+
+    if (num_svr > 1) {
+        for (int i = 0; i < num_svr; i++) {
+            pfd[i].fd = svr_sockets[i];
+            pfd[i].events = POLLIN;
+        }
+        if (poll(pfd, num_svr, -1) < 0)
+            return -1;
+        for (int i = 0; i < num_svr; i++) {
+            if (pfd[i].revents) {
+                svr_socket = svr_sockets[i];
+                break;
+            }
+        }
+    }
+
+    cli_socket = accept4(svr_socket, (struct sockaddr*)&client_addr,
+                         &client_len, SOCK_CLOEXEC);
+    if (cli_socket >= 0)
+        rsh_client_connected(cli_socket, &client_addr);
+    return cli_socket;
+}
+
+/*
+ * process_cli_requests(svr_sockets, num_svr)
+ */
+int process_cli_requests(int svr_sockets[], int num_svr){
+    int cli_socket;
+    int rc = OK;    
+
+    if (threaded_mode && start_workers(svr_sockets, num_svr) != OK)
+        return ERR_RDSH_SERVER;
+    if (!threaded_mode)
+        rsh_stats_thread("main");
     
     while(1){
         // Accept client connection
-        cli_socket = accept(svr_socket, (struct sockaddr*)&client_addr, &client_len);
+        cli_socket = accept_client(svr_sockets, num_svr);
         if (cli_socket < 0) {
+            if (errno == EINTR)
+                continue;
+            pthread_mutex_lock(&pool.lock);
+            bool stopping = pool.stopping;
+            pthread_mutex_unlock(&pool.lock);
+            if (stopping) {
+                rc = OK_EXIT;   // a worker got stop-server
+                break;
+            }
             perror("accept");
-            return ERR_RDSH_COMMUNICATION;
+            rc = ERR_RDSH_COMMUNICATION;
+            break;
+        }
+
+        if (threaded_mode) {
+            if (exec_client_thread(svr_sockets[0], cli_socket) != OK) {
+                rc = OK_EXIT;
+                break;
+            }
+            continue;
         }
-        
-        printf("Client connected from %s:%d\n", 
-               inet_ntoa(client_addr.sin_addr), 
-               ntohs(client_addr.sin_port));
         
         // Handle client requests
         rc = exec_client_requests(cli_socket);
@@ -135,6 +491,9 @@ int process_cli_requests(int svr_socket){
         printf("%s", RCMD_MSG_CLIENT_EXITED);
     }
 
+    if (threaded_mode)
+        drain_workers();
+
     return rc;
 }
 
@@ -145,7 +504,7 @@ int send_message_eof(int cli_socket){
     int send_len = 1;  // Just sending 1 byte - the EOF char
     int sent_len;
     
-    sent_len = send(cli_socket, &RDSH_EOF_CHAR, send_len, 0);
+    sent_len = send(cli_socket, &RDSH_EOF_CHAR, send_len, MSG_NOSIGNAL);
 
     if (sent_len != send_len){
         perror("send EOF failed");
@@ -161,8 +520,9 @@ int send_message_string(int cli_socket, char *buff){
     int send_len = strlen(buff);
     int sent_len;
     
-    // Send the message
-    sent_len = send(cli_socket, buff, send_len, 0);
+    // Send the message, the RDSH_EOF_CHAR that ends every response
+    // follows right away and pushes both out in one segment
+    sent_len = send(cli_socket, buff, send_len, MSG_NOSIGNAL | MSG_MORE);
     if (sent_len != send_len) {
         fprintf(stderr, CMD_ERR_RDSH_SEND, sent_len, send_len);
         return ERR_RDSH_COMMUNICATION;
@@ -171,6 +531,75 @@ int send_message_string(int cli_socket, char *buff){
     return OK;
 }
 
+/*
+ * send_reply(cli_socket, proto, id, msg, status)
+ *
+ * Sends a whole response made of msg: msg and RDSH_EOF_CHAR for v1, an OUT
+ * frame and an EXIT frame carrying status for v2.
+ */
+static int send_reply(int cli_socket, int proto, uint16_t id, const char *msg, int status){
+    rsh_stats_out(strlen(msg));
+    if (proto >= RDSH_PROTO_V2)
+        return rsh_send_reply(cli_socket, id, msg, strlen(msg), status);
+
+    if (*msg != '\0' && send_message_string(cli_socket, (char *)msg) != OK)
+        return ERR_RDSH_COMMUNICATION;
+    return send_message_eof(cli_socket);
+}
+
+/*
+ * recv_command(cli_socket, proto, id, flags, io_buff)
+ *
+ * Receives the next command into io_buff as a string, what one recv()
+ * returns for v1, one CMD frame for v2 and later, with its flags in
+ * *flags.  Pipelined commands wait in the socket until the ones before
+ * them are done.  IN frames left over from a command that stopped
+ * reading its stdin are skipped.
+ *
+ * returns:  length of the command, or ERR_RDSH_COMMUNICATION
+ */
+static int recv_command(int cli_socket, int proto, uint16_t *id, int *flags, char *io_buff){
+    int io_size;
+    int type;
+
+    *id = 0;
+    *flags = 0;
+    if (proto >= RDSH_PROTO_V2) {
+        do {
+            io_size = rsh_recv_frame(cli_socket, &type, flags, id, io_buff, RDSH_COMM_BUFF_SZ - 1);
+        } while (io_size >= 0 && type == RDSH_FRAME_IN);
+        if (io_size >= 0 && type != RDSH_FRAME_CMD)
+            io_size = ERR_RDSH_COMMUNICATION;
+    } else {
+        io_size = recv(cli_socket, io_buff, RDSH_COMM_BUFF_SZ - 1, 0);
+        if (io_size < 0)
+            perror("recv");
+        if (io_size <= 0)
+            io_size = ERR_RDSH_COMMUNICATION;
+    }
+
+    if (io_size >= 0)
+        io_buff[io_size] = '\0';
+    return io_size;
+}
+
+/*
+ * rsh_run_request(cli_socket, dir_fd, proto, id, opts, flags, fds, clist, fast_only)
+ *
+ * Runs one command for exec_client_requests() over the protocol the
+ * client speaks, on its own fds if it passed them.
+ *
+ * returns:  exit status of the last command, or ERR_RDSH_SPAWN, see
+ *           rsh_start_pipeline()
+ */
+static int rsh_run_request(int cli_socket, int *dir_fd, int proto, uint16_t id, int opts,
+                           int flags, int fds[], command_list_t *clist, bool fast_only) {
+    if (proto >= RDSH_PROTO_V2)
+        return rsh_relay_pipeline(cli_socket, dir_fd, id, opts, flags,
+                                  fds[0] >= 0 ? fds : NULL, clist, fast_only);
+    return rsh_execute_pipeline(cli_socket, dir_fd, clist, fast_only);
+}
+
 /*
  * exec_client_requests(cli_socket)
  */
@@ -178,6 +607,18 @@ int exec_client_requests(int cli_socket) {
     int io_size;
     command_list_t cmd_list;
     int rc = OK;
+    int proto;
+    int opts;
+    int flags;
+    int fds[3] = { -1, -1, -1 };
+    uint16_t id;
+    uint64_t cmd_start;
+    rsh_client_stats_t *client;
+    rsh_admit_client_t *adm;
+    rsh_admit_waiter_t ticket;
+    int procs;
+    int status;
+    int dir_fd;
     char *io_buff;
     
     // Allocate buffer for client commands
@@ -187,6 +628,27 @@ int exec_client_requests(int cli_socket) {
         close(cli_socket);
         return ERR_RDSH_SERVER;
     }
+    client = rsh_stats_connected(cli_socket);
+    adm = rsh_admit_join(cli_socket);
+    dir_fd = rsh_session_dir();
+
+    // v1 or v2, see rsh_server_hello()
+    proto = rsh_server_hello(cli_socket, &opts);
+    if (proto >= 0 && (opts & RDSH_OPT_PASSFD) && rsh_recv_fd_frame(cli_socket, fds) != OK)
+        proto = ERR_RDSH_COMMUNICATION;
+    if (proto < 0) {
+        fprintf(stderr, "Client disconnected or recv error\n");
+        for (int i = 0; i < 3; i++)
+            if (fds[i] >= 0)
+                close(fds[i]);
+        free(io_buff);
+        close(cli_socket);
+        if (dir_fd >= 0)
+            close(dir_fd);
+        rsh_admit_leave(adm);
+        rsh_stats_closed(client);
+        return ERR_RDSH_COMMUNICATION;
+    }
     
     // Process client commands
     while(1) {
@@ -195,26 +657,21 @@ int exec_client_requests(int cli_socket) {
         memset(&cmd_list, 0, sizeof(command_list_t));
         
         // Receive command from client
-        io_size = recv(cli_socket, io_buff, RDSH_COMM_BUFF_SZ - 1, 0);
-        
-        if (io_size <= 0) {
-            if (io_size < 0) {
-                perror("recv");
-            }
+        io_size = recv_command(cli_socket, proto, &id, &flags, io_buff);
+        if (io_size < 0) {
             // Either error or client disconnected
             fprintf(stderr, "Client disconnected or recv error\n");
             rc = ERR_RDSH_COMMUNICATION;
             break;
         }
-        
-        // Ensure null termination
-        io_buff[io_size] = '\0';
         printf("Received command: %s\n", io_buff);
+        cmd_start = rsh_stats_now();
+        rsh_stats_in(io_size);
         
         // Check for empty command
         if (strlen(io_buff) == 0) {
-            send_message_string(cli_socket, CMD_WARN_NO_CMD);
-            send_message_eof(cli_socket);
+            send_reply(cli_socket, proto, id, CMD_WARN_NO_CMD, 0);
+            rsh_stats_command(cmd_start);
             continue;
         }
         
@@ -225,8 +682,8 @@ int exec_client_requests(int cli_socket) {
         }
         
         if (strcmp(io_buff, "stop-server") == 0) {
-            send_message_string(cli_socket, "Server shutting down\n");
-            send_message_eof(cli_socket);
+            send_reply(cli_socket, proto, id, "Server shutting down\n", 0);
+            rsh_stats_command(cmd_start);
             rc = OK_EXIT;
             break;
         }
@@ -235,43 +692,510 @@ int exec_client_requests(int cli_socket) {
         rc = build_cmd_list(io_buff, &cmd_list);
         
         if (rc == WARN_NO_CMDS) {
-            send_message_string(cli_socket, CMD_WARN_NO_CMD);
-            send_message_eof(cli_socket);
+            send_reply(cli_socket, proto, id, CMD_WARN_NO_CMD, 0);
+            rsh_stats_command(cmd_start);
             continue;
         } else if (rc == ERR_TOO_MANY_COMMANDS) {
             char err_msg[100];
             sprintf(err_msg, CMD_ERR_PIPE_LIMIT, CMD_MAX);
-            send_message_string(cli_socket, err_msg);
-            send_message_eof(cli_socket);
+            send_reply(cli_socket, proto, id, err_msg, 1);
+            rsh_stats_command(cmd_start);
             continue;
         } else if (rc != OK) {
-            send_message_string(cli_socket, CMD_ERR_RDSH_EXEC);
-            send_message_eof(cli_socket);
+            send_reply(cli_socket, proto, id, CMD_ERR_RDSH_EXEC, 1);
+            rsh_stats_command(cmd_start);
+            continue;
+        }
+
+        if (cmd_list.num == 1 &&
+            rsh_match_command(cmd_list.commands[0].argv[0]) == BI_CMD_SVR_STATS) {
+            char *text = rsh_stats_text();
+            rc = send_reply(cli_socket, proto, id, text ? text : CMD_ERR_RDSH_EXEC, text ? 0 : 1);
+            rsh_stats_command(cmd_start);
+            free(text);
+            free_cmd_list(&cmd_list);
+            if (rc != OK)
+                break;
+            continue;
+        }
+
+        // A command that may run in-process tries that first, anything that
+        // starts processes waits for a turn, see rsh_admit_wait()
+        memset(&ticket, 0, sizeof(ticket));
+        procs = rsh_pipeline_procs(&cmd_list);
+        status = procs == 0 ? rsh_run_request(cli_socket, &dir_fd, proto, id, opts, flags,
+                                              fds, &cmd_list, true) : ERR_RDSH_SPAWN;
+        if (status == ERR_RDSH_SPAWN &&
+            rsh_admit_wait(adm, &ticket, procs > 0 ? procs : cmd_list.num) != OK) {
+            rc = send_reply(cli_socket, proto, id, RCMD_ERR_SVR_BUSY, RDSH_BUSY_STATUS);
+            rsh_stats_command(cmd_start);
+            free_cmd_list(&cmd_list);
+            if (rc != OK)
+                break;
             continue;
         }
         
-        // Execute the commands
-        rc = rsh_execute_pipeline(cli_socket, &cmd_list);
-        
-        // Send EOF to indicate end of command execution
-        rc = send_message_eof(cli_socket);
+        // Execute the commands, then end the response with RDSH_EOF_CHAR
+        // or the exit status
+        if (status == ERR_RDSH_SPAWN)
+            status = rsh_run_request(cli_socket, &dir_fd, proto, id, opts, flags,
+                                     fds, &cmd_list, false);
+        if (proto >= RDSH_PROTO_V2)
+            rc = rsh_send_exit(cli_socket, id, status);
+        else
+            rc = send_message_eof(cli_socket);
+        rsh_admit_done(&ticket);
+        rsh_stats_command(cmd_start);
+        free_cmd_list(&cmd_list);
+
         if (rc != OK) {
             fprintf(stderr, "Failed to send EOF\n");
             break;
         }
-        
-        free_cmd_list(&cmd_list);
     }
     
+    for (int i = 0; i < 3; i++)
+        if (fds[i] >= 0)
+            close(fds[i]);
     free(io_buff);
     close(cli_socket);
+    if (dir_fd >= 0)
+        close(dir_fd);
+    rsh_admit_leave(adm);
+    rsh_stats_closed(client);
     return rc;
 }
 
 /*
- * rsh_execute_pipeline(int cli_sock, command_list_t *clist)
+ * rsh_fast_run(cmd, dir_fd, out_fd, err_fd, status)
+ *
+ * Runs cmd in-process, see exec_fast_command(), and writes what it printed
+ * to out_fd and err_fd.  Only when that cannot block: the output fits one
+ * write, FAST_OUT_MAX is PIPE_BUF, and both fds poll writable.
+ *
+ * returns:  true with its exit status in *status, false to spawn it
+ */
+static bool rsh_fast_run(cmd_buff_t *cmd, int dir_fd, int out_fd, int err_fd, int *status) {
+    struct pollfd fds[2] = { { .fd = out_fd, .events = POLLOUT },
+                             { .fd = err_fd, .events = POLLOUT } };
+    fast_out_t out, err;
+    bool merged;
+
+    if (!fast_command(cmd) || poll(fds, 2, 0) != 2 ||
+        fds[0].revents != POLLOUT || fds[1].revents != POLLOUT)
+        return false;
+    merged = fast_same_output(out_fd, err_fd);
+    *status = exec_fast_command(cmd, dir_fd, out_fd, &out, merged ? &out : &err);
+    if (*status == FAST_FALLBACK)
+        return false;
+
+    if (out.len > 0 && write(out_fd, out.buf, out.len) < 0)
+        perror("write");
+    if (!merged && err.len > 0 && write(err_fd, err.buf, err.len) < 0)
+        perror("write");
+    return true;
+}
+
+static bool rsh_bare_cat(cmd_buff_t *cmd) {
+    return cmd->argc == 1 && !cmd->input_file && !cmd->output_file &&
+           rsh_match_command(cmd->argv[0]) == BI_CMD_CAT;
+}
+
+/*
+ * rsh_start_pipeline(clist, dir_fd, in_fd, out_fd, err_fd, pids)
+ *
+ * Starts one child per command with posix_spawnp(), connected by pipes,
+ * in the session's directory dir_fd.  The first command reads in_fd, the
+ * last writes out_fd, and every command's stderr goes to err_fd.  glibc spawns with clone(CLONE_VM |
+ * CLONE_VFORK), so starting a command costs the same however big the
+ * server and its thread count grow, where fork() copied the page tables.
+ *
+ * Trivial commands at the ends run in-process instead, see
+ * rsh_fast_run(): a command alone, the first one, its output then waits
+ * in the pipe to the second, or the last one if it does not read its
+ * input.  A bare cat at the end is dropped, what it would copy goes to
+ * out_fd directly.
+ *
+ * The pids are stored in pids[0..clist->num-1] for the caller to wait on.
+ * A command that could not be started gets -errno instead, its message
+ * goes to err_fd and errno is its exit status, as when the forked child
+ * failed in execvp().  One that ran in-process gets -its exit status, so
+ * 0 or less means there is nothing to wait for.
+ *
+ * With fast_only a command alone only runs in-process, the caller was not
+ * admitted to start processes, see rsh_pipeline_procs().
+ *
+ * returns:  OK, ERR_RDSH_SPAWN with fast_only if the command has to be
+ *           spawned after all, nothing ran then, or ERR_RDSH_CMD_EXEC
+ */
+int rsh_start_pipeline(command_list_t *clist, int dir_fd, int in_fd, int out_fd, int err_fd,
+                       pid_t pids[], bool fast_only) {
+    int pipes[CMD_MAX-1][2];
+    int head[2] = { -1, -1 };
+    int tail[2] = { -1, -1 };
+    int first = 0;
+    int last = clist->num - 1;
+    int status;
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t sigpipe;
+    uint64_t start = rsh_stats_now();
+
+    while (last > 0 && rsh_bare_cat(&clist->commands[last]))
+        pids[last--] = 0;
+
+    if (first == last) {
+        if (rsh_fast_run(&clist->commands[0], dir_fd, out_fd, err_fd, &status)) {
+            pids[0] = -status;
+            rsh_stats_spawned(start);
+            return OK;
+        }
+        if (fast_only)
+            return ERR_RDSH_SPAWN;
+    } else {
+        if (fast_command(&clist->commands[first]) && pipe2(head, O_CLOEXEC) == 0) {
+            if (rsh_fast_run(&clist->commands[first], dir_fd, head[1], err_fd, &status)) {
+                pids[first++] = -status;
+                in_fd = head[0];
+            } else {
+                close(head[0]);
+                head[0] = -1;
+            }
+            close(head[1]);
+        }
+        // the one before gets a pipe nobody reads, and SIGPIPE as it would
+        if (first < last && fast_command(&clist->commands[last]) &&
+            pipe2(tail, O_CLOEXEC) == 0) {
+            if (rsh_fast_run(&clist->commands[last], dir_fd, out_fd, err_fd, &status)) {
+                pids[last--] = -status;
+                out_fd = tail[1];
+            } else {
+                close(tail[1]);
+                tail[1] = -1;
+            }
+            close(tail[0]);
+        }
+    }
+    
+    // Create all necessary pipes, close on exec so they do not leak into
+    // pipelines other clients start at the same time
+    for (int i = first; i < last; i++) {
+        if (pipe2(pipes[i], O_CLOEXEC) == -1) {
+            perror("pipe");
+            for (int j = first; j < i; j++) {
+                close(pipes[j][0]);
+                close(pipes[j][1]);
+            }
+            if (head[0] >= 0)
+                close(head[0]);
+            if (tail[1] >= 0)
+                close(tail[1]);
+            return ERR_RDSH_CMD_EXEC;
+        }
+    }
+
+    // The server ignores SIGPIPE, the children get the default back
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigdefault(&attr, &sigpipe);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+    
+    // Spawn each command in the pipeline
+    for (int i = first; i <= last; i++) {
+        int stdin_fd = (i == first) ? in_fd : pipes[i-1][0];
+        int stdout_fd = (i == last) ? out_fd : pipes[i][1];
+        pid_t pid;
+        int rc;
+
+        // Every fd of the server is close on exec, only these three reach
+        // the command
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, stdin_fd, STDIN_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, stdout_fd, STDOUT_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, err_fd, STDERR_FILENO);
+        if (dir_fd >= 0)
+            posix_spawn_file_actions_addfchdir_np(&actions, dir_fd);
+
+        rc = posix_spawnp(&pid, clist->commands[i].argv[0], &actions, &attr,
+                          clist->commands[i].argv, environ);
+        posix_spawn_file_actions_destroy(&actions);
+
+        if (rc != 0) {
+            char error_msg[256];
+            snprintf(error_msg, sizeof(error_msg),
+                     "execvp failed: %s\nCommand not found: %s\n",
+                     strerror(rc), clist->commands[i].argv[0]);
+            if (write(err_fd, error_msg, strlen(error_msg)) < 0)
+                perror("write");
+            pid = -rc;
+        }
+        pids[i] = pid;
+    }
+    posix_spawnattr_destroy(&attr);
+    
+    // Parent process: close all pipe ends
+    for (int i = first; i < last; i++) {
+        close(pipes[i][0]);
+        close(pipes[i][1]);
+    }
+    if (head[0] >= 0)
+        close(head[0]);
+    if (tail[1] >= 0)
+        close(tail[1]);
+
+    rsh_stats_spawned(start);
+    return OK;
+}
+
+/*
+ * rsh_out_pipe(outp)
+ *
+ * Makes the pipe a pipeline writes its output into.  It is grown to
+ * RDSH_RELAY_PIPE_SZ when the system allows, so a large output moves in
+ * fewer, bigger splices.
  */
-int rsh_execute_pipeline(int cli_sock, command_list_t *clist) {
+static int rsh_out_pipe(int outp[2]) {
+    if (pipe2(outp, O_CLOEXEC) == -1) {
+        perror("pipe");
+        return ERR_RDSH_CMD_EXEC;
+    }
+    fcntl(outp[0], F_SETPIPE_SZ, RDSH_RELAY_PIPE_SZ);
+    return OK;
+}
+
+//Output compression for one command, see rsh_relay_output()
+typedef struct rsh_deflater {
+    z_stream    zs;
+    char        *in;            //RDSH_COMM_BUFF_SZ, output read from the pipe
+    char        *out;           //RDSH_COMM_BUFF_SZ, deflated payload
+} rsh_deflater_t;
+
+/*
+ * rsh_relay_deflated(cli_sock, out_fd, id, zip, avail)
+ *
+ * Reads up to avail bytes of output and sends them as one OUT frame,
+ * deflated when rsh_deflate_chunk() finds that worth it.
+ *
+ * returns:  bytes of output sent, or ERR_RDSH_COMMUNICATION
+ */
+static ssize_t rsh_relay_deflated(int cli_sock, int out_fd, uint16_t id,
+                                  rsh_deflater_t *zip, int avail) {
+    rsh_frame_hdr_t hdr;
+    ssize_t n;
+    int zlen;
+
+    if (avail > RDSH_COMM_BUFF_SZ)
+        avail = RDSH_COMM_BUFF_SZ;
+    do {
+        n = read(out_fd, zip->in, avail);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0)
+        return ERR_RDSH_COMMUNICATION;
+
+    zlen = rsh_deflate_chunk(&zip->zs, zip->in, n, zip->out);
+    if (zlen == 0)
+        return rsh_send_frame(cli_sock, RDSH_FRAME_OUT, id, zip->in, n) == OK ? n : ERR_RDSH_COMMUNICATION;
+
+    rsh_frame_hdr(&hdr, RDSH_FRAME_OUT, id, zlen);
+    hdr.flags = RDSH_FRAME_F_DEFLATE;
+    if (rsh_send_all(cli_sock, &hdr, sizeof(hdr)) != OK ||
+        rsh_send_all(cli_sock, zip->out, zlen) != OK)
+        return ERR_RDSH_COMMUNICATION;
+    return n;
+}
+
+/*
+ * rsh_relay_chunk(cli_sock, out_fd, id, zip, last)
+ *
+ * Sends what the readable output pipe holds as one OUT frame.  FIONREAD
+ * gives its length, the header is sent with MSG_MORE and the payload is
+ * spliced after it, the bytes never pass through a user space buffer.
+ * With a deflater the output has to be read after all and goes out
+ * through rsh_relay_deflated().  last says the pipe hung up, the payload
+ * is then held back for the EXIT frame that follows, see rshlib.h.
+ *
+ * returns:  bytes relayed, 0 once every writer is gone, or
+ *           ERR_RDSH_COMMUNICATION
+ */
+static ssize_t rsh_relay_chunk(int cli_sock, int out_fd, uint16_t id, rsh_deflater_t *zip,
+                               bool last) {
+    rsh_frame_hdr_t hdr;
+    ssize_t total = 0;
+    ssize_t n;
+    int avail;
+
+    if (ioctl(out_fd, FIONREAD, &avail) < 0)
+        return ERR_RDSH_COMMUNICATION;
+    // readable and empty, every writer is gone
+    if (avail == 0)
+        return 0;
+
+    if (zip != NULL)
+        return rsh_relay_deflated(cli_sock, out_fd, id, zip, avail);
+
+    rsh_frame_hdr(&hdr, RDSH_FRAME_OUT, id, avail);
+    do {
+        n = send(cli_sock, &hdr, sizeof(hdr), MSG_NOSIGNAL | MSG_MORE);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 || (n < (ssize_t)sizeof(hdr) &&
+                  rsh_send_all(cli_sock, (char *)&hdr + n, sizeof(hdr) - n) != OK))
+        return ERR_RDSH_COMMUNICATION;
+
+    while (avail > 0) {
+        n = splice(out_fd, NULL, cli_sock, NULL, avail,
+                   SPLICE_F_MOVE | (last ? SPLICE_F_MORE : 0));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return ERR_RDSH_COMMUNICATION;
+        total += n;
+        avail -= n;
+    }
+    return total;
+}
+
+/*
+ * rsh_relay_output(cli_sock, out_fd, proto, id, zip)
+ *
+ * Moves a pipeline's output from the read end of its pipe to the client
+ * with splice() each time the pipe is readable, as it is for v1 and
+ * through rsh_relay_chunk() for v2.  Once the pipe hung up the rest is
+ * sent MSG_MORE, the end of the response follows.
+ *
+ * returns:  bytes relayed, or ERR_RDSH_COMMUNICATION if the client went
+ *           away, the children then get SIGPIPE once out_fd is closed
+ */
+static ssize_t rsh_relay_output(int cli_sock, int out_fd, int proto, uint16_t id,
+                                rsh_deflater_t *zip) {
+    struct pollfd pfd = { .fd = out_fd, .events = POLLIN };
+    ssize_t total = 0;
+    ssize_t n;
+    bool last;
+
+    while (1) {
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            return ERR_RDSH_COMMUNICATION;
+        }
+        last = (pfd.revents & POLLHUP) != 0;
+
+        if (proto >= RDSH_PROTO_V2) {
+            n = rsh_relay_chunk(cli_sock, out_fd, id, zip, last);
+        } else {
+            n = splice(out_fd, NULL, cli_sock, NULL, RDSH_RELAY_PIPE_SZ,
+                       SPLICE_F_MOVE | (last ? SPLICE_F_MORE : 0));
+            if (n < 0 && errno == EINTR)
+                continue;
+        }
+        if (n <= 0)
+            return n < 0 ? ERR_RDSH_COMMUNICATION : total;
+        rsh_stats_out(n);
+        total += n;
+    }
+}
+
+/*
+ * rsh_relay_duplex(cli_sock, out_fd, in_fd, id, zip)
+ *
+ * rsh_relay_output() for a command that reads the client's stdin.  The
+ * payloads of IN frames are written to in_fd while the output goes the
+ * other way.  The socket is only read once the last payload is all in the
+ * pipe, so a command that reads slowly holds the client back through TCP
+ * flow control.  An empty IN frame closes in_fd and the command sees EOF.
+ * If the command stops reading the rest of the stream is left in the
+ * socket, recv_command() skips it.
+ *
+ * returns:  bytes of output relayed, or ERR_RDSH_COMMUNICATION
+ */
+static ssize_t rsh_relay_duplex(int cli_sock, int out_fd, int in_fd, uint16_t id,
+                                rsh_deflater_t *zip) {
+    struct pollfd pfd[3];
+    char *buff = malloc(RDSH_COMM_BUFF_SZ);
+    int pend_off = 0;
+    int pend_len = 0;
+    ssize_t total = 0;
+    ssize_t n;
+
+    if (buff == NULL) {
+        close(in_fd);
+        return rsh_relay_output(cli_sock, out_fd, RDSH_PROTO_V2, id, zip);
+    }
+    fcntl(in_fd, F_SETFL, O_NONBLOCK);
+
+    while (1) {
+        pfd[0].fd = out_fd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = (in_fd >= 0 && pend_len == 0) ? cli_sock : -1;
+        pfd[1].events = POLLIN;
+        pfd[2].fd = pend_len > 0 ? in_fd : -1;
+        pfd[2].events = POLLOUT;
+        if (poll(pfd, 3, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            total = ERR_RDSH_COMMUNICATION;
+            break;
+        }
+
+        if (pfd[0].revents) {
+            n = rsh_relay_chunk(cli_sock, out_fd, id, zip,
+                                (pfd[0].revents & POLLHUP) != 0);
+            if (n <= 0) {
+                if (n < 0)
+                    total = n;
+                break;
+            }
+            rsh_stats_out(n);
+            total += n;
+        }
+
+        if (pfd[1].revents) {
+            int type, flags;
+            uint16_t in_id;
+
+            n = rsh_recv_frame(cli_sock, &type, &flags, &in_id, buff, RDSH_COMM_BUFF_SZ);
+            if (n < 0 || type != RDSH_FRAME_IN) {
+                // gone, or not speaking the protocol, end the session
+                shutdown(cli_sock, SHUT_RD);
+                n = 0;
+            }
+            if (n == 0) {
+                close(in_fd);
+                in_fd = -1;
+            }
+            rsh_stats_in(n);
+            pend_off = 0;
+            pend_len = n;
+        }
+
+        if (pfd[2].revents) {
+            n = write(in_fd, buff + pend_off, pend_len - pend_off);
+            if (n < 0 && (errno == EAGAIN || errno == EINTR))
+                continue;
+            if (n < 0) {
+                // the command is done reading
+                close(in_fd);
+                in_fd = -1;
+                pend_len = 0;
+                continue;
+            }
+            pend_off += n;
+            if (pend_off == pend_len)
+                pend_len = 0;
+        }
+    }
+
+    if (in_fd >= 0)
+        close(in_fd);
+    free(buff);
+    return total;
+}
+
+/*
+ * rsh_execute_pipeline(int cli_sock, int *dir_fd, command_list_t *clist, bool fast_only)
+ */
+int rsh_execute_pipeline(int cli_sock, int *dir_fd, command_list_t *clist, bool fast_only) {
     if (!clist || clist->num == 0) {
         return ERR_RDSH_CMD_EXEC;
     }
@@ -284,96 +1208,41 @@ int rsh_execute_pipeline(int cli_sock, command_list_t *clist) {
     } else if (bi_cmd == BI_CMD_STOP_SVR) {
         return STOP_SERVER_SC;
     } else if (bi_cmd == BI_CMD_CD && clist->num == 1) {
-        if (clist->commands[0].argc > 1) {
-            if (chdir(clist->commands[0].argv[1]) != 0) {
-                char err_msg[256];
-                sprintf(err_msg, "cd: %s: %s\n", clist->commands[0].argv[1], strerror(errno));
-                send_message_string(cli_sock, err_msg);
-                return ERR_RDSH_CMD_EXEC;
-            }
+        char err_msg[256];
+        if (rsh_cd(&clist->commands[0], dir_fd, err_msg, sizeof(err_msg)) != 0) {
+            send_message_string(cli_sock, err_msg);
+            return ERR_RDSH_CMD_EXEC;
         }
         return OK;
     }
 
-    int pipes[CMD_MAX-1][2];
     pid_t pids[CMD_MAX];
+    int outp[2];
     int status;
     int exit_code = 0;
-    
-    // Create all necessary pipes
-    for (int i = 0; i < clist->num - 1; i++) {
-        if (pipe(pipes[i]) == -1) {
-            perror("pipe");
-            return ERR_RDSH_CMD_EXEC;
-        }
-    }
-    
-    // Fork and execute each command in the pipeline
-    for (int i = 0; i < clist->num; i++) {
-        pids[i] = fork();
-        
-        if (pids[i] < 0) {
-            perror("fork");
-            
-            // Close all pipes
-            for (int j = 0; j < clist->num - 1; j++) {
-                close(pipes[j][0]);
-                close(pipes[j][1]);
-            }
-            
-            return ERR_RDSH_CMD_EXEC;
-        }
-        
-        if (pids[i] == 0) {
-            // Child process
-            
-            // Set up stdin (from previous pipe or socket for first command)
-            if (i == 0) {
-                // First command gets input from client socket
-                dup2(cli_sock, STDIN_FILENO);
-            } else {
-                // Other commands get input from previous pipe
-                dup2(pipes[i-1][0], STDIN_FILENO);
-            }
-            
-            // Set up stdout (to next pipe or socket for last command)
-            if (i == clist->num - 1) {
-                // Last command sends output to client socket
-                dup2(cli_sock, STDOUT_FILENO);
-                dup2(cli_sock, STDERR_FILENO);
-            } else {
-                // Other commands send output to next pipe
-                dup2(pipes[i][1], STDOUT_FILENO);
-                // Error output goes to client socket for all commands
-                dup2(cli_sock, STDERR_FILENO);
-            }
-            
-            // Close all pipe ends in child
-            for (int j = 0; j < clist->num - 1; j++) {
-                close(pipes[j][0]);
-                close(pipes[j][1]);
-            }
-            
-            // Execute the command
-            execvp(clist->commands[i].argv[0], clist->commands[i].argv);
-            
-            // If execvp returns, there was an error
-            fprintf(stderr, "execvp failed: %s\n", strerror(errno));
-            char error_msg[256];
-            sprintf(error_msg, "Command not found: %s\n", clist->commands[i].argv[0]);
-            write(STDERR_FILENO, error_msg, strlen(error_msg));
-            exit(errno);
-        }
+
+    // stdin stays the socket, output comes back through rsh_relay_output()
+    if (rsh_out_pipe(outp) != OK) {
+        return ERR_RDSH_CMD_EXEC;
     }
-    
-    // Parent process: close all pipe ends
-    for (int i = 0; i < clist->num - 1; i++) {
-        close(pipes[i][0]);
-        close(pipes[i][1]);
+    status = rsh_start_pipeline(clist, *dir_fd, cli_sock, outp[1], outp[1], pids, fast_only);
+    if (status != OK) {
+        close(outp[0]);
+        close(outp[1]);
+        return status == ERR_RDSH_SPAWN ? status : ERR_RDSH_CMD_EXEC;
     }
+    close(outp[1]);
+    rsh_relay_output(cli_sock, outp[0], RDSH_PROTO_V1, 0, NULL);
+    close(outp[0]);
     
     // Wait for all children to complete
     for (int i = 0; i < clist->num; i++) {
+        if (pids[i] <= 0) {
+            // never started or ran in-process, -pids[i] is its status
+            if (i == clist->num - 1)
+                exit_code = -pids[i];
+            continue;
+        }
         if (waitpid(pids[i], &status, 0) > 0) {
             if (WIFEXITED(status)) {
                 if (i == clist->num - 1) {
@@ -387,6 +1256,190 @@ int rsh_execute_pipeline(int cli_sock, command_list_t *clist) {
     return exit_code;
 }
 
+/*
+ * rsh_wait_pipeline(clist, pids)
+ *
+ * Waits for the children rsh_start_pipeline() started.
+ *
+ * returns:  exit status of the last command, 128 + signal if it was killed
+ */
+static int rsh_wait_pipeline(command_list_t *clist, pid_t pids[]) {
+    int status;
+    int exit_code = 0;
+
+    for (int i = 0; i < clist->num; i++) {
+        if (pids[i] <= 0) {
+            // never started or ran in-process, -pids[i] is its status
+            if (i == clist->num - 1)
+                exit_code = -pids[i];
+            continue;
+        }
+        if (waitpid(pids[i], &status, 0) > 0 && i == clist->num - 1) {
+            if (WIFEXITED(status))
+                exit_code = WEXITSTATUS(status);
+            else if (WIFSIGNALED(status))
+                exit_code = 128 + WTERMSIG(status);
+        }
+    }
+    return exit_code;
+}
+
+/*
+ * rsh_run_on_fds(cli_sock, dir_fd, id, cmd_flags, fds, clist, fast_only)
+ *
+ * Runs a command on the stdout and stderr the client passed, and on its
+ * stdin if the CMD frame is flagged RDSH_FRAME_F_STDIN.  The server only
+ * waits, none of the output goes through it.
+ *
+ * returns:  exit status of the last command, or ERR_RDSH_SPAWN, see
+ *           rsh_start_pipeline()
+ */
+static int rsh_run_on_fds(int cli_sock, int dir_fd, uint16_t id, int cmd_flags, int fds[],
+                          command_list_t *clist, bool fast_only) {
+    pid_t pids[CMD_MAX];
+    int in_fd = fds[0];
+    int rc;
+
+    if (!(cmd_flags & RDSH_FRAME_F_STDIN))
+        in_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    rc = in_fd < 0 ? ERR_RDSH_CMD_EXEC :
+                     rsh_start_pipeline(clist, dir_fd, in_fd, fds[1], fds[2], pids, fast_only);
+    if (in_fd >= 0 && in_fd != fds[0])
+        close(in_fd);
+    if (rc == ERR_RDSH_SPAWN)
+        return rc;
+    if (rc != OK) {
+        rsh_send_frame(cli_sock, RDSH_FRAME_OUT, id, CMD_ERR_RDSH_EXEC, strlen(CMD_ERR_RDSH_EXEC));
+        return 1;
+    }
+    return rsh_wait_pipeline(clist, pids);
+}
+
+/*
+ * rsh_relay_pipeline(cli_sock, dir_fd, id, opts, cmd_flags, fds, clist, fast_only)
+ *
+ * Runs a command for a v2 client in its session's directory *dir_fd.  The children write into a pipe, which
+ * rsh_relay_output() moves to the socket as OUT frames, deflated if opts
+ * has RDSH_OPT_DEFLATE.  A CMD frame flagged RDSH_FRAME_F_STDIN gets a
+ * second pipe for stdin, fed from the client's IN frames by
+ * rsh_relay_duplex().  Otherwise the children read stdin
+ * from /dev/null so they cannot eat frames meant for the server.  If the
+ * client goes away the pipe is closed and the children get SIGPIPE.  fds
+ * are the client's own, see RDSH_OPT_PASSFD, or NULL.
+ *
+ * returns:  exit status of the last command, 128 + signal if it was killed,
+ *           or ERR_RDSH_SPAWN with fast_only, see rsh_start_pipeline()
+ */
+int rsh_relay_pipeline(int cli_sock, int *dir_fd, uint16_t id, int opts, int cmd_flags,
+                       int fds[], command_list_t *clist, bool fast_only) {
+    rsh_deflater_t dfl = { 0 };
+    rsh_deflater_t *zip = NULL;
+    pid_t pids[CMD_MAX];
+    int outp[2];
+    int inp[2] = { -1, -1 };
+    int rc;
+    int exit_code = 0;
+
+    if (clist->num == 1 &&
+        rsh_match_command(clist->commands[0].argv[0]) == BI_CMD_CD) {
+        char err_msg[256];
+        exit_code = rsh_cd(&clist->commands[0], dir_fd, err_msg, sizeof(err_msg));
+        if (exit_code != 0)
+            rsh_send_frame(cli_sock, RDSH_FRAME_OUT, id, err_msg, strlen(err_msg));
+        return exit_code;
+    }
+
+    if (fds != NULL)
+        return rsh_run_on_fds(cli_sock, *dir_fd, id, cmd_flags, fds, clist, fast_only);
+
+    if (cmd_flags & RDSH_FRAME_F_STDIN)
+        rc = pipe2(inp, O_CLOEXEC);
+    else
+        rc = (inp[0] = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0 ? -1 : 0;
+    if (rc < 0 || rsh_out_pipe(outp) != OK) {
+        perror("relay");
+        if (inp[0] >= 0)
+            close(inp[0]);
+        if (inp[1] >= 0)
+            close(inp[1]);
+        rsh_send_frame(cli_sock, RDSH_FRAME_OUT, id, CMD_ERR_RDSH_EXEC, strlen(CMD_ERR_RDSH_EXEC));
+        return 1;
+    }
+
+    rc = rsh_start_pipeline(clist, *dir_fd, inp[0], outp[1], outp[1], pids, fast_only);
+    close(inp[0]);
+    close(outp[1]);
+    if (rc != OK) {
+        close(outp[0]);
+        if (inp[1] >= 0)
+            close(inp[1]);
+        if (rc == ERR_RDSH_SPAWN)
+            return rc;
+        rsh_send_frame(cli_sock, RDSH_FRAME_OUT, id, CMD_ERR_RDSH_EXEC, strlen(CMD_ERR_RDSH_EXEC));
+        return 1;
+    }
+
+    // without the buffers or zlib the output just goes out as it is
+    if (opts & RDSH_OPT_DEFLATE) {
+        dfl.in = malloc(RDSH_COMM_BUFF_SZ);
+        dfl.out = malloc(RDSH_COMM_BUFF_SZ);
+        if (dfl.in != NULL && dfl.out != NULL && rsh_deflate_init(&dfl.zs) == OK)
+            zip = &dfl;
+    }
+    if (inp[1] >= 0)
+        rsh_relay_duplex(cli_sock, outp[0], inp[1], id, zip);
+    else
+        rsh_relay_output(cli_sock, outp[0], RDSH_PROTO_V2, id, zip);
+    close(outp[0]);
+    if (zip != NULL)
+        deflateEnd(&dfl.zs);
+    free(dfl.in);
+    free(dfl.out);
+
+    return rsh_wait_pipeline(clist, pids);
+}
+
+/*
+ * rsh_session_dir()
+ *
+ * Every session, a client connection, has its own working directory, held
+ * as an O_PATH fd.  cd resolves against it with openat() and the children
+ * fchdir() to it before exec, so the server's own never changes and the
+ * threaded and event cores can run sessions side by side.
+ *
+ * returns:  the directory a new session starts in, the server's, or
+ *           AT_FDCWD if it cannot be opened
+ */
+int rsh_session_dir(void) {
+    int fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+
+    return fd >= 0 ? fd : AT_FDCWD;
+}
+
+/*
+ * rsh_cd(cmd, dir_fd, err_msg, err_len)
+ *
+ * The cd builtin for every server core, moves the session in *dir_fd.
+ *
+ * returns:  0, or 1 with the message for the client in err_msg
+ */
+int rsh_cd(cmd_buff_t *cmd, int *dir_fd, char *err_msg, int err_len) {
+    int fd;
+
+    err_msg[0] = '\0';
+    if (cmd->argc < 2)
+        return 0;
+    fd = openat(*dir_fd, cmd->argv[1], O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        snprintf(err_msg, err_len, "cd: %s: %s\n", cmd->argv[1], strerror(errno));
+        return 1;
+    }
+    if (*dir_fd >= 0)
+        close(*dir_fd);
+    *dir_fd = fd;
+    return 0;
+}
+
 /*
  * rsh_match_command(const char *input)
  */
@@ -398,11 +1451,43 @@ Built_In_Cmds rsh_match_command(const char *input)
     if (strcmp(input, "dragon") == 0) return BI_CMD_DRAGON;
     if (strcmp(input, "cd") == 0) return BI_CMD_CD;
     if (strcmp(input, "stop-server") == 0) return BI_CMD_STOP_SVR;
+    if (strcmp(input, "server-stats") == 0) return BI_CMD_SVR_STATS;
     if (strcmp(input, "rc") == 0) return BI_CMD_RC;
+    if (strcmp(input, "echo") == 0) return BI_CMD_ECHO;
+    if (strcmp(input, "pwd") == 0) return BI_CMD_PWD;
+    if (strcmp(input, "cat") == 0) return BI_CMD_CAT;
+    if (strcmp(input, "ls") == 0) return BI_CMD_LS;
+    if (strcmp(input, "true") == 0) return BI_CMD_TRUE;
     
     return BI_NOT_BI;
 }
 
+/*
+ * rsh_pipeline_procs(clist)
+ *
+ * returns:  the processes clist starts, 0 for a builtin the server runs
+ *           itself or a command that may run in-process.  That one is
+ *           started fast_only, see rsh_start_pipeline(), and needs its
+ *           turn after all if it has to be spawned.
+ */
+int rsh_pipeline_procs(command_list_t *clist)
+{
+    if (clist->num == 1 && fast_command(&clist->commands[0]))
+        return 0;
+    if (clist->num == 1) {
+        switch (rsh_match_command(clist->commands[0].argv[0])) {
+        case BI_CMD_CD:
+        case BI_CMD_EXIT:
+        case BI_CMD_STOP_SVR:
+        case BI_CMD_SVR_STATS:
+            return 0;
+        default:
+            break;
+        }
+    }
+    return clist->num;
+}
+
 /*
  * rsh_built_in_cmd(cmd_buff_t *cmd)
  */
@@ -0,0 +1,516 @@
+#define _GNU_SOURCE     // open_memstream
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "dshlib.h"
+#include "rshlib.h"
+
+//Server statistics, see rshlib.h.  Every server thread counts into its
+//own cache line aligned block and nothing else writes to it, so counting
+//is an uncontended add on memory no other core touches.  Readers add the
+//blocks up.  A thread past RDSH_STATS_THREADS_MAX shares the last block,
+//which is why the adds are still atomic.
+
+struct rsh_client_stats {
+    char        addr[RDSH_PEER_KEY_SZ];     //"" for clients past the table
+    uint64_t    connections;
+    uint64_t    commands;
+    uint64_t    bytes_in;
+    uint64_t    bytes_out;
+};
+
+typedef struct rsh_hist {
+    uint64_t    buckets[RDSH_STATS_BUCKETS + 1];    //last one is +Inf
+    uint64_t    sum_ns;
+} rsh_hist_t;
+
+typedef struct rsh_stats_block {
+    char                name[16];
+    bool                shared;         //the overflow block, clients go to other
+    uint64_t            connections;
+    uint64_t            closed;
+    uint64_t            commands;
+    uint64_t            bytes_in;
+    uint64_t            bytes_out;
+    uint64_t            busy;
+    rsh_hist_t          spawn;
+    rsh_hist_t          command;
+    int                 num_clients;    //published with a release store
+    rsh_client_stats_t  clients[RDSH_STATS_CLIENTS];
+    rsh_client_stats_t  other;
+} __attribute__((aligned(64))) rsh_stats_block_t;
+
+static struct {
+    rsh_stats_block_t   *blocks[RDSH_STATS_THREADS_MAX];
+    int                 num_blocks;     //published with a release store
+    int                 queue_depth;
+    int                 admit_pipes;    //admission gauges, see rsh_admit.c
+    int                 admit_procs;
+    int                 admit_waiting;
+    uint64_t            started_ns;
+    pthread_mutex_t     lock;           //registering blocks
+} stats = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static __thread rsh_stats_block_t *self;
+static __thread rsh_client_stats_t *current;
+
+static inline void stat_add(uint64_t *counter, uint64_t n){
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t stat_get(const uint64_t *counter){
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+uint64_t rsh_stats_now(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * rsh_stats_thread(name)
+ *
+ * Gives the calling thread its own block, labelled name in the metrics.
+ * A thread that counts before calling this gets one named "thread".
+ */
+void rsh_stats_thread(const char *name){
+    rsh_stats_block_t *b;
+
+    if (self != NULL)
+        return;
+
+    pthread_mutex_lock(&stats.lock);
+    if (stats.num_blocks == RDSH_STATS_THREADS_MAX) {
+        b = stats.blocks[RDSH_STATS_THREADS_MAX - 1];
+        b->shared = true;
+        snprintf(b->name, sizeof(b->name), "shared");
+    } else if ((b = aligned_alloc(64, sizeof(*b))) != NULL) {
+        memset(b, 0, sizeof(*b));
+        snprintf(b->name, sizeof(b->name), "%s", name);
+        stats.blocks[stats.num_blocks] = b;
+        __atomic_store_n(&stats.num_blocks, stats.num_blocks + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&stats.lock);
+
+    self = b;
+}
+
+static rsh_stats_block_t *block(void){
+    if (self == NULL)
+        rsh_stats_thread("thread");
+    return self;
+}
+
+/*
+ * rsh_stats_connected(sock)
+ *
+ * Counts a new connection and makes its client the one the calling
+ * thread counts for, see rsh_stats_client().  A client missing from the
+ * thread's table is added, once it is full the rest go to "other".
+ *
+ * returns:  the client, for rsh_stats_client() and rsh_stats_closed()
+ */
+rsh_client_stats_t *rsh_stats_connected(int sock){
+    rsh_stats_block_t *b = block();
+    rsh_client_stats_t *cl = NULL;
+    char key[RDSH_PEER_KEY_SZ];
+
+    if (b == NULL)
+        return NULL;
+    rsh_peer_key(sock, key);
+    for (int i = 0; i < b->num_clients && cl == NULL; i++)
+        if (strcmp(b->clients[i].addr, key) == 0)
+            cl = &b->clients[i];
+    if (cl == NULL && !b->shared && b->num_clients < RDSH_STATS_CLIENTS) {
+        cl = &b->clients[b->num_clients];
+        strcpy(cl->addr, key);
+        __atomic_store_n(&b->num_clients, b->num_clients + 1, __ATOMIC_RELEASE);
+    }
+    if (cl == NULL)
+        cl = &b->other;
+
+    stat_add(&b->connections, 1);
+    stat_add(&cl->connections, 1);
+    current = cl;
+    return cl;
+}
+
+/*
+ * rsh_stats_client(cl)
+ *
+ * Makes cl the client the calling thread counts for.  A blocking core's
+ * thread serves one client and never needs this, an epoll reactor
+ * switches to the client of each event it handles.
+ */
+void rsh_stats_client(rsh_client_stats_t *cl){
+    current = cl;
+}
+
+void rsh_stats_closed(rsh_client_stats_t *cl){
+    rsh_stats_block_t *b = block();
+
+    if (b != NULL)
+        stat_add(&b->closed, 1);
+    if (current == cl)
+        current = NULL;
+}
+
+void rsh_stats_in(size_t n){
+    rsh_stats_block_t *b = block();
+
+    if (b == NULL)
+        return;
+    stat_add(&b->bytes_in, n);
+    if (current != NULL)
+        stat_add(&current->bytes_in, n);
+}
+
+void rsh_stats_out(size_t n){
+    rsh_stats_block_t *b = block();
+
+    if (b == NULL)
+        return;
+    stat_add(&b->bytes_out, n);
+    if (current != NULL)
+        stat_add(&current->bytes_out, n);
+}
+
+/*
+ * hist_add(h, ns)
+ *
+ * Bucket i counts what took up to 2^i microseconds.
+ */
+static void hist_add(rsh_hist_t *h, uint64_t ns){
+    uint64_t us = (ns + 999) / 1000;
+    int i = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+
+    if (i > RDSH_STATS_BUCKETS)
+        i = RDSH_STATS_BUCKETS;
+    stat_add(&h->buckets[i], 1);
+    stat_add(&h->sum_ns, ns);
+}
+
+/*
+ * rsh_stats_spawned(start)
+ *
+ * A pipeline was launched, starting at rsh_stats_now() time start.
+ */
+void rsh_stats_spawned(uint64_t start){
+    rsh_stats_block_t *b = block();
+
+    if (b != NULL)
+        hist_add(&b->spawn, rsh_stats_now() - start);
+}
+
+/*
+ * rsh_stats_command(start)
+ *
+ * A command received at time start has been answered.
+ */
+void rsh_stats_command(uint64_t start){
+    rsh_stats_block_t *b = block();
+
+    if (b == NULL)
+        return;
+    stat_add(&b->commands, 1);
+    hist_add(&b->command, rsh_stats_now() - start);
+    if (current != NULL)
+        stat_add(&current->commands, 1);
+}
+
+void rsh_stats_queue(int depth){
+    __atomic_store_n(&stats.queue_depth, depth, __ATOMIC_RELAXED);
+}
+
+void rsh_stats_admission(int pipes, int procs, int waiting){
+    __atomic_store_n(&stats.admit_pipes, pipes, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.admit_procs, procs, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.admit_waiting, waiting, __ATOMIC_RELAXED);
+}
+
+void rsh_stats_busy(void){
+    rsh_stats_block_t *b = block();
+
+    if (b != NULL)
+        stat_add(&b->busy, 1);
+}
+
+static void write_counter(FILE *f, const char *name, const char *type, const char *help,
+                          uint64_t value){
+    fprintf(f, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n", name, help, name, type, name,
+            (unsigned long long)value);
+}
+
+/*
+ * write_hist(f, name, help, blocks, n, offset)
+ *
+ * Writes the histogram at offset in each block as a Prometheus histogram
+ * in seconds, its buckets cumulative.
+ */
+static void write_hist(FILE *f, const char *name, const char *help,
+                       rsh_stats_block_t **blocks, int n, size_t offset){
+    uint64_t total = 0;
+    uint64_t sum_ns = 0;
+
+    fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (int i = 0; i <= RDSH_STATS_BUCKETS; i++) {
+        for (int k = 0; k < n; k++)
+            total += stat_get(&((rsh_hist_t *)((char *)blocks[k] + offset))->buckets[i]);
+        if (i < RDSH_STATS_BUCKETS)
+            fprintf(f, "%s_bucket{le=\"%.6f\"} %llu\n", name, (1ull << i) / 1e6,
+                    (unsigned long long)total);
+        else
+            fprintf(f, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)total);
+    }
+    for (int k = 0; k < n; k++)
+        sum_ns += stat_get(&((rsh_hist_t *)((char *)blocks[k] + offset))->sum_ns);
+    fprintf(f, "%s_sum %.6f\n%s_count %llu\n", name, sum_ns / 1e9, name,
+            (unsigned long long)total);
+}
+
+static int cmp_client(const void *a, const void *b){
+    return strcmp(((const rsh_client_stats_t *)a)->addr, ((const rsh_client_stats_t *)b)->addr);
+}
+
+/*
+ * write_clients(f, blocks, n)
+ *
+ * A client served by several threads has an entry in each of their
+ * tables, they are sorted by address and added up.
+ */
+static void write_clients(FILE *f, rsh_stats_block_t **blocks, int n){
+    static const struct {
+        const char *name;
+        const char *help;
+        size_t      offset;
+    } series[] = {
+        { "rsh_client_connections_total", "Connections by client.",
+          offsetof(rsh_client_stats_t, connections) },
+        { "rsh_client_commands_total", "Commands answered by client.",
+          offsetof(rsh_client_stats_t, commands) },
+        { "rsh_client_received_bytes_total", "Command and stdin bytes received by client.",
+          offsetof(rsh_client_stats_t, bytes_in) },
+        { "rsh_client_sent_bytes_total", "Output bytes sent by client.",
+          offsetof(rsh_client_stats_t, bytes_out) },
+    };
+    rsh_client_stats_t *all;
+    int count = 0;
+
+    all = calloc(n * (RDSH_STATS_CLIENTS + 1), sizeof(rsh_client_stats_t));
+    if (all == NULL)
+        return;
+    for (int k = 0; k < n; k++) {
+        int num = __atomic_load_n(&blocks[k]->num_clients, __ATOMIC_ACQUIRE);
+        for (int i = 0; i <= num; i++) {
+            const rsh_client_stats_t *cl = i < num ? &blocks[k]->clients[i] : &blocks[k]->other;
+            rsh_client_stats_t *sum = &all[count++];
+            strcpy(sum->addr, i < num ? cl->addr : "other");
+            sum->connections = stat_get(&cl->connections);
+            sum->commands = stat_get(&cl->commands);
+            sum->bytes_in = stat_get(&cl->bytes_in);
+            sum->bytes_out = stat_get(&cl->bytes_out);
+        }
+    }
+    qsort(all, count, sizeof(rsh_client_stats_t), cmp_client);
+
+    for (size_t s = 0; s < sizeof(series) / sizeof(series[0]); s++) {
+        fprintf(f, "# HELP %s %s\n# TYPE %s counter\n", series[s].name, series[s].help,
+                series[s].name);
+        for (int i = 0; i < count; ) {
+            uint64_t value = 0;
+            uint64_t connections = 0;
+            int j = i;
+            for (; j < count && strcmp(all[j].addr, all[i].addr) == 0; j++) {
+                value += *(uint64_t *)((char *)&all[j] + series[s].offset);
+                connections += all[j].connections;
+            }
+            // every thread has an other, only show it once it is used
+            if (connections > 0)
+                fprintf(f, "%s{client=\"%s\"} %llu\n", series[s].name, all[i].addr,
+                        (unsigned long long)value);
+            i = j;
+        }
+    }
+    free(all);
+}
+
+/*
+ * rsh_stats_write(f)
+ *
+ * Writes every counter to f in the Prometheus text format.
+ */
+void rsh_stats_write(FILE *f){
+    rsh_stats_block_t *blocks[RDSH_STATS_THREADS_MAX];
+    uint64_t connections = 0, closed = 0, commands = 0, bytes_in = 0, bytes_out = 0, busy = 0;
+    int n = __atomic_load_n(&stats.num_blocks, __ATOMIC_ACQUIRE);
+
+    memcpy(blocks, stats.blocks, n * sizeof(blocks[0]));
+    for (int k = 0; k < n; k++) {
+        connections += stat_get(&blocks[k]->connections);
+        closed += stat_get(&blocks[k]->closed);
+        commands += stat_get(&blocks[k]->commands);
+        bytes_in += stat_get(&blocks[k]->bytes_in);
+        bytes_out += stat_get(&blocks[k]->bytes_out);
+        busy += stat_get(&blocks[k]->busy);
+    }
+
+    write_counter(f, "rsh_uptime_seconds", "gauge", "Seconds since the server started.",
+                  stats.started_ns ? (rsh_stats_now() - stats.started_ns) / 1000000000ull : 0);
+    write_counter(f, "rsh_connections_active", "gauge", "Client connections open now.",
+                  connections - closed);
+    write_counter(f, "rsh_connections_total", "counter", "Client connections served.",
+                  connections);
+    write_counter(f, "rsh_queue_depth", "gauge", "Accepted clients waiting for a worker (-x).",
+                  __atomic_load_n(&stats.queue_depth, __ATOMIC_RELAXED));
+    write_counter(f, "rsh_pipelines_running", "gauge", "Pipelines admitted and running.",
+                  __atomic_load_n(&stats.admit_pipes, __ATOMIC_RELAXED));
+    write_counter(f, "rsh_processes_running", "gauge", "Processes of the running pipelines.",
+                  __atomic_load_n(&stats.admit_procs, __ATOMIC_RELAXED));
+    write_counter(f, "rsh_admission_waiting", "gauge", "Commands waiting to be admitted.",
+                  __atomic_load_n(&stats.admit_waiting, __ATOMIC_RELAXED));
+    write_counter(f, "rsh_busy_total", "counter", "Commands turned away as server busy.", busy);
+    write_counter(f, "rsh_commands_total", "counter", "Commands answered.", commands);
+    write_counter(f, "rsh_received_bytes_total", "counter",
+                  "Command and stdin bytes received from clients.", bytes_in);
+    write_counter(f, "rsh_sent_bytes_total", "counter",
+                  "Output bytes sent to clients, before compression.", bytes_out);
+    write_hist(f, "rsh_spawn_seconds", "Time to launch a pipeline.",
+               blocks, n, offsetof(rsh_stats_block_t, spawn));
+    write_hist(f, "rsh_command_seconds", "Time from receiving a command to its answer.",
+               blocks, n, offsetof(rsh_stats_block_t, command));
+
+    fprintf(f, "# HELP rsh_thread_commands_total Commands answered by server thread.\n"
+               "# TYPE rsh_thread_commands_total counter\n");
+    for (int k = 0; k < n; k++) {
+        // a worker that never had a client says nothing
+        if (stat_get(&blocks[k]->connections) == 0)
+            continue;
+        fprintf(f, "rsh_thread_commands_total{thread=\"%s\"} %llu\n", blocks[k]->name,
+                (unsigned long long)stat_get(&blocks[k]->commands));
+    }
+
+    write_clients(f, blocks, n);
+}
+
+/*
+ * rsh_stats_text()
+ *
+ * returns:  rsh_stats_write() output as a string to free, or NULL
+ */
+char *rsh_stats_text(void){
+    char *text = NULL;
+    size_t len;
+    FILE *f = open_memstream(&text, &len);
+
+    if (f == NULL)
+        return NULL;
+    rsh_stats_write(f);
+    if (fclose(f) != 0) {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
+
+//the -m dump thread
+static struct {
+    pthread_t       thread;
+    const char      *path;
+    bool            running;
+    bool            stop;
+    pthread_mutex_t lock;
+    pthread_cond_t  wake;
+} dump = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+};
+
+/*
+ * dump_file(path)
+ *
+ * Writes the metrics to path.tmp and renames it over path, so a reader
+ * never sees half a dump.
+ */
+static int dump_file(const char *path){
+    char tmp[PATH_MAX];
+    FILE *f;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    f = fopen(tmp, "w");
+    if (f == NULL) {
+        perror(tmp);
+        return ERR_RDSH_SERVER;
+    }
+    rsh_stats_write(f);
+    if (fclose(f) != 0 || rename(tmp, path) != 0) {
+        perror(path);
+        unlink(tmp);
+        return ERR_RDSH_SERVER;
+    }
+    return OK;
+}
+
+static void *dump_run(void *arg){
+    struct timespec until;
+
+    (void)arg;
+    clock_gettime(CLOCK_REALTIME, &until);
+    pthread_mutex_lock(&dump.lock);
+    while (!dump.stop) {
+        until.tv_sec += RDSH_STATS_DUMP_SECS;
+        while (!dump.stop &&
+               pthread_cond_timedwait(&dump.wake, &dump.lock, &until) == 0)
+            ;
+        pthread_mutex_unlock(&dump.lock);
+        dump_file(dump.path);
+        pthread_mutex_lock(&dump.lock);
+    }
+    pthread_mutex_unlock(&dump.lock);
+    return NULL;
+}
+
+/*
+ * rsh_stats_start(path)
+ *
+ * Starts the uptime clock, and if path is not NULL writes the
+ * metrics to it every RDSH_STATS_DUMP_SECS seconds until
+ * rsh_stats_stop(), which writes them one last time.
+ */
+int rsh_stats_start(const char *path){
+    stats.started_ns = rsh_stats_now();
+    if (path == NULL)
+        return OK;
+    dump.path = path;
+    dump.stop = false;
+    if (dump_file(path) != OK)
+        return ERR_RDSH_SERVER;
+    if (pthread_create(&dump.thread, NULL, dump_run, NULL) != 0) {
+        fprintf(stderr, "Failed to start the metrics dump thread\n");
+        return ERR_RDSH_SERVER;
+    }
+    dump.running = true;
+    return OK;
+}
+
+void rsh_stats_stop(void){
+    if (!dump.running)
+        return;
+    pthread_mutex_lock(&dump.lock);
+    dump.stop = true;
+    pthread_cond_signal(&dump.wake);
+    pthread_mutex_unlock(&dump.lock);
+    pthread_join(dump.thread, NULL);
+    dump.running = false;
+}
@@ -1,6 +1,12 @@
 #ifndef __RSH_LIB_H__
     #define __RSH_LIB_H__
 
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <zlib.h>
+
 #include "dshlib.h"
 
 //common remote shell client and server constants and definitions
@@ -16,6 +22,10 @@
 
 //constants for buffer sizes
 #define RDSH_COMM_BUFF_SZ       (1024*64)   //64K
+#define RDSH_RELAY_PIPE_SZ      (1024*1024) //pipeline output pipe, asked
+                                            //for with F_SETPIPE_SZ
+#define RDSH_REPLY_MAX          256         //answers the server makes up
+                                            //itself that go out in one send
 #define STOP_SERVER_SC          200         //returned from pipeline excution
                                             //if the command is to stop the
                                             //server.  See documentation for 
@@ -29,11 +39,155 @@
 //linux based systems. 
 static const char RDSH_EOF_CHAR = 0x04;    
 
+//protocol v2.  A client that speaks it opens with a HELLO frame, whose
+//first byte never starts a v1 command, and the server answers with the
+//version both will use.  After that every message is a frame: a header
+//and len bytes of payload.  A command is one CMD frame, its response any
+//number of OUT frames and an EXIT frame with the exit status, so output
+//may hold any byte, RDSH_EOF_CHAR included.
+//
+//v3 adds pipelining.  The client tags each CMD frame with a request id and
+//may send up to RDSH_PIPELINE_MAX of them before the first answer comes
+//back.  The server runs a connection's commands in the order they were
+//sent and echoes the id on every frame of the response.
+//
+//Options are asked for with a second HELLO byte, the server answers with
+//the ones it grants in a second byte of its own.  A client that sends one
+//byte gets one back, so older peers on either side see plain v2 or v3.
+#define RDSH_PROTO_V1           1
+#define RDSH_PROTO_V2           2
+#define RDSH_PROTO_V3           3
+#define RDSH_PROTO_VERSION      RDSH_PROTO_V3
+
+#define RDSH_PIPELINE_MAX       64          //commands a v3 client keeps in flight
+
+#define RDSH_FRAME_HELLO        0x01        //payload: version, [options]
+#define RDSH_FRAME_CMD          0x02        //payload: command line, no '\0'
+#define RDSH_FRAME_OUT          0x03        //payload: stdout and stderr bytes
+#define RDSH_FRAME_EXIT         0x04        //payload: 4 byte exit status
+#define RDSH_FRAME_IN           0x05        //payload: stdin bytes, empty at EOF
+#define RDSH_FRAME_FDS          0x06        //no payload, SCM_RIGHTS: stdin, stdout, stderr
+#define RDSH_FRAME_HDR_SZ       8
+
+//HELLO options
+#define RDSH_OPT_DEFLATE        0x01        //OUT payloads may be deflated
+#define RDSH_OPT_STDIN          0x02        //CMD may stream stdin in IN frames
+#define RDSH_OPT_PASSFD         0x04        //an FDS frame follows, Unix sockets only
+#define RDSH_OPT_ALL            (RDSH_OPT_DEFLATE | RDSH_OPT_STDIN | RDSH_OPT_PASSFD)
+
+//With RDSH_OPT_PASSFD a client on the same host hands the server its own
+//stdin, stdout and stderr in an FDS frame right after the HELLO.  Every
+//command of the session then writes straight to them and only the EXIT
+//frame, and the text of errors the server reports itself, comes back over
+//the socket.  A CMD flagged RDSH_FRAME_F_STDIN reads the passed stdin, no
+//IN frames follow it.
+
+//frame flags
+#define RDSH_FRAME_F_DEFLATE    0x01        //payload is one raw deflate stream
+#define RDSH_FRAME_F_STDIN      0x02        //CMD: IN frames follow until an empty one
+
+//with RDSH_OPT_DEFLATE the server deflates each chunk of output on its own,
+//chunks under RDSH_DEFLATE_MIN bytes or that do not shrink go out as they
+//are.  A deflated payload is never bigger than RDSH_COMM_BUFF_SZ.
+#define RDSH_DEFLATE_MIN        512
+#define RDSH_DEFLATE_LEVEL      Z_BEST_SPEED
+
+typedef struct rsh_frame_hdr {
+    uint8_t     type;
+    uint8_t     flags;                      //RDSH_FRAME_F_*, 0 unless an option allows
+    uint16_t    id;                         //request id, network order, 0 before v3
+    uint32_t    len;                        //payload bytes, network order
+} rsh_frame_hdr_t;
+
+//server cores, picked with -x or -e on the command line
+#define RDSH_SVR_SERIAL         0           //one client at a time
+#define RDSH_SVR_THREADED       1           //worker pool, -x
+#define RDSH_SVR_EVENT          2           //epoll reactors, -e
+
+#define RDSH_LISTEN_BACKLOG     1024        //connections waiting for accept
+
+//Latency of short answers.  TCP sockets on both ends are TCP_NODELAY, so
+//the last segment of an answer never waits for the ACK of the one before,
+//which the peer delays by up to 40ms.  The end of an answer goes out with
+//what precedes it where the server can tell it is the end: output read
+//after the pipe hung up is sent MSG_MORE and the EXIT frame or
+//RDSH_EOF_CHAR that follows pushes both out in one segment.  The socket
+//buffers are left to the kernel's autotuning, setting them turns it off.
+
+//Unix domain sockets.  With -u PATH the server listens on the socket PATH
+//as well as on its TCP port and the client connects to PATH instead, a
+//same host client then skips the TCP/IP stack.  boot_server() and
+//start_client() take such a path, anything with a '/' in it, in place of
+//the address.  A Unix stream socket can have no more in flight than its
+//send buffer, so both ends raise it.
+#define RDSH_LISTENERS_MAX      2           //the TCP port and a Unix socket
+#define RDSH_UNIX_SOCK_BUF      (1024*1024) //SO_SNDBUF and SO_RCVBUF
+
+//threaded server (-x).  Accepted clients wait in a bounded queue for one of
+//a fixed pool of worker threads, each worker serves one client at a time
+#define RDSH_WORKERS            64          //client sessions served at once
+#define RDSH_QUEUE_MAX          64          //accepted clients waiting for a worker
+
+//event server (-e).  One epoll reactor thread per core accepts and serves
+//its own connections with non blocking sockets, reading pipeline output
+//through a pipe.  An idle connection is just its socket and an rsh_conn_t.
+#define RDSH_REACTORS_MAX       64          //reactor threads at most
+#define RDSH_EPOLL_EVENTS       256         //events taken per epoll_wait
+
+//Server statistics.  The server-stats builtin answers with the counters in
+//the Prometheus text format, and with -m PATH the server also writes them
+//to PATH every RDSH_STATS_DUMP_SECS seconds.  Each server thread counts
+//into its own block in rsh_stats.c, readers add the blocks up.  Bytes are
+//command payloads: commands and stdin in, output out before compression,
+//output a client takes on its own fds (RDSH_OPT_PASSFD) is not seen.
+#define RDSH_STATS_THREADS_MAX  (2 + RDSH_WORKERS + RDSH_REACTORS_MAX)
+#define RDSH_STATS_CLIENTS      32          //clients a thread counts apart
+#define RDSH_STATS_BUCKETS      22          //latency buckets of 1us to 2^21us
+#define RDSH_STATS_DUMP_SECS    10          //-m dump interval
+#define RDSH_PEER_KEY_SZ        48          //"unix:<uid>" or an IP address
+
+//Admission control.  A pipeline only starts while the server and its client
+//are under their limits on running pipelines and on the processes those
+//started, set with -l.  Otherwise it waits in its client's queue, clients
+//are served round robin as pipelines end.  One that waited RDSH_ADMIT_WAIT_MS,
+//or finds the queue full, is answered RCMD_ERR_SVR_BUSY with exit status
+//RDSH_BUSY_STATUS.  A client is an IP address, or a uid on a Unix socket,
+//however many connections it opens.  Builtins are never held back.
+#define RDSH_ADMIT_PIPELINES        256     //pipelines running at once
+#define RDSH_ADMIT_PROCS            1024    //processes they started
+#define RDSH_ADMIT_CLIENT_PIPELINES 64      //the same for one client
+#define RDSH_ADMIT_CLIENT_PROCS     256
+#define RDSH_ADMIT_QUEUE_MAX        1024    //commands waiting to start
+#define RDSH_ADMIT_CLIENT_QUEUE     64      //of those, from one client
+#define RDSH_ADMIT_WAIT_MS          5000    //then the client is told busy
+#define RDSH_BUSY_STATUS            75      //EX_TEMPFAIL
+
+#define RDSH_ADMIT_WAITING      0
+#define RDSH_ADMIT_GRANTED      1
+#define RDSH_ADMIT_BUSY         2
+#define RDSH_ADMIT_DONE         3
+
+typedef struct rsh_admit_client rsh_admit_client_t;
+
+//One command asking to start, owned by the caller until it is granted,
+//turned away or cancelled.
+typedef struct rsh_admit_waiter {
+    struct rsh_admit_waiter *next;          //in the client's queue
+    rsh_admit_client_t      *client;
+    int                     procs;
+    int                     state;          //RDSH_ADMIT_*
+    uint64_t                deadline;       //rsh_stats_now() time to give up
+    void                    (*wake)(struct rsh_admit_waiter *w);
+    void                    *arg;           //for wake
+} rsh_admit_waiter_t;
+
 //rdsh specific error codes for functions
 #define ERR_RDSH_COMMUNICATION  -50     //Used for communication errors
 #define ERR_RDSH_SERVER         -51     //General server errors
 #define ERR_RDSH_CLIENT         -52     //General client errors
 #define ERR_RDSH_CMD_EXEC       -53     //RSH command execution errors
+#define ERR_RDSH_BUSY           -54     //admission control turned a command away
+#define ERR_RDSH_SPAWN          -55     //an in-process command has to be spawned
 #define WARN_RDSH_NOT_IMPL      -99     //Not Implemented yet warning
 
 //Output message constants for server
@@ -41,31 +195,100 @@ static const char RDSH_EOF_CHAR = 0x04;
 #define CMD_ERR_RDSH_EXEC   "rdsh-error: command execution error\n"
 #define CMD_ERR_RDSH_ITRNL  "rdsh-error: internal server error - %d\n"
 #define CMD_ERR_RDSH_SEND   "rdsh-error: partial send.  Sent %d, expected to send %d\n"
+#define CMD_ERR_RDSH_FRAME  "rdsh-error: frame of %u bytes is too large\n"
+#define RCMD_ERR_SVR_BUSY   "rdsh-error: server busy, try again later\n"
 #define RCMD_SERVER_EXITED  "server appeared to terminate - exiting\n"
 
 //Output message constants for client
 #define RCMD_MSG_CLIENT_EXITED  "client exited: getting next connection...\n"
 #define RCMD_MSG_SVR_STOP_REQ   "client requested server to stop, stopping...\n"
+#define RCMD_ERR_NO_STDIN       "server cannot stream stdin to a command (-r)\n"
+#define RCMD_ERR_NO_PASSFD      "server cannot take our stdin and stdout (-f needs -u)\n"
 #define RCMD_MSG_SVR_EXEC_REQ   "rdsh-exec:  %s\n"
 #define RCMD_MSG_SVR_RC_CMD     "rdsh-exec:  rc = %d\n"
+#define RCMD_MSG_SVR_WORKERS    "serving clients with %d worker threads\n"
+#define RCMD_MSG_SVR_DRAIN      "waiting for %d client session(s) to finish...\n"
+#define RCMD_MSG_SVR_REACTORS   "serving clients with %d epoll reactors\n"
 
 //client prototypes for rsh_cli.c - - see documentation for each function to
 //see what they do
 int start_client(char *address, int port);
 int client_cleanup(int cli_socket, char *cmd_buff, char *rsp_buff, int rc);
-int exec_remote_cmd_loop(char *address, int port);
+int exec_remote_cmd_loop(char *address, int port, int opts, char *run_cmd);
     
 
 //server prototypes for rsh_server.c - see documentation for each function to
 //see what they do
-int start_server(char *ifaces, int port, int is_threaded);
+int start_server(char *ifaces, int port, char *unix_path, char *stats_path, int svr_mode);
 int boot_server(char *ifaces, int port);
 int stop_server(int svr_socket);
 int send_message_eof(int cli_socket);
 int send_message_string(int cli_socket, char *buff);
-int process_cli_requests(int svr_socket);
+int process_cli_requests(int svr_sockets[], int num_svr);
+void rsh_client_connected(int cli_socket, const struct sockaddr_storage *addr);
 int exec_client_requests(int cli_socket);
-int rsh_execute_pipeline(int socket_fd, command_list_t *clist);
+int rsh_execute_pipeline(int socket_fd, int *dir_fd, command_list_t *clist, bool fast_only);
+int rsh_start_pipeline(command_list_t *clist, int dir_fd, int in_fd, int out_fd, int err_fd,
+                       pid_t pids[], bool fast_only);
+int rsh_relay_pipeline(int cli_sock, int *dir_fd, uint16_t id, int opts, int cmd_flags,
+                       int fds[], command_list_t *clist, bool fast_only);
+int rsh_pipeline_procs(command_list_t *clist);
+int rsh_session_dir(void);
+int rsh_cd(cmd_buff_t *cmd, int *dir_fd, char *err_msg, int err_len);
+
+//event server prototypes for rsh_event.c
+int process_cli_events(int svr_sockets[], int num_svr);
+
+//statistics prototypes for rsh_stats.c
+typedef struct rsh_client_stats rsh_client_stats_t;
+int rsh_stats_start(const char *path);
+void rsh_stats_stop(void);
+void rsh_stats_thread(const char *name);
+rsh_client_stats_t *rsh_stats_connected(int sock);
+void rsh_stats_client(rsh_client_stats_t *cl);
+void rsh_stats_closed(rsh_client_stats_t *cl);
+void rsh_stats_in(size_t n);
+void rsh_stats_out(size_t n);
+uint64_t rsh_stats_now(void);
+void rsh_stats_spawned(uint64_t start);
+void rsh_stats_command(uint64_t start);
+void rsh_stats_queue(int depth);
+void rsh_stats_admission(int pipes, int procs, int waiting);
+void rsh_stats_busy(void);
+void rsh_stats_write(FILE *f);
+char *rsh_stats_text(void);
+
+//admission control prototypes for rsh_admit.c
+void rsh_admit_limits(int pipes, int procs, int client_pipes, int client_procs);
+rsh_admit_client_t *rsh_admit_join(int sock);
+void rsh_admit_leave(rsh_admit_client_t *cl);
+int rsh_admit_enter(rsh_admit_client_t *cl, rsh_admit_waiter_t *w, int procs);
+int rsh_admit_wait(rsh_admit_client_t *cl, rsh_admit_waiter_t *w, int procs);
+bool rsh_admit_cancel(rsh_admit_waiter_t *w);
+int rsh_admit_granted(rsh_admit_waiter_t *w);
+void rsh_admit_done(rsh_admit_waiter_t *w);
+
+//protocol v2 prototypes for rsh_proto.c
+void rsh_frame_hdr(rsh_frame_hdr_t *hdr, int type, uint16_t id, uint32_t len);
+int rsh_send_all(int sock, const void *buff, size_t len);
+int rsh_recv_all(int sock, void *buff, size_t len);
+int rsh_send_frame(int sock, int type, uint16_t id, const void *payload, uint32_t len);
+int rsh_send_exit(int sock, uint16_t id, int status);
+int rsh_send_reply(int sock, uint16_t id, const char *msg, uint32_t len, int status);
+void rsh_tcp_nodelay(int sock);
+int rsh_recv_frame(int sock, int *type, int *flags, uint16_t *id, char *buff, uint32_t max);
+int rsh_server_hello(int cli_socket, int *opts);
+int rsh_client_hello(int cli_socket, int want_opts, int *opts);
+int rsh_hello_reply(const unsigned char *payload, int len, int allow, unsigned char reply[2]);
+int rsh_allowed_opts(int sock);
+int rsh_send_fds(int sock);
+ssize_t rsh_recv_fds(int sock, void *buff, size_t len, int flags, int fds[3]);
+int rsh_recv_fd_frame(int sock, int fds[3]);
+int rsh_is_unix_path(const char *addr);
+void rsh_peer_key(int sock, char key[RDSH_PEER_KEY_SZ]);
+void rsh_unix_bufs(int sock);
+int rsh_deflate_init(z_stream *zs);
+int rsh_deflate_chunk(z_stream *zs, const void *in, int len, void *out);
 
 Built_In_Cmds rsh_match_command(const char *input);
 Built_In_Cmds rsh_built_in_cmd(cmd_buff_t *cmd);